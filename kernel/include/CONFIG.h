@@ -18,7 +18,9 @@
 
 #define PAGE_SIZE 0x1000
 #define KERNEL_PAGED_BASE_ADDRESS 0xFFFFFFFF80000000
-#define INITIAL_MEMORY_STATUS_COUNT 100000
+//Virtual address range kMemoryStatus grows into, a page at a time, up to MEMORY_STATUS_MAX_COUNT entries
+#define MEMORY_STATUS_VIRTUAL_BASE 0xFFFFFF0000000000
+#define MEMORY_STATUS_MAX_COUNT 0x1000000
 #define KERNEL_STACK_SIZE 20 * PAGE_SIZE
 
 //Signal related
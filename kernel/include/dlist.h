@@ -21,6 +21,7 @@ typedef struct DList {
     size_t size; // Optional: Track size of the list
 } dlist_t;
 
+void dlist_cache_init();
 void dlist_init(dlist_t* list);
 dlist_node_t* dlist_add(dlist_t* list, volatile void* data);
 void dlist_remove(dlist_t* list, dlist_node_t* node);
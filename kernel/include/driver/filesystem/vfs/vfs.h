@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include "dlist.h"
 #include "types.h"
+#include "arena.h"
 
 
 #define DENTRY_ROOT 0xFFFFFFFF    
@@ -151,7 +152,7 @@ struct directory
 	void* handle;
 	dlist_t listEntry;
 	void *owner;
-	//arena_t* arena;
+	arena_t* arena;
 };
 
 struct dir_operations
@@ -229,7 +230,7 @@ struct file
 	void *copyBuffer;
 	uint32_t verification;
 	void *owner;
-	//arena_t* arena;
+	arena_t* arena;
 };
 
 struct file_operations
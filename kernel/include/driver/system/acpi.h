@@ -181,6 +181,59 @@ typedef struct {
     uint32_t CreatorRevision; // Creator Revision
 } __attribute__((packed)) acpi_table_header_t;
 
+// SRAT (System Resource Affinity Table) header, followed by variable length affinity structures
+typedef struct {
+    acpi_table_header_t header;
+    uint32_t reserved1;           // Must be 1 for backward compatibility
+    uint64_t reserved2;
+} __attribute__((packed)) acpi_srat_table_t;
+
+#define SRAT_TYPE_PROCESSOR_AFFINITY 0
+#define SRAT_TYPE_MEMORY_AFFINITY 1
+#define SRAT_TYPE_X2APIC_AFFINITY 2
+#define SRAT_AFFINITY_ENABLED 0x01
+
+typedef struct {
+    uint8_t  type;                // = 0
+    uint8_t  length;              // = 16
+    uint8_t  proximity_domain_lo;
+    uint8_t  apic_id;
+    uint32_t flags;
+    uint8_t  sapic_eid;
+    uint8_t  proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_processor_affinity_t;
+
+typedef struct {
+    uint8_t  type;                // = 1
+    uint8_t  length;              // = 40
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_memory_affinity_t;
+
+typedef struct {
+    uint8_t  type;                // = 2
+    uint8_t  length;              // = 24
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_affinity_t;
+
+// SLIT (System Locality Information Table), a locality_count x locality_count matrix of relative distances
+typedef struct {
+    acpi_table_header_t header;
+    uint64_t locality_count;
+    uint8_t  entries[];
+} __attribute__((packed)) acpi_slit_table_t;
+
 extern uintptr_t kPCIBaseAddress;
 void acpiFindTables();
 
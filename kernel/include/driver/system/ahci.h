@@ -773,6 +773,11 @@ typedef struct tagHBA_CMD_TBL
 	HBA_PRDT_ENTRY	prdt_entry[1];	// Physical region descriptor table entries, 0 ~ 65535
 } HBA_CMD_TBL;
 
+//ahci_lba_read programs one 8K PRD per 16 sectors, so a full read buffer needs this many entries
+#define AHCI_MAX_PRDT_ENTRIES ((AHCI_READ_BUFFER_SIZE) / 8192)
+//Command table big enough for AHCI_MAX_PRDT_ENTRIES, rounded up to the 128 byte alignment the HBA needs (0x1080)
+#define AHCI_COMMAND_TABLE_SIZE ((sizeof(HBA_CMD_TBL) + (AHCI_MAX_PRDT_ENTRIES - 1) * sizeof(HBA_PRDT_ENTRY) + 127) & ~(size_t)127)
+
 typedef volatile struct tagHBA_FIS
 {
 	// 0x00
@@ -801,7 +806,7 @@ uint32_t ahci_check_type(const hba_port_t *port, uint32_t* sig);
 void ahci_probe_ports(HBA_MEM *abar);
 void printAHCICaps();
 bool init_AHCI();
-void ahci_port_rebase(hba_port_t *port, int portno, uintptr_t remapBase);
+void ahci_port_rebase(volatile hba_port_t *port, int portno);
 void start_cmd(hba_port_t *port);
 void ahci_stop_cmd(volatile hba_port_t *port);
 void ahciIdentify(hba_port_t* port, int deviceType);
@@ -118,6 +118,17 @@ typedef struct
           };
           uint32_t cpuid_extended_feature_bits_ebx_reg;
         } cpuid_extended_feature_bits_3;
+
+        union {
+          struct {
+            uint8_t reserved1: 1;
+            uint8_t sgxkeys: 1;
+            uint8_t avx5124vnniw: 1;
+            uint8_t avx5124fmaps: 1;
+            uint8_t fsrm: 1;
+          };
+          uint32_t cpuid_extended_feature_bits_edx_reg;
+        } cpuid_extended_feature_bits_4;
     } cpuid_features_t;
 
 typedef struct
@@ -139,5 +150,6 @@ typedef struct
 
 int detect_cpu(void);
 extern cpuinfo_t kcpuInfo;
+extern cpuid_features_t kCPUFeatures;
 
 #endif
@@ -48,6 +48,8 @@
 
 #define NVME_SUBMISSION_QUEUE_SIZE    64
 #define NVME_COMPLETION_QUEUE_SIZE    64
+//Largest transfer whose PRP entries fit in a single PRP list page (setup_prp_list doesn't chain lists)
+#define NVME_MAX_PRP_LIST_TRANSFER    ((PAGE_SIZE / sizeof(uint64_t)) * PAGE_SIZE)
 
 typedef enum {
     // Admin Commands
@@ -9,4 +9,17 @@
 	uint64_t rdtsc();
 	uint64_t getCR3();
 	int tscGetCyclesPerSecond();
+
+	//Disable interrupts, returning the previous RFLAGS so they can be restored with interrupts_restore
+	static inline uint64_t interrupts_save_and_disable()
+	{
+		uint64_t flags;
+		__asm__ __volatile__("pushfq\n pop %0\n cli\n" : "=r"(flags) : : "memory");
+		return flags;
+	}
+
+	static inline void interrupts_restore(uint64_t flags)
+	{
+		__asm__ __volatile__("push %0\n popfq\n" : : "r"(flags) : "memory", "cc");
+	}
 #endif
@@ -0,0 +1,46 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "thread.h"
+#include "smp.h"
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+#define CR4_OSFXSR (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_OSXSAVE (1ULL << 18)
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+//Opmask, ZMM_Hi256 and Hi16_ZMM, only usable together
+#define XCR0_AVX512 (7ULL << 5)
+//State components the kernel will enable if the CPU has them
+#define FPU_XCR0_SUPPORTED (XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_AVX512)
+
+//Size of the legacy area used when the CPU has no XSAVE
+#define FPU_FXSAVE_SIZE 512
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+extern bool kFPUInitialized, kFPUXSaveEnabled;
+extern uint64_t kFPUXCR0;
+//Bytes in each thread's XSAVE (or FXSAVE) area, from CPUID leaf 0xD for the components enabled in XCR0
+extern uint32_t kFPUStateSize;
+//Thread whose FPU state was last loaded into each CPU's registers, NULL if the registers hold nothing of a thread's
+extern thread_t* volatile kFPUOwner[MAX_CPUS];
+extern volatile uint64_t kFPUSaveCount, kFPURestoreCount, kFPULazyHitCount;
+
+void fpu_init();
+void fpu_init_cpu();
+bool fpu_handle_device_not_available();
+void fpu_switch_out(uint32_t apic_id, thread_t* thread);
+void fpu_copy_thread(thread_t* parent, thread_t* child);
+bool kernel_fpu_usable();
+void kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif
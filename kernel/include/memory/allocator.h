@@ -6,24 +6,44 @@
 #include <stddef.h>
 
 #define RESERVED_PAGES 9
+//Minimum number of pages requested from the buddy allocator when kMemoryStatus runs out of free memory
+#define ALLOCATOR_HEAP_GROW_PAGES 16
+//Returned by free_memory when the address was a page allocation owned by the buddy allocator
+#define ALLOCATOR_FREED_PAGES 0xFFFFFFFE
+
+#define MEMORY_STATUS_NONE 0xFFFFFFFF
+#define MEMORY_STATUS_ADDRESS_TREE 0
+#define MEMORY_STATUS_SIZE_TREE 1
+#define MEMORY_STATUS_ENTRIES_PER_PAGE (PAGE_SIZE / sizeof(memory_status_t))
+//Compact kMemoryStatus and give pages back once this many pages worth of entries are unused
+#define MEMORY_STATUS_SHRINK_SLACK_PAGES 4
 
 typedef struct memory_status_s
 {
 	uint64_t startAddress;
 	uint64_t length;
 	bool in_use;
-
+	//Tree links (kMemoryStatus indexes) and heights for the address and size trees
+	uint8_t height[2];
+	uint32_t link[2][2];
 } memory_status_t;
 
 extern uint64_t kMemoryStatusCurrentPtr;
+extern uint64_t kMemoryStatusCapacity;
+extern uint64_t kMemoryStatusEntryCount;
 extern memory_status_t *kMemoryStatus;
+//Roots of the address ordered (all entries) and size ordered (free entries only) trees
+extern uint32_t kMemoryStatusRoot[2];
 
 bool physical_page_is_allocated_on(uintptr_t physical_page_start);
 uint64_t allocate_memory_at_address(uint64_t address, uint64_t requested_length, bool use_address);
 uint64_t allocate_memory_aligned(uint64_t requested_length);
+uint64_t allocate_memory_aligned_zone(uint64_t requested_length, uint32_t zone);
+uint64_t allocate_memory_aligned_node(uint64_t requested_length, uint32_t zone, uint32_t node);
 uint64_t allocate_memory(uint64_t requested_length);
+uint64_t allocation_size(uint64_t address);
+uint64_t allocator_largest_free_block();
 bool merge_freed_block(uint64_t freedIndex);
-void compact_memory_array();
 uint64_t free_memory(uint64_t address);
 void allocator_init();
 
@@ -0,0 +1,46 @@
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//One bucket per power of 2, bucket n counts allocations of 2^n to 2^(n+1)-1 bytes
+#define ALLOC_STATS_HISTOGRAM_BUCKETS 48
+//Distinct callsites tracked, allocations from callsites past this are only counted in the totals
+#define ALLOC_STATS_CALLSITE_SLOTS 256
+//Callsites included in allocstats_dump
+#define ALLOC_STATS_DUMP_TOP_N 10
+
+typedef struct alloc_callsite_s
+{
+	uintptr_t address;
+	uint64_t count;
+	uint64_t bytes;
+} alloc_callsite_t;
+
+typedef struct allocator_stats_s
+{
+	uint64_t live_bytes;
+	uint64_t peak_live_bytes;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	//Rates since the previous call to allocstats_get
+	uint64_t allocs_per_second;
+	uint64_t frees_per_second;
+	//Largest free kMemoryStatus entry and largest free buddy block
+	uint64_t heap_largest_free;
+	uint64_t page_largest_free;
+	uint64_t free_pages;
+	uint64_t status_entry_count;
+	uint64_t status_entry_capacity;
+	uint64_t untracked_callsite_count;
+	uint64_t size_histogram[ALLOC_STATS_HISTOGRAM_BUCKETS];
+} allocator_stats_t;
+
+void allocstats_record_alloc(uint64_t length, uintptr_t callsite);
+void allocstats_record_free(uint64_t length);
+void allocstats_get(allocator_stats_t* stats);
+int allocstats_top_callsites(alloc_callsite_t* callsites, int count);
+void allocstats_dump();
+
+#endif
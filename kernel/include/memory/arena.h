@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "CONFIG.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_CHUNK_SIZE PAGE_SIZE
+//Scratch arenas are sized so that a GPT partition table read (40 sectors) fits in the first chunk
+#define ARENA_SCRATCH_CHUNK_SIZE (PAGE_SIZE * 8)
+
+typedef struct arena_chunk_s
+{
+	struct arena_chunk_s* next;
+	size_t size;
+	size_t used;
+} arena_chunk_t;
+
+typedef struct arena_s
+{
+	//First chunk, kept across resets
+	arena_chunk_t* head;
+	//Chunk currently being bumped
+	arena_chunk_t* current;
+	size_t chunk_size;
+	uint64_t chunk_count;
+	//Scratch arena bookkeeping
+	volatile int busy;
+	bool temporary;
+} arena_t;
+
+typedef struct arena_mark_s
+{
+	arena_chunk_t* chunk;
+	size_t used;
+} arena_mark_t;
+
+arena_t* arena_create(size_t chunk_size);
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_zalloc(arena_t* arena, size_t size);
+arena_mark_t arena_save(arena_t* arena);
+void arena_rewind(arena_t* arena, arena_mark_t mark);
+void arena_reset(arena_t* arena);
+void arena_destroy(arena_t* arena);
+arena_t* arena_scratch_get();
+void arena_scratch_release(arena_t* arena);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "numa.h"
+
+//Largest block the buddy allocator will hand out or coalesce into (2^18 pages = 1GB)
+#define BUDDY_MAX_ORDER 18
+#define BUDDY_NO_PAGE 0xFFFFFFFF
+
+//Physical memory zones.  DMA32 is everything below 4GB, for devices which can only address 32 bits.
+#define MEMORY_ZONE_DMA32 0
+#define MEMORY_ZONE_NORMAL 1
+#define MEMORY_ZONE_COUNT 2
+#define MEMORY_ZONE_DMA32_LIMIT 0x100000000ULL
+
+//Page flags, only meaningful on the first page of a block
+#define BUDDY_PAGE_FREE 0x01
+#define BUDDY_PAGE_ALLOCATED 0x02
+//Block handed to the kMemoryStatus allocator to carve sub-page allocations from
+#define BUDDY_PAGE_HEAP 0x04
+//Free block being moved to its node's free lists by buddy_numa_init
+#define BUDDY_PAGE_REBUILD 0x08
+//Single page allocated by get_paging_table_page to hold a page table
+#define BUDDY_PAGE_TABLE 0x10
+//Single page allocated by cow_copy_page, freed by cow_release_range when its last mapping goes away
+#define BUDDY_PAGE_COW 0x20
+
+typedef struct buddy_page_s
+{
+	union
+	{
+		uint32_t next;			//Free list link while the block is free
+		uint32_t page_count;	//Number of pages allocated while the block is in use
+		uint32_t pcid;			//PCID of the address space while the page is a PML4 (BUDDY_PAGE_TABLE), see paging_pml4_cr3
+	};
+	union
+	{
+		uint32_t prev;			//Free list link while the block is free
+		uint32_t table_entries;	//Number of present entries while the page is a page table (BUDDY_PAGE_TABLE)
+	};
+	uint8_t order;
+	uint8_t flags;
+	//NUMA node the page is on, set for every page
+	uint8_t node;
+	//Number of address spaces mapping the page copy-on-write besides the first, set for every page
+	uint8_t share_count;
+} buddy_page_t;
+
+extern buddy_page_t* kBuddyPages;
+extern uint64_t kBuddyPageCount;
+extern uint64_t kBuddyFreePageCount;
+extern uint64_t kBuddyZoneFreePageCount[MEMORY_ZONE_COUNT];
+extern uint64_t kBuddyNodeFreePageCount[NUMA_MAX_NODES];
+extern uintptr_t kBuddyPagesPhysical;
+extern uint64_t kBuddyPagesSize;
+
+void buddy_init(uintptr_t reservedStart, uintptr_t reservedEnd);
+uint64_t buddy_alloc_pages(uint64_t page_count, uint8_t flags);
+uint64_t buddy_alloc_pages_zone(uint64_t page_count, uint8_t flags, uint32_t zone);
+uint64_t buddy_alloc_pages_node(uint64_t page_count, uint8_t flags, uint32_t zone, uint32_t node);
+uint64_t buddy_alloc_pages_at(uint64_t address, uint64_t page_count);
+uint64_t buddy_free_pages(uint64_t address);
+bool buddy_owns_allocation(uint64_t address);
+bool buddy_page_is_allocated(uintptr_t physical_page);
+uint64_t buddy_largest_free_block();
+void buddy_numa_init();
+
+#endif
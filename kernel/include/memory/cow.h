@@ -0,0 +1,18 @@
+#ifndef COW_H
+#define COW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "paging.h"
+
+//buddy_page_t::share_count is a byte, pages shared any wider are copied up front instead
+#define COW_MAX_SHARES 0xFF
+
+extern volatile uint64_t kCOWSharedPages, kCOWCopiedPages;
+
+void cow_share_range(pt_entry_t* srcPML4, pt_entry_t* dstPML4, uint64_t start, uint64_t end, uint64_t extraFlags);
+bool cow_handle_fault(uint64_t address, uint64_t error_code);
+bool cow_release_page(uintptr_t physical);
+void cow_release_range(pt_entry_t* pml4, uint64_t start, uint64_t end);
+
+#endif
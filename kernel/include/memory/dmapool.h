@@ -0,0 +1,36 @@
+#ifndef DMAPOOL_H
+#define DMAPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DMA_POOL_MAX_POOLS 16
+#define DMA_POOL_NAME_LENGTH 32
+//Minimum number of blocks carved out of each region
+#define DMA_POOL_MIN_BLOCKS_PER_REGION 8
+
+typedef struct dma_pool_s
+{
+	char name[DMA_POOL_NAME_LENGTH];
+	size_t block_size;
+	size_t stride;
+	size_t region_size;
+	uint64_t blocks_per_region;
+	//Highest memory zone regions may come from
+	uint32_t zone;
+	//Free blocks, linked through their first 8 bytes
+	void* free_list;
+	uint64_t free_count;
+	uint64_t region_count;
+	volatile int lock;
+} dma_pool_t;
+
+extern dma_pool_t kDMAPools[DMA_POOL_MAX_POOLS];
+extern int kDMAPoolCount;
+
+dma_pool_t* dma_pool_create(const char* name, size_t size, size_t align);
+dma_pool_t* dma_pool_create_zone(const char* name, size_t size, size_t align, uint32_t zone);
+void* dma_pool_alloc(dma_pool_t* pool);
+void dma_pool_free(dma_pool_t* pool, void* block);
+
+#endif
@@ -8,7 +8,10 @@
 
 void *kmalloc_aligned(uint64_t length);
 void *kmalloc(uint64_t length);
+void *kmalloc_aligned_node(uint64_t length, uint32_t node);
 void *kmalloc_dma(uint64_t length);
+void *kmalloc_dma32(uint64_t length);
+void *kmalloc_dma_zone(uint64_t length, uint32_t zone);
 void *kmalloc_dma32_address(uint32_t address, uint64_t length);
 void kfree(void *address);
 #endif
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef MEMCMP_H
 #define MEMCMP_H
 
+#include <stddef.h>
+
 int memcmp(const void *ptr1, const void *ptr2, size_t num);
+int memcmp_word(const void *ptr1, const void *ptr2, size_t num);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,64 @@
 #ifndef MEMOPS_H
 #define MEMOPS_H
 
+#include <stdbool.h>
 #include "memcpy.h"
 #include "memset.h"
 
+//Shorter copies and fills use the qword loop, kernel_fpu_begin/end cost more than the vector loops save
+#define MEMOPS_SMALL_SIZE 256
+//From this size rep movsb/stosb beats the vector loops on CPUs with ERMS
+#define MEMOPS_ERMS_THRESHOLD 512
+//Copies and fills this large would only evict the cache, they use non-temporal stores
+#define MEMOPS_NON_TEMPORAL_THRESHOLD (1024 * 1024)
+
+#define MEMOPS_FEATURE_SSE2 0x1
+#define MEMOPS_FEATURE_AVX2 0x2
+#define MEMOPS_FEATURE_ERMS 0x4
+#define MEMOPS_FEATURE_FSRM 0x8
+
+typedef void* (*memops_copy_t)(void* dest, const void* src, size_t len);
+typedef void* (*memops_fill_t)(void* dest, int val, size_t len);
+typedef void (*memops_move_t)(void* dest, const void* src, size_t len);
+
+typedef struct memops_variant_s
+{
+	const char* name;
+	//MEMOPS_FEATURE_* the CPU needs to run the variant
+	uint32_t features;
+	memops_copy_t copy;
+	memops_fill_t fill;
+	//Backward copy for overlapping moves with dest above src, NULL if the variant has none
+	memops_move_t moveBackward;
+} memops_variant_t;
+
+extern memops_variant_t kMemopsVariants[];
+extern const uint32_t kMemopsVariantCount;
+extern uint32_t kMemopsFeatures;
+//The routines memcpy, memmove and memset dispatch to, picked by memops_init
+extern memops_copy_t kMemcpyBlock, kMemcpyNonTemporal;
+extern memops_move_t kMemmoveBackward;
+extern memops_fill_t kMemsetBlock, kMemsetNonTemporal;
+//Sizes from which rep movsb/stosb is used, SIZE_MAX without ERMS
+extern size_t kMemcpyStringThreshold, kMemsetStringThreshold;
+
+void memops_init();
+bool memops_variant_supported(const memops_variant_t* variant);
+
+void* memcpy_qword(void* dest, const void* src, size_t len);
+void* memcpy_erms(void* dest, const void* src, size_t len);
+void* memcpy_sse2(void* dest, const void* src, size_t len);
+void* memcpy_avx2(void* dest, const void* src, size_t len);
+void* memcpy_sse2_nt(void* dest, const void* src, size_t len);
+void* memcpy_avx2_nt(void* dest, const void* src, size_t len);
+void memmove_backward_qword(void* dest, const void* src, size_t len);
+void memmove_backward_sse2(void* dest, const void* src, size_t len);
+void memmove_backward_avx2(void* dest, const void* src, size_t len);
+void* memset_qword(void* dest, int val, size_t len);
+void* memset_erms(void* dest, int val, size_t len);
+void* memset_sse2(void* dest, int val, size_t len);
+void* memset_avx2(void* dest, int val, size_t len);
+void* memset_sse2_nt(void* dest, int val, size_t len);
+void* memset_avx2_nt(void* dest, int val, size_t len);
+
 #endif
@@ -0,0 +1,41 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_MEMORY_RANGES 64
+//Highest APIC ID tracked in the CPU to node map
+#define NUMA_MAX_APIC_ID 256
+//Pass as the node to allocate from the calling CPU's node
+#define NUMA_NODE_LOCAL 0xFF
+//SLIT distances, used when the firmware doesn't provide a SLIT
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+typedef struct numa_memory_range_s
+{
+	uint64_t base;
+	uint64_t end;
+	uint8_t node;
+} numa_memory_range_t;
+
+extern uint32_t kNumaNodeCount;
+extern uint32_t kNumaProximityDomain[NUMA_MAX_NODES];
+extern numa_memory_range_t kNumaMemoryRanges[NUMA_MAX_MEMORY_RANGES];
+extern uint32_t kNumaMemoryRangeCount;
+extern uint8_t kNumaCpuNode[NUMA_MAX_APIC_ID];
+extern uint8_t kNumaDistance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+//For each node, every node ordered nearest first (starting with itself)
+extern uint8_t kNumaFallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+void numa_parse_srat(void* srat);
+void numa_parse_slit(void* slit);
+void numa_init();
+uint32_t numa_node_for_address(uint64_t address);
+uint64_t numa_node_range_end(uint64_t address);
+uint32_t numa_cpu_node(uint32_t apic_id);
+uint32_t numa_current_node();
+
+#endif
@@ -10,6 +10,8 @@
 #define PDPT_SHIFT 30
 #define PD_SHIFT   21
 #define PT_SHIFT   12
+//PML4 entries from here up map the kernel half, they point to the same PDPTs in every PML4
+#define PML4_KERNEL_FIRST_ENTRY 256
 
 #define KERNEL_PAGE_COUNT 0x1000
 
@@ -21,8 +23,42 @@
 #define PAGE_PCD          (1ULL << 4)    // Cache disable
 #define PAGE_ACCESSED     (1ULL << 5)    // Accessed
 #define PAGE_DIRTY        (1ULL << 6)    // Dirty
+#define PAGE_LARGE        (1ULL << 7)    // PS bit, PDPT/PD entry maps a 1GB/2MB page
 #define PAGE_GLOBAL       (1ULL << 8)    // Global page
 #define PAGE_NO_EXECUTE   (1ULL << 63)   // No-execute
+#define PAGE_COW          (1ULL << 9)    // Software bit, read-only page shared copy-on-write
+#define PAGE_SHARED       (1ULL << 10)   // Software bit, page is counted in its buddy_page_t::share_count
+
+//Page fault error code bits
+#define PAGE_FAULT_PRESENT 0x1   // The page was present, the fault is a protection violation
+#define PAGE_FAULT_WRITE   0x2   // The access was a write
+#define PAGE_FAULT_USER    0x4   // The access came from ring 3
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+//Set in a value written to CR3 so the TLB entries tagged with the new PCID are kept.  CR3 values are stored without it.
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR3_PCID_MASK 0xFFFULL
+
+#define PAGING_PCID_COUNT 4096
+//The kernel's PML4 always uses PCID 0
+#define PAGING_KERNEL_PCID 0
+//Handed out once every other PCID is in use.  Address spaces can share it because it is always flushed when loaded.
+#define PAGING_SHARED_PCID (PAGING_PCID_COUNT - 1)
+
+//INVPCID types
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+#define INVPCID_ALL_GLOBAL 2
+#define INVPCID_ALL 3
+
+//paging_flush_tlb_range flushes the whole TLB rather than invalidating more than this many pages one at a time
+#define PAGING_FLUSH_ALL_THRESHOLD 64
+//Freed page table pages kept for reuse before they go back to the buddy allocator
+#define PAGING_TABLE_FREE_LIST_MAX 64
+
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
 
 #define PAGE_FLAGS_MASK 0xFFFUL
 #define PAGE_ADDRESS_MASK  (~PAGE_FLAGS_MASK)
@@ -42,13 +78,19 @@ typedef uint64_t pt_entry_t;
 typedef struct {
 	pt_entry_t entries[512];
 } page_table_t;
+//Called by paging_for_each_page for each mapped page, with the page's page table entry
+typedef void (*paging_page_callback_t)(pt_entry_t* pte, uint64_t virtual_address, void* context);
 
 extern pt_entry_t kKernelPML4;
 extern pt_entry_t kKernelPML4v;
 extern uint64_t kHHDMOffset;
-//Pointer to the beginning of the pool of identity mapped pages that are allocated and mapped, to be used for page tables
-extern uintptr_t kPagingPagesBaseAddressV;
-extern uintptr_t kPagingPagesBaseAddressP;
+extern bool kPaging1GPagesSupported;
+extern bool kPagingPCIDEnabled;
+extern bool kPagingINVPCIDSupported;
+extern uint64_t kPagingCR3LoadFlags;
+extern bool kPagingTablesInitialized;
+extern uint64_t kPagingTablePagesInUse;
+extern uint64_t kPagingTableFreeCount;
 extern uintptr_t kKernelPageMappings[KERNEL_PAGE_COUNT][2];
 extern int kKernelPageMappingsCount;
 
@@ -65,12 +107,41 @@ void paging_map_pages(
 
 void paging_unmap_page(pt_entry_t *pml4, uint64_t virtual_address);
 void paging_unmap_pages(pt_entry_t *pml4, uint64_t virtual_address, size_t length);
+void paging_flush_tlb_range(uint64_t start, uint64_t end);
+void paging_flush_pml4_range(pt_entry_t* pml4, uint64_t start, uint64_t end);
+void paging_for_each_page(pt_entry_t* pml4, uint64_t start, uint64_t end, paging_page_callback_t callback, void* context);
 uintptr_t paging_walk_paging_table_keep_flags(pt_entry_t* pml4, uint64_t virtual_address, bool keepPageFlags);
 uintptr_t paging_walk_paging_table(pt_entry_t* pml4, uint64_t virtual_address);
 void validatePagingHierarchy(uintptr_t address);
 void init_os64_paging_tables();
+void paging_map_hhdm(pt_entry_t* pml4v);
 void paging_map_kernel_into_pml4(uintptr_t* pml4v);
+void paging_populate_kernel_half(pt_entry_t* pml4v);
+pt_entry_t* paging_create_pml4();
+void paging_enable_global_pages();
+void paging_enable_pcid();
+uint16_t paging_alloc_pcid(uint64_t pml4);
+uint64_t paging_pml4_cr3(pt_entry_t* pml4v);
+void paging_free_pcid(uint16_t pcid);
+void paging_flush_tlb_all();
+
+static inline void paging_invpcid(uint64_t type, uint64_t pcid, uint64_t address)
+{
+	struct { uint64_t pcid; uint64_t address; } descriptor = {pcid, address};
+	__asm__ __volatile__("invpcid %0, %1" : : "r"(type), "m"(descriptor) : "memory");
+}
+
+/// @brief Load CR3 without dropping the TLB entries of the PCID being switched to (except for PAGING_SHARED_PCID)
+/// @param cr3 PML4 physical address | PCID
+static inline void paging_write_cr3(uint64_t cr3)
+{
+	if ((cr3 & CR3_PCID_MASK) != PAGING_SHARED_PCID)
+		cr3 |= kPagingCR3LoadFlags;
+	__asm__ __volatile__("mov cr3, %0" : : "r"(cr3) : "memory");
+}
 uintptr_t get_paging_table_page();
 uintptr_t get_paging_table_pageV();
+void free_paging_table_page(uintptr_t page);
+void paging_free_pml4(pt_entry_t* pml4v);
 
 #endif // PAGING_H
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "smp.h"
+
+#define SLAB_MAX_CACHES 16
+#define SLAB_NAME_LENGTH 32
+//Objects each CPU can hold without touching the cache lock
+#define SLAB_MAGAZINE_SIZE 16
+//Objects moved between a magazine and the cache's shared free list at a time
+#define SLAB_BATCH_SIZE (SLAB_MAGAZINE_SIZE / 2)
+//Minimum number of objects carved out of each slab
+#define SLAB_MIN_OBJECTS_PER_SLAB 8
+#define SLAB_DEFAULT_ALIGNMENT 8
+
+typedef struct slab_magazine_s
+{
+	uint32_t count;
+	void* objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct kmem_cache_s
+{
+	char name[SLAB_NAME_LENGTH];
+	size_t object_size;
+	size_t stride;
+	size_t slab_size;
+	size_t objects_per_slab;
+	//Objects not held by any magazine, linked through their first 8 bytes
+	void* free_list;
+	uint64_t free_count;
+	uint64_t slab_count;
+	volatile int lock;
+	slab_magazine_t magazines[MAX_CPUS];
+} kmem_cache_t;
+
+extern kmem_cache_t kSlabCaches[SLAB_MAX_CACHES];
+extern int kSlabCacheCount;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t object_size);
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t object_size, size_t alignment);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+#endif
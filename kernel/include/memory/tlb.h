@@ -0,0 +1,46 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "paging.h"
+#include "smp.h"
+
+//Requests each CPU can have waiting.  Deferred requests which don't fit turn into a full flush, acknowledged ones wait for room.
+#define TLB_QUEUE_SIZE 16
+//End of the user half, a request for [0, TLB_USER_HALF_END) drops a whole PCID
+#define TLB_USER_HALF_END 0x0000800000000000ULL
+//The kernel half.  A request for all of it drops every TLB entry, global ones and other PCIDs' paging-structure caches included.
+#define TLB_KERNEL_HALF_START 0xFFFF800000000000ULL
+#define TLB_KERNEL_HALF_END 0xFFFFFFFFFFFFFFFFULL
+
+typedef struct tlb_request_s
+{
+	//CR3 (PML4 physical address | PCID) of the address space the range was changed in
+	uint64_t cr3;
+	uint64_t start, end;
+	//Decremented once the request has been processed, NULL when nobody is waiting on it
+	volatile uint32_t* ack;
+} tlb_request_t;
+
+typedef struct tlb_queue_s
+{
+	volatile int lock;
+	uint32_t count;
+	//A deferred request didn't fit, everything is flushed the next time the queue is processed
+	bool flushAll;
+	tlb_request_t requests[TLB_QUEUE_SIZE];
+} tlb_queue_t;
+
+//CR3 of the thread each CPU is running, maintained by the scheduler
+extern volatile uint64_t kTLBActiveCR3[MAX_CPUS];
+//For each PCID, the CPUs which have loaded it and may still have TLB entries tagged with it
+extern volatile uint32_t kTLBPCIDCpus[PAGING_PCID_COUNT];
+extern uint64_t kTLBShootdownCount, kTLBShootdownIPICount;
+
+void tlb_invalidate_local(uint64_t addressSpace, uint64_t start, uint64_t end);
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end);
+void tlb_process_queue();
+void tlb_switch_cr3(uint32_t apic_id, uint64_t cr3);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "task.h"
+
+//Physical address of a VMA whose pages are zero filled on first touch
+#define VMA_ANONYMOUS 0
+
+//A range of a task's address space which is mapped a page at a time, by the page fault handler, as it is touched
+typedef struct vma_s
+{
+	uintptr_t start, end;
+	//Page flags each page is mapped with
+	uint64_t flags;
+	//Physical address start is backed by (a lazy mapping of existing memory), or VMA_ANONYMOUS
+	uintptr_t physical;
+} vma_t;
+
+vma_t* vma_add(task_t* task, uintptr_t start, size_t length, uint64_t flags, uintptr_t physical);
+vma_t* vma_find(task_t* task, uintptr_t address);
+bool vma_handle_fault(uint64_t address, uint64_t error_code);
+void vma_copy_all(task_t* parent, task_t* child);
+void vma_release_all(task_t* task);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef ZEROPOOL_H
+#define ZEROPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "CONFIG.h"
+
+//Most pre-zeroed pages the pool will hold
+#define ZERO_POOL_MAX_PAGES 512
+//The /pagezero thread starts refilling once the pool drops below this many pages
+#define ZERO_POOL_LOW_WATERMARK (ZERO_POOL_MAX_PAGES / 4)
+//How long /pagezero sleeps between checks of the pool
+#define ZERO_POOL_SLEEP_TICKS (TICKS_PER_SECOND / 10)
+//Nice value of the /pagezero task, lowest priority so it only runs when a core would otherwise idle
+#define ZERO_POOL_TASK_PRIORITY 20
+
+extern volatile uint64_t kZeroPoolCount;
+extern volatile uint64_t kZeroPoolHits;
+extern volatile uint64_t kZeroPoolMisses;
+extern volatile uint64_t kZeroPoolPagesZeroed;
+extern volatile uint64_t kZeroPoolLastRefillLagTicks;
+extern volatile uint64_t kZeroPoolMaxRefillLagTicks;
+
+uint64_t zero_pool_get_page();
+bool zero_pool_refill(uint64_t max_pages);
+void zero_pool_thread();
+
+#endif
@@ -5,19 +5,47 @@
 #include "thread.h"
 #include "task.h"
 #include "smp.h"
+#include "CONFIG.h"
 
 #define SCHEDULER_STACK_SIZE 0x4000
 #define NO_TASK (void*)0xFFFFFFFFFFFFFFFF
 #define NO_PREV (void*)NO_THREAD
 #define NO_NEXT (void*)NO_THREAD
-#define RUNNABLE_TICKS_INTERVAL 20
-#define HIGH_PRIORITY_TICKS_BOOST 10000000
+//Runnable threads are kept in one FIFO list per priority level, level 0 highest.  Task priorities -20..20 map onto
+//levels 0..39, with 19 and 20 sharing the last.
+#define SCHEDULER_PRIORITY_LEVELS 40
+//Time slices, in scheduler passes, at the lowest and highest priority levels.  Those in between are interpolated.
+#define SCHEDULER_MIN_TIMESLICE 1
+#define SCHEDULER_MAX_TIMESLICE 8
+#define SCHEDULER_TIMESLICE(level) (SCHEDULER_MIN_TIMESLICE + (SCHEDULER_PRIORITY_LEVELS - 1 - (level)) * \
+		(SCHEDULER_MAX_TIMESLICE - SCHEDULER_MIN_TIMESLICE) / (SCHEDULER_PRIORITY_LEVELS - 1))
+//Ticks a thread can wait on a run queue before it is promoted to the level of the threads keeping it off the CPU
+#define SCHEDULER_STARVATION_TICKS (TICKS_PER_SECOND / 2)
+//Scheduler passes on a core between checks for a sibling carrying more work than it
+#define SCHEDULER_BALANCE_INTERVAL 8
+
+	//One per core.  The locks are only ever held with interrupts disabled.
+	typedef struct
+	{
+		//Runnable threads waiting for this core by priority level, NO_THREAD when a level is empty.  Bit n of levelBitmap
+		//is set when level n has threads queued.
+		thread_t *levelHead[SCHEDULER_PRIORITY_LEVELS], *levelTail[SCHEDULER_PRIORITY_LEVELS];
+		uint64_t levelBitmap;
+		//The core's idle thread while it's queued, only run when no other thread is
+		thread_t *idle;
+		//Threads queued, and how many of those aren't pinned to this core so can be stolen by another
+		volatile uint32_t count, stealableCount;
+		volatile int lock;
+		//Thread the core is running, NO_THREAD until it runs its first one
+		thread_t *current;
+		uint32_t balanceCountdown;
+		//Next level scheduler_runqueue_age checks for a starving thread
+		uint32_t agingLevel;
+	} scheduler_runqueue_t;
 
 	extern task_t *kTaskList;
 	extern thread_t *kThreadList;
 	extern thread_t *qZombie;
-	extern thread_t *qRunning;
-	extern thread_t *qRunnable;
 	extern thread_t *qStopped;
 	extern thread_t *qUSleep;
 	extern thread_t *qISleep;
@@ -26,12 +54,18 @@
 	extern volatile uint64_t kIdleTicks[MAX_CPUS];
 	extern volatile bool mp_inScheduler[MAX_CPUS];
 	extern volatile bool kSchedulerInitialized;
+	extern volatile int kSchedulerSwitchTasksLock;
+	extern scheduler_runqueue_t kRunQueues[MAX_CPUS];
+	extern volatile uint64_t kSchedulerStealCount;
 	
 	void scheduler_init();
 	void scheduler_enable();
 	void scheduler_disable();
 	void scheduler_submit_new_task(task_t *newTask);
 	void scheduler_change_thread_queue(thread_t* thread, eThreadState newState);
+	void scheduler_remove_thread_from_queue(eThreadState queue, thread_t *thread);
+	thread_t* scheduler_steal_thread(uint32_t cpu, uint32_t victim);
+	thread_t *scheduler_find_thread_to_run(core_local_storage_t *cls, bool justBrowsing);
 	void scheduler_yield(core_local_storage_t *cls);
 	void scheduler_trigger(core_local_storage_t *cls);
 	void scheduler_wake_isleep_task(task_t *task);
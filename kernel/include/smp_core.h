@@ -35,6 +35,7 @@ void send_ipi(uint32_t apic_id, uint32_t vector, uint32_t delivery_mode, uint32_
 void send_ipi_int(uint32_t apic_id, uint32_t vector, uint32_t delivery_mode, uint32_t level, uint32_t trigger_mode, bool CLISTI);
 void ap_wake_up_aps();
 void ap_enable_schedulers();
+void mpSendInvTLB(uint32_t apic_id);
 
 static inline core_local_storage_t* get_core_local_storage(void)
 {
@@ -0,0 +1,26 @@
+#ifndef STRSIMD_H
+#define STRSIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//strlen and memcmp switch to the vector routines once this many bytes have been scanned a word at a time.  Shorter
+//strings (paths, names) aren't worth the cost of kernel_fpu_begin/end.
+#define STRINGS_SIMD_THRESHOLD 256
+
+typedef size_t (*strings_strlen_t)(const char* str);
+typedef int (*strings_memcmp_t)(const void* ptr1, const void* ptr2, size_t num);
+
+//Vector routines picked by strings_init, NULL until then
+extern strings_strlen_t kStrlenSimd;
+extern strings_memcmp_t kMemcmpSimd;
+
+void strings_init();
+size_t strlen_word(const char* str);
+size_t strlen_sse2(const char* str);
+size_t strlen_avx2(const char* str);
+int memcmp_word(const void* ptr1, const void* ptr2, size_t num);
+int memcmp_sse2(const void* ptr1, const void* ptr2, size_t num);
+int memcmp_avx2(const void* ptr1, const void* ptr2, size_t num);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef STRWORD_H
+#define STRWORD_H
+
+#include <stdint.h>
+
+//Helpers for scanning strings 8 bytes at a time.  The types may alias any char data, strword_unaligned_t also allows
+//loads from any address.
+typedef uint64_t __attribute__((may_alias)) strword_t;
+typedef uint64_t __attribute__((may_alias, aligned(1))) strword_unaligned_t;
+
+#define STRWORD_SIZE 8
+#define STRWORD_ONES 0x0101010101010101ULL
+#define STRWORD_HIGHS 0x8080808080808080ULL
+//Every byte of the word set to c
+#define STRWORD_REPEAT(c) (STRWORD_ONES * (uint8_t)(c))
+//Non-zero if any byte of w is zero.  The lowest set bit marks the first zero byte, bits above it can be false positives.
+#define STRWORD_HAS_ZERO(w) (((w) - STRWORD_ONES) & ~(w) & STRWORD_HIGHS)
+//Index of the first byte marked in a STRWORD_HAS_ZERO mask, or the first differing byte of two words XORed together
+#define STRWORD_FIRST_BYTE(mask) (__builtin_ctzll(mask) >> 3)
+//An aligned word never spans two pages, an unaligned load from p could fault on the next page if the string ends first
+#define STRWORD_CROSSES_PAGE(p) (((uintptr_t)(p) & 0xFFF) > 0x1000 - STRWORD_SIZE)
+
+#endif
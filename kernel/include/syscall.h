@@ -22,6 +22,12 @@ typedef struct {
 
 #define MAX_SYSCALLS 256
 
+// What syscall_Enter saves at the top of the thread's kernel stack (just below its RSP0) before dispatching
+typedef struct {
+    uint64_t userRFLAGS, userRIP, userRSP, padding;
+    uint64_t R15, R14, R13, R12, RBP, RBX;
+} syscall_frame_t;
+
 // The actual syscall table
 extern syscall_entry_t syscall_table[MAX_SYSCALLS];
 
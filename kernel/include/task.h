@@ -9,9 +9,10 @@
 
 #define TASK_MAX_EXIT_HANDLERS 10
 #define TASK_DEFAULT_PRIORITY 0
-#define TASK_STRUCT_VADDR 0xFFFF8000FFFFF000
+//In the user half (but not user accessible) since the kernel half is shared by every task
+#define TASK_STRUCT_VADDR 0x6e000000
 #define TASK_HEAP_START 0x70000000
-#define TASK_HEAP_END   0x00007FFFFFFFFFFF
+#define TASK_HEAP_END   (THREAD_USER_STACK_REGION_BASE - 1)
 #define TASK_ARGV_VIRT 0x6f000000
 //Virtual address of the environment pointers
 #define TASK_ENVP_VIRT 0x6f010000
@@ -71,6 +72,7 @@
         char** argv;
         struct rusage usage;
         void* stdin, *stdout, *stderr;        //standard input/output/error pointers
+        //vma_t's describing the task's lazily populated memory, NULL until the first vma_add
         dlist_t* mmaps;
         int errno;
         char* cwd;                              //Current working directory for the process
@@ -86,15 +88,24 @@
         char* realEnv;
 		uint64_t envPSize, envSize;
         bool justForked;
-        uint32_t forkChildCR3;
+        //CR3 of the task's most recently forked child
+        uint64_t forkChildCR3;
         uint32_t childNumber;
         uint32_t lastChildNumber;
         bool foreground, stdinRedirected, stdoutRedirected, stderrRedirected;
         uintptr_t *stackInitialPage;
         uint32_t minorFaults, majorFaults, cSwitches;
 		uint64_t* pml4, *pml4v;
+		//PCID the task's threads run with, part of their CR3 value
+		uint16_t pcid;
+		//Protects mmaps, and the last VMA a fault was resolved in
+		volatile int mmapLock;
+		dlist_node_t* mmapHint;
 		void *prev, *next;
     } task_t;
 
+	void task_cache_init();
 	task_t* task_create(char* path, int argc, char** argv, task_t* parentTaskPtr, bool isKernelTask, uint64_t pinnedAPICID);
+	void task_release_address_space(task_t* task);
+	task_t* task_fork(task_t* parentTask);
 #endif
\ No newline at end of file
@@ -18,8 +18,21 @@
 #define THREAD_KERNEL_STACK_SIZE  0xFFFF	//64k kernel stack
 #define THREAD_KERNEL_STACK_INITIAL_VIRT_ADDRESS THREAD_KERNEL_STACK_VIRTUAL_START + THREAD_KERNEL_STACK_SIZE - 8
 
+//Stacks are reserved as virtual ranges, one slot per thread ID.  User stacks are populated a page at a time by the page fault
+//handler, kernel stacks in full when they are created.
+//Each slot starts with THREAD_STACK_GUARD_PAGE_COUNT guard pages, which are never mapped, and the rest of the slot above the stack
+//is never mapped either.
+#define THREAD_USER_STACK_REGION_BASE 0x00007E0000000000
+#define THREAD_USER_STACK_SLOT_SIZE 0x200000
+//In the kernel half, so kernel stacks are mapped once in the kernel PML4 and seen by every task
+#define THREAD_KERNEL_STACK_REGION_BASE 0xFFFFFE0000000000
+#define THREAD_KERNEL_STACK_SLOT_SIZE 0x20000
+
 #define THREAD_VIRTUAL_STRUCT_ADDRESS 0xF0000000
 #define NO_THREAD (void*)0xFFFFFFFFFFFFFFFF
+//mp_apic of a thread which can run on any core
+#define THREAD_NOT_PINNED 0xFFFFFFFFFFFFFFFF
+#define THREAD_NO_CPU 0xFFFFFFFF
 
 typedef enum
 {
@@ -51,16 +64,32 @@ typedef struct s_thread
 	thread_context_t regs;
 	uintptr_t* pml4;
 	eThreadState threadState;
-	uint64_t totalRunTicks, ticksSinceLastInterrupted, prioritizedTicksInRunnable;
+	uint64_t totalRunTicks, ticksSinceLastInterrupted;
+	//kTicksSinceStart when the thread was last queued or promoted, used to spot starving threads
+	uint64_t runnableSinceTicks;
+	//Scheduler passes left in the thread's time slice
+	uint32_t timeSliceLeft;
+	//Run queue priority level the thread is queued at.  Can be above its task's while queued, see scheduler_runqueue_age.
+	uint8_t queueLevel;
+	//Queue at the highest priority level the next time it becomes runnable
+	bool wakeBoost;
 	uint64_t lastRunStartTicks, lastRunEndTicks, totalRunningTicks;
 	uintptr_t esp0BaseV, esp0BaseP, esp0Size, esp3BaseV, esp3BaseP, esp3Size;
 	void* ownerTask;
 	struct s_thread *forkedThread;
+	//XSAVE (or FXSAVE) area, allocated the first time the thread uses the FPU.  See fpu.c.
+	void* fpuState;
+	//CPU whose registers fpuState was last loaded into
+	uint32_t fpuCpu;
+	//Core whose run queue the thread is on, or which it last ran on.  THREAD_NO_CPU until it is first queued.
+	uint32_t runQueueCpu;
 	struct s_thread *prev, *next;
 	signals_t signals;
 } thread_t;
 
+void thread_cache_init();
 thread_t* createThread(void* parentTask, bool kernelThread);
-uintptr_t thread_allocate_guarded_stack_memory(uintptr_t pml4, uintptr_t *virtualStart, uint64_t requestedLength, bool isRing3Stack);
+uintptr_t thread_allocate_guarded_stack_memory(uintptr_t pml4, uint64_t threadID, uintptr_t *virtualStart, uint64_t requestedLength, bool isRing3Stack);
+bool thread_handle_stack_fault(uint64_t address, uint64_t error_code);
 
 #endif
@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+//IST slot #PF runs on, so a fault growing a kernel stack doesn't need room on that stack
+#define TSS_IST_PAGE_FAULT 1
+#define TSS_IST_STACK_SIZE 0x4000
+
 typedef struct  {
     uint16_t limit_low;          // Bits 0-15 of the TSS size
     uint16_t base_low;           // Bits 0-15 of the TSS base address
@@ -1,5 +1,13 @@
 #include "dlist.h"
 #include "kmalloc.h"
+#include "slab.h"
+
+kmem_cache_t* kDListNodeCache = NULL;
+
+/// @brief Create the dlist_node_t cache.  Called once at boot, before anything adds to a dlist or the APs start.
+void dlist_cache_init() {
+    kDListNodeCache = kmem_cache_create("dlist_node_t", sizeof(dlist_node_t));
+}
 
 void dlist_init(dlist_t* list) {
     list->head = NULL;
@@ -11,7 +19,7 @@ void dlist_init(dlist_t* list) {
 /// @param The list to add the node to
 /// @param Pointer to the data the node will hold
 dlist_node_t* dlist_add(dlist_t* list, volatile void* data) {
-    dlist_node_t* new_node = kmalloc(sizeof(dlist_node_t));
+    dlist_node_t* new_node = kmem_cache_alloc(kDListNodeCache);
     new_node->data = data;
     new_node->next = NULL;
     if (list->tail == NULL) { // Empty list
@@ -40,7 +48,7 @@ void dlist_remove(dlist_t* list, dlist_node_t* node) {
         list->tail = node->prev;
     }
 
-    kfree(node);
+    kmem_cache_free(kDListNodeCache, node);
     list->size--;
 }
 
@@ -57,7 +65,7 @@ void dlist_destroy(dlist_t* list)
 		kfree((void*)current->data);
         // Free the data if a callback is provided
         // Free the node itself
-        kfree(current);
+        kmem_cache_free(kDListNodeCache, current);
 
         current = next;
     }
@@ -5,6 +5,7 @@
 #include "panic.h"
 #include "serial_logging.h"
 #include "kmalloc.h"
+#include "arena.h"
 #include "memops.h"
 #include "strcpy.h"
 
@@ -37,7 +38,8 @@ int utf16_to_char_string(char* dest, uint16_t* src, int dest_length, int src_len
 bool parseGPT(block_device_info_t* device)
 {
 	int readLen=0;
-	char *partBuffer = kmalloc(40*512);
+	arena_t* scratch = arena_scratch_get();
+	char *partBuffer = arena_zalloc(scratch, 40*512);
 
 	printd(DEBUG_BOOT | DEBUG_DETAILED,"BOOT: parseGPT -  Retrieving MBR for %s\n", device->block_device->name);
 	bool lResult=device->block_device->ops->read(device, 1, mbrBuffer, 1);
@@ -82,7 +84,7 @@ bool parseGPT(block_device_info_t* device)
 		}
     }
 	printd(DEBUG_BOOT | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED,"BOOT:  parseGPT - Freeing partBuffer\n");
-	kfree(partBuffer);
+	arena_scratch_release(scratch);
 
 	printd(DEBUG_BOOT | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED,"BOOT: parseGPT - returning\n");
     return true;
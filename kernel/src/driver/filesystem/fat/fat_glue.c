@@ -148,14 +148,10 @@ void ff_memfree (
 DWORD get_fattime(void) {
     // Convert epoch time (kSystemCurrentTime) to calendar time
     time_t raw_time = (time_t)kSystemCurrentTime; // Cast epoch time
-    struct tm *timeinfo = kmalloc(sizeof(struct tm));
+    arena_t* scratch = arena_scratch_get();
+    struct tm *timeinfo = arena_alloc(scratch, sizeof(struct tm));
 	gmtime(&raw_time, timeinfo);      // Convert to UTC time
 
-    if (!timeinfo) {
-        // Return default time if conversion fails (e.g., 1980-01-01 00:00:00)
-        return ((DWORD)(1980 - 1980) << 25) | ((DWORD)1 << 21) | ((DWORD)1 << 16);
-    }
-
     // Pack the time components into a DWORD
     DWORD fattime = 0;
     fattime |= ((DWORD)(timeinfo->tm_year - 80) << 25); // Year since 1980
@@ -165,7 +161,7 @@ DWORD get_fattime(void) {
     fattime |= ((DWORD)(timeinfo->tm_min) << 5);        // Minute (0–59)
     fattime |= ((DWORD)(timeinfo->tm_sec / 2));         // Second (0–59, divided by 2)
 
-	kfree(timeinfo);
+	arena_scratch_release(scratch);
 
     return fattime;
 }
@@ -183,10 +179,12 @@ void create_fat_path(char* fsPath, vfs_filesystem_t* vfs_fs)
 
 static int fat_open (vfs_file_t** vfs_file, const char* path, const char* mode, vfs_filesystem_t* vfs_fs)
 {
-	FIL* fat_file = kmalloc(sizeof(FIL));  // FIL object (FAT filesystem file handle)
+	//The VFS file and FIL object (FAT filesystem file handle) share an arena which is released on close
+	arena_t* arena = arena_create(sizeof(vfs_file_t) + sizeof(FIL) + ARENA_ALIGNMENT * 2);
+	FIL* fat_file = arena_zalloc(arena, sizeof(FIL));
     BYTE fat_mode = 0;
 
-	*vfs_file = kmalloc(sizeof(vfs_file_t));
+	*vfs_file = arena_zalloc(arena, sizeof(vfs_file_t));
 	// Convert VFS mode string to FAT mode flags
     if (strcmp(mode, "r") == 0) fat_mode = FA_READ;
     else if (strcmp(mode, "w") == 0) fat_mode = FA_WRITE | FA_CREATE_ALWAYS;
@@ -198,9 +196,12 @@ static int fat_open (vfs_file_t** vfs_file, const char* path, const char* mode,
 	create_fat_path(lPath, vfs_fs);
 
     if (f_open(fat_file, lPath, fat_mode) != FR_OK) {
+		arena_destroy(arena);
+		*vfs_file = NULL;
         return -1; // Error
     }
 
+    (*vfs_file)->arena = arena;
     (*vfs_file)->handle = fat_file;
 	(*vfs_file)->f_path = (void*)path;
 	(*vfs_file)->owner = 0x0;
@@ -237,8 +238,7 @@ static int fat_close(vfs_file_t* vfs_file) {
     if (f_close(fat_file) != FR_OK) {
         return -1; // Error
     }
-    kfree(vfs_file); // Free the VFS file object
-	kfree(fat_file);
+    arena_destroy(vfs_file->arena); // Free the VFS file and FIL objects
     return 0; // Success
 }
 
@@ -303,33 +303,36 @@ static int fat_fprintf(vfs_file_t* vfs_file, const char* fmt, ...)
 static int fat_initialize(vfs_filesystem_t* vfs_fs) {
     // Allocate FAT context
     FATFS* fat_fs = kmalloc(sizeof(FATFS));
-	char* drive_label = kmalloc(255);
+	arena_t* scratch = arena_scratch_get();
+	char* drive_label = arena_zalloc(scratch, 255);
 
 	create_fat_path(drive_label, vfs_fs);
 
     // Mount the FATFS
     if (f_mount(fat_fs, drive_label, 1) != FR_OK) {
-        kfree(drive_label);
+        arena_scratch_release(scratch);
+        kfree(fat_fs);
         return -1; // Failed to mount
     }
 
     // Store the context in the VFS filesystem
     vfs_fs->fs_specific = fat_fs;
     vfs_fs->fops = &fat_fops;
-	kfree(drive_label);
+	arena_scratch_release(scratch);
     return 0; // Success
 }
 
 static int fat_uninitialize(vfs_filesystem_t* vfs_fs)
 {
 	int retVal = 0;
-	char* drive_label = kmalloc(255);
+	arena_t* scratch = arena_scratch_get();
+	char* drive_label = arena_zalloc(scratch, 255);
 	
 	create_fat_path(drive_label, vfs_fs);
 
 	retVal = f_unmount(drive_label);
 	kfree(vfs_fs->fs_specific);
-	kfree(drive_label);
+	arena_scratch_release(scratch);
 	return retVal;
 }
 
@@ -337,7 +340,9 @@ static int fat_uninitialize(vfs_filesystem_t* vfs_fs)
 // FAT directory methods
 static int fat_open_dir(vfs_directory_t** vfs_dir, const char* path, vfs_filesystem_t* vfs_fs)
 {
-	DIR* dir=kmalloc(sizeof(DIR));
+	//The VFS directory and DIR object share an arena which is released on close
+	arena_t* arena = arena_create(sizeof(vfs_directory_t) + sizeof(DIR) + ARENA_ALIGNMENT * 2);
+	DIR* dir=arena_zalloc(arena, sizeof(DIR));
 	char tempPath[255];
 
 	strncpy(tempPath, path, 255);
@@ -345,17 +350,21 @@ static int fat_open_dir(vfs_directory_t** vfs_dir, const char* path, vfs_filesys
 
 	if (f_opendir(dir, tempPath))
 		{
-			kfree(dir);
+			arena_destroy(arena);
 			return -1;
 		}
-	*vfs_dir = kmalloc(sizeof(vfs_directory_t));
+	*vfs_dir = arena_zalloc(arena, sizeof(vfs_directory_t));
 	(*vfs_dir)->handle=dir;
+	(*vfs_dir)->arena=arena;
 	return 0;
 }
 
 static int fat_close_dir(vfs_directory_t* vfs_dir)
 {
-	return f_closedir(vfs_dir->handle);
+	int retVal = f_closedir(vfs_dir->handle);
+
+	arena_destroy(vfs_dir->arena);
+	return retVal;
 }
 
 static int fat_read_dir(vfs_directory_t* vfs_dir, void* filInfo)
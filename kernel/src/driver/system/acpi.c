@@ -5,6 +5,7 @@
 #include "paging.h"
 #include "panic.h"
 #include "smp.h"
+#include "numa.h"
 
 extern uintptr_t kPCIBaseAddress;
 extern uintptr_t kLimineRSDP;
@@ -241,4 +242,14 @@ void acpiFindTables() {
 				detail += *(uint8_t*)(detail + 1);
 		}
 	}
+
+	//Locate SRAT/SLIT (NUMA topology).  Without them everything is node 0.
+	acpi_table_header_t *sratHeader = (void*)acpiFindTable(rootSDT, "SRAT");
+	if (sratHeader)
+	{
+        printd(DEBUG_ACPI, "ACPI: SRAT table found at %p\n", sratHeader);
+		numa_parse_srat(sratHeader);
+		numa_parse_slit(acpiFindTable(rootSDT, "SLIT"));
+	}
+	numa_init();
 }
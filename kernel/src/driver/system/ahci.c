@@ -4,6 +4,8 @@
 #include "time.h"
 #include "paging.h"
 #include "kmalloc.h"
+#include "dmapool.h"
+#include "buddy.h"
 #include "serial_logging.h"
 #include "BasicRenderer.h"
 #include "memory/memcpy.h"
@@ -79,41 +81,44 @@ int ata_find_cmdslot(const hba_port_t *port) {
     return -1;
 }
 
-void ahci_port_rebase(volatile hba_port_t *port, int portno, uintptr_t remapBase) {
-    //each command list is 1k (32k possible per port))
-    printd(DEBUG_AHCI, "AHCI: Stopping and rebasing port %u (0x%08x) clb/fb from 0x%08x/0x%08x to 0x%08x/0x%08x\n", 
-				portno, port, port->clb, port->fb, (remapBase + (portno<<10)), (remapBase + (portno<<10))+0x1000);
+dma_pool_t* kAHCICommandListPool;
+dma_pool_t* kAHCIFISPool;
+dma_pool_t* kAHCICommandTablePool;
+
+void ahci_port_rebase(volatile hba_port_t *port, int portno) {
+    // Command list: 32 entries * 32 bytes = 1K, 1K aligned
+    // FIS: 256 bytes, 256 byte aligned
+    // Command tables: 32 per port, AHCI_COMMAND_TABLE_SIZE bytes each (64+16+48+16*256), 128 byte aligned
+    if (kAHCICommandListPool == NULL)
+    {
+        //HBAs without S64A ignore the upper 32 bits of every address we give them
+        uint32_t zone = ahciABAR->cap.S64A?MEMORY_ZONE_NORMAL:MEMORY_ZONE_DMA32;
+        kAHCICommandListPool = dma_pool_create_zone("ahci_command_list", 1024, 1024, zone);
+        kAHCIFISPool = dma_pool_create_zone("ahci_fis", 256, 256, zone);
+        kAHCICommandTablePool = dma_pool_create_zone("ahci_command_table", AHCI_COMMAND_TABLE_SIZE, 128, zone);
+    }
+    uintptr_t commandList = (uintptr_t)dma_pool_alloc(kAHCICommandListPool);
+    uintptr_t fis = (uintptr_t)dma_pool_alloc(kAHCIFISPool);
+
+    printd(DEBUG_AHCI, "AHCI: Stopping and rebasing port %u (0x%08x) clb/fb from 0x%08x/0x%08x to 0x%016lx/0x%016lx\n", 
+				portno, port, port->clb, port->fb, commandList, fis);
     ahci_stop_cmd(port); // Stop command engine
 
-    // Command list offset: 1K*portno
-    // Command list entry size = 32
-    // Command list entry maxim count = 32
-    // Command list maxim size = 32*32 = 1K per port
-    port->clbu = (remapBase + (portno<<10)) >> 32;
-    port->clb = (remapBase + (portno<<10));
-	uint64_t thePort = (uint64_t)port->clbu << 32 | port->clb;
-	memset((void*)thePort, 0, 1024);
+    port->clbu = commandList >> 32;
+    port->clb = commandList;
+	memset((void*)commandList, 0, 1024);
     
-    //each FIS is 256 bytes
-    // FIS offset: 32K+256*portno
-    // FIS entry size = 256 bytes per port
-    port->fbu = port->clbu;
-    port->fb = (port->clb + 0x1000);
-	thePort = (uint64_t)port->fbu << 32 | port->fb;
-	memset((void*)thePort, 0, 256);
-
-	printd(DEBUG_AHCI, "AHCI: Done rebasing, setting up a cmdheader at the clb (0x%016x)\n",port->clb);
-
-    // Command table offset: 40K + 8K*portno
-    // Command table size = 256*32 = 8K per port
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)(uint64_t)(port->clb);
+    port->fbu = fis >> 32;
+    port->fb = fis;
+	memset((void*)fis, 0, 256);
+
+	printd(DEBUG_AHCI, "AHCI: Done rebasing, setting up a cmdheader at the clb (0x%016x)\n",commandList);
+
+    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)commandList;
     for (int i = 0; i < 32; i++) {
         cmdheader[i].prdtl = 8; // 8 prdt entries per command table
-        // 256 bytes per command table, 64+16+48+16*8
-        // Command table offset: 40K + 8K*portno + cmdheader_index*256
-        cmdheader[i].ctba = remapBase + (40 << 10) + (portno << 13) + (i << 8);
-        cmdheader[i].ctbau = 0;
-		memset((void*) cmdheader[i].ctba_64, 0, 256);
+        cmdheader[i].ctba_64 = dma_pool_alloc(kAHCICommandTablePool);
+		memset((void*) cmdheader[i].ctba_64, 0, AHCI_COMMAND_TABLE_SIZE);
     }
 	printd(DEBUG_AHCI,"AHCI:\tctba zero = 0x%08x\n",cmdheader[0].ctba);
 	printd(DEBUG_AHCI, "AHCI: Restarting port\n");
@@ -349,12 +354,12 @@ void ahci_probe_ports(HBA_MEM *ahci_abar) {
 				if (dt == AHCI_DEV_SATA) {
 					printd(DEBUG_AHCI, "AHCI: SATA drive found at port %d (0x%08x)\n", i, &ahci_abar->ports[i]);
 					printd(DEBUG_AHCI | DEBUG_DETAILED, "AHCI:\tCLB=0x%08x, fb=0x%08x\n", ahci_abar->ports[i].clb, ahci_abar->ports[i].fb);
-					ahci_port_rebase(&ahci_abar->ports[i], i, base);
+					ahci_port_rebase(&ahci_abar->ports[i], i);
 					ahciIdentify(&ahci_abar->ports[i], AHCI_DEV_SATA);
 				} else if (dt == AHCI_DEV_SATAPI) {
 					printd(DEBUG_AHCI, "AHCI:SATAPI drive found at port %d (0x%08x)\n", i, &ahci_abar->ports[i]);
 					printd(DEBUG_AHCI | DEBUG_DETAILED, "AHCI:\tCLB=0x%08x, fb=0x%08x\n", ahci_abar->ports[i].clb, ahci_abar->ports[i].fb);
-					ahci_port_rebase(&ahci_abar->ports[i], i, base);
+					ahci_port_rebase(&ahci_abar->ports[i], i);
 					//Run an ATA_IDENTIFY
 					ahciIdentify(&ahci_abar->ports[i], AHCI_DEV_SATAPI);
 				} else if (dt == AHCI_DEV_SEMB) {
@@ -453,7 +458,7 @@ while ((status & (ATA_SR_BSY | ATA_SR_DRQ)) && timeout--) {
 
 void ahciIdentify(hba_port_t* port, int deviceType) {
     printd(DEBUG_AHCI, "AHCI: ahciIdentify, port@0x%08x(%u), clb@0x%08x\n", port, kBlockDeviceInfoCount, &port->clb);
-    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)(uint64_t) port->clb;
+    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)((uint64_t)port->clbu << 32 | port->clb);
     int slot = ata_find_cmdslot(port);
     if (slot == -1)
         return;
@@ -665,7 +670,7 @@ int ahci_lba_read(block_device_info_t* device, uint64_t sector, void* buffer, ui
 	size_t remaining_sectors = sector_count;
 
 	if (kAHCIBuffer == NULL)
-		kAHCIBuffer = kmalloc_dma(AHCI_READ_BUFFER_SIZE);
+		kAHCIBuffer = ahciABAR->cap.S64A?kmalloc_dma(AHCI_READ_BUFFER_SIZE):kmalloc_dma32(AHCI_READ_BUFFER_SIZE);
 
 	if (sector_count == 0)
 		panic("ahci_lba-read: Attempt to read a sector_count of 0\n");
@@ -682,7 +687,7 @@ int ahci_lba_read(block_device_info_t* device, uint64_t sector, void* buffer, ui
     port->pxis.AsUlong = (uint32_t) - 1; // Clear pending interrupt bits
     //int spin = 0; // Spin lock timeout counter
 
-    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*) (uint64_t)port->clb;
+    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)((uint64_t)port->clbu << 32 | port->clb);
     int slot = find_cmdslot(port);
     if (slot == -1)
         return -1;
@@ -690,7 +695,7 @@ int ahci_lba_read(block_device_info_t* device, uint64_t sector, void* buffer, ui
     printd(DEBUG_AHCI, "AHCI: cmdheader=0x%08x\n", cmdheader);
     cmdheader->prdtl = (uint16_t) ((sector_count - 1) >> 4) + 1; // PRDT entries count
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) (uint64_t)(cmdheader->ctba);
+    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) cmdheader->ctba_64;
     memset(cmdtbl, 0, sizeof (HBA_CMD_TBL) +
             (cmdheader->prdtl) * sizeof (HBA_PRDT_ENTRY));
     printd(DEBUG_AHCI, "AHCI: read - cmdtable=0x%08x,ctba=0x%08x\n", cmdtbl, cmdheader->ctba);
@@ -766,7 +771,7 @@ int ahciBlockingRead28(uint32_t sector, uint8_t *buffer, uint32_t sector_count)
     kAHCICurrentDisk->pxis.AsUlong = (uint32_t) - 1; // Clear pending interrupt bits
     //int spin = 0; // Spin lock timeout counter
 
-    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*) kAHCICurrentDisk->clb;
+    HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)((uint64_t)kAHCICurrentDisk->clbu << 32 | kAHCICurrentDisk->clb);
     int slot = find_cmdslot(kAHCICurrentDisk);
     if (slot == -1)
         return false;
@@ -774,7 +779,7 @@ int ahciBlockingRead28(uint32_t sector, uint8_t *buffer, uint32_t sector_count)
     printd(DEBUG_AHCI, "AHCI: cmdheader=0x%08x\n", cmdheader);
     cmdheader->prdtl = (uint16_t) ((sector_count - 1) >> 4) + 1; // PRDT entries count
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) (cmdheader->ctba);
+    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*) cmdheader->ctba_64;
     memset(cmdtbl, 0, sizeof (HBA_CMD_TBL) +
             (cmdheader->prdtl - 1) * sizeof (HBA_PRDT_ENTRY));
     printd(DEBUG_AHCI, "AHCI: read - cmdtable=0x%08x,ctba=0x%08x\n", cmdtbl, cmdheader->ctba);
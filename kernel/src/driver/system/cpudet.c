@@ -41,10 +41,12 @@ cpuid_features_t kCPUFeatures;
 
 void identifyCPUFeatures(cpuid_features_t* cpuFeatures)
 {
-    uint32_t eax, ebx, ecx, edx;
+    uint32_t eax, ebx, ecx;
 
     __cpuid(1, eax, ebx, cpuFeatures->cpuid_feature_bits_2.cpuid_feature_bits_ecx_reg, cpuFeatures->cpuid_feature_bits.cpuid_features_edx_reg);
-    __cpuid(7, eax, cpuFeatures->cpuid_extended_feature_bits_3.cpuid_extended_feature_bits_ebx_reg , ecx, edx);
+    //Leaf 7 has sub-leaves, the feature flags are in sub-leaf 0
+    __cpuid_count(7, 0, eax, cpuFeatures->cpuid_extended_feature_bits_3.cpuid_extended_feature_bits_ebx_reg , ecx,
+        cpuFeatures->cpuid_extended_feature_bits_4.cpuid_extended_feature_bits_edx_reg);
 }
 
 /* Simply call this function detect_cpu(); */
@@ -3,6 +3,10 @@
 #include "serial_logging.h"
 #include "smp_core.h"
 #include "task.h"
+#include "thread.h"
+#include "vma.h"
+#include "cow.h"
+#include "fpu.h"
 #include "CONFIG.h"
 #include "log.h"
 #include "sprintf.h"
@@ -42,6 +46,13 @@ void handle_invalid_opcode(uint64_t rip) {
     exception_panic("Invalid opcode (#UD) occurred!", rip, 0xFFFFFFFFFFFFFFFF);
 }
 
+//Returns to device_not_available_handler, which retries the FPU instruction, once the thread's FPU state is loaded
+void handle_device_not_available(uint64_t rip) {
+    if (fpu_handle_device_not_available())
+        return;
+    exception_panic("Device not available (#NM) occurred!", rip, 0xFFFFFFFFFFFFFFFF);
+}
+
 void handle_double_fault(uint64_t rip) {
     exception_panic("Double fault (#DF) occurred!", rip, 0xFFFFFFFFFFFFFFFF);
 }
@@ -51,10 +62,25 @@ void handle_general_protection_fault(uint64_t error_code, uint64_t rip) {
 }
 
 
+//Returns to page_fault_handler, which restarts the faulting instruction, if the fault was resolved
 void handle_page_fault(uint64_t error_code, uint64_t rip) {
 	uint64_t cr2;
     __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));  // Read CR2
-	
+
+	//Thread stacks and VMAs are populated on first touch and shared pages copied on first write.  None of them need I/O,
+	//so these are all minor faults.
+	if (thread_handle_stack_fault(cr2, error_code) || vma_handle_fault(cr2, error_code) || cow_handle_fault(cr2, error_code))
+	{
+		core_local_storage_t* core = get_core_local_storage();
+		if (core != NULL && core->currentThread != NULL)
+		{
+			task_t* task = (task_t*)core->currentThread->ownerTask;
+			__sync_fetch_and_add(&task->minorFaults, 1);
+			__sync_fetch_and_add(&task->usage.ru_minflt, 1);
+		}
+		return;
+	}
+
 	char message[128];
     sprintf(message, "Page Fault (#PF) occurred for address 0x%016lx", cr2);
 
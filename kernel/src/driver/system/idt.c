@@ -1,5 +1,6 @@
 #include "driver/system/idt.h"
 #include "smp_core.h"
+#include "tss.h"
 
 extern void vector123();
 extern void vector124();
@@ -17,6 +18,7 @@ extern void divide_by_zero_handler();
 extern void invalid_opcode_handler();
 extern void double_fault_handler();
 extern void general_protection_fault_handler();
+extern void device_not_available_handler();
 extern void page_fault_handler();
 extern void machine_check_handler();
 
@@ -39,9 +41,11 @@ void initialize_idt() {
 	// IDT Entries for all major exceptions, all using 0x8E (Interrupt Gate)
 	set_idt_entry(0x00, (uint64_t)&divide_by_zero_handler, 0x28, 0x8E); // #DE
 	set_idt_entry(0x06, (uint64_t)&invalid_opcode_handler, 0x28, 0x8E); // #UD
+	set_idt_entry(0x07, (uint64_t)&device_not_available_handler, 0x28, 0x8E); // #NM
 	set_idt_entry(0x08, (uint64_t)&double_fault_handler, 0x28, 0x8E);
 	set_idt_entry(0x0D, (uint64_t)&general_protection_fault_handler, 0x28, 0x8E); // #GP
 	set_idt_entry(0x0E, (uint64_t)&page_fault_handler, 0x28, 0x8E); // #PF
+	kIDT[0x0E].ist = TSS_IST_PAGE_FAULT;
 	set_idt_entry(0x12, (uint64_t)&machine_check_handler, 0x28, 0x8E); // #MC
 
     // Set IRQ handlers
@@ -4,6 +4,7 @@
 #include "CONFIG.h"
 #include "printd.h"
 #include "io.h"
+#include "allocstats.h"
 
 // Keystrokes are generated from PS/2 set-1 scancodes and exposed through a
 // simple ring buffer so other subsystems can poll without blocking the IRQ path.
@@ -191,6 +192,11 @@ static void keyboard_emit_event(uint8_t scancode, char ascii) {
         }
     }
 
+    // Ctrl+Alt+M dumps the allocator statistics to serial
+    if ((ascii == 'm' || ascii == 'M') && (s_modifiers & KEYBOARD_MOD_CTRL) && (s_modifiers & KEYBOARD_MOD_ALT)) {
+        allocstats_dump();
+    }
+
     keyboard_event_t event = {
         .ascii = ascii,
         .scancode = scancode,
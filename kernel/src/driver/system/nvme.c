@@ -1,5 +1,7 @@
 #include "nvme.h"
 #include "kmalloc.h"
+#include "slab.h"
+#include "dmapool.h"
 #include "paging.h"
 #include "BasicRenderer.h"
 #include "serial_logging.h"
@@ -22,6 +24,10 @@ uint16_t initialCMDValue;
 uint32_t bar0InitialValue, bar1InitialValue;
 uint64_t nvmeBaseAddressRemap = NVME_ABAR_OVERRIDE_ADDRESS;	
 char* nvmeIdentifyInfo;
+kmem_cache_t* kNVMECommandCache;
+//Queues are at most 64 entries (see nvme_init_admin_queues) so each one fits in a page
+dma_pool_t* kNVMEQueuePool;
+dma_pool_t* kNVMEPRPListPool;
 
 void log_nvme_debug_info(
     volatile nvme_controller_t* controller,         // Base NVMe registers address
@@ -356,20 +362,24 @@ printf("2 ");
     // Calculate queue sizes
     size_t subQueueSize = controller->queueDepth * sizeof(nvme_submission_queue_entry_t);
     size_t compQueueSize = controller->queueDepth * sizeof(nvme_completion_queue_entry_t);
-    controller->admSubQueue = kmalloc_dma(subQueueSize);
+    controller->admSubQueue = dma_pool_alloc(kNVMEQueuePool);
     if (!controller->admSubQueue) panic("Failed to allocate memory for admin submission queue\n");
+    memset((void*)controller->admSubQueue, 0, subQueueSize);
 printf("2 ");
-    controller->cmdSubQueue = kmalloc_dma(subQueueSize);
-//	kDebugLevel &= ~(DEBUG_PAGING);
+    controller->cmdSubQueue = dma_pool_alloc(kNVMEQueuePool);
     if (!controller->cmdSubQueue) panic("Failed to allocate memory for command submission queue\n");
+    memset((void*)controller->cmdSubQueue, 0, subQueueSize);
+//	kDebugLevel &= ~(DEBUG_PAGING);
 
 printf("3 ");
-    controller->admCompQueue = kmalloc_dma(compQueueSize);
+    controller->admCompQueue = dma_pool_alloc(kNVMEQueuePool);
     if (!controller->admCompQueue) panic("Failed to allocate memory for admin completion queue\n");
+    memset((void*)controller->admCompQueue, 0, compQueueSize);
 
 printf("4 ");
-    controller->cmdCompQueue = kmalloc_dma(compQueueSize);
+    controller->cmdCompQueue = dma_pool_alloc(kNVMEQueuePool);
     if (!controller->cmdCompQueue) panic("Failed to allocate memory for command completion queue\n");
+    memset((void*)controller->cmdCompQueue, 0, compQueueSize);
 
     // Ensure queue alignment based on CAP.DSTRD
     uint64_t cap = controller->registers->cap;
@@ -427,14 +437,16 @@ printf("10)\n");
 
 void nvme_init_cmd_queues(nvme_controller_t* controller)
 {
-   nvme_submission_queue_entry_t* cmd = kmalloc_aligned(sizeof(nvme_submission_queue_entry_t));
+   nvme_submission_queue_entry_t* cmd = kmem_cache_alloc(kNVMECommandCache);
 
     // Step 1: Create I/O Completion Queue
     cmd->opc = NVME_ADMIN_CREATE_IO_COMPLETION_QUEUE;                  // CREATE IO COMPLETION QUEUE
 	cmd->nsid = 0x0;
     cmd->cid = controller->adminCID++;
 	uint32_t mallocSize = sizeof(nvme_completion_queue_entry_t) * controller->queueDepth;
-    cmd->prp1 = (uintptr_t)kmalloc_dma(mallocSize);         // Physical address of CQ buffer
+    cmd->prp1 = (uintptr_t)dma_pool_alloc(kNVMEQueuePool);         // Physical address of CQ buffer
+    if (!cmd->prp1) panic("Failed to allocate memory for I/O completion queue\n");
+    memset((void*)cmd->prp1, 0, mallocSize);
     cmd->cdw10 = controller->cmdQID | ((controller->queueDepth - 1)<<16); // CQ ID = 1, Queue Size = QUEUE_DEPTH - 1
     cmd->cdw11 = 0x1;                 // Interrupts disabled, Physically Contiguous
     // Submit command to Admin SQ
@@ -457,7 +469,9 @@ void nvme_init_cmd_queues(nvme_controller_t* controller)
 	cmd->nsid = 0x0;
     cmd->cid =  controller->adminCID++;
 	mallocSize = sizeof(nvme_submission_queue_entry_t) * controller->queueDepth;
-    cmd->prp1 = (uintptr_t)kmalloc_dma(mallocSize);         // Physical address of SQ buffer
+    cmd->prp1 = (uintptr_t)dma_pool_alloc(kNVMEQueuePool);         // Physical address of SQ buffer
+    if (!cmd->prp1) panic("Failed to allocate memory for I/O submission queue\n");
+    memset((void*)cmd->prp1, 0, mallocSize);
     cmd->cdw10 = ((controller->queueDepth - 1) << 16) | 1; //Queue Size = QUEUE_DEPTH - 1,  SQ ID = 1
     cmd->cdw11 = 0x00010001;          // Priority = 0 (high), PC=1
 
@@ -475,7 +489,7 @@ void nvme_init_cmd_queues(nvme_controller_t* controller)
 
 	controller->cmdSubQueue = (void*)cmd->prp1;
     printd(DEBUG_NVME | DEBUG_DETAILED, "NVME: Command Submission Queue successfully created at 0x%016lx\n",cmd->prp1);
-	kfree(cmd);
+	kmem_cache_free(kNVMECommandCache, cmd);
 }
 
 void nvme_extract_cap(nvme_controller_t* controller) {
@@ -587,7 +601,7 @@ uint32_t nvme_parse_lba_format(uint8_t* namespace_buffer, uint8_t index) {
 
 void nvme_set_features(nvme_controller_t* controller)
 {
-	nvme_submission_queue_entry_t* command = kmalloc(sizeof(nvme_submission_queue_entry_t));
+	nvme_submission_queue_entry_t* command = kmem_cache_alloc(kNVMECommandCache);
 
 	command->opc = NVME_ADMIN_SET_FEATURES;
 	command->nsid = 0x0;
@@ -607,7 +621,7 @@ void nvme_set_features(nvme_controller_t* controller)
 	printd(DEBUG_NVME | DEBUG_DETAILED, "Max Submission Queues: %u, Max Completion Queues: %u\n", 
 		max_submission_queues, max_completion_queues);
 	nvme_ring_doorbell(controller, 0, false, ++controller->admCompQueueHeadIndex);
-	kfree(command);
+	kmem_cache_free(kNVMECommandCache, command);
 }
 
 void nvme_parse_model_name(char nvme_device_name[40], char* deviceName)
@@ -637,7 +651,7 @@ uint64_t calculate_mdts(uint8_t mdts) {
 
 void nvme_identify(nvme_controller_t* controller)
 {
-	nvme_submission_queue_entry_t* command = kmalloc(sizeof(nvme_submission_queue_entry_t));
+	nvme_submission_queue_entry_t* command = kmem_cache_alloc(kNVMECommandCache);
 
 	nvmeIdentifyInfo = kmalloc_dma(PAGE_SIZE);
 
@@ -719,6 +733,9 @@ void nvme_identify(nvme_controller_t* controller)
 	nvme_identify_controller_t* cData = (nvme_identify_controller_t*)command->prp1;
 	nvme_parse_model_name(cData->mn, controller->deviceName);
 	controller->maxBytesPerTransfer = calculate_mdts(cData->mdts);
+	//MDTS 0 means the controller has no limit.  Either way, keep transfers small enough for one PRP list page.
+	if (cData->mdts == 0 || controller->maxBytesPerTransfer > NVME_MAX_PRP_LIST_TRANSFER)
+		controller->maxBytesPerTransfer = NVME_MAX_PRP_LIST_TRANSFER;
 	printd(DEBUG_NVME, "NVME: Identified max bytes per NVME transfer: 0x%08x bytes\n", controller->maxBytesPerTransfer);
 	//kDebugLevel |= DEBUG_KMALLOC | DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED;
 	controller->dmaReadBuffer = kmalloc_dma(controller->maxBytesPerTransfer);
@@ -728,13 +745,15 @@ void nvme_identify(nvme_controller_t* controller)
 	printd(DEBUG_NVME, "NVME: Device found, model: %s, max bytes per PRP = %u\n", controller->deviceName, controller->maxBytesPerTransfer);
 
 	kfree(buffer);
-	kfree(command);
+	kmem_cache_free(kNVMECommandCache, command);
 }
 
 uintptr_t setup_prp_list(uintptr_t startAddress, uint32_t prpCount)
 {
 
-	uintptr_t* prpList = kmalloc_dma(prpCount * sizeof(uintptr_t));
+	if (prpCount * sizeof(uintptr_t) > PAGE_SIZE)
+		panic("setup_prp_list: %u PRP entries don't fit in a single PRP list page\n", prpCount);
+	uintptr_t* prpList = dma_pool_alloc(kNVMEPRPListPool);
 	for (uint32_t idx = 0; idx<prpCount;idx++)
 	{
 		prpList[idx]=startAddress;
@@ -768,7 +787,7 @@ void nvme_write_disk(nvme_controller_t* controller, uint64_t LBA, size_t length,
         }
 
         // Allocate the NVMe command
-        nvme_submission_queue_entry_t* cmd = kmalloc_aligned(sizeof(nvme_submission_queue_entry_t));
+        nvme_submission_queue_entry_t* cmd = kmem_cache_alloc(kNVMECommandCache);
 
         // Populate the NVMe read command
         cmd->opc = NVME_OPCODE_WRITE;
@@ -808,9 +827,9 @@ void nvme_write_disk(nvme_controller_t* controller, uint64_t LBA, size_t length,
 
         // Free PRPs and command
         if (prpCount > 2) {
-            kfree((void*)cmd->prp2);
+            dma_pool_free(kNVMEPRPListPool, (void*)cmd->prp2);
         }
-        kfree(cmd);
+        kmem_cache_free(kNVMECommandCache, cmd);
 
         // Update offsets and remaining data
         userBufferOffset += transferLength;
@@ -845,7 +864,7 @@ void nvme_read_disk(nvme_controller_t* controller, uint64_t LBA, size_t length,
         }
 
         // Allocate the NVMe command
-        nvme_submission_queue_entry_t* cmd = kmalloc_aligned(sizeof(nvme_submission_queue_entry_t));
+        nvme_submission_queue_entry_t* cmd = kmem_cache_alloc(kNVMECommandCache);
 
         // Populate the NVMe read command
         cmd->opc = NVME_OPCODE_READ;
@@ -886,9 +905,9 @@ void nvme_read_disk(nvme_controller_t* controller, uint64_t LBA, size_t length,
 
         // Free PRPs and command
         if (prpCount > 2) {
-            kfree((void*)cmd->prp2);
+            dma_pool_free(kNVMEPRPListPool, (void*)cmd->prp2);
         }
-        kfree(cmd);
+        kmem_cache_free(kNVMECommandCache, cmd);
 
         // Update offsets and remaining data
         userBufferOffset += transferLength;
@@ -1034,6 +1053,9 @@ void nvme_init_device(pci_device_t* nvmeDevice)
 
 void init_NVME()
 {
+	kNVMECommandCache = kmem_cache_create("nvme_submission_queue_entry_t", sizeof(nvme_submission_queue_entry_t));
+	kNVMEQueuePool = dma_pool_create("nvme_queue", PAGE_SIZE, PAGE_SIZE);
+	kNVMEPRPListPool = dma_pool_create("nvme_prp_list", PAGE_SIZE, PAGE_SIZE);
 
 	for (int idx = 0; idx < kPCIDeviceCount; idx++)
 		if (kPCIDeviceHeaders[idx].class == 0x1 && kPCIDeviceHeaders[idx].subClass == 0x8)
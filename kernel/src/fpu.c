@@ -0,0 +1,231 @@
+#include <cpuid.h>
+#include "fpu.h"
+#include "kmalloc.h"
+#include "memcpy.h"
+#include "memset.h"
+#include "panic.h"
+#include "smp_core.h"
+#include "x86_64.h"
+#include "driver/system/cpudet.h"
+#include "serial_logging.h"
+
+//FPU state is switched lazily.  CR0.TS is set whenever the registers don't belong to the running thread, so a thread's
+//first FPU/SSE/AVX instruction after it is loaded traps (#NM) and fpu_handle_device_not_available loads its state then.
+//Threads which never touch the FPU are never saved or restored.  Whenever TS is set the registers' owner has already been
+//saved, so #NM never has to save anything.
+
+bool kFPUInitialized = false, kFPUXSaveEnabled = false;
+bool kFPUXSaveOptSupported = false;
+uint64_t kFPUXCR0 = 0;
+uint32_t kFPUStateSize = FPU_FXSAVE_SIZE;
+thread_t* volatile kFPUOwner[MAX_CPUS];
+volatile uint64_t kFPUSaveCount = 0, kFPURestoreCount = 0, kFPULazyHitCount = 0;
+//State a thread starts with, captured on the BSP just after fninit
+void* kFPUInitialState;
+//Per CPU, whether fpu_init_cpu has enabled SSE/AVX on it.  The vector memops can't run on an AP before then.
+volatile bool kFPUCpuReady[MAX_CPUS];
+//Per CPU, whether a kernel_fpu_begin section is open and the interrupt flags to put back when it ends
+volatile bool kFPUKernelActive[MAX_CPUS];
+uint64_t kFPUKernelFlags[MAX_CPUS];
+
+static inline uint64_t fpu_read_cr0()
+{
+	uint64_t cr0;
+
+	asm volatile("mov %0, cr0" : "=r"(cr0));
+	return cr0;
+}
+
+static inline void fpu_set_ts()
+{
+	uint64_t cr0 = fpu_read_cr0();
+
+	//Writing CR0 serializes, skip it if there's nothing to change
+	if (!(cr0 & CR0_TS))
+		asm volatile("mov cr0, %0" : : "r"(cr0 | CR0_TS) : "memory");
+}
+
+static inline void fpu_save(void* area)
+{
+	if (kFPUXSaveOptSupported)
+		asm volatile("xsaveopt64 [%0]" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	else if (kFPUXSaveEnabled)
+		asm volatile("xsave64 [%0]" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	else
+		asm volatile("fxsave64 [%0]" : : "r"(area) : "memory");
+	__sync_fetch_and_add(&kFPUSaveCount, 1);
+}
+
+static inline void fpu_restore(void* area)
+{
+	if (kFPUXSaveEnabled)
+		asm volatile("xrstor64 [%0]" : : "r"(area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	else
+		asm volatile("fxrstor64 [%0]" : : "r"(area) : "memory");
+	__sync_fetch_and_add(&kFPURestoreCount, 1);
+}
+
+/// @brief Enable the FPU, SSE and the XSAVE components in kFPUXCR0 on this CPU, leaving TS set.  Called on each AP, the
+/// BSP calls it from fpu_init.
+void fpu_init_cpu()
+{
+	uint64_t cr0 = fpu_read_cr0(), cr4;
+	uint32_t apic_id = read_apic_id();
+
+	//MP makes wait/fwait honour TS too, NE reports x87 errors as #MF instead of through the PIC
+	cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+	asm volatile("mov cr0, %0" : : "r"(cr0));
+	asm volatile("mov %0, cr4" : "=r"(cr4));
+	cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+	if (kFPUXSaveEnabled)
+		cr4 |= CR4_OSXSAVE;
+	asm volatile("mov cr4, %0" : : "r"(cr4));
+	if (kFPUXSaveEnabled)
+		asm volatile("xsetbv" : : "c"(0), "a"((uint32_t)kFPUXCR0), "d"((uint32_t)(kFPUXCR0 >> 32)));
+	asm volatile("fninit");
+
+	kFPUOwner[apic_id] = NULL;
+	kFPUKernelActive[apic_id] = false;
+	fpu_set_ts();
+	kFPUCpuReady[apic_id] = true;
+}
+
+/// @brief Pick the XSAVE components to enable, size the per-thread state areas and enable the FPU on the BSP.  Called
+/// once detect_cpu has filled in kCPUFeatures, before the APs are started.
+void fpu_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+
+	if (kCPUFeatures.cpuid_feature_bits_2.xsave)
+	{
+		__cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+		kFPUXCR0 = (((uint64_t)edx << 32) | eax) & FPU_XCR0_SUPPORTED;
+		if ((kFPUXCR0 & XCR0_AVX512) != XCR0_AVX512 || !(kFPUXCR0 & XCR0_AVX))
+			kFPUXCR0 &= ~XCR0_AVX512;
+		__cpuid_count(0xD, 1, eax, ebx, ecx, edx);
+		kFPUXSaveOptSupported = eax & 1;
+		kFPUXSaveEnabled = true;
+	}
+	fpu_init_cpu();
+	if (kFPUXSaveEnabled)
+	{
+		//EBX is the area size for the components now enabled in XCR0
+		__cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+		kFPUStateSize = ebx;
+	}
+
+	//The XSAVE header must start out zeroed for xrstor to accept the area
+	kFPUInitialState = kmalloc_aligned(kFPUStateSize);
+	memset(kFPUInitialState, 0, kFPUStateSize);
+	asm volatile("clts");
+	asm volatile("fninit");
+	asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+	fpu_save(kFPUInitialState);
+	fpu_set_ts();
+	kFPUInitialized = true;
+	printd(DEBUG_BOOT, "FPU: %s, XCR0=0x%lx, 0x%x byte state area per thread\n",
+			kFPUXSaveOptSupported?"XSAVEOPT":kFPUXSaveEnabled?"XSAVE":"FXSAVE", kFPUXCR0, kFPUStateSize);
+}
+
+/// @brief Handle #NM, raised by the running thread's first FPU instruction since it was loaded.  Loads the thread's FPU
+/// state unless it is still in this CPU's registers from the last time the thread used the FPU here.
+/// @return false if the fault isn't one lazy switching explains
+bool fpu_handle_device_not_available()
+{
+	if (!kFPUInitialized || !kCLSInitialized)
+		return false;
+
+	core_local_storage_t* cls = get_core_local_storage();
+	thread_t* thread = cls->currentThread;
+	uint32_t apic_id = cls->apic_id;
+
+	//Kernel code only uses the FPU between kernel_fpu_begin and kernel_fpu_end, which clear TS themselves
+	if (thread == NULL || kFPUKernelActive[apic_id])
+		return false;
+	if (thread->fpuState == NULL)
+	{
+		thread->fpuState = kmalloc_aligned(kFPUStateSize);
+		memcpy(thread->fpuState, kFPUInitialState, kFPUStateSize);
+	}
+	asm volatile("clts");
+	if (kFPUOwner[apic_id] == thread && thread->fpuCpu == apic_id)
+	{
+		__sync_fetch_and_add(&kFPULazyHitCount, 1);
+		return true;
+	}
+	fpu_restore(thread->fpuState);
+	kFPUOwner[apic_id] = thread;
+	thread->fpuCpu = apic_id;
+	return true;
+}
+
+/// @brief Save the FPU state of a thread coming off the CPU, if it has used the FPU since it was loaded, and set TS for
+/// whatever runs next.  The registers are left as they are, so the thread skips the restore if it is next to use the FPU
+/// on this CPU.
+void fpu_switch_out(uint32_t apic_id, thread_t* thread)
+{
+	if (!kFPUInitialized || (fpu_read_cr0() & CR0_TS))
+		return;
+	if (kFPUOwner[apic_id] == thread)
+		fpu_save(thread->fpuState);
+	fpu_set_ts();
+}
+
+/// @brief Give a forked child a copy of its parent's FPU state.  Called on the parent's CPU.
+void fpu_copy_thread(thread_t* parent, thread_t* child)
+{
+	if (!kFPUInitialized || parent->fpuState == NULL)
+		return;
+
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t apic_id = read_apic_id();
+
+	//The parent's latest state may only be in the registers
+	if (kFPUOwner[apic_id] == parent && !(fpu_read_cr0() & CR0_TS))
+		fpu_save(parent->fpuState);
+	interrupts_restore(flags);
+	child->fpuState = kmalloc_aligned(kFPUStateSize);
+	memcpy(child->fpuState, parent->fpuState, kFPUStateSize);
+}
+
+/// @brief Whether kernel_fpu_begin can be called here.  It can't before fpu_init has run and fpu_init_cpu has enabled the
+/// FPU on this CPU, or once a section is open on this CPU, i.e. from a page fault taken inside one.
+bool kernel_fpu_usable()
+{
+	uint32_t apic_id = read_apic_id();
+
+	return kFPUInitialized && kFPUCpuReady[apic_id] && !kFPUKernelActive[apic_id];
+}
+
+/// @brief Let kernel code use the FPU, SSE and AVX registers until kernel_fpu_end.  The owner's state is saved first if it
+/// is live in the registers.  Interrupts are disabled for the whole section, so keep it short and don't block in it.
+void kernel_fpu_begin()
+{
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t apic_id = read_apic_id();
+
+	if (kFPUKernelActive[apic_id])
+		panic("kernel_fpu_begin: Already in a kernel FPU section on CPU %u\n", apic_id);
+	kFPUKernelActive[apic_id] = true;
+	kFPUKernelFlags[apic_id] = flags;
+	//TS clear means the owner has been using the registers since it was loaded
+	if (!(fpu_read_cr0() & CR0_TS))
+	{
+		if (kFPUOwner[apic_id] != NULL)
+			fpu_save(kFPUOwner[apic_id]->fpuState);
+	}
+	else
+		asm volatile("clts");
+	kFPUOwner[apic_id] = NULL;
+}
+
+void kernel_fpu_end()
+{
+	uint32_t apic_id = read_apic_id();
+
+	//The registers hold nothing worth keeping, the next thread to use the FPU loads its own state
+	fpu_set_ts();
+	kFPUKernelActive[apic_id] = false;
+	interrupts_restore(kFPUKernelFlags[apic_id]);
+}
@@ -19,6 +19,9 @@
 #include "ahci.h"
 #include "ata.h"
 #include "memset.h"
+#include "memops.h"
+#include "strsimd.h"
+#include "fpu.h"
 #include "vfs.h"
 #include "acpi.h"
 #include "nvme.h"
@@ -63,6 +66,7 @@ task_t* kKernelTask;
 uint64_t kCPUCyclesPerSecond;
 task_t* kIdleTasks[MAX_CPUS];
 task_t* kLogDTask;
+task_t* kPageZeroTask;
 
 /// @brief Create the kernel task
 /// This is done manually whereas every other task in the system is created by calling the task_create method in task.c.
@@ -133,6 +137,10 @@ void kernel_init()
 		init_NVME();
 	}
 	detect_cpu();
+	fpu_init();
+	memops_init();
+	strings_init();
+	paging_enable_pcid();
 	kCPUCyclesPerSecond = tscGetCyclesPerSecond();
 
 	printf("Detected cpu: %s\n", &kcpuInfo.brand_name);
@@ -167,6 +175,10 @@ void kernel_init()
     kLogDTask->threads->regs.RDI = 1;
     scheduler_submit_new_task(kLogDTask);
 #endif
+
+    //Keeps the pool of pre-zeroed pages that kmalloc_aligned/kmalloc_dma draw from topped up
+    kPageZeroTask = task_create("/pagezero", 0, NULL, kKernelTask, true, 0);
+    scheduler_submit_new_task(kPageZeroTask);
    
     scheduler_enable();
     scheduler_change_thread_queue(kKernelTask->threads, THREAD_STATE_RUNNING);
@@ -246,6 +258,10 @@ void kernel_main()
 	printf("Initializing allocator, available memory is %Lu bytes\n",kAvailableMemory);
 	allocator_init();
 	init_os64_paging_tables();
+	//Object caches are created here, single threaded, rather than on first use from whichever CPU gets there first
+	dlist_cache_init();
+	thread_cache_init();
+	task_cache_init();
 	kKernelStack = (uintptr_t)kmalloc_aligned(KERNEL_STACK_SIZE);
 	__asm__ volatile ("cli\nmov rsp, %0\nsti\n" : : "r" (kKernelStack + KERNEL_STACK_SIZE - 8));
 	printf("Kernel stack initialized, 0x%x bytes\n", KERNEL_STACK_SIZE);
@@ -5,6 +5,7 @@
 #include "kernel.h"
 #include "smp.h"
 #include "kmalloc.h"
+#include "numa.h"
 #include "CONFIG.h"
 #include "sprintf.h"
 #include "memset.h"
@@ -60,8 +61,8 @@ void log_store_entry(uint16_t core, uint64_t tick_count, uint8_t priority, uint8
 
 void logging_queueing_init() {
     for (int i = 0; i <  (int)kLimineSMPInfo->cpu_count; i++) {
-        // Allocate memory for each core's log buffer
-        core_log_buffers[i].entries = (log_entry_t *)kmalloc(LOG_BUFFER_SIZE); 
+        // Allocate memory for each core's log buffer, from the core's own NUMA node
+        core_log_buffers[i].entries = (log_entry_t *)kmalloc_aligned_node(LOG_BUFFER_SIZE, numa_cpu_node(kLimineSMPInfo->cpus[i]->lapic_id));
         core_log_buffers[i].capacity = LOG_BUFFER_SIZE / sizeof(log_entry_t);
         core_log_buffers[i].head = 0;  // Initialize head pointer
         core_log_buffers[i].tail = 0;  // Initialize tail pointer
@@ -6,10 +6,19 @@
 #include "serial_logging.h"
 #include "panic.h"
 #include "memcpy.h"
+#include "buddy.h"
 
-memory_status_t *kMemoryStatus;
-//Points to the next available kernel status - increment AFTER use
+memory_status_t *kMemoryStatus = (memory_status_t*)MEMORY_STATUS_VIRTUAL_BASE;
+//Points to the next never used kernel status - increment AFTER use
 uint64_t kMemoryStatusCurrentPtr = 0;
+//Number of entries backed by mapped pages
+uint64_t kMemoryStatusCapacity = 0;
+//Number of entries currently describing memory
+uint64_t kMemoryStatusEntryCount = 0;
+//Entries released by merging, linked through their address tree left link
+uint32_t kMemoryStatusFreeEntry = MEMORY_STATUS_NONE;
+//Roots of the address ordered (all entries) and size ordered (free entries only) trees
+uint32_t kMemoryStatusRoot[2] = {MEMORY_STATUS_NONE, MEMORY_STATUS_NONE};
 uintptr_t memoryBaseAddress;
 
 //NOTE: Will return the passed address if it is already page aligned
@@ -17,332 +26,494 @@ static inline uintptr_t round_up_to_nearest_page(uintptr_t addr) {
     return (addr + 0xFFF) & ~0xFFF;
 }
 
-void compact_memory_array() {
-    size_t writeIndex = 0; // Where the next valid entry will be written
-	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: Compacting memory status array\n");
+/***********             STATUS ENTRY TREES            ************/
+//Both trees are AVL trees.  The address tree is keyed on startAddress, the size tree on length then startAddress.
+//NOTE: An entry's key must not change while it is in a tree.  Remove it, update it and insert it again.
 
-    for (size_t i = 0; i < kMemoryStatusCurrentPtr; i++) 
-	{
-		//If the current entry is in use
-        if (kMemoryStatus[i].length > 0) 
-		{
-            //And the "write to" index isn't the same as the current entry
-            if (i != writeIndex) 
-			{
-			// Copy the valid entry to the "write to" index
-                kMemoryStatus[writeIndex] = kMemoryStatus[i];
-            }
-			//Increment the "write to" index regardless
-            writeIndex++;
-        }
-    }
-
-	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: Clearing out compacted entries\n");
-    // Clear remaining entries after the last valid index
-    for (size_t i = writeIndex; i < kMemoryStatusCurrentPtr; i++) {
-        kMemoryStatus[i].startAddress = 0;
-        kMemoryStatus[i].length = 0;
-        kMemoryStatus[i].in_use = false;
-    }
-	kMemoryStatusCurrentPtr=writeIndex;
-}
-
-bool merge_freed_block(uint64_t freedIndex) {
-    memory_status_t *freedBlock = &kMemoryStatus[freedIndex];
-
-    // Scan for a parent block to merge into
-	memory_status_t* ours=&kMemoryStatus[freedIndex];
-    printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: Looking for an entry to merge ours at index %u, address 0x%016lx, with\n", freedIndex, ours->startAddress);
-	for (size_t idx = 0; idx < kMemoryStatusCurrentPtr; idx++) {
-        if (idx == freedIndex) continue; // Skip the block being freed
-
-        memory_status_t *candidate = &kMemoryStatus[idx];
-		if (candidate->startAddress == 0x0) continue;
-        // Check if the candidate is free and contiguous
-        if (!candidate->in_use && candidate->length > 0) {
-            // Merge freed block into candidate (preceding)
-            if (candidate->startAddress + candidate->length == freedBlock->startAddress) {
-				printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: found a p candidate with start=0x%016lx, length=0x%016lx, in_use=%u\n", 
-						candidate->startAddress, candidate->length, candidate->in_use);
-                candidate->length += freedBlock->length;
-
-                // Invalidate the freed block
-                freedBlock->startAddress = 0;
-                freedBlock->length = 0;
-                freedBlock->in_use = false;
-				printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: Merged with candidate: start=0x%016lx, length=0x%016lx, in_use=%u\n", 
-						candidate->startAddress, candidate->length, candidate->in_use);
-                return true;
-            }
-
-            // Merge candidate into freed block (following)
-            if (freedBlock->startAddress + freedBlock->length == candidate->startAddress) {
-				printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: found an f candidate with start=0x%016lx, length=0x%016lx, in_use=%u\n", 
-						candidate->startAddress, candidate->length, candidate->in_use);
-                candidate->length += freedBlock->length;
-				//The found candidate followed our block to be freed, so its new address becomes our block's
-				candidate->startAddress = freedBlock->startAddress;
-
-                // Invalidate the freed block
-                freedBlock->startAddress = 0;
-                freedBlock->length = 0;
-                freedBlock->in_use = false;
-				printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: Merged with candidate: start=0x%016lx, length=0x%016lx, in_use=%u\n", 
-						candidate->startAddress, candidate->length, candidate->in_use);
-				return true;
-            }
-        }
-    }
-	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\t allocator: Did not find a candidate to merge with\n");
-	return false;
+static inline int status_height(int tree, uint32_t idx)
+{
+	return idx == MEMORY_STATUS_NONE?0:kMemoryStatus[idx].height[tree];
 }
 
-//Identify whether any statuses allocate on the page passed.
-bool physical_page_is_allocated_on(uintptr_t physical_page)
+static inline void status_update_height(int tree, uint32_t idx)
 {
-	for (uint64_t cnt=0;cnt<kMemoryStatusCurrentPtr;cnt++)
-		if ((kMemoryStatus[cnt].startAddress & 0xFFFFFFFFFFFFF000) == physical_page && kMemoryStatus[cnt].in_use == true)
-			return true;
-	return false;
+	int left = status_height(tree, kMemoryStatus[idx].link[tree][0]);
+	int right = status_height(tree, kMemoryStatus[idx].link[tree][1]);
+	kMemoryStatus[idx].height[tree] = (left > right?left:right) + 1;
+}
+
+static inline int status_compare(int tree, uint32_t a, uint32_t b)
+{
+	memory_status_t* entryA = &kMemoryStatus[a];
+	memory_status_t* entryB = &kMemoryStatus[b];
+
+	if (tree == MEMORY_STATUS_SIZE_TREE && entryA->length != entryB->length)
+		return entryA->length < entryB->length?-1:1;
+	if (entryA->startAddress != entryB->startAddress)
+		return entryA->startAddress < entryB->startAddress?-1:1;
+	return 0;
+}
+
+//Rotate idx's child on side dir up into idx's place
+static uint32_t status_rotate(int tree, uint32_t idx, int dir)
+{
+	uint32_t child = kMemoryStatus[idx].link[tree][dir];
+
+	kMemoryStatus[idx].link[tree][dir] = kMemoryStatus[child].link[tree][!dir];
+	kMemoryStatus[child].link[tree][!dir] = idx;
+	status_update_height(tree, idx);
+	status_update_height(tree, child);
+	return child;
 }
 
-/// @brief Get the address of the first block of memory found that is greater than or equal to the length passed
-/// @param requestedLength 
-/// @param aligned 
-/// @return 
-memory_status_t* get_status_entry_for_first_available_address(uint64_t requested_length, bool page_aligned)
+static uint32_t status_balance(int tree, uint32_t idx)
 {
-	for (uint64_t cnt = 0; cnt < kMemoryStatusCurrentPtr; cnt++)
+	status_update_height(tree, idx);
+	int balance = status_height(tree, kMemoryStatus[idx].link[tree][1]) - status_height(tree, kMemoryStatus[idx].link[tree][0]);
+	if (balance > 1 || balance < -1)
 	{
-		//Don't allow page 0 to be allocated!!!
-		if (kMemoryStatus[cnt].startAddress > 0 && kMemoryStatus[cnt].in_use == false && 
-		//Either the requested block doesn't need to be aligned and the current status' size is big enough
-			( 
-				(page_aligned == false && kMemoryStatus[cnt].length >= requested_length)
-				||  ( round_up_to_nearest_page(requested_length) < kMemoryStatus[cnt].length)
-			)
-		)
-		{
-			return &kMemoryStatus[cnt];
-		}
+		int dir = balance > 0;
+		uint32_t child = kMemoryStatus[idx].link[tree][dir];
+		//Double rotation when the child leans the other way
+		if (status_height(tree, kMemoryStatus[child].link[tree][!dir]) > status_height(tree, kMemoryStatus[child].link[tree][dir]))
+			kMemoryStatus[idx].link[tree][dir] = status_rotate(tree, child, !dir);
+		return status_rotate(tree, idx, dir);
 	}
-	return NULL;
+	return idx;
 }
 
-uint64_t get_status_index_for_requested_address(uint64_t address,uint64_t requested_length, bool in_use)
+static uint32_t status_tree_insert_at(int tree, uint32_t root, uint32_t idx)
 {
-	for (uint64_t cnt = 0; cnt < kMemoryStatusCurrentPtr; cnt++)
+	if (root == MEMORY_STATUS_NONE)
 	{
-		if ( (kMemoryStatus[cnt].startAddress <= address && kMemoryStatus[cnt].startAddress + kMemoryStatus[cnt].length > address) &&
-			kMemoryStatus[cnt].in_use == in_use &&
-			kMemoryStatus[cnt].length >= requested_length
-		)
-			return cnt;
+		kMemoryStatus[idx].link[tree][0] = MEMORY_STATUS_NONE;
+		kMemoryStatus[idx].link[tree][1] = MEMORY_STATUS_NONE;
+		kMemoryStatus[idx].height[tree] = 1;
+		return idx;
 	}
-	panic("get_status_index_for_requested_address: Can't find the index!!! :-(\n");
-	return 0;
+	int dir = status_compare(tree, idx, root) > 0;
+	kMemoryStatus[root].link[tree][dir] = status_tree_insert_at(tree, kMemoryStatus[root].link[tree][dir], idx);
+	return status_balance(tree, root);
+}
+
+//Unlink the smallest entry under root, returning it in *min
+static uint32_t status_tree_remove_min(int tree, uint32_t root, uint32_t* min)
+{
+	if (kMemoryStatus[root].link[tree][0] == MEMORY_STATUS_NONE)
+	{
+		*min = root;
+		return kMemoryStatus[root].link[tree][1];
+	}
+	kMemoryStatus[root].link[tree][0] = status_tree_remove_min(tree, kMemoryStatus[root].link[tree][0], min);
+	return status_balance(tree, root);
 }
 
-memory_status_t* get_status_entry_for_requested_address(uint64_t address,uint64_t requested_length, bool in_use)
+static uint32_t status_tree_remove_at(int tree, uint32_t root, uint32_t idx)
 {
-	for (uint64_t cnt = 0; cnt < kMemoryStatusCurrentPtr; cnt++)
+	if (root == MEMORY_STATUS_NONE)
+		panic("allocator: kMemoryStatus entry %u (0x%016lx) is not in tree %u\n", idx, kMemoryStatus[idx].startAddress, tree);
+
+	int cmp = status_compare(tree, idx, root);
+	if (cmp != 0)
 	{
-		if ( (kMemoryStatus[cnt].startAddress <= address && kMemoryStatus[cnt].startAddress + kMemoryStatus[cnt].length > address) &&
-			kMemoryStatus[cnt].in_use == in_use &&
-			kMemoryStatus[cnt].length >= requested_length
-		)
-			return &kMemoryStatus[cnt];
+		int dir = cmp > 0;
+		kMemoryStatus[root].link[tree][dir] = status_tree_remove_at(tree, kMemoryStatus[root].link[tree][dir], idx);
+		return status_balance(tree, root);
 	}
-	panic("get_status_entry_for_requested_address: Can't find the index!!! :-(\n");
-	return NULL;
+
+	uint32_t left = kMemoryStatus[root].link[tree][0];
+	uint32_t right = kMemoryStatus[root].link[tree][1];
+	if (left == MEMORY_STATUS_NONE)
+		return right;
+	if (right == MEMORY_STATUS_NONE)
+		return left;
+	//Replace the removed entry with its successor
+	uint32_t successor;
+	right = status_tree_remove_min(tree, right, &successor);
+	kMemoryStatus[successor].link[tree][0] = left;
+	kMemoryStatus[successor].link[tree][1] = right;
+	return status_balance(tree, successor);
+}
+
+static inline void status_tree_insert(int tree, uint32_t idx)
+{
+	kMemoryStatusRoot[tree] = status_tree_insert_at(tree, kMemoryStatusRoot[tree], idx);
+}
+
+static inline void status_tree_remove(int tree, uint32_t idx)
+{
+	kMemoryStatusRoot[tree] = status_tree_remove_at(tree, kMemoryStatusRoot[tree], idx);
 }
 
-void update_existing_status_entry(memory_status_t* entry, uint64_t address, uint64_t length, bool in_use)
+/// @brief Find the entry with the highest start address less than or equal to address
+static uint32_t status_find_at_or_before(uint64_t address)
 {
-	entry->startAddress = address;
-	entry->length = length;
-	entry->in_use = in_use;
+	uint32_t found = MEMORY_STATUS_NONE;
+
+	for (uint32_t idx = kMemoryStatusRoot[MEMORY_STATUS_ADDRESS_TREE]; idx != MEMORY_STATUS_NONE;)
+		if (kMemoryStatus[idx].startAddress <= address)
+		{
+			found = idx;
+			idx = kMemoryStatus[idx].link[MEMORY_STATUS_ADDRESS_TREE][1];
+		}
+		else
+			idx = kMemoryStatus[idx].link[MEMORY_STATUS_ADDRESS_TREE][0];
+	return found;
+}
+
+/// @brief Find the entry starting exactly at address
+static uint32_t status_find_at(uint64_t address)
+{
+	uint32_t idx = status_find_at_or_before(address);
+
+	return idx != MEMORY_STATUS_NONE && kMemoryStatus[idx].startAddress == address?idx:MEMORY_STATUS_NONE;
 }
 
-memory_status_t* make_new_status_entry(uint64_t address, uint64_t length, bool in_use)
+/// @brief Find the smallest free entry at least requested_length long (lowest address on ties)
+static uint32_t status_find_free_at_least(uint64_t requested_length)
 {
-	kMemoryStatus[kMemoryStatusCurrentPtr].startAddress = address;
-	kMemoryStatus[kMemoryStatusCurrentPtr].length = length;
-	kMemoryStatus[kMemoryStatusCurrentPtr].in_use = in_use;
-	kMemoryStatusCurrentPtr++;
-	return &kMemoryStatus[kMemoryStatusCurrentPtr-1];
+	uint32_t found = MEMORY_STATUS_NONE;
+
+	for (uint32_t idx = kMemoryStatusRoot[MEMORY_STATUS_SIZE_TREE]; idx != MEMORY_STATUS_NONE;)
+		if (kMemoryStatus[idx].length >= requested_length)
+		{
+			found = idx;
+			idx = kMemoryStatus[idx].link[MEMORY_STATUS_SIZE_TREE][0];
+		}
+		else
+			idx = kMemoryStatus[idx].link[MEMORY_STATUS_SIZE_TREE][1];
+	return found;
 }
 
-uint64_t allocate_memory_at_address_internal(uint64_t requested_address, uint64_t requested_length, bool use_address, bool page_aligned)
+//Point whichever link refers to entry from at entry to instead.  Both entries must have the same key.
+static void status_tree_replace(int tree, uint32_t from, uint32_t to)
 {
-	memory_status_t* memaddr;
-	uint64_t retVal = 0;
-	uint64_t found_block_original_length = 0;
-	uint64_t block_before_length = 0;
-	uint64_t aligned_start;
-	uint64_t aligned_length = 0;
-
-	if (requested_length >= 200000000)
+	uint32_t* link = &kMemoryStatusRoot[tree];
+
+	while (*link != from)
 	{
-		int a = 0;
-		a+=1;
+		if (*link == MEMORY_STATUS_NONE)
+			panic("allocator: kMemoryStatus entry %u (0x%016lx) is not in tree %u\n", from, kMemoryStatus[from].startAddress, tree);
+		link = &kMemoryStatus[*link].link[tree][status_compare(tree, from, *link) > 0];
 	}
+	*link = to;
+}
 
-	//Find the appropriate memory status page
-	if (!use_address)
+/***********           STATUS ENTRY STORAGE            ************/
+
+/// @brief Back another page of kMemoryStatus entries with memory
+static void grow_memory_status_entries()
+{
+	if (kMemoryStatusCapacity + MEMORY_STATUS_ENTRIES_PER_PAGE > MEMORY_STATUS_MAX_COUNT)
+		panic("allocator: kMemoryStatus is full, %u entries in use\n", kMemoryStatusEntryCount);
+	if (!kPagingTablesInitialized)
+		panic("allocator: kMemoryStatus can't grow before the kernel paging tables are initialized\n");
+
+	uintptr_t page = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+	if (page == 0)
+		panic("allocator: Out of memory growing kMemoryStatus\n");
+	uintptr_t virtual_address = (uintptr_t)kMemoryStatus + (kMemoryStatusCapacity * sizeof(memory_status_t));
+	paging_map_page((pt_entry_t*)kKernelPML4v, virtual_address, page, PAGE_PRESENT | PAGE_WRITE);
+	memset((void*)virtual_address, 0, PAGE_SIZE);
+	kMemoryStatusCapacity += MEMORY_STATUS_ENTRIES_PER_PAGE;
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: kMemoryStatus grew to 0x%lx entries\n", kMemoryStatusCapacity);
+}
+
+/// @brief Pack the entries in use to the bottom of kMemoryStatus and give back the pages no longer needed
+static void shrink_memory_status_entries()
+{
+	uint64_t low = 0;
+	uint64_t high = kMemoryStatusCurrentPtr;
+
+	//Move the highest entries in use down into the lowest unused ones
+	while (true)
+	{
+		while (low < high && kMemoryStatus[low].length != 0)
+			low++;
+		while (high > low && kMemoryStatus[high - 1].length == 0)
+			high--;
+		if (low >= high)
+			break;
+		high--;
+		kMemoryStatus[low] = kMemoryStatus[high];
+		status_tree_replace(MEMORY_STATUS_ADDRESS_TREE, high, low);
+		if (!kMemoryStatus[low].in_use)
+			status_tree_replace(MEMORY_STATUS_SIZE_TREE, high, low);
+		kMemoryStatus[high].length = 0;
+	}
+	kMemoryStatusCurrentPtr = low;
+	kMemoryStatusFreeEntry = MEMORY_STATUS_NONE;
+
+	//Keep one page of unused entries so a free followed by an allocation doesn't remap a page
+	uint64_t keep = ((kMemoryStatusCurrentPtr / MEMORY_STATUS_ENTRIES_PER_PAGE) + 2) * MEMORY_STATUS_ENTRIES_PER_PAGE;
+	while (kMemoryStatusCapacity > keep)
+	{
+		kMemoryStatusCapacity -= MEMORY_STATUS_ENTRIES_PER_PAGE;
+		uintptr_t virtual_address = (uintptr_t)kMemoryStatus + (kMemoryStatusCapacity * sizeof(memory_status_t));
+		uintptr_t page = paging_walk_paging_table((pt_entry_t*)kKernelPML4v, virtual_address);
+		paging_unmap_page((pt_entry_t*)kKernelPML4v, virtual_address);
+		buddy_free_pages(page & PAGE_ADDRESS_MASK);
+	}
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: kMemoryStatus compacted to 0x%lx entries, 0x%lx mapped\n", kMemoryStatusCurrentPtr, kMemoryStatusCapacity);
+}
+
+/***********              STATUS ENTRIES               ************/
+
+uint32_t make_new_status_entry(uint64_t address, uint64_t length, bool in_use)
+{
+	uint32_t idx;
+
+	if (kMemoryStatusFreeEntry != MEMORY_STATUS_NONE)
 	{
-		//When a specific address is NOT requested, internally align request to 8 bytes since our architecture is 64-bit
-		// Align to the next multiple of 8
-		requested_length = (requested_length + 7) & ~((size_t)7);
-		memaddr = get_status_entry_for_first_available_address(requested_length, page_aligned);
-		if (memaddr == NULL)
-			__asm__("cli\nhlt\n");
+		idx = kMemoryStatusFreeEntry;
+		kMemoryStatusFreeEntry = kMemoryStatus[idx].link[MEMORY_STATUS_ADDRESS_TREE][0];
 	}
 	else
 	{
-		memaddr = get_status_entry_for_requested_address(requested_address, requested_length, false);
-		if ( memaddr == NULL)
-			__asm__("cli\nhlt\n");
+		if (kMemoryStatusCurrentPtr == kMemoryStatusCapacity)
+			grow_memory_status_entries();
+		idx = kMemoryStatusCurrentPtr++;
 	}
-	if (memaddr->length < requested_length)
-		retVal = 0;
-	else if (memaddr->length == requested_length)
+	kMemoryStatusEntryCount++;
+
+	kMemoryStatus[idx].startAddress = address;
+	kMemoryStatus[idx].length = length;
+	kMemoryStatus[idx].in_use = in_use;
+	status_tree_insert(MEMORY_STATUS_ADDRESS_TREE, idx);
+	if (!in_use)
+		status_tree_insert(MEMORY_STATUS_SIZE_TREE, idx);
+	return idx;
+}
+
+//Remove an entry from the address tree and put it on the list of reusable entries.  Must already be out of the size tree.
+static void release_status_entry(uint32_t idx)
+{
+	status_tree_remove(MEMORY_STATUS_ADDRESS_TREE, idx);
+	kMemoryStatus[idx].startAddress = 0;
+	kMemoryStatus[idx].length = 0;
+	kMemoryStatus[idx].in_use = false;
+	kMemoryStatus[idx].link[MEMORY_STATUS_ADDRESS_TREE][0] = kMemoryStatusFreeEntry;
+	kMemoryStatusFreeEntry = idx;
+	kMemoryStatusEntryCount--;
+}
+
+/// @brief Merge a just freed entry with free neighbours on either side and add the result to the size tree
+/// @param freedIndex Index of an entry which is not in use and not in the size tree
+/// @return True if the entry was merged with at least one neighbour
+bool merge_freed_block(uint64_t freedIndex)
+{
+	uint32_t idx = freedIndex;
+	bool merged = false;
+
+	//Merge into a free block that ends where ours starts
+	uint32_t before = kMemoryStatus[idx].startAddress?status_find_at_or_before(kMemoryStatus[idx].startAddress - 1):MEMORY_STATUS_NONE;
+	if (before != MEMORY_STATUS_NONE && !kMemoryStatus[before].in_use &&
+		kMemoryStatus[before].startAddress + kMemoryStatus[before].length == kMemoryStatus[idx].startAddress)
 	{
-		memaddr->in_use = true;
-		retVal = memaddr->startAddress;
+		printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: Merging into preceding block start=0x%016lx, length=0x%016lx\n",
+				kMemoryStatus[before].startAddress, kMemoryStatus[before].length);
+		status_tree_remove(MEMORY_STATUS_SIZE_TREE, before);
+		kMemoryStatus[before].length += kMemoryStatus[idx].length;
+		release_status_entry(idx);
+		idx = before;
+		merged = true;
 	}
-	else //memory available is > requested memory
+
+	//Merge in a free block that starts where ours ends
+	uint32_t after = status_find_at(kMemoryStatus[idx].startAddress + kMemoryStatus[idx].length);
+	if (after != MEMORY_STATUS_NONE && !kMemoryStatus[after].in_use)
 	{
-		found_block_original_length = memaddr->length;
+		printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "\tallocator: Merging in following block start=0x%016lx, length=0x%016lx\n",
+				kMemoryStatus[after].startAddress, kMemoryStatus[after].length);
+		status_tree_remove(MEMORY_STATUS_SIZE_TREE, after);
+		kMemoryStatus[idx].length += kMemoryStatus[after].length;
+		release_status_entry(after);
+		merged = true;
+	}
 
-		//The starting address for the new Status entry, aligned if necessary.  THIS IS ONLY USED AS A RETURN VALUE FROM THIS METHOD
-		uint64_t true_start = memaddr->startAddress;
-		if (page_aligned)
-		{
-			aligned_start = round_up_to_nearest_page(memaddr->startAddress);
-			//Count the extra bytes between the aligned start and the real start, and add the requested length
-			aligned_length = aligned_start - memaddr->startAddress + requested_length;
-		}
-		else
-		{
-			aligned_start = memaddr->startAddress;
-			aligned_length = requested_length;
-		}
-		uint64_t aligned_end = true_start + aligned_length;
-
-		//Create an entry for the memory being utilized
-		//NOTE that even if an aligned address was requested, the new entry will start with the unaligned start address. 
-		//The address RETURNED will be the aligned address
-		/*memory_status_t* new_entry = */make_new_status_entry(
-							  use_address?requested_address:
-							  	memaddr->startAddress, 
-							  aligned_length, 
-							  true);
-		//If a specific address was requested and there was memory before the requested address, make a block from its starting address to the requested address - 1
-		if (use_address && memaddr->startAddress != requested_address)
-		{
-			block_before_length = requested_address - memaddr->startAddress;
-			make_new_status_entry(memaddr->startAddress, requested_address - memaddr->startAddress, false);
-		}
+	status_tree_insert(MEMORY_STATUS_SIZE_TREE, idx);
+	return merged;
+}
 
-		//Fixup the exiting entry to just point to what's left after the allocated memory
-		//If a specific address was requested, make the current status point to the address after the requested memory
-		if (use_address)
-			update_existing_status_entry(memaddr, requested_address + requested_length, found_block_original_length - block_before_length - requested_length, false);
-		else
-			//Otherwise just update the starting address and length of the existing address to point to after the allocated memory
-			update_existing_status_entry(memaddr, 
-			                             //The end of the created block which is the new startAddress of the existing block
-										 aligned_end,
-										 memaddr->length - aligned_length,
-										 false
-										 );
-		retVal = use_address?requested_address:aligned_start;
+//Identify whether any statuses allocate on the page passed.
+bool physical_page_is_allocated_on(uintptr_t physical_page)
+{
+	bool heap_page = false;
+
+	//Walk back through the entries starting before the end of the page until one ends before the page starts
+	for (uint32_t idx = status_find_at_or_before(physical_page + PAGE_SIZE - 1);
+		 idx != MEMORY_STATUS_NONE && kMemoryStatus[idx].startAddress + kMemoryStatus[idx].length > physical_page;
+		 idx = kMemoryStatus[idx].startAddress?status_find_at_or_before(kMemoryStatus[idx].startAddress - 1):MEMORY_STATUS_NONE)
+	{
+		if (kMemoryStatus[idx].in_use == true)
+			return true;
+		heap_page = true;
+	}
+	//Pages the buddy allocator gave to kMemoryStatus are only allocated if a status entry on them is in use
+	return !heap_page && buddy_page_is_allocated(physical_page);
+}
+
+/// @brief Get the memory status heap more memory from the buddy allocator
+static void grow_memory_status_heap(uint64_t requested_length)
+{
+	uint64_t grow_pages = round_up_to_nearest_page(requested_length) / PAGE_SIZE;
+	if (grow_pages < ALLOCATOR_HEAP_GROW_PAGES)
+		grow_pages = ALLOCATOR_HEAP_GROW_PAGES;
+	uint64_t grow_address = buddy_alloc_pages(grow_pages, BUDDY_PAGE_HEAP);
+	if (grow_address == 0)
+		panic("allocator: Out of memory growing the memory status heap by 0x%lx pages\n", grow_pages);
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: Added 0x%lx pages at 0x%016lx to the memory status heap\n", grow_pages, grow_address);
+	uint32_t idx = make_new_status_entry(grow_address, grow_pages * PAGE_SIZE, true);
+	kMemoryStatus[idx].in_use = false;
+	merge_freed_block(idx);
+}
+
+uint64_t allocate_memory_internal(uint64_t requested_length)
+{
+	//Align the request to 8 bytes since our architecture is 64-bit.  Entries in use are never 0 bytes long.
+	requested_length = requested_length?(requested_length + 7) & ~((size_t)7):8;
 
+	uint32_t idx = status_find_free_at_least(requested_length);
+	if (idx == MEMORY_STATUS_NONE)
+	{
+		grow_memory_status_heap(requested_length);
+		idx = status_find_free_at_least(requested_length);
+	}
+
+	memory_status_t* memaddr = &kMemoryStatus[idx];
+	status_tree_remove(MEMORY_STATUS_SIZE_TREE, idx);
+	memaddr->in_use = true;
+	//Give anything past the requested length back as a new free entry.  The allocated entry keeps its start address so its place in the address tree doesn't change.
+	if (memaddr->length > requested_length)
+	{
+		uint64_t remaining = memaddr->length - requested_length;
+		memaddr->length = requested_length;
+		make_new_status_entry(memaddr->startAddress + requested_length, remaining, false);
 	}
-	printd(DEBUG_ALLOCATOR, "allocate_memory_at_address_internal: Allocated 0x%08x bytes at phys address 0x%08x (%s - %s)\n", aligned_length, use_address?requested_address:aligned_start,
-			use_address?"requested address":"",page_aligned?"aligned":"");
-	return retVal;
+
+	printd(DEBUG_ALLOCATOR, "allocate_memory: Allocated 0x%08x bytes at phys address 0x%08x\n", requested_length, memaddr->startAddress);
+	return memaddr->startAddress;
 }
 
-/// @brief Allocate memory, possibly at a specific address (not block aligned unless you pass a block aligned address)
+/// @brief Allocate memory, possibly at a specific address
 /// @param address - The address of the requested memory range.  Pass 0 if no specific address is requested
 /// @param requestedLength - The length of the requested memory range.  If 0 method returns 0
-/// @param aligned - Should the starting address be aligned to a block based on system block size.
-/// @return 
+/// @param use_address - Allocate the pages holding address..address+requested_length
+/// @return The start of the allocation.  With use_address this is address rounded down to its page, which is what
+/// free_memory has to be passed.
 uint64_t allocate_memory_at_address(uint64_t address, uint64_t requested_length, bool use_address)
 {
-	return allocate_memory_at_address_internal(address, requested_length, use_address, false);
+	if (!use_address)
+		return allocate_memory_internal(requested_length);
+
+	//Specific addresses are handed out by the buddy allocator a page at a time
+	uint64_t page_start = address & 0xFFFFFFFFFFFFF000;
+	uint64_t page_count = round_up_to_nearest_page(address + requested_length - page_start) / PAGE_SIZE;
+	if (buddy_alloc_pages_at(page_start, page_count) == 0)
+		panic("allocate_memory_at_address: Requested range 0x%016lx for 0x%lx bytes is not available\n", address, requested_length);
+	return page_start;
 }
 
 uint64_t allocate_memory_aligned(uint64_t requested_length)
 {
-	return allocate_memory_at_address_internal(0, requested_length, false, true);
+	return allocate_memory_aligned_zone(requested_length, MEMORY_ZONE_NORMAL);
+}
+
+/// @brief Allocate page aligned memory from zone, or a lower zone if zone is exhausted
+/// @param requested_length Number of bytes to allocate, rounded up to whole pages
+/// @param zone MEMORY_ZONE_DMA32 for memory a 32-bit device can address, MEMORY_ZONE_NORMAL for anything
+/// @return The physical address of the allocation
+uint64_t allocate_memory_aligned_zone(uint64_t requested_length, uint32_t zone)
+{
+	return allocate_memory_aligned_node(requested_length, zone, NUMA_NODE_LOCAL);
+}
+
+/// @brief Allocate page aligned memory from zone (or a lower zone), preferring NUMA node
+/// @param requested_length Number of bytes to allocate, rounded up to whole pages
+/// @param zone MEMORY_ZONE_DMA32 for memory a 32-bit device can address, MEMORY_ZONE_NORMAL for anything
+/// @param node The preferred node, NUMA_NODE_LOCAL for the calling CPU's node
+/// @return The physical address of the allocation
+uint64_t allocate_memory_aligned_node(uint64_t requested_length, uint32_t zone, uint32_t node)
+{
+	uint64_t page_count = round_up_to_nearest_page(requested_length) / PAGE_SIZE;
+	uint64_t address = buddy_alloc_pages_node(page_count?page_count:1, BUDDY_PAGE_ALLOCATED, zone, node);
+
+	if (address == 0)
+		panic("allocate_memory_aligned: Out of memory allocating 0x%lx bytes from zone %u\n", requested_length, zone);
+	printd(DEBUG_ALLOCATOR, "allocate_memory_aligned: Allocated 0x%08x bytes at phys address 0x%08x\n", requested_length, address);
+	return address;
 }
 
 //NOTE: Only the kernel can request unaligned memory.  User space allocations MUST be on a page boundry and be the full page
 uint64_t allocate_memory(uint64_t requested_length)
 {
-	return allocate_memory_at_address_internal(0, requested_length, false, false);
+	return allocate_memory_internal(requested_length);
 }
 
-//TODO: Coalesce adjacent memory blocks back together
+/// @brief Free memory allocated by any of the allocate_memory methods, merging it with any free neighbours
+/// @param address The address returned by the allocation
+/// @return The kMemoryStatus index of the freed entry, or ALLOCATOR_FREED_PAGES if the memory went back to the buddy allocator
 uint64_t free_memory(uint64_t address)
 {
 	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: Freeing memory at 0x%016lx\n", address);
-	uint64_t statusIdx = get_status_index_for_requested_address(address, 0, true);
-	memory_status_t *status_entry = &kMemoryStatus[statusIdx];
-	if (status_entry != NULL)
+	if (buddy_free_pages(address))
+		return ALLOCATOR_FREED_PAGES;
+
+	uint32_t statusIdx = status_find_at_or_before(address);
+	if (statusIdx != MEMORY_STATUS_NONE && kMemoryStatus[statusIdx].in_use &&
+		kMemoryStatus[statusIdx].startAddress + kMemoryStatus[statusIdx].length > address)
 	{
+		memory_status_t *status_entry = &kMemoryStatus[statusIdx];
 		printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "allocator: Found block to free, address = 0x%016lx, length=0x%016lx\n", status_entry->startAddress, status_entry->length);
 		status_entry->in_use = false;
 		//TODO: Fix this.  It isn't working because some addresses are NOT offset by the HHDM
 //		//Memory should still be mapped so we can clear it out safely
 //		memset((void*)(status_entry->startAddress + kHHDMOffset), 0xFE, status_entry->length);
+		merge_freed_block(statusIdx);
+		if (kMemoryStatusCapacity - kMemoryStatusEntryCount >= MEMORY_STATUS_SHRINK_SLACK_PAGES * MEMORY_STATUS_ENTRIES_PER_PAGE)
+			shrink_memory_status_entries();
 		return statusIdx;
 	}
 	panic("ALLOCATOR: Did not find kMemoryStatus entry to mark not in use, address was: 0x%016lx\n",address);
 	return 0xFFFFFFFF;
 }
 
-void allocator_init()
+/// @brief Get the size of the allocation starting at address
+/// @param address The physical address returned by one of the allocate_memory methods
+/// @return The allocation's length in bytes (whole pages for page allocations), 0 if address isn't the start of an allocation
+uint64_t allocation_size(uint64_t address)
 {
+	if (buddy_owns_allocation(address))
+		return kBuddyPages[address / PAGE_SIZE].page_count * PAGE_SIZE;
 
-	//uint64_t allocate_size = sizeof(memory_status_t) * INITIAL_MEMORY_STATUS_COUNT;
-	//uint64_t page_count = round_up_to_nearest_page(allocate_size) / PAGE_SIZE;
-	
-	//Get the lowest available address above or equal to 0x1000 (don't include the zero page)
-	//NOTE: First pages went to paging structures
-	memoryBaseAddress = getLowestAvailableMemoryAddress(0x1000) + (RESERVED_PAGES * PAGE_SIZE);
+	uint32_t statusIdx = status_find_at(address);
+	if (statusIdx != MEMORY_STATUS_NONE && kMemoryStatus[statusIdx].in_use)
+		return kMemoryStatus[statusIdx].length;
+	return 0;
+}
 
-	//Update the kernel page tables for the memory used by kMemoryStatus
-	//paging_map_pages((pt_entry_t*)kKernelPML4v, memoryBaseAddress, memoryBaseAddress, page_count, PAGE_PRESENT | PAGE_WRITE);
+/// @brief Length of the largest free kMemoryStatus entry, i.e. the largest sub-page allocation possible without growing the heap
+uint64_t allocator_largest_free_block()
+{
+	uint64_t largest = 0;
 
-	//Create an allocator entry for kMemoryStatus which is MAX_MEMORY_STATUS_COUNT entries long
-	//kMemoryStatus = (memory_status_t*)allocate_memory(allocate_size);
-	kMemoryStatus = (memory_status_t*)(memoryBaseAddress + kHHDMOffset);
+	//The size tree is ordered on length so the largest entry is the rightmost one
+	for (uint32_t idx = kMemoryStatusRoot[MEMORY_STATUS_SIZE_TREE]; idx != MEMORY_STATUS_NONE; idx = kMemoryStatus[idx].link[MEMORY_STATUS_SIZE_TREE][1])
+		largest = kMemoryStatus[idx].length;
+	return largest;
+}
 
-	//Parse the memory map into the newly created kMemoryStatus
-	for (uint64_t cnt=0;cnt<kMemMapEntryCount;cnt++)
-	{
-		if (kMemMap[cnt]->type == LIMINE_MEMMAP_USABLE)
-		{
-			kMemoryStatus[kMemoryStatusCurrentPtr].startAddress = kMemMap[cnt]->base;
-			kMemoryStatus[kMemoryStatusCurrentPtr].length = kMemMap[cnt]->length;
-			//CLR 11/24/2024 - Removed claiming LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE as usable memory
-			kMemoryStatus[kMemoryStatusCurrentPtr].in_use = kMemMap[cnt]->type != LIMINE_MEMMAP_USABLE;  //If the type isn't 0/5 then the area is in use
-			kMemoryStatusCurrentPtr++;
-		}
-	}
+void allocator_init()
+{
+	//Get the lowest available address above or equal to 0x1000 (don't include the zero page)
+	//NOTE: First pages went to paging structures
+	uint64_t lowestAddress = getLowestAvailableMemoryAddress(0x1000);
+	memoryBaseAddress = lowestAddress + (RESERVED_PAGES * PAGE_SIZE);
+
+	//Hand all usable memory, except the pages paging_init used, to the buddy allocator
+	buddy_init(lowestAddress, memoryBaseAddress);
 
-	//Officially allocate our allocator entries and map them, along with the reverved pages where we created our initial paging pages
-	uint64_t size = sizeof(memory_status_t);
-	uint64_t allocSize = size*INITIAL_MEMORY_STATUS_COUNT;
-	uint64_t newAddress = allocate_memory(allocSize) | kHHDMOffset;
-	uint64_t mapSize = allocSize/PAGE_SIZE;
-	if (allocSize%PAGE_SIZE)
-		mapSize++;
-	//paging_map_pages((pt_entry_t*)kKernelPML4v, newAddress, newAddress - kHHDMOffset, mapSize, PAGE_PRESENT | PAGE_WRITE);
-	memcpy((void*)newAddress, kMemoryStatus, kMemoryStatusCurrentPtr * size);
-	kMemoryStatus = (memory_status_t*)newAddress;
-}
\ No newline at end of file
+	//kMemoryStatus only tracks sub-page allocations.  Its entries are mapped a page at a time as they are needed, and its memory comes from the buddy allocator.
+	kMemoryStatusCurrentPtr = 0;
+	kMemoryStatusCapacity = 0;
+}
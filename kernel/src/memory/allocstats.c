@@ -0,0 +1,161 @@
+#include "CONFIG.h"
+#include "allocstats.h"
+#include "allocator.h"
+#include "buddy.h"
+#include "kernel.h"
+#include "memset.h"
+#include "sprintf.h"
+#include "serial_logging.h"
+
+//Everything here is updated with atomics so recording never takes a lock on the kmalloc path
+volatile uint64_t kAllocStatsLiveBytes = 0;
+volatile uint64_t kAllocStatsPeakLiveBytes = 0;
+volatile uint64_t kAllocStatsAllocCount = 0;
+volatile uint64_t kAllocStatsFreeCount = 0;
+volatile uint64_t kAllocStatsUntrackedCallsites = 0;
+volatile uint64_t kAllocStatsHistogram[ALLOC_STATS_HISTOGRAM_BUCKETS];
+alloc_callsite_t kAllocStatsCallsites[ALLOC_STATS_CALLSITE_SLOTS];
+
+//Counters as of the last allocstats_get, for the per second rates
+uint64_t kAllocStatsSampleTick = 0;
+uint64_t kAllocStatsSampleAllocs = 0;
+uint64_t kAllocStatsSampleFrees = 0;
+
+static inline uint32_t allocstats_bucket(uint64_t length)
+{
+	uint32_t bucket = length?63 - __builtin_clzll(length):0;
+	return bucket < ALLOC_STATS_HISTOGRAM_BUCKETS?bucket:ALLOC_STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+/// @brief Account for an allocation
+/// @param length Number of bytes allocated
+/// @param callsite Address the allocation was requested from, usually __builtin_return_address(0)
+void allocstats_record_alloc(uint64_t length, uintptr_t callsite)
+{
+	__sync_fetch_and_add(&kAllocStatsAllocCount, 1);
+	__sync_fetch_and_add(&kAllocStatsHistogram[allocstats_bucket(length)], 1);
+	uint64_t live = __sync_add_and_fetch(&kAllocStatsLiveBytes, length);
+	if (live > kAllocStatsPeakLiveBytes)
+		kAllocStatsPeakLiveBytes = live;
+
+	//Open addressed hash table, slots are claimed with a CAS on the address and never released
+	uint32_t slot = (uint32_t)((callsite * 0x9E3779B97F4A7C15ULL) >> 56) % ALLOC_STATS_CALLSITE_SLOTS;
+	for (int probe = 0; probe < ALLOC_STATS_CALLSITE_SLOTS; probe++)
+	{
+		alloc_callsite_t* entry = &kAllocStatsCallsites[slot];
+		if (entry->address == 0)
+			__sync_bool_compare_and_swap(&entry->address, 0, callsite);
+		if (entry->address == callsite)
+		{
+			__sync_fetch_and_add(&entry->count, 1);
+			__sync_fetch_and_add(&entry->bytes, length);
+			return;
+		}
+		slot = (slot + 1) % ALLOC_STATS_CALLSITE_SLOTS;
+	}
+	__sync_fetch_and_add(&kAllocStatsUntrackedCallsites, 1);
+}
+
+/// @brief Account for a free
+/// @param length Number of bytes freed, as returned by allocation_size
+void allocstats_record_free(uint64_t length)
+{
+	__sync_fetch_and_add(&kAllocStatsFreeCount, 1);
+	__sync_fetch_and_sub(&kAllocStatsLiveBytes, length);
+}
+
+/// @brief Take a snapshot of the allocator statistics
+/// @param stats Where to put the snapshot
+void allocstats_get(allocator_stats_t* stats)
+{
+	uint64_t now = kTicksSinceStart;
+
+	stats->live_bytes = kAllocStatsLiveBytes;
+	stats->peak_live_bytes = kAllocStatsPeakLiveBytes;
+	stats->alloc_count = kAllocStatsAllocCount;
+	stats->free_count = kAllocStatsFreeCount;
+	stats->heap_largest_free = allocator_largest_free_block();
+	stats->page_largest_free = buddy_largest_free_block();
+	stats->free_pages = kBuddyFreePageCount;
+	stats->status_entry_count = kMemoryStatusEntryCount;
+	stats->status_entry_capacity = kMemoryStatusCapacity;
+	stats->untracked_callsite_count = kAllocStatsUntrackedCallsites;
+	for (int cnt = 0; cnt < ALLOC_STATS_HISTOGRAM_BUCKETS; cnt++)
+		stats->size_histogram[cnt] = kAllocStatsHistogram[cnt];
+
+	if (now > kAllocStatsSampleTick)
+	{
+		stats->allocs_per_second = (stats->alloc_count - kAllocStatsSampleAllocs) * TICKS_PER_SECOND / (now - kAllocStatsSampleTick);
+		stats->frees_per_second = (stats->free_count - kAllocStatsSampleFrees) * TICKS_PER_SECOND / (now - kAllocStatsSampleTick);
+		kAllocStatsSampleTick = now;
+		kAllocStatsSampleAllocs = stats->alloc_count;
+		kAllocStatsSampleFrees = stats->free_count;
+	}
+	else
+		stats->allocs_per_second = stats->frees_per_second = 0;
+}
+
+/// @brief Get the callsites which have made the most allocations
+/// @param callsites Array to fill, most allocations first
+/// @param count Number of entries in callsites
+/// @return Number of entries filled in
+int allocstats_top_callsites(alloc_callsite_t* callsites, int count)
+{
+	int found = 0;
+
+	//Insertion sort of the table into the caller's array, the table is small and this isn't a hot path
+	for (int slot = 0; slot < ALLOC_STATS_CALLSITE_SLOTS; slot++)
+	{
+		alloc_callsite_t entry = kAllocStatsCallsites[slot];
+		if (entry.address == 0)
+			continue;
+		int pos = found < count?found:count;
+		while (pos > 0 && callsites[pos - 1].count < entry.count)
+		{
+			if (pos < count)
+				callsites[pos] = callsites[pos - 1];
+			pos--;
+		}
+		if (pos < count)
+		{
+			callsites[pos] = entry;
+			if (found < count)
+				found++;
+		}
+	}
+	return found;
+}
+
+/// @brief Print the allocator statistics and top callsites to the serial port, regardless of the debug level
+void allocstats_dump()
+{
+	allocator_stats_t stats;
+	alloc_callsite_t callsites[ALLOC_STATS_DUMP_TOP_N];
+	char line[160];
+
+	allocstats_get(&stats);
+	snprintf(line, sizeof(line), "ALLOCSTATS: live=0x%lx bytes (peak 0x%lx), allocs=%lu (%lu/s), frees=%lu (%lu/s)\n",
+			stats.live_bytes, stats.peak_live_bytes, stats.alloc_count, stats.allocs_per_second, stats.free_count, stats.frees_per_second);
+	serial_print_string(line);
+	snprintf(line, sizeof(line), "ALLOCSTATS: largest free heap block=0x%lx, largest free page block=0x%lx, free pages=0x%lx, status entries=%lu/%lu\n",
+			stats.heap_largest_free, stats.page_largest_free, stats.free_pages, stats.status_entry_count, stats.status_entry_capacity);
+	serial_print_string(line);
+	for (int cnt = 0; cnt < ALLOC_STATS_HISTOGRAM_BUCKETS; cnt++)
+		if (stats.size_histogram[cnt])
+		{
+			snprintf(line, sizeof(line), "ALLOCSTATS:\t2^%u bytes: %lu\n", cnt, stats.size_histogram[cnt]);
+			serial_print_string(line);
+		}
+	int found = allocstats_top_callsites(callsites, ALLOC_STATS_DUMP_TOP_N);
+	for (int cnt = 0; cnt < found; cnt++)
+	{
+		snprintf(line, sizeof(line), "ALLOCSTATS:\tcallsite 0x%016lx: %lu allocations, 0x%lx bytes\n",
+				callsites[cnt].address, callsites[cnt].count, callsites[cnt].bytes);
+		serial_print_string(line);
+	}
+	if (stats.untracked_callsite_count)
+	{
+		snprintf(line, sizeof(line), "ALLOCSTATS:\t%lu allocations from untracked callsites\n", stats.untracked_callsite_count);
+		serial_print_string(line);
+	}
+}
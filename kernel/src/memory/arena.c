@@ -0,0 +1,156 @@
+#include "arena.h"
+#include "kmalloc.h"
+#include "memset.h"
+#include "smp.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+//Per-CPU scratch arenas, created on first use
+arena_t* kScratchArenas[MAX_CPUS];
+
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1))
+#define ARENA_HEADER_SIZE ARENA_ROUND(sizeof(arena_t))
+#define ARENA_CHUNK_HEADER_SIZE ARENA_ROUND(sizeof(arena_chunk_t))
+#define ARENA_CHUNK_DATA(chunk) ((uint8_t*)(chunk) + ARENA_CHUNK_HEADER_SIZE)
+
+/// @brief Create an arena.  The arena header and its first chunk share a single allocation.
+/// @param chunk_size Usable size of each chunk, 0 for ARENA_DEFAULT_CHUNK_SIZE
+/// @return The new arena
+arena_t* arena_create(size_t chunk_size)
+{
+	arena_t* arena;
+
+	if (chunk_size == 0)
+		chunk_size = ARENA_DEFAULT_CHUNK_SIZE;
+	chunk_size = ARENA_ROUND(chunk_size);
+
+	arena = kmalloc(ARENA_HEADER_SIZE + ARENA_CHUNK_HEADER_SIZE + chunk_size);
+	arena->head = (arena_chunk_t*)((uint8_t*)arena + ARENA_HEADER_SIZE);
+	arena->head->next = NULL;
+	arena->head->size = chunk_size;
+	arena->head->used = 0;
+	arena->current = arena->head;
+	arena->chunk_size = chunk_size;
+	arena->chunk_count = 1;
+	arena->busy = 0;
+	arena->temporary = false;
+	return arena;
+}
+
+/// @brief Bump allocate from the arena.  Memory is not zeroed and is only released by reset, rewind or destroy.
+/// @param arena The arena
+/// @param size Bytes to allocate
+/// @return ARENA_ALIGNMENT aligned memory
+void* arena_alloc(arena_t* arena, size_t size)
+{
+	arena_chunk_t* chunk = arena->current;
+	void* retVal;
+
+	size = ARENA_ROUND(size);
+	while (chunk->used + size > chunk->size)
+	{
+		//Chunks after current are left over from before a reset/rewind, reuse them if they fit
+		if (chunk->next != NULL && chunk->next->size >= size)
+		{
+			chunk = chunk->next;
+			chunk->used = 0;
+			continue;
+		}
+		arena_chunk_t* newChunk;
+		size_t newSize = size > arena->chunk_size ? size : arena->chunk_size;
+
+		newChunk = kmalloc(ARENA_CHUNK_HEADER_SIZE + newSize);
+		newChunk->size = newSize;
+		newChunk->used = 0;
+		newChunk->next = chunk->next;
+		chunk->next = newChunk;
+		arena->chunk_count++;
+		printd(DEBUG_KMALLOC | DEBUG_DETAILED, "ARENA: Arena 0x%016lx grew by 0x%lx bytes, %u chunks\n", arena, newSize, arena->chunk_count);
+		chunk = newChunk;
+	}
+	arena->current = chunk;
+	retVal = ARENA_CHUNK_DATA(chunk) + chunk->used;
+	chunk->used += size;
+	return retVal;
+}
+
+/// @brief Bump allocate zeroed memory from the arena
+void* arena_zalloc(arena_t* arena, size_t size)
+{
+	void* retVal = arena_alloc(arena, size);
+
+	memset(retVal, 0, size);
+	return retVal;
+}
+
+/// @brief Record the arena's current position so that later allocations can be released with arena_rewind
+arena_mark_t arena_save(arena_t* arena)
+{
+	arena_mark_t mark = {arena->current, arena->current->used};
+
+	return mark;
+}
+
+/// @brief Release everything allocated since mark was taken.  Chunks are kept for reuse.
+void arena_rewind(arena_t* arena, arena_mark_t mark)
+{
+	arena->current = mark.chunk;
+	arena->current->used = mark.used;
+}
+
+/// @brief Release every allocation in O(1).  Chunks are kept and reused as the arena refills.
+void arena_reset(arena_t* arena)
+{
+	arena->current = arena->head;
+	arena->head->used = 0;
+}
+
+/// @brief Release every allocation and return all of the arena's memory, including the arena itself
+void arena_destroy(arena_t* arena)
+{
+	arena_chunk_t* chunk = arena->head->next;
+	arena_chunk_t* next;
+
+	while (chunk != NULL)
+	{
+		next = chunk->next;
+		kfree(chunk);
+		chunk = next;
+	}
+	kfree(arena);
+}
+
+/// @brief Borrow the current CPU's scratch arena for short lived buffers.  Must be returned with arena_scratch_release.
+/// @return The CPU's scratch arena, or a temporary arena if it is already in use (i.e. by a preempted thread)
+arena_t* arena_scratch_get()
+{
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t cpu = read_apic_id();
+	arena_t* arena;
+
+	if (kScratchArenas[cpu] == NULL)
+		kScratchArenas[cpu] = arena_create(ARENA_SCRATCH_CHUNK_SIZE);
+	arena = kScratchArenas[cpu];
+	if (__sync_lock_test_and_set(&arena->busy, 1))
+	{
+		interrupts_restore(flags);
+		arena = arena_create(ARENA_SCRATCH_CHUNK_SIZE);
+		arena->temporary = true;
+		return arena;
+	}
+	interrupts_restore(flags);
+	return arena;
+}
+
+/// @brief Return a scratch arena, releasing everything allocated from it
+void arena_scratch_release(arena_t* arena)
+{
+	if (arena->temporary)
+	{
+		arena_destroy(arena);
+		return;
+	}
+	arena_reset(arena);
+	__sync_lock_release(&arena->busy);
+}
@@ -0,0 +1,410 @@
+#include "CONFIG.h"
+#include "buddy.h"
+#include "memmap.h"
+#include "paging.h"
+#include "memset.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+//One entry per physical page frame, indexed by page frame number
+buddy_page_t* kBuddyPages;
+uintptr_t kBuddyPagesPhysical = 0;
+uint64_t kBuddyPagesSize = 0;
+uint64_t kBuddyPageCount = 0;
+uint64_t kBuddyFreePageCount = 0;
+uint64_t kBuddyZoneFreePageCount[MEMORY_ZONE_COUNT];
+uint64_t kBuddyNodeFreePageCount[NUMA_MAX_NODES];
+//Each node and zone has its own free lists.  Zone boundaries are multiples of the largest block so blocks never straddle zones,
+//and blocks are never built across a node boundary.
+uint32_t kBuddyFreeList[NUMA_MAX_NODES][MEMORY_ZONE_COUNT][BUDDY_MAX_ORDER + 1];
+volatile int kBuddyLock = 0;
+
+static inline uint32_t buddy_order_for_count(uint64_t page_count)
+{
+	uint32_t order = 0;
+	while (((uint64_t)1 << order) < page_count)
+		order++;
+	return order;
+}
+
+static inline uint32_t buddy_zone_for_pfn(uint64_t pfn)
+{
+	return pfn < MEMORY_ZONE_DMA32_LIMIT / PAGE_SIZE?MEMORY_ZONE_DMA32:MEMORY_ZONE_NORMAL;
+}
+
+static void buddy_list_push(uint32_t order, uint64_t pfn)
+{
+	buddy_page_t* page = &kBuddyPages[pfn];
+	uint32_t zone = buddy_zone_for_pfn(pfn);
+	uint32_t* list = &kBuddyFreeList[page->node][zone][order];
+
+	page->next = *list;
+	page->prev = BUDDY_NO_PAGE;
+	page->order = order;
+	page->flags = BUDDY_PAGE_FREE;
+	if (*list != BUDDY_NO_PAGE)
+		kBuddyPages[*list].prev = pfn;
+	*list = pfn;
+	kBuddyFreePageCount += (uint64_t)1 << order;
+	kBuddyZoneFreePageCount[zone] += (uint64_t)1 << order;
+	kBuddyNodeFreePageCount[page->node] += (uint64_t)1 << order;
+}
+
+static void buddy_list_remove(uint32_t order, uint64_t pfn)
+{
+	buddy_page_t* page = &kBuddyPages[pfn];
+	uint32_t zone = buddy_zone_for_pfn(pfn);
+
+	if (page->prev != BUDDY_NO_PAGE)
+		kBuddyPages[page->prev].next = page->next;
+	else
+		kBuddyFreeList[page->node][zone][order] = page->next;
+	if (page->next != BUDDY_NO_PAGE)
+		kBuddyPages[page->next].prev = page->prev;
+	page->flags = 0;
+	kBuddyFreePageCount -= (uint64_t)1 << order;
+	kBuddyZoneFreePageCount[zone] -= (uint64_t)1 << order;
+	kBuddyNodeFreePageCount[page->node] -= (uint64_t)1 << order;
+}
+
+//Return a block to the free lists, merging it with its buddy for as long as the buddy is also free
+static void buddy_free_block(uint64_t pfn, uint32_t order)
+{
+	kBuddyPages[pfn].flags = 0;
+	while (order < BUDDY_MAX_ORDER)
+	{
+		uint64_t buddy = pfn ^ ((uint64_t)1 << order);
+		if (buddy >= kBuddyPageCount || !(kBuddyPages[buddy].flags & BUDDY_PAGE_FREE) || kBuddyPages[buddy].order != order ||
+			kBuddyPages[buddy].node != kBuddyPages[pfn].node)
+			break;
+		buddy_list_remove(order, buddy);
+		pfn &= buddy;
+		order++;
+	}
+	buddy_list_push(order, pfn);
+}
+
+//Free an arbitrary page range by splitting it into the largest naturally aligned blocks it contains
+static void buddy_free_range(uint64_t pfn, uint64_t page_count)
+{
+	while (page_count)
+	{
+		uint32_t order = pfn?__builtin_ctzll(pfn):BUDDY_MAX_ORDER;
+		if (order > BUDDY_MAX_ORDER)
+			order = BUDDY_MAX_ORDER;
+		while (((uint64_t)1 << order) > page_count)
+			order--;
+		//Don't build a block which crosses into another node's memory
+		if (kNumaNodeCount > 1)
+		{
+			uint64_t nodeEndPfn = numa_node_range_end(pfn * PAGE_SIZE) / PAGE_SIZE;
+			while (order > 0 && pfn + ((uint64_t)1 << order) > nodeEndPfn)
+				order--;
+		}
+		buddy_free_block(pfn, order);
+		pfn += (uint64_t)1 << order;
+		page_count -= (uint64_t)1 << order;
+	}
+}
+
+//Find the free block containing pfn, returning its first page (BUDDY_NO_PAGE if the page isn't free)
+static uint64_t buddy_find_free_block(uint64_t pfn, uint32_t* order)
+{
+	for (uint32_t cnt = 0; cnt <= BUDDY_MAX_ORDER; cnt++)
+	{
+		uint64_t block = pfn & ~(((uint64_t)1 << cnt) - 1);
+		if ((kBuddyPages[block].flags & BUDDY_PAGE_FREE) && kBuddyPages[block].order == cnt)
+		{
+			*order = cnt;
+			return block;
+		}
+	}
+	return BUDDY_NO_PAGE;
+}
+
+//Take [pfn, pfn+page_count) off the free lists, giving back whatever is left of each block it was carved from.
+//Pages in the range that are not free are skipped.
+static void buddy_carve_range(uint64_t pfn, uint64_t page_count)
+{
+	uint64_t end = pfn + page_count;
+	uint32_t order = 0;
+
+	while (pfn < end)
+	{
+		uint64_t block = buddy_find_free_block(pfn, &order);
+		if (block == BUDDY_NO_PAGE)
+		{
+			pfn++;
+			continue;
+		}
+		uint64_t blockEnd = block + ((uint64_t)1 << order);
+		uint64_t carveEnd = blockEnd < end?blockEnd:end;
+		buddy_list_remove(order, block);
+		if (block < pfn)
+			buddy_free_range(block, pfn - block);
+		if (carveEnd < blockEnd)
+			buddy_free_range(carveEnd, blockEnd - carveEnd);
+		pfn = carveEnd;
+	}
+}
+
+/// @brief Allocate physically contiguous pages, preferring memory above 4GB so the DMA32 zone is kept for devices that need it
+/// @param page_count The number of pages to allocate
+/// @param flags BUDDY_PAGE_ALLOCATED for a direct page allocation, BUDDY_PAGE_HEAP for memory backing kMemoryStatus
+/// @return The physical address of the first page, or 0 if no block is large enough
+uint64_t buddy_alloc_pages(uint64_t page_count, uint8_t flags)
+{
+	return buddy_alloc_pages_zone(page_count, flags, MEMORY_ZONE_NORMAL);
+}
+
+/// @brief Allocate physically contiguous pages from zone or any zone below it, preferring the calling CPU's NUMA node
+/// @param page_count The number of pages to allocate
+/// @param flags BUDDY_PAGE_ALLOCATED for a direct page allocation, BUDDY_PAGE_HEAP for memory backing kMemoryStatus
+/// @param zone The highest zone the pages may come from, MEMORY_ZONE_DMA32 for memory below 4GB
+/// @return The physical address of the first page, or 0 if no block is large enough
+uint64_t buddy_alloc_pages_zone(uint64_t page_count, uint8_t flags, uint32_t zone)
+{
+	return buddy_alloc_pages_node(page_count, flags, zone, NUMA_NODE_LOCAL);
+}
+
+/// @brief Allocate physically contiguous pages from zone or any zone below it, preferring node
+/// @param page_count The number of pages to allocate
+/// @param flags BUDDY_PAGE_ALLOCATED for a direct page allocation, BUDDY_PAGE_HEAP for memory backing kMemoryStatus
+/// @param zone The highest zone the pages may come from, MEMORY_ZONE_DMA32 for memory below 4GB
+/// @param node The preferred NUMA node, NUMA_NODE_LOCAL for the calling CPU's node.  Other nodes are tried nearest first.
+/// @return The physical address of the first page, or 0 if no block is large enough
+uint64_t buddy_alloc_pages_node(uint64_t page_count, uint8_t flags, uint32_t zone, uint32_t node)
+{
+	uint32_t order = buddy_order_for_count(page_count);
+	uint32_t found = 0;
+	uint32_t foundNode = 0;
+	int foundZone = -1;
+
+	if (page_count == 0 || order > BUDDY_MAX_ORDER || zone >= MEMORY_ZONE_COUNT)
+		return 0;
+	if (node == NUMA_NODE_LOCAL || node >= kNumaNodeCount)
+		node = numa_current_node();
+
+	while (__sync_lock_test_and_set(&kBuddyLock, 1));
+	//Go to a more distant node only when none of the nearer node's usable zones can satisfy the request,
+	//and within a node fall back to lower zones only when the requested one can't
+	for (uint32_t fallback = 0; fallback < kNumaNodeCount && foundZone < 0; fallback++)
+	{
+		foundNode = kNumaFallback[node][fallback];
+		for (foundZone = zone; foundZone >= 0; foundZone--)
+		{
+			for (found = order; found <= BUDDY_MAX_ORDER && kBuddyFreeList[foundNode][foundZone][found] == BUDDY_NO_PAGE; found++);
+			if (found <= BUDDY_MAX_ORDER)
+				break;
+		}
+	}
+	if (foundZone < 0)
+	{
+		__sync_lock_release(&kBuddyLock);
+		printd(DEBUG_ALLOCATOR, "BUDDY: No free block of order %u for 0x%lx pages in zone %u\n", order, page_count, zone);
+		return 0;
+	}
+
+	uint64_t pfn = kBuddyFreeList[foundNode][foundZone][found];
+	buddy_list_remove(found, pfn);
+	//Split the block, giving back the upper half each time, until it is the requested order
+	while (found > order)
+	{
+		found--;
+		buddy_list_push(found, pfn + ((uint64_t)1 << found));
+	}
+	//Give back the pages rounding up to a power of two added
+	if (((uint64_t)1 << order) > page_count)
+		buddy_free_range(pfn + page_count, ((uint64_t)1 << order) - page_count);
+
+	kBuddyPages[pfn].flags = flags;
+	kBuddyPages[pfn].page_count = page_count;
+	__sync_lock_release(&kBuddyLock);
+
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "BUDDY: Allocated 0x%lx pages at 0x%016lx (order %u, zone %u, node %u)\n", page_count, pfn * PAGE_SIZE, order, foundZone, foundNode);
+	return pfn * PAGE_SIZE;
+}
+
+/// @brief Allocate a specific range of physical pages
+/// @param address The page aligned physical address of the range
+/// @param page_count The number of pages in the range
+/// @return The address passed, or 0 if any page in the range is not free
+uint64_t buddy_alloc_pages_at(uint64_t address, uint64_t page_count)
+{
+	uint64_t pfn = address / PAGE_SIZE;
+	uint32_t order;
+
+	if (address % PAGE_SIZE || page_count == 0 || pfn + page_count > kBuddyPageCount)
+		return 0;
+
+	while (__sync_lock_test_and_set(&kBuddyLock, 1));
+	//Make sure the whole range is free before taking any of it
+	for (uint64_t cnt = pfn; cnt < pfn + page_count;)
+	{
+		uint64_t block = buddy_find_free_block(cnt, &order);
+		if (block == BUDDY_NO_PAGE)
+		{
+			__sync_lock_release(&kBuddyLock);
+			printd(DEBUG_ALLOCATOR, "BUDDY: Page 0x%016lx of requested range 0x%016lx is not free\n", cnt * PAGE_SIZE, address);
+			return 0;
+		}
+		cnt = block + ((uint64_t)1 << order);
+	}
+	buddy_carve_range(pfn, page_count);
+	kBuddyPages[pfn].flags = BUDDY_PAGE_ALLOCATED;
+	kBuddyPages[pfn].page_count = page_count;
+	__sync_lock_release(&kBuddyLock);
+
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "BUDDY: Allocated 0x%lx pages at requested address 0x%016lx\n", page_count, address);
+	return address;
+}
+
+/// @brief Free pages allocated with buddy_alloc_pages(BUDDY_PAGE_ALLOCATED) or buddy_alloc_pages_at
+/// @param address The address returned by the allocation
+/// @return The number of pages freed, 0 if address is not the start of a buddy page allocation
+uint64_t buddy_free_pages(uint64_t address)
+{
+	uint64_t pfn = address / PAGE_SIZE;
+
+	if (!buddy_owns_allocation(address))
+		return 0;
+
+	while (__sync_lock_test_and_set(&kBuddyLock, 1));
+	uint64_t page_count = kBuddyPages[pfn].page_count;
+	buddy_free_range(pfn, page_count);
+	__sync_lock_release(&kBuddyLock);
+
+	printd(DEBUG_ALLOCATOR | DEBUG_DETAILED, "BUDDY: Freed 0x%lx pages at 0x%016lx\n", page_count, address);
+	return page_count;
+}
+
+bool buddy_owns_allocation(uint64_t address)
+{
+	uint64_t pfn = address / PAGE_SIZE;
+
+	return kBuddyPages != NULL && address % PAGE_SIZE == 0 && pfn < kBuddyPageCount && (kBuddyPages[pfn].flags & BUDDY_PAGE_ALLOCATED);
+}
+
+/// @brief Size in bytes of the largest free block in any zone
+uint64_t buddy_largest_free_block()
+{
+	for (int order = BUDDY_MAX_ORDER; order >= 0; order--)
+		for (uint32_t node = 0; node < kNumaNodeCount; node++)
+			for (int zone = 0; zone < MEMORY_ZONE_COUNT; zone++)
+				if (kBuddyFreeList[node][zone][order] != BUDDY_NO_PAGE)
+					return ((uint64_t)1 << order) * PAGE_SIZE;
+	return 0;
+}
+
+//NOTE: Pages handed to the kMemoryStatus heap are reported as allocated
+bool buddy_page_is_allocated(uintptr_t physical_page)
+{
+	uint32_t order;
+	uint64_t pfn = physical_page / PAGE_SIZE;
+
+	if (pfn >= kBuddyPageCount)
+		return false;
+	return buddy_find_free_block(pfn, &order) == BUDDY_NO_PAGE;
+}
+
+/// @brief Build the buddy free lists from the usable entries of the Limine memory map
+/// @param reservedStart Start of a physical range already in use which must not be handed out
+/// @param reservedEnd End of the reserved range
+void buddy_init(uintptr_t reservedStart, uintptr_t reservedEnd)
+{
+	kBuddyPageCount = kMaxPhysicalAddress / PAGE_SIZE;
+	kBuddyPagesSize = kBuddyPageCount * sizeof(buddy_page_t);
+	if (kBuddyPagesSize % PAGE_SIZE)
+		kBuddyPagesSize += PAGE_SIZE - (kBuddyPagesSize % PAGE_SIZE);
+
+	for (int zone = 0; zone < MEMORY_ZONE_COUNT; zone++)
+		kBuddyZoneFreePageCount[zone] = 0;
+	for (int node = 0; node < NUMA_MAX_NODES; node++)
+	{
+		kBuddyNodeFreePageCount[node] = 0;
+		for (int zone = 0; zone < MEMORY_ZONE_COUNT; zone++)
+			for (int cnt = 0; cnt <= BUDDY_MAX_ORDER; cnt++)
+				kBuddyFreeList[node][zone][cnt] = BUDDY_NO_PAGE;
+	}
+
+	//Find a home for the page array in the first usable region big enough to hold it
+	for (uint64_t cnt = 0; cnt < kMemMapEntryCount && kBuddyPagesPhysical == 0; cnt++)
+	{
+		if (kMemMap[cnt]->type != LIMINE_MEMMAP_USABLE)
+			continue;
+		uintptr_t start = kMemMap[cnt]->base;
+		uintptr_t end = kMemMap[cnt]->base + kMemMap[cnt]->length;
+		if (start < reservedEnd && end > reservedStart)
+			start = reservedEnd;
+		start = (start + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1);
+		if (start >= PAGE_SIZE && start < end && end - start >= kBuddyPagesSize)
+			kBuddyPagesPhysical = start;
+	}
+	if (kBuddyPagesPhysical == 0)
+		panic("BUDDY: No usable memory region can hold the 0x%lx byte page array\n", kBuddyPagesSize);
+
+	kBuddyPages = (buddy_page_t*)(kBuddyPagesPhysical + kHHDMOffset);
+	memset(kBuddyPages, 0, kBuddyPagesSize);
+
+	for (uint64_t cnt = 0; cnt < kMemMapEntryCount; cnt++)
+	{
+		if (kMemMap[cnt]->type != LIMINE_MEMMAP_USABLE)
+			continue;
+		uint64_t startPfn = (kMemMap[cnt]->base + PAGE_SIZE - 1) / PAGE_SIZE;
+		uint64_t endPfn = (kMemMap[cnt]->base + kMemMap[cnt]->length) / PAGE_SIZE;
+		//Don't allow page 0 to be allocated!!!
+		if (startPfn == 0)
+			startPfn = 1;
+		if (endPfn > startPfn)
+			buddy_free_range(startPfn, endPfn - startPfn);
+	}
+
+	//Take back the early paging pages and the page array itself
+	buddy_carve_range(reservedStart / PAGE_SIZE, (reservedEnd - reservedStart) / PAGE_SIZE);
+	buddy_carve_range(kBuddyPagesPhysical / PAGE_SIZE, kBuddyPagesSize / PAGE_SIZE);
+
+	printd(DEBUG_ALLOCATOR, "BUDDY: Managing 0x%lx pages, 0x%lx free (0x%lx DMA32, 0x%lx normal), page array at 0x%016lx (0x%lx bytes)\n",
+			kBuddyPageCount, kBuddyFreePageCount, kBuddyZoneFreePageCount[MEMORY_ZONE_DMA32], kBuddyZoneFreePageCount[MEMORY_ZONE_NORMAL],
+			kBuddyPagesPhysical, kBuddyPagesSize);
+}
+
+/// @brief Tag every page with its NUMA node and move the free blocks to their node's free lists.  Called by numa_init once the SRAT
+/// has been parsed, since the buddy allocator is up well before ACPI is.
+void buddy_numa_init()
+{
+	while (__sync_lock_test_and_set(&kBuddyLock, 1));
+	//Take every free block off the free lists, marking it so it can be found again
+	for (uint64_t pfn = 0; pfn < kBuddyPageCount; pfn++)
+	{
+		if (kBuddyPages[pfn].flags & BUDDY_PAGE_FREE)
+		{
+			uint32_t order = kBuddyPages[pfn].order;
+			buddy_list_remove(order, pfn);
+			kBuddyPages[pfn].order = order;
+			kBuddyPages[pfn].flags = BUDDY_PAGE_REBUILD;
+		}
+	}
+	for (uint32_t cnt = 0; cnt < kNumaMemoryRangeCount; cnt++)
+	{
+		uint64_t endPfn = kNumaMemoryRanges[cnt].end / PAGE_SIZE;
+		for (uint64_t pfn = kNumaMemoryRanges[cnt].base / PAGE_SIZE; pfn < endPfn && pfn < kBuddyPageCount; pfn++)
+			kBuddyPages[pfn].node = kNumaMemoryRanges[cnt].node;
+	}
+	//Give the blocks back, which splits them at node boundaries and puts them on the right node's lists
+	for (uint64_t pfn = 0; pfn < kBuddyPageCount;)
+	{
+		if (kBuddyPages[pfn].flags & BUDDY_PAGE_REBUILD)
+		{
+			uint64_t page_count = (uint64_t)1 << kBuddyPages[pfn].order;
+			kBuddyPages[pfn].flags = 0;
+			buddy_free_range(pfn, page_count);
+			pfn += page_count;
+		}
+		else
+			pfn++;
+	}
+	__sync_lock_release(&kBuddyLock);
+
+	for (uint32_t node = 0; node < kNumaNodeCount; node++)
+		printd(DEBUG_ALLOCATOR, "BUDDY: Node %u has 0x%lx free pages\n", node, kBuddyNodeFreePageCount[node]);
+}
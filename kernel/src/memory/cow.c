@@ -0,0 +1,198 @@
+#include "cow.h"
+#include "buddy.h"
+#include "memcpy.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+//Serializes changes to share counts and to copy-on-write page table entries
+volatile int kCOWLock = 0;
+volatile uint64_t kCOWSharedPages = 0, kCOWCopiedPages = 0;
+
+typedef struct
+{
+	pt_entry_t* dstPML4;
+	uint64_t extraFlags;
+	//A writable source page was made read-only, so the source's TLBs need flushing
+	bool srcChanged;
+} cow_share_t;
+
+//buddy_page_t holding the share count of a physical page, NULL if the buddy allocator doesn't track it
+static inline buddy_page_t* cow_buddy_page(uintptr_t physical)
+{
+	if (physical / PAGE_SIZE >= kBuddyPageCount)
+		return NULL;
+	return &kBuddyPages[physical / PAGE_SIZE];
+}
+
+//Allocate a page and copy physical into it.  Nothing else owns the copy, so it is marked for cow_release_range to free.
+static uintptr_t cow_copy_page(uintptr_t physical)
+{
+	uintptr_t copy = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+
+	if (copy == 0)
+		panic("cow_copy_page: Out of memory\n");
+	kBuddyPages[copy / PAGE_SIZE].flags |= BUDDY_PAGE_COW;
+	memcpy((void*)PHYS_TO_VIRT(copy), (void*)PHYS_TO_VIRT(physical), PAGE_SIZE);
+	__sync_fetch_and_add(&kCOWCopiedPages, 1);
+	return copy;
+}
+
+//paging_for_each_page callback, maps one of the source's pages into the destination
+static void cow_share_page(pt_entry_t* pte, uint64_t virtual_address, void* context)
+{
+	cow_share_t* share = context;
+	uintptr_t physical = *pte & 0x000FFFFFFFFFF000ULL;
+	uint64_t flags = ((*pte & (PAGE_FLAGS_MASK | PAGE_NO_EXECUTE)) & ~(PAGE_ACCESSED | PAGE_DIRTY | PAGE_GLOBAL)) | share->extraFlags;
+	buddy_page_t* page = cow_buddy_page(physical);
+
+	//Already mapped in the destination, i.e. its own task_t
+	if (paging_walk_paging_table(share->dstPML4, virtual_address) != 0xbadbadba)
+		return;
+	if (page == NULL || page->share_count == COW_MAX_SHARES)
+	{
+		if (flags & PAGE_COW)
+			flags = (flags & ~PAGE_COW) | PAGE_WRITE;
+		flags &= ~PAGE_SHARED;
+		paging_map_page(share->dstPML4, virtual_address, cow_copy_page(physical), flags);
+		return;
+	}
+	//Pages which can be written are made read-only on both sides, the first write gets its own copy
+	if (flags & (PAGE_WRITE | PAGE_COW))
+	{
+		flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+		if (*pte & PAGE_WRITE)
+		{
+			*pte = (*pte & ~PAGE_WRITE) | PAGE_COW;
+			share->srcChanged = true;
+		}
+	}
+	//The CPU ignores PAGE_SHARED, adding it doesn't need a flush
+	*pte |= PAGE_SHARED;
+	page->share_count++;
+	paging_map_page(share->dstPML4, virtual_address, physical, flags | PAGE_SHARED);
+	__sync_fetch_and_add(&kCOWSharedPages, 1);
+}
+
+/// @brief Map the pages in [start, end) of srcPML4 into dstPML4 at the same addresses, sharing them copy-on-write.  Costs
+/// one page table entry per mapped page, no memory is copied until one side writes.
+/// @param extraFlags Flags to add to the destination's mappings, i.e. PAGE_USER
+void cow_share_range(pt_entry_t* srcPML4, pt_entry_t* dstPML4, uint64_t start, uint64_t end, uint64_t extraFlags)
+{
+	cow_share_t share = {dstPML4, extraFlags, false};
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kCOWLock, 1));
+	paging_for_each_page(srcPML4, start, end, cow_share_page, &share);
+	__sync_lock_release(&kCOWLock);
+	interrupts_restore(flags);
+	//Outside the lock, other CPUs may need to take it before they can acknowledge the shootdown
+	if (share.srcChanged)
+		paging_flush_pml4_range(srcPML4, start, end);
+	printd(DEBUG_PAGING | DEBUG_DETAILED, "COW: Shared 0x%016lx-0x%016lx of PML4 0x%016lx with 0x%016lx\n", start, end, srcPML4, dstPML4);
+}
+
+//paging_for_each_page callback, returns the entry it is called with
+static void cow_find_pte(pt_entry_t* pte, uint64_t virtual_address, void* context)
+{
+	(void)virtual_address;
+	*(pt_entry_t**)context = pte;
+}
+
+/// @brief Give the address space being run its own writable copy of a copy-on-write page.  Called by the page fault handler.
+/// @param address The faulting address (CR2)
+/// @param error_code The page fault error code
+/// @return true if the page is now writable and the faulting instruction can be restarted
+bool cow_handle_fault(uint64_t address, uint64_t error_code)
+{
+	uint64_t page = address & PAGE_ADDRESS_MASK;
+	pt_entry_t* pte = NULL;
+	uint64_t cr3;
+
+	if ((error_code & (PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE)) != (PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE))
+		return false;
+	__asm__ __volatile__("mov %0, cr3" : "=r"(cr3));
+	pt_entry_t* pml4 = (pt_entry_t*)PHYS_TO_VIRT(cr3 & 0x000FFFFFFFFFF000ULL);
+
+	while (__sync_lock_test_and_set(&kCOWLock, 1));
+	paging_for_each_page(pml4, page, page + PAGE_SIZE, cow_find_pte, &pte);
+	if (pte == NULL || !(*pte & (PAGE_COW | PAGE_WRITE)) || ((error_code & PAGE_FAULT_USER) && !(*pte & PAGE_USER)))
+	{
+		__sync_lock_release(&kCOWLock);
+		return false;
+	}
+	//Another thread of the address space got its copy while we waited for the lock
+	if (*pte & PAGE_WRITE)
+	{
+		__sync_lock_release(&kCOWLock);
+		return true;
+	}
+	uintptr_t physical = *pte & 0x000FFFFFFFFFF000ULL;
+	uint64_t flags = ((*pte & (PAGE_FLAGS_MASK | PAGE_NO_EXECUTE)) & ~(PAGE_COW | PAGE_SHARED)) | PAGE_WRITE;
+	buddy_page_t* sharedPage = cow_buddy_page(physical);
+	//The last address space still mapping the page can just write to it
+	if (sharedPage != NULL && sharedPage->share_count > 0)
+	{
+		physical = cow_copy_page(physical);
+		sharedPage->share_count--;
+	}
+	*pte = physical | flags;
+	__sync_lock_release(&kCOWLock);
+	paging_flush_pml4_range(pml4, page, page + PAGE_SIZE);
+	return true;
+}
+
+//Drop one reference to a page, caller holds kCOWLock.  Returns true if nothing else maps the page.
+static bool cow_release_page_locked(uintptr_t physical)
+{
+	buddy_page_t* page = cow_buddy_page(physical);
+
+	if (page == NULL || page->share_count == 0)
+		return true;
+	page->share_count--;
+	return false;
+}
+
+/// @brief Drop an address space's reference to a page it is unmapping for good, i.e. on task teardown
+/// @return true if no other address space shares the page, so the caller should free it
+bool cow_release_page(uintptr_t physical)
+{
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kCOWLock, 1));
+	bool last = cow_release_page_locked(physical);
+	__sync_lock_release(&kCOWLock);
+	interrupts_restore(flags);
+	return last;
+}
+
+//paging_for_each_page callback, drops the address space's reference to a shared page and frees copies nothing else maps
+static void cow_release_shared_page(pt_entry_t* pte, uint64_t virtual_address, void* context)
+{
+	uintptr_t physical = *pte & 0x000FFFFFFFFFF000ULL;
+	buddy_page_t* page = cow_buddy_page(physical);
+	bool last = true;
+
+	(void)virtual_address;
+	(void)context;
+	if (*pte & PAGE_SHARED)
+		last = cow_release_page_locked(physical);
+	if (last && page != NULL && (page->flags & BUDDY_PAGE_COW))
+	{
+		page->flags &= ~BUDDY_PAGE_COW;
+		buddy_free_pages(physical);
+	}
+}
+
+/// @brief Drop the references an address space being torn down holds on the shared pages in [start, end), freeing the
+/// copies cow_copy_page made once nothing maps them.  Other pages belong to whoever allocated them (VMA pages are
+/// released by vma_release_all).
+void cow_release_range(pt_entry_t* pml4, uint64_t start, uint64_t end)
+{
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kCOWLock, 1));
+	paging_for_each_page(pml4, start, end, cow_release_shared_page, NULL);
+	__sync_lock_release(&kCOWLock);
+	interrupts_restore(flags);
+}
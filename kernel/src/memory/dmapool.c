@@ -0,0 +1,113 @@
+#include "CONFIG.h"
+#include "dmapool.h"
+#include "kmalloc.h"
+#include "buddy.h"
+#include "strcpy.h"
+#include "memset.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+dma_pool_t kDMAPools[DMA_POOL_MAX_POOLS];
+int kDMAPoolCount = 0;
+volatile int kDMAPoolCreateLock = 0;
+
+/// @brief Create a pool of fixed size, identity mapped, uncached blocks for device DMA
+/// @param name Name of the pool, for debugging
+/// @param size Size of each block
+/// @param align Power of 2 alignment of each block, up to PAGE_SIZE.  Blocks of PAGE_SIZE or less never cross a page boundary.
+/// @return The new pool
+dma_pool_t* dma_pool_create(const char* name, size_t size, size_t align)
+{
+	return dma_pool_create_zone(name, size, align, MEMORY_ZONE_NORMAL);
+}
+
+/// @brief Create a DMA pool whose blocks come from zone or below, e.g. MEMORY_ZONE_DMA32 for 32-bit only devices
+/// @param name Name of the pool, for debugging
+/// @param size Size of each block
+/// @param align Power of 2 alignment of each block, up to PAGE_SIZE
+/// @param zone Highest memory zone the pool's regions may come from
+/// @return The new pool
+dma_pool_t* dma_pool_create_zone(const char* name, size_t size, size_t align, uint32_t zone)
+{
+	dma_pool_t* pool;
+
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+	if (align > PAGE_SIZE || (align & (align - 1)))
+		panic("dma_pool_create: Invalid alignment 0x%lx for pool %s\n", align, name);
+
+	while (__sync_lock_test_and_set(&kDMAPoolCreateLock, 1));
+	if (kDMAPoolCount == DMA_POOL_MAX_POOLS)
+		panic("dma_pool_create: No room for pool %s, DMA_POOL_MAX_POOLS is %u\n", name, DMA_POOL_MAX_POOLS);
+	pool = &kDMAPools[kDMAPoolCount++];
+	__sync_lock_release(&kDMAPoolCreateLock);
+
+	memset(pool, 0, sizeof(dma_pool_t));
+	strncpy(pool->name, name, DMA_POOL_NAME_LENGTH - 1);
+	pool->block_size = size;
+	pool->zone = zone;
+	pool->stride = (size + align - 1) & ~(align - 1);
+	pool->region_size = (pool->stride * DMA_POOL_MIN_BLOCKS_PER_REGION + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+	if (pool->stride <= PAGE_SIZE)
+		pool->blocks_per_region = (pool->region_size / PAGE_SIZE) * (PAGE_SIZE / pool->stride);
+	else
+		pool->blocks_per_region = pool->region_size / pool->stride;
+
+	printd(DEBUG_KMALLOC, "DMAPOOL: Created pool %s, block size 0x%lx, stride 0x%lx, %u blocks per 0x%lx byte region\n",
+			pool->name, pool->block_size, pool->stride, pool->blocks_per_region, pool->region_size);
+	return pool;
+}
+
+//Map a new region and carve it into blocks on the pool's free list.  Called with the pool lock held.
+static void dma_pool_grow(dma_pool_t* pool)
+{
+	//kmalloc_dma identity maps the region uncached, this is the only page table work the pool ever does
+	uint8_t* region = kmalloc_dma_zone(pool->region_size, pool->zone);
+	uint64_t offset = 0;
+
+	for (uint64_t cnt = 0; cnt < pool->blocks_per_region; cnt++)
+	{
+		//Small blocks never straddle a page, PRP lists depend on that
+		if (pool->stride <= PAGE_SIZE && (offset % PAGE_SIZE) + pool->stride > PAGE_SIZE)
+			offset = (offset + PAGE_SIZE) & ~((uint64_t)PAGE_SIZE - 1);
+		void** block = (void**)(region + offset);
+		*block = pool->free_list;
+		pool->free_list = block;
+		offset += pool->stride;
+	}
+	pool->free_count += pool->blocks_per_region;
+	pool->region_count++;
+	printd(DEBUG_KMALLOC | DEBUG_DETAILED, "DMAPOOL: Pool %s grew to %u regions\n", pool->name, pool->region_count);
+}
+
+/// @brief Allocate a block from a DMA pool.  The block is not zeroed.
+/// @param pool The pool to allocate from
+/// @return The block's address, which is also its physical (bus) address
+void* dma_pool_alloc(dma_pool_t* pool)
+{
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&pool->lock, 1));
+	if (pool->free_list == NULL)
+		dma_pool_grow(pool);
+	void* block = pool->free_list;
+	pool->free_list = *(void**)block;
+	pool->free_count--;
+	__sync_lock_release(&pool->lock);
+	interrupts_restore(flags);
+	return block;
+}
+
+/// @brief Return a block to the DMA pool it was allocated from
+/// @param pool The pool the block was allocated from
+/// @param block The block to free
+void dma_pool_free(dma_pool_t* pool, void* block)
+{
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&pool->lock, 1));
+	*(void**)block = pool->free_list;
+	pool->free_list = block;
+	pool->free_count++;
+	__sync_lock_release(&pool->lock);
+	interrupts_restore(flags);
+}
@@ -1,29 +1,52 @@
 #include "kmalloc.h"
 #include "allocator.h"
+#include "buddy.h"
+#include "zeropool.h"
+#include "allocstats.h"
 #include "paging.h"
 #include "memset.h"
 #include "serial_logging.h"
 #include "panic.h"
 
-uint64_t kFreeCallCount=0;
-#define KFREE_COMPACT_FREQUENCY 10
-void kmalloc_common(uint64_t physical_address, uint64_t virtual_address, uint64_t length)
+static void *kmalloc_dma_internal(uint64_t length, uint32_t zone);
+
+static inline uint64_t round_up_to_page(uint64_t length)
+{
+	return length?(length + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1):PAGE_SIZE;
+}
+
+//All of RAM is mapped into the HHDM by init_os64_paging_tables, so there's nothing to map here, just zero the memory
+void kmalloc_common(uint64_t virtual_address, uint64_t length)
 {
-	uint64_t page_count = length / PAGE_SIZE;
-	if (length % PAGE_SIZE != 0)
-		page_count++;
-	if (virtual_address % PAGE_SIZE)
-		page_count++;
-	paging_map_pages((pt_entry_t*)kKernelPML4v, virtual_address & PAGE_ADDRESS_MASK, physical_address & PAGE_ADDRESS_MASK, page_count, PAGE_PRESENT | PAGE_WRITE);
 	memset((void*)virtual_address, 0, length);
 }
 
 // Allocate aligned memory for the kernel
 void *kmalloc_aligned(uint64_t length)
 {
+	allocstats_record_alloc(round_up_to_page(length), (uintptr_t)__builtin_return_address(0));
+	//Single pages come from the pre-zeroed pool when possible, those are already mapped and zeroed
+	if (length <= PAGE_SIZE)
+	{
+		uint64_t addr = zero_pool_get_page();
+		if (addr)
+			return (void*)(addr + kHHDMOffset);
+	}
 	uint64_t addr = allocate_memory_aligned(length);
 	uint64_t virtual_address = addr + kHHDMOffset;
-	kmalloc_common(addr, virtual_address, length);
+	kmalloc_common(virtual_address, length);
+	return (void*)virtual_address;
+}
+
+/// @brief Same as kmalloc_aligned, with the pages coming from NUMA node when it has room
+/// @param length Bytes to allocate, rounded up to whole pages
+/// @param node The preferred node, i.e. numa_cpu_node() of the CPU which will use the memory
+void *kmalloc_aligned_node(uint64_t length, uint32_t node)
+{
+	allocstats_record_alloc(round_up_to_page(length), (uintptr_t)__builtin_return_address(0));
+	//The zero pool isn't node aware so it can't be used here
+	uint64_t virtual_address = allocate_memory_aligned_node(length, MEMORY_ZONE_NORMAL, node) + kHHDMOffset;
+	kmalloc_common(virtual_address, length);
 	return (void*)virtual_address;
 }
 
@@ -32,9 +55,11 @@ void *kmalloc(uint64_t length)
 {
 	if (length==0)
 		panic("kmalloc: Attempt to allocate 0 bytes is invalid\n");
+	//Same rounding as allocate_memory so the live byte count balances on kfree
+	allocstats_record_alloc((length + 7) & ~((uint64_t)7), (uintptr_t)__builtin_return_address(0));
 	uint64_t addr = allocate_memory(length);
 	uint64_t virtual_address = addr + kHHDMOffset;
-	kmalloc_common(addr, virtual_address, length);
+	kmalloc_common(virtual_address, length);
 	return (void*)virtual_address;
 }
 
@@ -43,12 +68,43 @@ void *kmalloc(uint64_t length)
 /// @return 
 void *kmalloc_dma(uint64_t length)
 {
-	printd(DEBUG_KMALLOC,"kmalloc_dma: Allocating %lu bytes\n", length);
+	allocstats_record_alloc(round_up_to_page(length), (uintptr_t)__builtin_return_address(0));
+	return kmalloc_dma_internal(length, MEMORY_ZONE_NORMAL);
+}
+
+/// @brief Same as kmalloc_dma except the memory is guaranteed to be below 4GB, for devices limited to 32-bit DMA addresses
+void *kmalloc_dma32(uint64_t length)
+{
+	allocstats_record_alloc(round_up_to_page(length), (uintptr_t)__builtin_return_address(0));
+	return kmalloc_dma_internal(length, MEMORY_ZONE_DMA32);
+}
+
+/// @brief Same as kmalloc_dma, with the memory coming from zone or below
+void *kmalloc_dma_zone(uint64_t length, uint32_t zone)
+{
+	allocstats_record_alloc(round_up_to_page(length), (uintptr_t)__builtin_return_address(0));
+	return kmalloc_dma_internal(length, zone);
+}
+
+static void *kmalloc_dma_internal(uint64_t length, uint32_t zone)
+{
+	printd(DEBUG_KMALLOC,"kmalloc_dma: Allocating %lu bytes from zone %u\n", length, zone);
 	
 	int a=0;
 	if (length >= 0x2000000)
 		a++;
-	uint64_t addr = allocate_memory_aligned(length);
+	//The zero pool isn't zone aware, so only unrestricted requests can use it
+	uint64_t addr = (length <= PAGE_SIZE && zone == MEMORY_ZONE_NORMAL)?zero_pool_get_page():0;
+	if (addr)
+	{
+		//The page was zeroed through the cacheable HHDM mapping, so flush it before it is accessed uncached
+		for (uint64_t line = 0; line < PAGE_SIZE; line += 64)
+			__asm__ volatile("clflush [%0]" : : "r"(addr + kHHDMOffset + line) : "memory");
+		paging_map_pages((pt_entry_t*)kKernelPML4v, addr, addr, 1, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
+		printd(DEBUG_KMALLOC,"kmalloc_dma: returning pre-zeroed page 0x%016lx ...\n", addr);
+		return (void*)(uintptr_t)addr;
+	}
+	addr = allocate_memory_aligned_zone(length, zone);
 	uint64_t page_count = length / PAGE_SIZE;
 	if (length % PAGE_SIZE != 0)
 		page_count++;
@@ -66,13 +122,14 @@ void *kmalloc_dma(uint64_t length)
 
 void *kmalloc_dma32_address(uint32_t address, uint64_t length)
 {
+	//buddy_alloc_pages_at only hands out whole pages starting at the page the address is in
+	allocstats_record_alloc(round_up_to_page(length + (address & (PAGE_SIZE - 1))), (uintptr_t)__builtin_return_address(0));
 	uint64_t addr = allocate_memory_at_address(address, length, true);
-	uint64_t page_count = length / PAGE_SIZE;
-	if (length % PAGE_SIZE != 0)
-		page_count++;
+	uint64_t page_count = round_up_to_page(length + (address - addr)) / PAGE_SIZE;
 	paging_map_pages((pt_entry_t*)kKernelPML4v, addr, addr, page_count, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
 	memset((void*)(uintptr_t)address, 0, length);
-	return (void*)(uintptr_t)address;
+	//The page start, not address, is what kfree needs back
+	return (void*)(uintptr_t)addr;
 }
 
 void kfree(void *address) 
@@ -81,12 +138,10 @@ void kfree(void *address)
     // Free the allocation (remove the HHDM offset from the address when freeing it)
 	printd(DEBUG_KMALLOC, "KMALLOC: Freeing address 0x%016lx (0x%016lx)\n",address, physicalAddress);
 
+	allocstats_record_free(allocation_size(physicalAddress));
 	uint64_t idx = free_memory(physicalAddress);
 	if (idx==0xFFFFFFFF)
 		panic("kFree: free_memory returned 0xFFFFFFFF indicating it could not find the block of memory to free for physical address 0x%016lx\n",physicalAddress);
-    merge_freed_block(idx);
-	if (++kFreeCallCount%KFREE_COMPACT_FREQUENCY==0)
-		compact_memory_array();
 #ifdef KMALLOC_CLEAR_FREED_POINTERS
 	address = (void*)0xBADBADBA;
 #endif
@@ -1,6 +1,10 @@
 #include "strings.h"
 
 #include <stddef.h>  // For size_t
+#include "memory/memcmp.h"
+#include "strings/strword.h"
+#include "strings/strsimd.h"
+#include "fpu.h"
 
 ///@brief Compare two blocks of memory byte by byte.
  /// This function compares the first `num` bytes of the memory areas pointed to by
@@ -16,9 +20,29 @@
  ///         than the corresponding byte in `ptr2`.
  ///         Returns 0 if the memory blocks are identical for the first `num` bytes.
  int memcmp(const void *ptr1, const void *ptr2, size_t num) {
+    int result;
+
+    // Long compares (page and sector contents) go to the vector routine
+    if (num < STRINGS_SIMD_THRESHOLD || kMemcmpSimd == NULL || !kernel_fpu_usable())
+        return memcmp_word(ptr1, ptr2, num);
+    kernel_fpu_begin();
+    result = kMemcmpSimd(ptr1, ptr2, num);
+    kernel_fpu_end();
+    return result;
+}
+
+// Compares 8 bytes at a time, the lowest set bit of the XOR of two words is in the first byte that differs
+int memcmp_word(const void *ptr1, const void *ptr2, size_t num) {
     const unsigned char *a = (const unsigned char *)ptr1;
     const unsigned char *b = (const unsigned char *)ptr2;
 
+    for (; num >= 8; num -= 8, a += 8, b += 8) {
+        uint64_t diff = *(const strword_unaligned_t *)a ^ *(const strword_unaligned_t *)b;
+        if (diff) {
+            int index = STRWORD_FIRST_BYTE(diff);
+            return (int)a[index] - (int)b[index];
+        }
+    }
     for (size_t i = 0; i < num; i++) {
         if (a[i] != b[i]) {
             return (int)a[i] - (int)b[i];  // Return the difference between the first mismatched bytes
@@ -1,6 +1,47 @@
 #include "memory/memcpy.h"
+#include "memory/memops.h"
+#include "fpu.h"
 
-void *memcpy(void *dest1, const void *src1, size_t len) {
+//Picked by memops_init from the CPU's features, these are safe on any x86_64 CPU until then.  The kernel is built with
+//-mgeneral-regs-only, so the compiler never keeps anything in the vector registers the asm below uses.
+memops_copy_t kMemcpyBlock = memcpy_sse2;
+memops_copy_t kMemcpyNonTemporal = NULL;
+memops_move_t kMemmoveBackward = memmove_backward_sse2;
+size_t kMemcpyStringThreshold = SIZE_MAX;
+
+// The vector routines use the SSE/AVX registers, so they run between kernel_fpu_begin and kernel_fpu_end.  Where that
+// isn't allowed (a fault taken inside another section) the qword loop is used instead.
+void *memcpy(void *dest, const void *src, size_t len) {
+    memops_copy_t copy = NULL;
+
+    if (len >= MEMOPS_NON_TEMPORAL_THRESHOLD && kMemcpyNonTemporal != NULL)
+        copy = kMemcpyNonTemporal;
+    else if (len >= kMemcpyStringThreshold)
+        return memcpy_erms(dest, src, len);
+    else if (len >= MEMOPS_SMALL_SIZE)
+        copy = kMemcpyBlock;
+    if (copy == NULL || !kernel_fpu_usable())
+        return memcpy_qword(dest, src, len);
+    kernel_fpu_begin();
+    copy(dest, src, len);
+    kernel_fpu_end();
+    return dest;
+}
+
+void memmove(void *dest, const void *src, size_t n) {
+    // Copying forward is safe unless dest starts inside src
+    if ((uintptr_t)dest <= (uintptr_t)src || (uintptr_t)dest >= (uintptr_t)src + n)
+        memcpy(dest, src, n);
+    else if (n < MEMOPS_SMALL_SIZE || !kernel_fpu_usable())
+        memmove_backward_qword(dest, src, n);
+    else {
+        kernel_fpu_begin();
+        kMemmoveBackward(dest, src, n);
+        kernel_fpu_end();
+    }
+}
+
+void *memcpy_qword(void *dest1, const void *src1, size_t len) {
     uint8_t *dest = (uint8_t *)dest1;
     const uint8_t *src = (const uint8_t *)src1;
 
@@ -10,27 +51,9 @@ void *memcpy(void *dest1, const void *src1, size_t len) {
         len--;
     }
 
-    // Main loop: copy memory 8 bytes at a time, with page boundary checks once per page
-    while (len >= 8) {
-        // Calculate the remaining bytes in the current page
-        size_t bytes_to_page_end = PAGE_SIZE - ((uintptr_t)dest & (PAGE_SIZE - 1));
-
-        // Copy as many 8-byte chunks as possible within the page
-        size_t chunk_len = (len < bytes_to_page_end) ? len : bytes_to_page_end;
-        uint64_t *dest64 = (uint64_t *)dest;
-        const uint64_t *src64 = (const uint64_t *)src;
-
-        // Copy in 8-byte chunks until we reach the end of the page or the specified length
-        while (chunk_len >= 8) {
-            *dest64++ = *src64++;
-            chunk_len -= 8;
-            len -= 8;
-        }
-
-        // Move the pointers to the next position after the chunks
-        dest = (uint8_t *)dest64;
-        src = (const uint8_t *)src64;
-    }
+    // Main loop: copy memory 8 bytes at a time
+    for (; len >= 8; len -= 8, dest += 8, src += 8)
+        *(uint64_t *)dest = *(const uint64_t *)src;
 
     // Handle remaining bytes one at a time
     while (len--) {
@@ -40,16 +63,206 @@ void *memcpy(void *dest1, const void *src1, size_t len) {
     return dest1;
 }
 
-void memmove(void *dest, const void *src, size_t n) {
-    if (dest < src) {
-        // No overlap or safe to copy forward
-        memcpy(dest, src, n);
-    } else {
-        // Overlap: Copy backward
-        unsigned char *d = (unsigned char *)dest + n;
-        const unsigned char *s = (const unsigned char *)src + n;
-        while (n--) {
-            *(--d) = *(--s);
-        }
+// Microcoded string copy, with ERMS it moves whole cache lines at a time
+void *memcpy_erms(void *dest, const void *src, size_t len) {
+    void *d = dest;
+
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(len) : : "memory");
+    return dest;
+}
+
+void *memcpy_sse2(void *dest, const void *src, size_t len) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    // 64 bytes per iteration, all four loads are done before the stores so forward overlapping moves are safe
+    if (len >= 64) {
+        __asm__ __volatile__(
+            "1:\n\t"
+            "movdqu xmm0, [%1]\n\t"
+            "movdqu xmm1, [%1 + 16]\n\t"
+            "movdqu xmm2, [%1 + 32]\n\t"
+            "movdqu xmm3, [%1 + 48]\n\t"
+            "movdqu [%0], xmm0\n\t"
+            "movdqu [%0 + 16], xmm1\n\t"
+            "movdqu [%0 + 32], xmm2\n\t"
+            "movdqu [%0 + 48], xmm3\n\t"
+            "add %0, 64\n\t"
+            "add %1, 64\n\t"
+            "sub %2, 64\n\t"
+            "cmp %2, 64\n\t"
+            "jae 1b\n\t"
+            : "+r"(d), "+r"(s), "+r"(len) : : "memory", "cc");
+    }
+    memcpy_qword(d, s, len);
+    return dest;
+}
+
+void *memcpy_avx2(void *dest, const void *src, size_t len) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if (len >= 128) {
+        __asm__ __volatile__(
+            "1:\n\t"
+            "vmovdqu ymm0, [%1]\n\t"
+            "vmovdqu ymm1, [%1 + 32]\n\t"
+            "vmovdqu ymm2, [%1 + 64]\n\t"
+            "vmovdqu ymm3, [%1 + 96]\n\t"
+            "vmovdqu [%0], ymm0\n\t"
+            "vmovdqu [%0 + 32], ymm1\n\t"
+            "vmovdqu [%0 + 64], ymm2\n\t"
+            "vmovdqu [%0 + 96], ymm3\n\t"
+            "add %0, 128\n\t"
+            "add %1, 128\n\t"
+            "sub %2, 128\n\t"
+            "cmp %2, 128\n\t"
+            "jae 1b\n\t"
+            // Dirty upper halves make later SSE instructions pay a transition penalty
+            "vzeroupper\n\t"
+            : "+r"(d), "+r"(s), "+r"(len) : : "memory", "cc");
+    }
+    memcpy_sse2(d, s, len);
+    return dest;
+}
+
+// Non-temporal stores go around the cache, dest is aligned first since movntdq needs it
+void *memcpy_sse2_nt(void *dest, const void *src, size_t len) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    if (len < head + 64)
+        return memcpy_sse2(dest, src, len);
+    memcpy_qword(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    __asm__ __volatile__(
+        "1:\n\t"
+        "prefetchnta [%1 + 512]\n\t"
+        "movdqu xmm0, [%1]\n\t"
+        "movdqu xmm1, [%1 + 16]\n\t"
+        "movdqu xmm2, [%1 + 32]\n\t"
+        "movdqu xmm3, [%1 + 48]\n\t"
+        "movntdq [%0], xmm0\n\t"
+        "movntdq [%0 + 16], xmm1\n\t"
+        "movntdq [%0 + 32], xmm2\n\t"
+        "movntdq [%0 + 48], xmm3\n\t"
+        "add %0, 64\n\t"
+        "add %1, 64\n\t"
+        "sub %2, 64\n\t"
+        "cmp %2, 64\n\t"
+        "jae 1b\n\t"
+        // Non-temporal stores are weakly ordered, make them visible before anything that follows
+        "sfence\n\t"
+        : "+r"(d), "+r"(s), "+r"(len) : : "memory", "cc");
+    memcpy_qword(d, s, len);
+    return dest;
+}
+
+void *memcpy_avx2_nt(void *dest, const void *src, size_t len) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+    if (len < head + 128)
+        return memcpy_avx2(dest, src, len);
+    memcpy_qword(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    __asm__ __volatile__(
+        "1:\n\t"
+        "prefetchnta [%1 + 512]\n\t"
+        "vmovdqu ymm0, [%1]\n\t"
+        "vmovdqu ymm1, [%1 + 32]\n\t"
+        "vmovdqu ymm2, [%1 + 64]\n\t"
+        "vmovdqu ymm3, [%1 + 96]\n\t"
+        "vmovntdq [%0], ymm0\n\t"
+        "vmovntdq [%0 + 32], ymm1\n\t"
+        "vmovntdq [%0 + 64], ymm2\n\t"
+        "vmovntdq [%0 + 96], ymm3\n\t"
+        "add %0, 128\n\t"
+        "add %1, 128\n\t"
+        "sub %2, 128\n\t"
+        "cmp %2, 128\n\t"
+        "jae 1b\n\t"
+        "sfence\n\t"
+        "vzeroupper\n\t"
+        : "+r"(d), "+r"(s), "+r"(len) : : "memory", "cc");
+    memcpy_sse2(d, s, len);
+    return dest;
+}
+
+// Backward copies for memmove when dest overlaps the end of src.  Each one copies from the top down, loading a whole
+// block before storing it, so a store never lands on source bytes which haven't been read yet.
+void memmove_backward_qword(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest + n;
+    const uint8_t *s = (const uint8_t *)src + n;
+
+    while (((uintptr_t)d & 7) && n) {
+        *(--d) = *(--s);
+        n--;
+    }
+    for (; n >= 8; n -= 8) {
+        d -= 8;
+        s -= 8;
+        *(uint64_t *)d = *(const uint64_t *)s;
+    }
+    while (n--) {
+        *(--d) = *(--s);
+    }
+}
+
+void memmove_backward_sse2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest + n;
+    const uint8_t *s = (const uint8_t *)src + n;
+
+    if (n >= 64) {
+        __asm__ __volatile__(
+            "1:\n\t"
+            "sub %0, 64\n\t"
+            "sub %1, 64\n\t"
+            "movdqu xmm0, [%1]\n\t"
+            "movdqu xmm1, [%1 + 16]\n\t"
+            "movdqu xmm2, [%1 + 32]\n\t"
+            "movdqu xmm3, [%1 + 48]\n\t"
+            "movdqu [%0], xmm0\n\t"
+            "movdqu [%0 + 16], xmm1\n\t"
+            "movdqu [%0 + 32], xmm2\n\t"
+            "movdqu [%0 + 48], xmm3\n\t"
+            "sub %2, 64\n\t"
+            "cmp %2, 64\n\t"
+            "jae 1b\n\t"
+            : "+r"(d), "+r"(s), "+r"(n) : : "memory", "cc");
+    }
+    // What's left is the first n bytes
+    memmove_backward_qword(dest, src, n);
+}
+
+void memmove_backward_avx2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest + n;
+    const uint8_t *s = (const uint8_t *)src + n;
+
+    if (n >= 128) {
+        __asm__ __volatile__(
+            "1:\n\t"
+            "sub %0, 128\n\t"
+            "sub %1, 128\n\t"
+            "vmovdqu ymm0, [%1]\n\t"
+            "vmovdqu ymm1, [%1 + 32]\n\t"
+            "vmovdqu ymm2, [%1 + 64]\n\t"
+            "vmovdqu ymm3, [%1 + 96]\n\t"
+            "vmovdqu [%0], ymm0\n\t"
+            "vmovdqu [%0 + 32], ymm1\n\t"
+            "vmovdqu [%0 + 64], ymm2\n\t"
+            "vmovdqu [%0 + 96], ymm3\n\t"
+            "sub %2, 128\n\t"
+            "cmp %2, 128\n\t"
+            "jae 1b\n\t"
+            "vzeroupper\n\t"
+            : "+r"(d), "+r"(s), "+r"(n) : : "memory", "cc");
     }
+    memmove_backward_sse2(dest, src, n);
 }
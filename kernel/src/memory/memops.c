@@ -0,0 +1,63 @@
+#include "memops.h"
+#include "driver/system/cpudet.h"
+#include "fpu.h"
+#include "serial_logging.h"
+
+//MEMOPS_FEATURE_* of the CPU, filled in by memops_init
+uint32_t kMemopsFeatures = MEMOPS_FEATURE_SSE2;
+
+memops_variant_t kMemopsVariants[] =
+{
+	{"qword", 0, memcpy_qword, memset_qword, memmove_backward_qword},
+	{"erms", MEMOPS_FEATURE_ERMS, memcpy_erms, memset_erms, NULL},
+	{"sse2", MEMOPS_FEATURE_SSE2, memcpy_sse2, memset_sse2, memmove_backward_sse2},
+	{"avx2", MEMOPS_FEATURE_AVX2, memcpy_avx2, memset_avx2, memmove_backward_avx2},
+	{"sse2-nt", MEMOPS_FEATURE_SSE2, memcpy_sse2_nt, memset_sse2_nt, NULL},
+	{"avx2-nt", MEMOPS_FEATURE_AVX2, memcpy_avx2_nt, memset_avx2_nt, NULL},
+};
+const uint32_t kMemopsVariantCount = sizeof(kMemopsVariants) / sizeof(kMemopsVariants[0]);
+
+bool memops_variant_supported(const memops_variant_t* variant)
+{
+	return (variant->features & kMemopsFeatures) == variant->features;
+}
+
+/// @brief Pick the copy, fill and move routines for this CPU.  Called after fpu_init, until then the SSE2 routines (which
+/// every x86_64 CPU has) are picked, though memcpy and memset use the qword loops until kernel_fpu_begin can be called.
+void memops_init()
+{
+	kMemopsFeatures = MEMOPS_FEATURE_SSE2;
+	if (kCPUFeatures.cpuid_extended_feature_bits_3.erms)
+		kMemopsFeatures |= MEMOPS_FEATURE_ERMS;
+	if (kCPUFeatures.cpuid_extended_feature_bits_4.fsrm)
+		kMemopsFeatures |= MEMOPS_FEATURE_FSRM;
+	//The ymm registers can only be used once fpu_init has enabled AVX state in XCR0
+	if (kCPUFeatures.cpuid_extended_feature_bits_3.avx2 && (kFPUXCR0 & XCR0_AVX))
+		kMemopsFeatures |= MEMOPS_FEATURE_AVX2;
+
+	if (kMemopsFeatures & MEMOPS_FEATURE_AVX2)
+	{
+		kMemcpyBlock = memcpy_avx2;
+		kMemcpyNonTemporal = memcpy_avx2_nt;
+		kMemmoveBackward = memmove_backward_avx2;
+		kMemsetBlock = memset_avx2;
+		kMemsetNonTemporal = memset_avx2_nt;
+	}
+	else
+	{
+		kMemcpyBlock = memcpy_sse2;
+		kMemcpyNonTemporal = memcpy_sse2_nt;
+		kMemmoveBackward = memmove_backward_sse2;
+		kMemsetBlock = memset_sse2;
+		kMemsetNonTemporal = memset_sse2_nt;
+	}
+	//FSRM makes rep movsb cheap to start, even for short copies
+	if (kMemopsFeatures & MEMOPS_FEATURE_FSRM)
+		kMemcpyStringThreshold = MEMOPS_SMALL_SIZE;
+	else if (kMemopsFeatures & MEMOPS_FEATURE_ERMS)
+		kMemcpyStringThreshold = MEMOPS_ERMS_THRESHOLD;
+	if (kMemopsFeatures & MEMOPS_FEATURE_ERMS)
+		kMemsetStringThreshold = MEMOPS_ERMS_THRESHOLD;
+	printd(DEBUG_BOOT, "MEMOPS: %s block copy, rep movsb from 0x%lx bytes, rep stosb from 0x%lx bytes\n",
+			(kMemopsFeatures & MEMOPS_FEATURE_AVX2)?"AVX2":"SSE2", kMemcpyStringThreshold, kMemsetStringThreshold);
+}
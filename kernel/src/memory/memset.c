@@ -1,17 +1,44 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#include <stdint.h>
-#include <stddef.h>
+#include "memory/memset.h"
+#include "memory/memops.h"
+#include "fpu.h"
 
-#define PAGE_SIZE 4096
+//Picked by memops_init from the CPU's features, these are safe on any x86_64 CPU until then
+memops_fill_t kMemsetBlock = memset_sse2;
+memops_fill_t kMemsetNonTemporal = NULL;
+size_t kMemsetStringThreshold = SIZE_MAX;
 
-void *memset(void *d1, int val, size_t len) {
-    uint8_t *d = d1;
+static inline uint64_t memset_pattern(int val) {
     uint64_t val64 = (uint64_t)(val & 0xFF);
     val64 |= val64 << 8;
     val64 |= val64 << 16;
     val64 |= val64 << 32;
+    return val64;
+}
+
+// Like memcpy, the vector routines only run between kernel_fpu_begin and kernel_fpu_end
+void *memset(void *d1, int val, size_t len) {
+    memops_fill_t fill = NULL;
+
+    if (len >= MEMOPS_NON_TEMPORAL_THRESHOLD && kMemsetNonTemporal != NULL)
+        fill = kMemsetNonTemporal;
+    else if (len >= kMemsetStringThreshold)
+        return memset_erms(d1, val, len);
+    else if (len >= MEMOPS_SMALL_SIZE)
+        fill = kMemsetBlock;
+    if (fill == NULL || !kernel_fpu_usable())
+        return memset_qword(d1, val, len);
+    kernel_fpu_begin();
+    fill(d1, val, len);
+    kernel_fpu_end();
+    return d1;
+}
+
+void *memset_qword(void *d1, int val, size_t len) {
+    uint8_t *d = d1;
+    uint64_t val64 = memset_pattern(val);
 
     // Handle unaligned start
     while (((uintptr_t)d & 7) && len) {
@@ -19,30 +46,121 @@ void *memset(void *d1, int val, size_t len) {
         len--;
     }
 
-    // Main loop: set memory 8 bytes at a time, with page boundary checks once per page
-    while (len >= 8) {
-        // Calculate the remaining bytes in the current page
-        size_t bytes_to_page_end = PAGE_SIZE - ((uintptr_t)d & (PAGE_SIZE - 1));
+    // Main loop: set memory 8 bytes at a time
+    for (; len >= 8; len -= 8, d += 8)
+        *(uint64_t *)d = val64;
+
+    // Handle remaining bytes one at a time
+    while (len--) {
+        *d++ = (uint8_t)val;
+    }
+
+    return d1;
+}
+
+void *memset_erms(void *d1, int val, size_t len) {
+    void *d = d1;
 
-        // Copy as many 8-byte chunks as possible within the page
-        size_t chunk_len = (len < bytes_to_page_end) ? len : bytes_to_page_end;
-        uint64_t *d64 = (uint64_t *)d;
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(len) : "a"(val) : "memory");
+    return d1;
+}
 
-        // Copy in 8-byte chunks until we reach the end of the page or the specified length
-        while (chunk_len >= 8) {
-            *d64++ = val64;
-            chunk_len -= 8;
-            len -= 8;
-        }
+void *memset_sse2(void *d1, int val, size_t len) {
+    uint8_t *d = d1;
 
-        // Move the pointer to the next position after the chunks
-        d = (uint8_t *)d64;
+    if (len >= 64) {
+        __asm__ __volatile__(
+            "movq xmm0, %2\n\t"
+            "punpcklqdq xmm0, xmm0\n\t"
+            "1:\n\t"
+            "movdqu [%0], xmm0\n\t"
+            "movdqu [%0 + 16], xmm0\n\t"
+            "movdqu [%0 + 32], xmm0\n\t"
+            "movdqu [%0 + 48], xmm0\n\t"
+            "add %0, 64\n\t"
+            "sub %1, 64\n\t"
+            "cmp %1, 64\n\t"
+            "jae 1b\n\t"
+            : "+r"(d), "+r"(len) : "r"(memset_pattern(val)) : "memory", "cc");
     }
+    memset_qword(d, val, len);
+    return d1;
+}
 
-    // Handle remaining bytes one at a time
-    while (len--) {
-        *d++ = (uint8_t)val;
+void *memset_avx2(void *d1, int val, size_t len) {
+    uint8_t *d = d1;
+
+    if (len >= 128) {
+        __asm__ __volatile__(
+            "vmovq xmm0, %2\n\t"
+            "vpbroadcastq ymm0, xmm0\n\t"
+            "1:\n\t"
+            "vmovdqu [%0], ymm0\n\t"
+            "vmovdqu [%0 + 32], ymm0\n\t"
+            "vmovdqu [%0 + 64], ymm0\n\t"
+            "vmovdqu [%0 + 96], ymm0\n\t"
+            "add %0, 128\n\t"
+            "sub %1, 128\n\t"
+            "cmp %1, 128\n\t"
+            "jae 1b\n\t"
+            "vzeroupper\n\t"
+            : "+r"(d), "+r"(len) : "r"(memset_pattern(val)) : "memory", "cc");
     }
+    memset_sse2(d, val, len);
+    return d1;
+}
+
+void *memset_sse2_nt(void *d1, int val, size_t len) {
+    uint8_t *d = d1;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    if (len < head + 64)
+        return memset_sse2(d1, val, len);
+    memset_qword(d, val, head);
+    d += head;
+    len -= head;
+    __asm__ __volatile__(
+        "movq xmm0, %2\n\t"
+        "punpcklqdq xmm0, xmm0\n\t"
+        "1:\n\t"
+        "movntdq [%0], xmm0\n\t"
+        "movntdq [%0 + 16], xmm0\n\t"
+        "movntdq [%0 + 32], xmm0\n\t"
+        "movntdq [%0 + 48], xmm0\n\t"
+        "add %0, 64\n\t"
+        "sub %1, 64\n\t"
+        "cmp %1, 64\n\t"
+        "jae 1b\n\t"
+        "sfence\n\t"
+        : "+r"(d), "+r"(len) : "r"(memset_pattern(val)) : "memory", "cc");
+    memset_qword(d, val, len);
+    return d1;
+}
+
+void *memset_avx2_nt(void *d1, int val, size_t len) {
+    uint8_t *d = d1;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
 
+    if (len < head + 128)
+        return memset_avx2(d1, val, len);
+    memset_qword(d, val, head);
+    d += head;
+    len -= head;
+    __asm__ __volatile__(
+        "vmovq xmm0, %2\n\t"
+        "vpbroadcastq ymm0, xmm0\n\t"
+        "1:\n\t"
+        "vmovntdq [%0], ymm0\n\t"
+        "vmovntdq [%0 + 32], ymm0\n\t"
+        "vmovntdq [%0 + 64], ymm0\n\t"
+        "vmovntdq [%0 + 96], ymm0\n\t"
+        "add %0, 128\n\t"
+        "sub %1, 128\n\t"
+        "cmp %1, 128\n\t"
+        "jae 1b\n\t"
+        "sfence\n\t"
+        "vzeroupper\n\t"
+        : "+r"(d), "+r"(len) : "r"(memset_pattern(val)) : "memory", "cc");
+    memset_sse2(d, val, len);
     return d1;
 }
@@ -0,0 +1,185 @@
+#include "CONFIG.h"
+#include "numa.h"
+#include "acpi.h"
+#include "buddy.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+
+//Until an SRAT is parsed everything is node 0
+uint32_t kNumaNodeCount = 1;
+uint32_t kNumaProximityDomain[NUMA_MAX_NODES];
+numa_memory_range_t kNumaMemoryRanges[NUMA_MAX_MEMORY_RANGES];
+uint32_t kNumaMemoryRangeCount = 0;
+uint8_t kNumaCpuNode[NUMA_MAX_APIC_ID];
+uint8_t kNumaDistance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+uint8_t kNumaFallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+bool kNumaSRATParsed = false;
+
+//Map an ACPI proximity domain to a node number, assigning the next node if the domain hasn't been seen yet
+static int numa_node_for_domain(uint32_t domain)
+{
+	for (uint32_t node = 0; node < kNumaNodeCount; node++)
+		if (kNumaProximityDomain[node] == domain)
+			return node;
+	if (kNumaNodeCount == NUMA_MAX_NODES)
+	{
+		printd(DEBUG_ACPI, "NUMA: Proximity domain %u ignored, NUMA_MAX_NODES is %u\n", domain, NUMA_MAX_NODES);
+		return -1;
+	}
+	kNumaProximityDomain[kNumaNodeCount] = domain;
+	return kNumaNodeCount++;
+}
+
+/// @brief Build the CPU and memory range to node maps from the ACPI SRAT
+/// @param srat The SRAT table, NULL if the firmware didn't provide one
+void numa_parse_srat(void* srat)
+{
+	acpi_srat_table_t* table = srat;
+	int node;
+
+	if (table == NULL)
+		return;
+
+	kNumaNodeCount = 0;
+	uintptr_t entry = (uintptr_t)table + sizeof(acpi_srat_table_t);
+	while (entry < (uintptr_t)table + table->header.Length)
+	{
+		uint8_t type = *(uint8_t*)entry;
+		uint8_t length = *(uint8_t*)(entry + 1);
+
+		if (length == 0)
+			break;
+		if (type == SRAT_TYPE_PROCESSOR_AFFINITY)
+		{
+			acpi_srat_processor_affinity_t* cpu = (acpi_srat_processor_affinity_t*)entry;
+			uint32_t domain = cpu->proximity_domain_lo | (cpu->proximity_domain_hi[0] << 8) | (cpu->proximity_domain_hi[1] << 16) | (cpu->proximity_domain_hi[2] << 24);
+			if ((cpu->flags & SRAT_AFFINITY_ENABLED) && (node = numa_node_for_domain(domain)) >= 0)
+			{
+				kNumaCpuNode[cpu->apic_id] = node;
+				printd(DEBUG_ACPI | DEBUG_DETAILED, "NUMA: APIC ID %u is in proximity domain %u (node %u)\n", cpu->apic_id, domain, node);
+			}
+		}
+		else if (type == SRAT_TYPE_X2APIC_AFFINITY)
+		{
+			acpi_srat_x2apic_affinity_t* cpu = (acpi_srat_x2apic_affinity_t*)entry;
+			if ((cpu->flags & SRAT_AFFINITY_ENABLED) && cpu->x2apic_id < NUMA_MAX_APIC_ID && (node = numa_node_for_domain(cpu->proximity_domain)) >= 0)
+			{
+				kNumaCpuNode[cpu->x2apic_id] = node;
+				printd(DEBUG_ACPI | DEBUG_DETAILED, "NUMA: x2APIC ID %u is in proximity domain %u (node %u)\n", cpu->x2apic_id, cpu->proximity_domain, node);
+			}
+		}
+		else if (type == SRAT_TYPE_MEMORY_AFFINITY)
+		{
+			acpi_srat_memory_affinity_t* mem = (acpi_srat_memory_affinity_t*)entry;
+			if ((mem->flags & SRAT_AFFINITY_ENABLED) && mem->length_bytes && (node = numa_node_for_domain(mem->proximity_domain)) >= 0)
+			{
+				if (kNumaMemoryRangeCount == NUMA_MAX_MEMORY_RANGES)
+					printd(DEBUG_ACPI, "NUMA: Memory range 0x%016lx ignored, NUMA_MAX_MEMORY_RANGES is %u\n", mem->base_address, NUMA_MAX_MEMORY_RANGES);
+				else
+				{
+					kNumaMemoryRanges[kNumaMemoryRangeCount].base = mem->base_address;
+					kNumaMemoryRanges[kNumaMemoryRangeCount].end = mem->base_address + mem->length_bytes;
+					kNumaMemoryRanges[kNumaMemoryRangeCount].node = node;
+					kNumaMemoryRangeCount++;
+					printd(DEBUG_ACPI | DEBUG_DETAILED, "NUMA: Memory 0x%016lx-0x%016lx is in proximity domain %u (node %u)\n",
+							mem->base_address, mem->base_address + mem->length_bytes, mem->proximity_domain, node);
+				}
+			}
+		}
+		entry += length;
+	}
+	//An SRAT with no enabled entries is the same as no SRAT
+	if (kNumaNodeCount == 0)
+	{
+		kNumaNodeCount = 1;
+		return;
+	}
+	kNumaSRATParsed = true;
+	printd(DEBUG_ACPI, "NUMA: SRAT describes %u nodes and %u memory ranges\n", kNumaNodeCount, kNumaMemoryRangeCount);
+}
+
+/// @brief Load the node distance matrix from the ACPI SLIT
+/// @param slit The SLIT table, NULL if the firmware didn't provide one
+void numa_parse_slit(void* slit)
+{
+	acpi_slit_table_t* table = slit;
+
+	if (table == NULL || !kNumaSRATParsed)
+		return;
+
+	for (uint32_t from = 0; from < kNumaNodeCount; from++)
+		for (uint32_t to = 0; to < kNumaNodeCount; to++)
+			if (kNumaProximityDomain[from] < table->locality_count && kNumaProximityDomain[to] < table->locality_count)
+				kNumaDistance[from][to] = table->entries[kNumaProximityDomain[from] * table->locality_count + kNumaProximityDomain[to]];
+	printd(DEBUG_ACPI, "NUMA: SLIT has %u localities\n", table->locality_count);
+}
+
+/// @brief Build the per-node fallback order and split the buddy free lists by node.  Call after numa_parse_srat/numa_parse_slit.
+void numa_init()
+{
+	for (uint32_t from = 0; from < kNumaNodeCount; from++)
+	{
+		for (uint32_t to = 0; to < kNumaNodeCount; to++)
+		{
+			if (kNumaDistance[from][to] == 0)
+				kNumaDistance[from][to] = from == to?NUMA_LOCAL_DISTANCE:NUMA_REMOTE_DISTANCE;
+			kNumaFallback[from][to] = to;
+		}
+		//Insertion sort on distance, the node itself is always the nearest
+		for (uint32_t cnt = 1; cnt < kNumaNodeCount; cnt++)
+		{
+			uint8_t node = kNumaFallback[from][cnt];
+			int pos = cnt - 1;
+			while (pos >= 0 && (kNumaDistance[from][kNumaFallback[from][pos]] > kNumaDistance[from][node] ||
+					(kNumaDistance[from][kNumaFallback[from][pos]] == kNumaDistance[from][node] && node == from)))
+			{
+				kNumaFallback[from][pos + 1] = kNumaFallback[from][pos];
+				pos--;
+			}
+			kNumaFallback[from][pos + 1] = node;
+		}
+	}
+
+	if (kNumaNodeCount > 1)
+		buddy_numa_init();
+	printd(DEBUG_ACPI, "NUMA: %u node(s) initialized\n", kNumaNodeCount);
+}
+
+/// @brief Get the node a physical address belongs to.  Addresses the SRAT doesn't describe are on node 0.
+uint32_t numa_node_for_address(uint64_t address)
+{
+	for (uint32_t cnt = 0; cnt < kNumaMemoryRangeCount; cnt++)
+		if (address >= kNumaMemoryRanges[cnt].base && address < kNumaMemoryRanges[cnt].end)
+			return kNumaMemoryRanges[cnt].node;
+	return 0;
+}
+
+/// @brief Get the end of the run of memory starting at address which is all on the same node
+/// @return The first address past the run, which is not necessarily on a different node
+uint64_t numa_node_range_end(uint64_t address)
+{
+	uint64_t end = 0xFFFFFFFFFFFFFFFF;
+
+	for (uint32_t cnt = 0; cnt < kNumaMemoryRangeCount; cnt++)
+	{
+		if (address >= kNumaMemoryRanges[cnt].base && address < kNumaMemoryRanges[cnt].end)
+			return kNumaMemoryRanges[cnt].end;
+		//Address is in a hole, the run ends where the next range starts
+		if (kNumaMemoryRanges[cnt].base > address && kNumaMemoryRanges[cnt].base < end)
+			end = kNumaMemoryRanges[cnt].base;
+	}
+	return end;
+}
+
+uint32_t numa_cpu_node(uint32_t apic_id)
+{
+	return apic_id < NUMA_MAX_APIC_ID?kNumaCpuNode[apic_id]:0;
+}
+
+/// @brief Get the node of the CPU this is running on
+uint32_t numa_current_node()
+{
+	if (kNumaNodeCount == 1)
+		return 0;
+	return numa_cpu_node(read_apic_id());
+}
@@ -2,6 +2,7 @@
 #include "CONFIG.h"
 #include "kmalloc.h"
 #include "allocator.h"
+#include "buddy.h"
 #include "memmap.h"
 #include "BasicRenderer.h"
 #include "memory/memset.h"
@@ -14,6 +15,11 @@
 #include "gdt.h"
 #include "idt.h"
 #include "pci_lookup.h"
+#include "x86_64.h"
+#include "zeropool.h"
+#include "limine.h"
+#include "driver/system/cpudet.h"
+#include "tlb.h"
 
 
 extern uintptr_t kKernelBaseAddressV;
@@ -33,21 +39,106 @@ pt_entry_t kKernelPML4;
 pt_entry_t kKernelPML4v;
 //Higher Half Direct Mapping offset
 uint64_t kHHDMOffset;
-uint64_t kPagingPagesCount;
-uintptr_t kPagingPagesBaseAddressV, kPagingPagesBaseAddressP;
-uintptr_t kPagingPagesCurrentPtr;
+//Page table pages come from the buddy allocator as they are needed.  Freed ones are kept on a free list, linked through their first 8 bytes.
+uintptr_t kPagingTableFreeList = 0;
+uint64_t kPagingTableFreeCount = 0;
+uint64_t kPagingTablePagesInUse = 0;
+volatile int kPagingTableLock = 0;
+//Set once the kernel's own paging tables are being built, mappings made before that are lost when CR3 is switched
+bool kPagingTablesInitialized = false;
+//Set by paging_map_hhdm from CPUID 0x80000001 EDX bit 26
+bool kPaging1GPagesSupported = false;
+//Set by paging_enable_pcid from the CPUID feature bits detect_cpu collects
+bool kPagingPCIDEnabled = false;
+bool kPagingINVPCIDSupported = false;
+//OR'd into CR3 loads (CR3_NOFLUSH once PCIDs are enabled), also used by the scheduler's CR3 loads
+uint64_t kPagingCR3LoadFlags = 0;
+//PCIDs in use, PAGING_KERNEL_PCID and PAGING_SHARED_PCID are never handed out by the bitmap
+uint64_t kPagingPCIDMap[PAGING_PCID_COUNT / 64] = {[0] = 1ULL << PAGING_KERNEL_PCID, [PAGING_PCID_COUNT / 64 - 1] = 1ULL << 63};
+volatile int kPagingPCIDLock = 0;
 
 // Helper function to create a page entry with specified flags
 static inline pt_entry_t table_entry(uint64_t physical_address, uint64_t flags) {
     return (physical_address & 0x000FFFFFFFFFF000ULL) | flags;
 }
 
+//buddy_page_t of a page table if it came from get_paging_table_page, NULL for the bootloader's and paging_init's tables
+static inline buddy_page_t* paging_table_page(pt_entry_t* table_or_entry)
+{
+    uintptr_t address = (uintptr_t)table_or_entry;
+
+    if (address < kHHDMOffset || address - kHHDMOffset >= kBuddyPageCount * PAGE_SIZE)
+        return NULL;
+    buddy_page_t* page = &kBuddyPages[(address - kHHDMOffset) / PAGE_SIZE];
+    return (page->flags & BUDDY_PAGE_TABLE)?page:NULL;
+}
+
+//Set a paging entry, keeping the count of present entries in the table it belongs to up to date
+static inline void paging_set_entry(pt_entry_t* entry, pt_entry_t value)
+{
+    buddy_page_t* table = paging_table_page(entry);
+
+    if (table != NULL)
+        table->table_entries += ((value & PAGE_PRESENT) != 0) - ((*entry & PAGE_PRESENT) != 0);
+    *entry = value;
+}
+
+//Kernel half pages are the same in every address space so they're marked global and survive CR3 loads.  User
+//accessible pages mapped up there (i.e. ring 3 stacks in the HHDM) are left alone.
+static inline uint64_t paging_leaf_flags(uint64_t virtual_address, uint64_t flags)
+{
+    if ((virtual_address & (1ULL << 63)) && !(flags & PAGE_USER))
+        flags |= PAGE_GLOBAL;
+    return flags;
+}
+
 // Calculate the index at each level from the virtual address
 #define PML4_INDEX(addr)  (((addr) >> 39) & 0x1FF)
 #define PDPT_INDEX(addr)  (((addr) >> 30) & 0x1FF)
 #define PD_INDEX(addr)    (((addr) >> 21) & 0x1FF)
 #define PT_INDEX(addr)    (((addr) >> 12) & 0x1FF)
 
+//Physical address of a 1GB/2MB page entry (bit 12 is the PAT bit in these, not part of the address)
+static inline uint64_t large_page_base(pt_entry_t entry, uint64_t size) {
+    return entry & 0x000FFFFFFFFFF000ULL & ~(size - 1);
+}
+
+//Does an existing 1GB/2MB page already map virtual_address to physical_address with the requested caching/access flags?
+static inline bool large_page_covers(pt_entry_t entry, uint64_t size, uint64_t virtual_address, uint64_t physical_address, uint64_t flags) {
+    uint64_t attributes = PAGE_WRITE | PAGE_USER | PAGE_PWT | PAGE_PCD;
+    return large_page_base(entry, size) + (virtual_address & (size - 1)) == physical_address &&
+           (entry & attributes) == (flags & attributes);
+}
+
+//Replace a 1GB/2MB page with a table of 512 entries which map the same memory with the same flags
+static void paging_split_large_page(pt_entry_t* entry, uint64_t size)
+{
+    uint64_t child_size = size / 512;
+    uint64_t base = large_page_base(*entry, size);
+    uint64_t child_flags = (*entry & (PAGE_FLAGS_MASK | PAGE_NO_EXECUTE)) & ~PAGE_LARGE;
+    uint64_t table_phys = get_paging_table_page();
+    pt_entry_t* table = (pt_entry_t*)PHYS_TO_VIRT(table_phys);
+
+    if (child_size > PAGE_SIZE)
+        child_flags |= PAGE_LARGE;
+    for (int cnt = 0; cnt < 512; cnt++)
+        table[cnt] = (base + (cnt * child_size)) | child_flags;
+    paging_table_page(table)->table_entries = 512;
+    //The translations are the same before and after so there's nothing to flush
+    *entry = table_phys | (*entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
+    printd(DEBUG_PAGING | DEBUG_DETAILED, "PAGING: Split 0x%lx byte page at 0x%016lx into 0x%lx byte pages\n", size, base, child_size);
+}
+
+//Return the table an entry points to, allocating an empty one if the entry isn't present
+static pt_entry_t* paging_get_or_create_table(pt_entry_t* entry, uint64_t flags)
+{
+    if (!(*entry & PAGE_PRESENT))
+    {
+        paging_set_entry(entry, get_paging_table_page() | flags | PAGE_PRESENT);
+    }
+    return (pt_entry_t*)PHYS_TO_VIRT(*entry & 0x000FFFFFFFFFF000ULL);
+}
+
 void validatePagingHierarchy(uintptr_t address) {
     uintptr_t* pml4 = (uintptr_t*)kKernelPML4v;
     uintptr_t pml4Index = (address >> 39) & 0x1FF;
@@ -98,6 +189,11 @@ uintptr_t paging_walk_paging_table_keep_flags(pt_entry_t* pml4, uint64_t virtual
     if ((pd_entry & 0x1) == 0) { // Check Present bit
         return 0xbadbadba; // PDPT entry is invalid
     }
+
+    // Check for a 1 GiB page
+    if (pd_entry & PAGE_LARGE)
+        return large_page_base(pd_entry, PAGE_SIZE_1G) | (virtual_address & (PAGE_SIZE_1G - 1));
+
     pt_entry_t* pd = (pt_entry_t*)((pd_entry & ~0xFFF) | kHHDMOffset);
 
     // Get the PD entry
@@ -134,12 +230,244 @@ uintptr_t paging_walk_paging_table_keep_flags(pt_entry_t* pml4, uint64_t virtual
     return physical_address;
 }
 
+static inline uint64_t paging_read_cr3()
+{
+    uint64_t cr3;
+    asm volatile("mov %0, cr3" : "=r"(cr3));
+    return cr3;
+}
+
+/// @brief Invalidate every TLB entry on this CPU, global ones and those of every PCID included
+void paging_flush_tlb_all()
+{
+    if (kPagingINVPCIDSupported)
+    {
+        paging_invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+    //Toggling CR4.PGE drops everything, for all PCIDs
+    uint64_t cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4));
+    asm volatile("mov cr4, %0" : : "r"(cr4 ^ CR4_PGE) : "memory");
+    asm volatile("mov cr4, %0" : : "r"(cr4) : "memory");
+}
+
+/// @brief Invalidate the TLB entries for [start, end) on this CPU.  Small ranges are invalidated a page at a time.  Anything
+/// over PAGING_FLUSH_ALL_THRESHOLD pages flushes the current PCID if the range is in the user half, or the whole TLB
+/// (global entries included) if it is in the kernel half.
+void paging_flush_tlb_range(uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return;
+    if ((end - start) / PAGE_SIZE > PAGING_FLUSH_ALL_THRESHOLD)
+    {
+        if (start & (1ULL << 63))
+            paging_flush_tlb_all();
+        else
+            //Reloading CR3 without CR3_NOFLUSH drops the current PCID's non-global entries
+            asm volatile("mov cr3, %0" : : "r"(paging_read_cr3()) : "memory");
+        return;
+    }
+    for (uint64_t address = start & PAGE_ADDRESS_MASK; address < end; address += PAGE_SIZE)
+        asm volatile("invlpg [%0]" : : "r"(address) : "memory");
+}
+
+/// @brief Invalidate [start, end) after changing pml4's mappings, on this CPU and on every other CPU which may have them cached
+void paging_flush_pml4_range(pt_entry_t* pml4, uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return;
+    uint64_t cr3 = paging_pml4_cr3(pml4);
+    tlb_invalidate_local(cr3, start, end);
+    tlb_shootdown(cr3, start, end);
+}
+
+//Map size bytes (PAGE_SIZE_2M or PAGE_SIZE_1G) at virtual_address with a single PS entry.  Both addresses must be aligned to size.
+//Returns false without changing anything if the range is already mapped by a lower level table, so the caller can fall back to 4K pages.
+static bool paging_map_large_page(pt_entry_t* pml4, uint64_t virtual_address, uint64_t physical_address, uint64_t size, uint64_t flags)
+{
+    uint64_t tableRequiredFlags = (flags & PAGE_WRITE)?PAGE_WRITE:0;
+    pt_entry_t* pdpt = paging_get_or_create_table(&pml4[PML4_INDEX(virtual_address)], tableRequiredFlags);
+    pt_entry_t* entry = &pdpt[PDPT_INDEX(virtual_address)];
+    uint64_t largeFlags = paging_leaf_flags(virtual_address, flags & (PAGE_FLAGS_MASK | PAGE_NO_EXECUTE)) | PAGE_PRESENT | PAGE_LARGE;
+
+    pml4[PML4_INDEX(virtual_address)] |= tableRequiredFlags;
+    if (size == PAGE_SIZE_2M)
+    {
+        if ((*entry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+        {
+            if (large_page_covers(*entry, PAGE_SIZE_1G, virtual_address, physical_address, flags))
+                return true;
+            paging_split_large_page(entry, PAGE_SIZE_1G);
+        }
+        pt_entry_t* pd = paging_get_or_create_table(entry, tableRequiredFlags);
+        *entry |= tableRequiredFlags;
+        entry = &pd[PD_INDEX(virtual_address)];
+    }
+
+    if ((*entry & (PAGE_PRESENT | PAGE_LARGE)) == PAGE_PRESENT)
+        return false;
+    if ((*entry & PAGE_PRESENT) && large_page_covers(*entry, size, virtual_address, physical_address, flags))
+        return true;
+    bool wasPresent = (*entry & PAGE_PRESENT) != 0;
+    paging_set_entry(entry, (physical_address & ~(size - 1)) | largeFlags);
+    //Replacing a different large page, one invlpg drops the whole translation
+    if (wasPresent)
+        paging_flush_pml4_range(pml4, virtual_address, virtual_address + PAGE_SIZE);
+    return true;
+}
+
+//Unmap the 1GB/2MB page mapping virtual_address if it lies entirely inside [virtual_address, virtual_address + length).
+//Returns the number of bytes unmapped, 0 if there is no large page there or it is only partially covered.  The caller flushes the TLB.
+static uint64_t paging_unmap_large_page(pt_entry_t* pml4, uint64_t virtual_address, uint64_t length)
+{
+    if (!(pml4[PML4_INDEX(virtual_address)] & PAGE_PRESENT))
+        return 0;
+    pt_entry_t* pdpt = (pt_entry_t*)PHYS_TO_VIRT(pml4[PML4_INDEX(virtual_address)] & 0x000FFFFFFFFFF000ULL);
+    pt_entry_t* entry = &pdpt[PDPT_INDEX(virtual_address)];
+    uint64_t size = PAGE_SIZE_1G;
+
+    if ((*entry & (PAGE_PRESENT | PAGE_LARGE)) == PAGE_PRESENT)
+    {
+        pt_entry_t* pd = (pt_entry_t*)PHYS_TO_VIRT(*entry & 0x000FFFFFFFFFF000ULL);
+        entry = &pd[PD_INDEX(virtual_address)];
+        size = PAGE_SIZE_2M;
+    }
+    if ((*entry & (PAGE_PRESENT | PAGE_LARGE)) != (PAGE_PRESENT | PAGE_LARGE) || (virtual_address & (size - 1)) || length < size)
+        return 0;
+    paging_set_entry(entry, 0);
+    return size;
+}
+
+//Walk to the page table for virtual_address, creating any missing tables and splitting large pages in the way.
+//Returns NULL if a large page already maps virtual_address to physical_address with the same attributes, with its size in coveredSize.
+static pt_entry_t* paging_get_page_table(pt_entry_t* pml4, uint64_t virtual_address, uint64_t physical_address, uint64_t flags, uint64_t* coveredSize)
+{
+    uint64_t tableRequiredFlags = (flags & PAGE_WRITE)?PAGE_WRITE:0;
+    pt_entry_t* pdpt = paging_get_or_create_table(&pml4[PML4_INDEX(virtual_address)], tableRequiredFlags);
+    pt_entry_t* pdptEntry = &pdpt[PDPT_INDEX(virtual_address)];
+
+    pml4[PML4_INDEX(virtual_address)] |= tableRequiredFlags;
+    if ((*pdptEntry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+    {
+        *coveredSize = PAGE_SIZE_1G;
+        if (large_page_covers(*pdptEntry, PAGE_SIZE_1G, virtual_address, physical_address, flags))
+            return NULL;
+        paging_split_large_page(pdptEntry, PAGE_SIZE_1G);
+    }
+    pt_entry_t* pd = paging_get_or_create_table(pdptEntry, tableRequiredFlags);
+    pt_entry_t* pdEntry = &pd[PD_INDEX(virtual_address)];
+
+    *pdptEntry |= tableRequiredFlags;
+    if ((*pdEntry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+    {
+        *coveredSize = PAGE_SIZE_2M;
+        if (large_page_covers(*pdEntry, PAGE_SIZE_2M, virtual_address, physical_address, flags))
+            return NULL;
+        paging_split_large_page(pdEntry, PAGE_SIZE_2M);
+    }
+    pt_entry_t* pt = paging_get_or_create_table(pdEntry, tableRequiredFlags);
+    *pdEntry |= tableRequiredFlags;
+    return pt;
+}
+
+/// @brief Call callback with the page table entry of every 4KB page mapped in [start, end), skipping unmapped parts of the
+/// range a table at a time.  Large pages in the range are split first.
+void paging_for_each_page(pt_entry_t* pml4, uint64_t start, uint64_t end, paging_page_callback_t callback, void* context)
+{
+    uint64_t address = start & PAGE_ADDRESS_MASK;
+
+    while (address < end)
+    {
+        pt_entry_t* pml4Entry = &pml4[PML4_INDEX(address)];
+        if (!(*pml4Entry & PAGE_PRESENT))
+        {
+            address = (address + (1ULL << PML4_SHIFT)) & ~((1ULL << PML4_SHIFT) - 1);
+            continue;
+        }
+        pt_entry_t* pdptEntry = &((pt_entry_t*)PHYS_TO_VIRT(*pml4Entry & 0x000FFFFFFFFFF000ULL))[PDPT_INDEX(address)];
+        if (!(*pdptEntry & PAGE_PRESENT))
+        {
+            address = (address + PAGE_SIZE_1G) & ~(PAGE_SIZE_1G - 1);
+            continue;
+        }
+        if (*pdptEntry & PAGE_LARGE)
+            paging_split_large_page(pdptEntry, PAGE_SIZE_1G);
+        pt_entry_t* pdEntry = &((pt_entry_t*)PHYS_TO_VIRT(*pdptEntry & 0x000FFFFFFFFFF000ULL))[PD_INDEX(address)];
+        if (!(*pdEntry & PAGE_PRESENT))
+        {
+            address = (address + PAGE_SIZE_2M) & ~(PAGE_SIZE_2M - 1);
+            continue;
+        }
+        if (*pdEntry & PAGE_LARGE)
+            paging_split_large_page(pdEntry, PAGE_SIZE_2M);
+        pt_entry_t* pte = &((pt_entry_t*)PHYS_TO_VIRT(*pdEntry & 0x000FFFFFFFFFF000ULL))[PT_INDEX(address)];
+        if (*pte & PAGE_PRESENT)
+            callback(pte, address, context);
+        address += PAGE_SIZE;
+    }
+}
+
 // Walk the paging table to find the paging entries for a virtual address, returns the PTE value
 uintptr_t paging_walk_paging_table(pt_entry_t* pml4, uint64_t virtual_address) 
 {
 	return paging_walk_paging_table_keep_flags(pml4, virtual_address, false);
 }
 
+//Unlink the table entry points to if it came from get_paging_table_page and no longer has any present entries, adding it to
+//released.  The list is linked through the tables' first entry, which stays not present since table addresses are page aligned.
+static bool paging_release_table_if_empty(pt_entry_t* entry, uintptr_t* released)
+{
+    if ((*entry & (PAGE_PRESENT | PAGE_LARGE)) != PAGE_PRESENT)
+        return false;
+    buddy_page_t* table = paging_table_page((pt_entry_t*)PHYS_TO_VIRT(*entry & 0x000FFFFFFFFFF000ULL));
+    if (table == NULL || table->table_entries != 0)
+        return false;
+    uintptr_t table_phys = *entry & 0x000FFFFFFFFFF000ULL;
+    paging_set_entry(entry, 0);
+    *(uintptr_t*)PHYS_TO_VIRT(table_phys) = *released;
+    *released = table_phys;
+    return true;
+}
+
+//Free the tables paging_prune_tables unlinked, once the TLBs (and paging-structure caches) have been flushed everywhere
+static void paging_free_released_tables(uintptr_t released)
+{
+    while (released)
+    {
+        uintptr_t next = *(uintptr_t*)PHYS_TO_VIRT(released);
+        free_paging_table_page(released);
+        released = next;
+    }
+}
+
+/// @brief Unlink the page tables under [start, end) which have no present entries left, working up from the PTs.  Each level
+/// is checked on its own, a PD or PDPT can be left empty by unmapping a large page without any PT being freed.  PDPTs in the
+/// kernel half are never released since every PML4 points to them.
+/// @return List of the unlinked tables, to be freed with paging_free_released_tables after the TLB flush
+static uintptr_t paging_prune_tables(pt_entry_t* pml4, uint64_t start, uint64_t end)
+{
+    uintptr_t released = 0;
+
+    for (uint64_t address = start & ~(PAGE_SIZE_2M - 1); address < end; address += PAGE_SIZE_2M)
+    {
+        pt_entry_t* pml4Entry = &pml4[PML4_INDEX(address)];
+        if ((*pml4Entry & PAGE_PRESENT) == 0)
+            continue;
+        pt_entry_t* pdpt = (pt_entry_t*)PHYS_TO_VIRT(*pml4Entry & 0x000FFFFFFFFFF000ULL);
+        pt_entry_t* pdptEntry = &pdpt[PDPT_INDEX(address)];
+        if ((*pdptEntry & (PAGE_PRESENT | PAGE_LARGE)) == PAGE_PRESENT)
+        {
+            pt_entry_t* pd = (pt_entry_t*)PHYS_TO_VIRT(*pdptEntry & 0x000FFFFFFFFFF000ULL);
+            paging_release_table_if_empty(&pd[PD_INDEX(address)], &released);
+            paging_release_table_if_empty(pdptEntry, &released);
+        }
+        if (PML4_INDEX(address) < PML4_KERNEL_FIRST_ENTRY)
+            paging_release_table_if_empty(pml4Entry, &released);
+    }
+    return released;
+}
+
 void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physical_address, uint64_t flags) {
     // Align addresses to 4 KB boundaries
     physical_address &= PAGE_ADDRESS_MASK;
@@ -164,8 +492,7 @@ void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physic
 	    printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "\tPDPT not present - allocating it\n");
         uint64_t new_pdpt_phys = get_paging_table_page();
         pt_entry_t *new_pdpt_page = (pt_entry_t *)PHYS_TO_VIRT(new_pdpt_phys);
-        memset(new_pdpt_page, 0, PAGE_SIZE);
-        pml4[PML4_INDEX(virtual_address)] = new_pdpt_phys | tableRequiredFlags | PAGE_PRESENT;
+        paging_set_entry(&pml4[PML4_INDEX(virtual_address)], new_pdpt_phys | tableRequiredFlags | PAGE_PRESENT);
         pdpt_page = new_pdpt_page;
     }
 
@@ -173,6 +500,14 @@ void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physic
     pt_entry_t *pd_page;
     uint64_t pdpt_entry = pdpt_page[PDPT_INDEX(virtual_address)];
 
+    if ((pdpt_entry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+        // Already mapped by a 1GB page (i.e. the HHDM), split it if the mapping needs to be different
+        if (large_page_covers(pdpt_entry, PAGE_SIZE_1G, virtual_address, physical_address, flags))
+            return;
+        paging_split_large_page(&pdpt_page[PDPT_INDEX(virtual_address)], PAGE_SIZE_1G);
+        pdpt_entry = pdpt_page[PDPT_INDEX(virtual_address)];
+    }
+
     if (pdpt_entry & PAGE_PRESENT) {
         // Combine existing flags with new flags
         pdpt_page[PDPT_INDEX(virtual_address)] = (pdpt_entry & ~0xFFF) | ((pdpt_entry | tableRequiredFlags) & 0xFFF);
@@ -184,8 +519,7 @@ void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physic
         // Allocate new PD page
         uint64_t new_pd_phys = get_paging_table_page();
         pt_entry_t *new_pd_page = (pt_entry_t *)PHYS_TO_VIRT(new_pd_phys);
-        memset(new_pd_page, 0, PAGE_SIZE);
-        pdpt_page[PDPT_INDEX(virtual_address)] = new_pd_phys | tableRequiredFlags | PAGE_PRESENT;
+        paging_set_entry(&pdpt_page[PDPT_INDEX(virtual_address)], new_pd_phys | tableRequiredFlags | PAGE_PRESENT);
         pd_page = new_pd_page;
     }
 
@@ -193,6 +527,14 @@ void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physic
     pt_entry_t *pt_page;
     uint64_t pd_entry = pd_page[PD_INDEX(virtual_address)];
 
+    if ((pd_entry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+        // Already mapped by a 2MB page, split it if the mapping needs to be different
+        if (large_page_covers(pd_entry, PAGE_SIZE_2M, virtual_address, physical_address, flags))
+            return;
+        paging_split_large_page(&pd_page[PD_INDEX(virtual_address)], PAGE_SIZE_2M);
+        pd_entry = pd_page[PD_INDEX(virtual_address)];
+    }
+
     if (pd_entry & PAGE_PRESENT) {
        // Combine existing flags with new flags
         pd_page[PD_INDEX(virtual_address)] = (pd_entry & ~0xFFF) | ((pd_entry | tableRequiredFlags) & 0xFFF);
@@ -204,17 +546,16 @@ void paging_map_page(pt_entry_t *pml4, uint64_t virtual_address, uint64_t physic
 	    printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "\tPT not present - allocating it\n");
         uint64_t new_pt_phys = get_paging_table_page();
         pt_entry_t *new_pt_page = (pt_entry_t *)PHYS_TO_VIRT(new_pt_phys);
-        memset(new_pt_page, 0, PAGE_SIZE);
         if ((((uintptr_t)new_pt_page >> 32) & 0xFFFFFFFF) != 0xFFFF8000)
 			panic("Bad page table entry address. (0x%016lx)  kHHDMOffset = 0x%016lx\n", new_pt_page, kHHDMOffset);
-		pd_page[PD_INDEX(virtual_address)] = new_pt_phys | tableRequiredFlags | PAGE_PRESENT;
+		paging_set_entry(&pd_page[PD_INDEX(virtual_address)], new_pt_phys | tableRequiredFlags | PAGE_PRESENT);
         pt_page = new_pt_page;
     }
 
-	uint16_t finalFlags =  flags | PAGE_PRESENT;
+	uint16_t finalFlags =  paging_leaf_flags(virtual_address, flags) | PAGE_PRESENT;
     printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "\tSetting page table entry at 0x%016lx, index 0x%04x, to 0x%016lx, flags 0x%08x\n", pt_page, PT_INDEX(virtual_address), physical_address, finalFlags);
     // Step 4: Map the final page in the PT table
-    pt_page[PT_INDEX(virtual_address)] = physical_address | finalFlags;
+    paging_set_entry(&pt_page[PT_INDEX(virtual_address)], physical_address | finalFlags);
 }
 
 void paging_unmap_page(pt_entry_t *pml4, uint64_t virtual_address) {
@@ -229,6 +570,8 @@ void paging_unmap_page(pt_entry_t *pml4, uint64_t virtual_address) {
 
     // Step 2: Traverse the PD table
     pt_entry_t *pd;
+    if ((pdpt[PDPT_INDEX(virtual_address)] & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+        paging_split_large_page(&pdpt[PDPT_INDEX(virtual_address)], PAGE_SIZE_1G);
     if (pdpt[PDPT_INDEX(virtual_address)] & PAGE_PRESENT) {
         pd = (pt_entry_t *)PHYS_TO_VIRT(pdpt[PDPT_INDEX(virtual_address)] & ~0xFFF);
     } else {
@@ -238,6 +581,8 @@ void paging_unmap_page(pt_entry_t *pml4, uint64_t virtual_address) {
 
     // Step 3: Traverse the PT table
     pt_entry_t *pt;
+    if ((pd[PD_INDEX(virtual_address)] & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+        paging_split_large_page(&pd[PD_INDEX(virtual_address)], PAGE_SIZE_2M);
     if (pd[PD_INDEX(virtual_address)] & PAGE_PRESENT) {
         pt = (pt_entry_t *)PHYS_TO_VIRT(pd[PD_INDEX(virtual_address)] & ~0xFFF);
     } else {
@@ -247,9 +592,14 @@ void paging_unmap_page(pt_entry_t *pml4, uint64_t virtual_address) {
 
     // Step 4: Unmap the final page in the PT table
     if (pt[PT_INDEX(virtual_address)] & PAGE_PRESENT) {
-        pt[PT_INDEX(virtual_address)] = 0;  // Clear the page entry to unmap it
-        // Flush the TLB entry for this virtual address
-       asm volatile("invlpg [%0]" : : "r"(virtual_address) : "memory");
+        paging_set_entry(&pt[PT_INDEX(virtual_address)], 0);  // Clear the page entry to unmap it
+        uintptr_t released = paging_prune_tables(pml4, virtual_address, virtual_address + PAGE_SIZE);
+        // Flush the TLB entry for this virtual address (everywhere), which also drops the paging-structure caches
+        if (released && (virtual_address & (1ULL << 63)))
+            paging_flush_pml4_range(pml4, TLB_KERNEL_HALF_START, TLB_KERNEL_HALF_END);
+        else
+            paging_flush_pml4_range(pml4, virtual_address, virtual_address + PAGE_SIZE);
+        paging_free_released_tables(released);
     }
 }
 
@@ -272,7 +622,6 @@ void paging_map_pages(pt_entry_t* pml4,uint64_t virtual_address,uint64_t physica
 		printd(DEBUG_PAGING, "Adjusted virtual address to 0x%016lx and incremented page count by 1 due to address not being aligned to page boundry\n", virtual_address);
 	}
 
-
 //	if (physical_address < 0x1000)
 //		panic("paging_map_pages: Attempt to map physical address 0x%016lx to virtual address 0x%016lx\n", physical_address, virtual_address);
 
@@ -284,8 +633,53 @@ void paging_map_pages(pt_entry_t* pml4,uint64_t virtual_address,uint64_t physica
 	// 	kDebugLevel = 0;
 	// }
 
-	for (uint64_t cnt=0;cnt<page_count;cnt++)
-		paging_map_page(pml4, virtual_address + (PAGE_SIZE * cnt), physical_address + (PAGE_SIZE * cnt), flags);
+	//Start/end of the PTEs which replaced an existing mapping, flushed once at the end
+	uint64_t flushStart = 0xFFFFFFFFFFFFFFFF, flushEnd = 0;
+
+	//Use 1GB/2MB pages wherever the virtual and physical addresses are both aligned and enough of the range is left,
+	//4K pages for the unaligned edges
+	for (uint64_t cnt=0;cnt<page_count;)
+	{
+		uint64_t virt = virtual_address + (PAGE_SIZE * cnt);
+		uint64_t phys = physical_address + (PAGE_SIZE * cnt);
+		uint64_t remaining = (page_count - cnt) * PAGE_SIZE;
+		uint64_t coveredSize = 0;
+
+		if (kPaging1GPagesSupported && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 && remaining >= PAGE_SIZE_1G &&
+			paging_map_large_page(pml4, virt, phys, PAGE_SIZE_1G, flags))
+		{
+			cnt += PAGE_SIZE_1G / PAGE_SIZE;
+			continue;
+		}
+		if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && remaining >= PAGE_SIZE_2M &&
+			paging_map_large_page(pml4, virt, phys, PAGE_SIZE_2M, flags))
+		{
+			cnt += PAGE_SIZE_2M / PAGE_SIZE;
+			continue;
+		}
+		//Walk the upper levels once, then fill PTEs up to the end of this page table (the next 2MB boundary)
+		pt_entry_t* pt = paging_get_page_table(pml4, virt, phys, flags, &coveredSize);
+		uint64_t spanPages = (PAGE_SIZE_2M - (virt & (PAGE_SIZE_2M - 1))) / PAGE_SIZE;
+		if (pt == NULL)
+			//An existing large page already maps the rest of its span correctly
+			spanPages = (coveredSize - (virt & (coveredSize - 1))) / PAGE_SIZE;
+		if (spanPages > page_count - cnt)
+			spanPages = page_count - cnt;
+		uint64_t leafFlags = paging_leaf_flags(virt, flags) | PAGE_PRESENT;
+		for (uint64_t idx = PT_INDEX(virt); pt != NULL && idx < PT_INDEX(virt) + spanPages; idx++)
+		{
+			pt_entry_t entry = (phys + ((idx - PT_INDEX(virt)) * PAGE_SIZE)) | leafFlags;
+			if ((pt[idx] & PAGE_PRESENT) && pt[idx] != entry)
+			{
+				uint64_t replaced = virt + ((idx - PT_INDEX(virt)) * PAGE_SIZE);
+				flushStart = replaced < flushStart?replaced:flushStart;
+				flushEnd = replaced + PAGE_SIZE;
+			}
+			paging_set_entry(&pt[idx], entry);
+		}
+		cnt += spanPages;
+	}
+	paging_flush_pml4_range(pml4, flushStart, flushEnd);
 	
 	// if (page_count > 0xA1)
 	// {
@@ -296,16 +690,76 @@ void paging_map_pages(pt_entry_t* pml4,uint64_t virtual_address,uint64_t physica
 void paging_unmap_pages(pt_entry_t *pml4, uint64_t virtual_address, size_t length) {
     // Align the virtual address down to the nearest page boundary
     uint64_t aligned_address = virtual_address & ~(PAGE_SIZE - 1);
-
-    // Adjust the length to account for any extra bytes due to alignment
-    size_t end_address = virtual_address + length;
-    size_t aligned_length = end_address - aligned_address;
-    size_t num_pages = (aligned_length + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    // Unmap each page in the range
-    for (size_t i = 0; i < num_pages; i++) {
-        paging_unmap_page(pml4, aligned_address + i * PAGE_SIZE);
+    uint64_t end_address = virtual_address + length;
+    uint64_t flushStart = 0xFFFFFFFFFFFFFFFF, flushEnd = 0;
+
+    if ((uintptr_t)pml4 < kHHDMOffset)
+        pml4 = (pt_entry_t*)((uintptr_t)pml4 | kHHDMOffset);
+
+    // Large pages the range fully covers are dropped whole, partially covered ones are split.  Page tables are walked once
+    // per 2MB span and the TLB is flushed once at the end.
+    for (uint64_t address = aligned_address; address < end_address;) {
+        uint64_t unmapped = paging_unmap_large_page(pml4, address, end_address - address);
+        if (unmapped) {
+            flushStart = address < flushStart?address:flushStart;
+            flushEnd = address + unmapped;
+            address += unmapped;
+            continue;
+        }
+
+        uint64_t spanEnd = (address + PAGE_SIZE_2M) & ~(PAGE_SIZE_2M - 1);
+        if (spanEnd <= address || spanEnd > end_address)
+            spanEnd = end_address;
+        if (!(pml4[PML4_INDEX(address)] & PAGE_PRESENT)) {
+            uint64_t next = (address + (1ULL << PML4_SHIFT)) & ~((1ULL << PML4_SHIFT) - 1);
+            if (next <= address)
+                break;
+            address = next;
+            continue;
+        }
+        pt_entry_t *pdpt = (pt_entry_t *)PHYS_TO_VIRT(pml4[PML4_INDEX(address)] & ~0xFFF);
+        if ((pdpt[PDPT_INDEX(address)] & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+            paging_split_large_page(&pdpt[PDPT_INDEX(address)], PAGE_SIZE_1G);
+        if (!(pdpt[PDPT_INDEX(address)] & PAGE_PRESENT)) {
+            uint64_t next = (address + PAGE_SIZE_1G) & ~(PAGE_SIZE_1G - 1);
+            if (next <= address)
+                break;
+            address = next;
+            continue;
+        }
+        pt_entry_t *pd = (pt_entry_t *)PHYS_TO_VIRT(pdpt[PDPT_INDEX(address)] & ~0xFFF);
+        if ((pd[PD_INDEX(address)] & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+            paging_split_large_page(&pd[PD_INDEX(address)], PAGE_SIZE_2M);
+        if (!(pd[PD_INDEX(address)] & PAGE_PRESENT)) {
+            address = spanEnd;
+            continue;
+        }
+        pt_entry_t *pt = (pt_entry_t *)PHYS_TO_VIRT(pd[PD_INDEX(address)] & ~0xFFF);
+        for (; address < spanEnd; address += PAGE_SIZE) {
+            if (pt[PT_INDEX(address)] & PAGE_PRESENT) {
+                paging_set_entry(&pt[PT_INDEX(address)], 0);
+                flushStart = address < flushStart?address:flushStart;
+                flushEnd = address + PAGE_SIZE;
+            }
+        }
     }
+    //Empty tables are unlinked before the flush and only freed once nothing can still be using a translation through them.
+    //Every CPU gets one invalidation for the whole range, INVLPG drops all of the paging-structure caches along with it.
+    uintptr_t released = paging_prune_tables(pml4, aligned_address, end_address);
+    if (released && flushStart >= flushEnd)
+    {
+        flushStart = aligned_address;
+        flushEnd = aligned_address + PAGE_SIZE;
+    }
+    //INVLPG only drops the paging-structure caches of the current PCID.  Other CPUs can have kernel half tables cached under
+    //whichever PCID they are running, so freeing one takes a full flush (INVPCID type 2 or a CR4.PGE toggle) everywhere.
+    if (released && (aligned_address & (1ULL << 63)))
+    {
+        flushStart = TLB_KERNEL_HALF_START;
+        flushEnd = TLB_KERNEL_HALF_END;
+    }
+    paging_flush_pml4_range(pml4, flushStart, flushEnd);
+    paging_free_released_tables(released);
 }
 
 void paging_init()
@@ -318,25 +772,106 @@ void paging_init()
 	*(pt_entry_t*)(memoryBaseAddress + kHHDMOffset) = (memoryBaseAddress  + PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE;
 	//PD entry 0 points to 0x3000 - 2MB coverage
 	*(pt_entry_t*)(memoryBaseAddress + kHHDMOffset + PAGE_SIZE) = (memoryBaseAddress  + (PAGE_SIZE * 2)) | PAGE_PRESENT | PAGE_WRITE;
+	//The PT that PD entry points to starts out empty
+	memset((void*)(memoryBaseAddress + kHHDMOffset + (PAGE_SIZE * 2)), 0, PAGE_SIZE);
+}
+
+/// @brief Allocate a zeroed page for a page table
+/// @return The physical address of the page
+uintptr_t get_paging_table_page()
+{
+	uintptr_t page = 0;
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kPagingTableLock, 1));
+	if (kPagingTableFreeList)
+	{
+		page = kPagingTableFreeList;
+		kPagingTableFreeList = *(uintptr_t*)PHYS_TO_VIRT(page);
+		kPagingTableFreeCount--;
+	}
+	kPagingTablePagesInUse++;
+	__sync_lock_release(&kPagingTableLock);
+	interrupts_restore(flags);
+
+	if (page)
+		memset((void*)PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+	else
+	{
+		//The pool grows a page at a time, preferring pages /pagezero has already cleared
+		page = zero_pool_get_page();
+		if (page == 0)
+		{
+			page = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+			if (page == 0)
+				panic("get_paging_table_page: Out of memory\n");
+			memset((void*)PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+		}
+		kBuddyPages[page / PAGE_SIZE].flags |= BUDDY_PAGE_TABLE;
+	}
+	kBuddyPages[page / PAGE_SIZE].table_entries = 0;
+	//Until paging_alloc_pcid gives it one, if it becomes a PML4
+	kBuddyPages[page / PAGE_SIZE].pcid = PAGING_SHARED_PCID;
+	return page;
+}
 
-	uint64_t temp =  sizeof(memory_status_t);
-	uint64_t page_count_to_map = (INITIAL_MEMORY_STATUS_COUNT * temp) / PAGE_SIZE;
-	//Map the allocator starting at 0x4000
-	for (pt_entry_t cnt=0;cnt<page_count_to_map;cnt++)
+/// @brief Give back a page allocated with get_paging_table_page.  The caller must already have unlinked it from the paging hierarchy.
+void free_paging_table_page(uintptr_t page)
+{
+	bool keep;
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kPagingTableLock, 1));
+	kPagingTablePagesInUse--;
+	keep = kPagingTableFreeCount < PAGING_TABLE_FREE_LIST_MAX;
+	if (keep)
 	{
-		uint64_t virtual_address = (memoryBaseAddress + kHHDMOffset + (PAGE_SIZE * 2)) + (cnt*8);
-		uint64_t physical_address = (memoryBaseAddress + (PAGE_SIZE * (3 + cnt)));
-		*(pt_entry_t*)(virtual_address) = physical_address | PAGE_PRESENT | PAGE_WRITE;
+		*(uintptr_t*)PHYS_TO_VIRT(page) = kPagingTableFreeList;
+		kPagingTableFreeList = page;
+		kPagingTableFreeCount++;
 	}
+	__sync_lock_release(&kPagingTableLock);
+	interrupts_restore(flags);
 
+	if (!keep)
+	{
+		//pcid shares its space with the page count buddy_free_pages goes by
+		kBuddyPages[page / PAGE_SIZE].page_count = 1;
+		kBuddyPages[page / PAGE_SIZE].flags &= ~BUDDY_PAGE_TABLE;
+		buddy_free_pages(page);
+	}
+}
 
+//Free a table and every table under it.  Leaf entries (pages and large pages) are left alone, the memory they map isn't owned by the tables.
+static void paging_free_table_tree(uintptr_t table_phys, int level)
+{
+	pt_entry_t* table = (pt_entry_t*)PHYS_TO_VIRT(table_phys);
+
+	if (paging_table_page(table) == NULL)
+		return;
+	for (int cnt = 0; level > 1 && cnt < 512; cnt++)
+		if ((table[cnt] & (PAGE_PRESENT | PAGE_LARGE)) == PAGE_PRESENT)
+			paging_free_table_tree(table[cnt] & 0x000FFFFFFFFFF000ULL, level - 1);
+	free_paging_table_page(table_phys);
 }
 
-uintptr_t get_paging_table_page()
+/// @brief Free a task's PML4 and all of the page tables under it, i.e. on task teardown.  Kernel half entries which are the
+/// same as the kernel's PML4 are shared and are left alone.
+/// @param pml4v Virtual (HHDM) address of the PML4.  It must not be the active CR3.
+void paging_free_pml4(pt_entry_t* pml4v)
 {
-	uintptr_t retVal = kPagingPagesCurrentPtr;
-	kPagingPagesCurrentPtr += PAGE_SIZE;
-	return retVal;
+	pt_entry_t* kernelPML4 = (pt_entry_t*)kKernelPML4v;
+
+	if ((uintptr_t)pml4v == kKernelPML4v)
+		panic("paging_free_pml4: Attempt to free the kernel's PML4\n");
+	for (int cnt = 0; cnt < 512; cnt++)
+	{
+		if (!(pml4v[cnt] & PAGE_PRESENT) || (cnt >= PML4_KERNEL_FIRST_ENTRY && (pml4v[cnt] & 0x000FFFFFFFFFF000ULL) == (kernelPML4[cnt] & 0x000FFFFFFFFFF000ULL)))
+			continue;
+		paging_free_table_tree(pml4v[cnt] & 0x000FFFFFFFFFF000ULL, 3);
+	}
+	free_paging_table_page(VIRT_TO_PHYS(pml4v));
+	printd(DEBUG_PAGING | DEBUG_DETAILED, "PAGING: Freed PML4 0x%016lx, 0x%lx page table pages in use\n", pml4v, kPagingTablePagesInUse);
 }
 
 uintptr_t get_paging_table_pageV()
@@ -378,6 +913,177 @@ void paging_map_kernel_into_pml4(uintptr_t* pml4v)
 	printd(DEBUG_PAGING | DEBUG_DETAILED, "PAGING (paging_map_kernel_into_pml4): %u kernel page mappings copied\n",kKernelPageMappingsCount);
 }
 
+/// @brief Give every kernel half PML4 entry a PDPT up front.  Kernel mappings made later only ever change the PDPTs and
+/// below, so they show up in every PML4 created with paging_create_pml4.
+/// @param pml4v Virtual address of the kernel's PML4
+void paging_populate_kernel_half(pt_entry_t* pml4v)
+{
+	for (int cnt = PML4_KERNEL_FIRST_ENTRY; cnt < 512; cnt++)
+	{
+		paging_get_or_create_table(&pml4v[cnt], PAGE_WRITE);
+		pml4v[cnt] |= PAGE_WRITE;
+	}
+}
+
+/// @brief Create a PML4 for a new address space.  The user half is empty and the kernel half is a copy of the kernel PML4's
+/// top level entries, which share the kernel's PDPTs.
+/// @return Virtual (HHDM) address of the new PML4
+pt_entry_t* paging_create_pml4()
+{
+	pt_entry_t* pml4v = (pt_entry_t*)get_paging_table_pageV();
+	pt_entry_t* kernelPML4 = (pt_entry_t*)kKernelPML4v;
+
+	for (int cnt = PML4_KERNEL_FIRST_ENTRY; cnt < 512; cnt++)
+		paging_set_entry(&pml4v[cnt], kernelPML4[cnt]);
+	printd(DEBUG_PAGING | DEBUG_DETAILED, "PAGING: Created PML4 0x%016lx sharing the kernel half\n", pml4v);
+	return pml4v;
+}
+
+/// @brief Turn on CR4.PGE so PAGE_GLOBAL translations survive CR3 loads.  Called on each CPU once it is on the kernel's PML4.
+void paging_enable_global_pages()
+{
+	uint64_t cr4;
+
+	asm volatile("mov %0, cr4" : "=r"(cr4));
+	if (!(cr4 & CR4_PGE))
+		asm volatile("mov cr4, %0" : : "r"(cr4 | CR4_PGE) : "memory");
+}
+
+/// @brief Turn on CR4.PCIDE if the CPU supports PCIDs, so CR3 loads stop flushing the TLB.  Called on the BSP once detect_cpu
+/// has run and on each AP as it comes up, while CR3 is the kernel's PML4 (PCID 0).
+void paging_enable_pcid()
+{
+	uint64_t cr4;
+
+	if (!kCPUFeatures.cpuid_feature_bits_2.pcid)
+		return;
+	kPagingINVPCIDSupported = kCPUFeatures.cpuid_extended_feature_bits_3.invpcid;
+	asm volatile("mov %0, cr4" : "=r"(cr4));
+	if (!(cr4 & CR4_PCIDE))
+		asm volatile("mov cr4, %0" : : "r"(cr4 | CR4_PCIDE) : "memory");
+	if (!kPagingPCIDEnabled)
+		printd(DEBUG_PAGING, "PAGING: PCIDs enabled%s\n", kPagingINVPCIDSupported?", INVPCID supported":"");
+	kPagingPCIDEnabled = true;
+	kPagingCR3LoadFlags = CR3_NOFLUSH;
+}
+
+/// @brief Allocate a PCID for a new address space
+/// @param pml4 Physical address of the address space's PML4
+/// @return The PCID, PAGING_KERNEL_PCID if PCIDs aren't enabled or PAGING_SHARED_PCID if they have all been handed out
+uint16_t paging_alloc_pcid(uint64_t pml4)
+{
+	uint16_t pcid = PAGING_SHARED_PCID;
+
+	if (!kPagingPCIDEnabled)
+		return PAGING_KERNEL_PCID;
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&kPagingPCIDLock, 1));
+	for (int word = 0; word < PAGING_PCID_COUNT / 64; word++)
+	{
+		if (kPagingPCIDMap[word] == 0xFFFFFFFFFFFFFFFF)
+			continue;
+		int bit = __builtin_ctzll(~kPagingPCIDMap[word]);
+		kPagingPCIDMap[word] |= 1ULL << bit;
+		pcid = (word * 64) + bit;
+		break;
+	}
+	__sync_lock_release(&kPagingPCIDLock);
+	interrupts_restore(flags);
+	//Kept with the PML4 so paging_pml4_cr3 can read it straight back
+	buddy_page_t* table = paging_table_page((pt_entry_t*)PHYS_TO_VIRT(pml4));
+	if (table != NULL)
+		table->pcid = pcid;
+	if (pcid == PAGING_SHARED_PCID)
+		printd(DEBUG_PAGING, "PAGING: Out of PCIDs, using the shared PCID\n");
+	return pcid;
+}
+
+/// @brief Return a PCID allocated with paging_alloc_pcid, dropping the TLB entries tagged with it on every CPU
+void paging_free_pcid(uint16_t pcid)
+{
+	if (pcid == PAGING_KERNEL_PCID || pcid == PAGING_SHARED_PCID)
+		return;
+	tlb_invalidate_local(pcid, 0, TLB_USER_HALF_END);
+	tlb_shootdown(pcid, 0, TLB_USER_HALF_END);
+	kTLBPCIDCpus[pcid] = 0;
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&kPagingPCIDLock, 1));
+	kPagingPCIDMap[pcid / 64] &= ~(1ULL << (pcid % 64));
+	__sync_lock_release(&kPagingPCIDLock);
+	interrupts_restore(flags);
+}
+
+/// @brief Get the CR3 value (PML4 physical address | PCID) for a PML4
+/// @param pml4v Virtual or physical address of the PML4
+uint64_t paging_pml4_cr3(pt_entry_t* pml4v)
+{
+	uint64_t pml4 = VIRT_TO_PHYS(pml4v);
+
+	if (!kPagingPCIDEnabled || pml4 == kKernelPML4)
+		return pml4;
+	buddy_page_t* table = paging_table_page((pt_entry_t*)PHYS_TO_VIRT(pml4));
+	return pml4 | (table != NULL?table->pcid:PAGING_SHARED_PCID);
+}
+
+/// @brief Map all of RAM at kHHDMOffset using 1GB pages where the CPU supports them and 2MB pages elsewhere.  The unaligned
+/// head and tail of each region get 4K pages, so the reserved or MMIO memory next to it is never mapped write-back.
+/// @param pml4v Virtual address of the PML4 to build the HHDM in
+void paging_map_hhdm(pt_entry_t* pml4v)
+{
+	uint32_t eax = 0x80000001, ebx, ecx, edx;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	//CPUID 0x80000001 EDX bit 26 = Page1GB
+	bool use1GPages = (edx & (1 << 26)) != 0;
+	kPaging1GPagesSupported = use1GPages;
+	uint64_t count1G = 0, count2M = 0, count4K = 0;
+
+	for (uint64_t entry = 0; entry < kMemMapEntryCount; entry++)
+	{
+		uint64_t type = kMemMap[entry]->type;
+		if (type != LIMINE_MEMMAP_USABLE && type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE &&
+			type != LIMINE_MEMMAP_ACPI_RECLAIMABLE && type != LIMINE_MEMMAP_KERNEL_AND_MODULES)
+			continue;
+
+		uint64_t start = kMemMap[entry]->base & PAGE_ADDRESS_MASK;
+		uint64_t end = (kMemMap[entry]->base + kMemMap[entry]->length + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK;
+		//The part of the region which can be mapped with large pages
+		uint64_t largeStart = (start + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+		uint64_t largeEnd = end & ~(PAGE_SIZE_2M - 1);
+		if (largeStart >= largeEnd)
+			largeStart = largeEnd = end;
+
+		if (start < largeStart)
+		{
+			paging_map_pages(pml4v, start + kHHDMOffset, start, (largeStart - start) / PAGE_SIZE, PAGE_WRITE);
+			count4K += (largeStart - start) / PAGE_SIZE;
+		}
+		for (uint64_t phys = largeStart; phys < largeEnd;)
+		{
+			uint64_t virt = phys + kHHDMOffset;
+			pt_entry_t* pdpt = paging_get_or_create_table(&pml4v[PML4_INDEX(virt)], PAGE_WRITE);
+			pt_entry_t* pdptEntry = &pdpt[PDPT_INDEX(virt)];
+
+			if (use1GPages && (phys & (PAGE_SIZE_1G - 1)) == 0 && phys + PAGE_SIZE_1G <= largeEnd && !(*pdptEntry & PAGE_PRESENT))
+			{
+				paging_set_entry(pdptEntry, phys | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | PAGE_GLOBAL);
+				count1G++;
+				phys += PAGE_SIZE_1G;
+				continue;
+			}
+			pt_entry_t* pd = paging_get_or_create_table(pdptEntry, PAGE_WRITE);
+			paging_set_entry(&pd[PD_INDEX(virt)], phys | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | PAGE_GLOBAL);
+			count2M++;
+			phys += PAGE_SIZE_2M;
+		}
+		if (largeEnd < end)
+		{
+			paging_map_pages(pml4v, largeEnd + kHHDMOffset, largeEnd, (end - largeEnd) / PAGE_SIZE, PAGE_WRITE);
+			count4K += (end - largeEnd) / PAGE_SIZE;
+		}
+	}
+	printd(DEBUG_PAGING, "PAGING: HHDM mapped with %u 1GB pages, %u 2MB pages and %u 4K pages\n", count1G, count2M, count4K);
+}
+
 void init_os64_paging_tables()
 {
 	
@@ -385,27 +1091,20 @@ void init_os64_paging_tables()
 	uint64_t rsp = 0;
 	uintptr_t physAddrLookup = 0;
 
-	uint64_t allocSize = kMaxPhysicalAddress / PAGE_SIZE;
-	kPagingPagesCount = allocSize / PAGE_SIZE;
-	if (allocSize % PAGE_SIZE)
-		kPagingPagesCount++;
-	//Preallocate mapped pages for use when a new paging page is required by paging_map_page
-	kPagingPagesBaseAddressP = (uintptr_t)allocate_memory_aligned(allocSize);
-	kPagingPagesBaseAddressV = kPagingPagesBaseAddressP | kHHDMOffset;
-	kPagingPagesCurrentPtr = kPagingPagesBaseAddressP;
-
-
-	//Make sure all the pages are empty
-	memset((void*)kPagingPagesBaseAddressV, 0, allocSize);
+	//Page table pages come from the buddy allocator as they are needed, see get_paging_table_page
+	kPagingTablesInitialized = true;
 
 	save_kernel_mappings();
 
-	printd(DEBUG_PAGING | DEBUG_DETAILED,"PAGING: Allocated page pool - 0x%08x pages at 0x%016x (virtual=0x%016lx)\n",
-			kMaxPhysicalAddress / PAGE_SIZE, kPagingPagesBaseAddressP, kPagingPagesBaseAddressV);
-
     uintptr_t* pml4p = (uintptr_t*)get_paging_table_page();
 	uintptr_t* pml4v = (uintptr_t*)((uintptr_t)pml4p | kHHDMOffset);
 
+	//Map all of RAM into the HHDM once, up front, so kmalloc never has to touch the page tables.  This covers the
+	//page pool and the buddy allocator's page array too.  It has to come first so the 4K mappings below don't
+	//leave holes in the 2MB pages.
+	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map HHDM\n");
+	paging_map_hhdm(pml4v);
+
 	printd(DEBUG_PAGING | DEBUG_DETAILED,"PAGING: Mapping existing items into the new pml4\n");
 	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map PML4\n");
 	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual pml4 (%p) to physical pml4 (%p)\n", pml4v, pml4p);
@@ -416,11 +1115,6 @@ void init_os64_paging_tables()
 	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual page 0 to physical page 0 (not present)\n");
 	paging_map_page(pml4v, 0, 0, 0); 
 
-	//Map the page pool into the new structure
-	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map paging page pool\n");
-	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual page pool (0x%016lx) to physical page pool (0x%016lx)\n", kPagingPagesBaseAddressV, kPagingPagesBaseAddressP);
-	paging_map_pages(pml4v, kPagingPagesBaseAddressV, kPagingPagesBaseAddressP, kPagingPagesCount, PAGE_PRESENT | PAGE_WRITE);
-
 	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map kernel\n");
 	paging_map_kernel_into_pml4(pml4v);
 	
@@ -472,15 +1166,6 @@ void init_os64_paging_tables()
 	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual framebuffer base (0x%016lx) to physical framebuffer base (0x%016lx), %u pages in new page tables\n", kFrameBuffer.base_address, physAddrLookup, pagesToMap);
 	paging_map_pages(pml4v, (uintptr_t)kFrameBuffer.base_address, physAddrLookup, pagesToMap, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
 
-	//Map the allocator struct array
-	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map memory status structures\n");
-	physAddrLookup = paging_walk_paging_table((pt_entry_t*)kKernelPML4v,(uintptr_t)kMemoryStatus);
-	pagesToMap = (INITIAL_MEMORY_STATUS_COUNT * sizeof(memory_status_t))/PAGE_SIZE;
-	if ((INITIAL_MEMORY_STATUS_COUNT * sizeof(memory_status_t))%PAGE_SIZE)
-	pagesToMap++;
-	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual memory status (0x%016lx) to physical memory status (0x%016lx), %u pages in new page tables\n", kMemoryStatus, physAddrLookup, pagesToMap);
-	paging_map_pages(pml4v, (uintptr_t)kMemoryStatus, physAddrLookup, pagesToMap, PAGE_PRESENT | PAGE_WRITE);
-
 	//Map the PCI ID data
 	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map PCI ID data\n");
 	physAddrLookup = paging_walk_paging_table((pt_entry_t*)kKernelPML4v, (uintptr_t)kPCIIdsData);
@@ -510,7 +1195,6 @@ void init_os64_paging_tables()
 		pagesToMap++;
 	paging_map_pages(pml4v, (uintptr_t)*kLimineSMPInfo->cpus, physAddrLookup, pagesToMap, PAGE_PRESENT | PAGE_WRITE);
 
-
 	printd(DEBUG_PAGING | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED, "* PAGING: Map stack\n");
 	asm volatile("mov %0, rsp" : "=r" (rsp));
 	// Get the physical address corresponding to the current RSP
@@ -543,8 +1227,12 @@ void init_os64_paging_tables()
 	printd(DEBUG_PAGING | DEBUG_DETAILED,"\tPAGING: Mapping virtual IDT (0x%016lx) to physical IDT (0x%016lx), %u pages in new page tables\n", idtr.base, physAddrLookup, pagesToMap);
 	paging_map_pages(pml4v, idtr.base & PAGE_ADDRESS_MASK, physAddrLookup & PAGE_ADDRESS_MASK, pagesToMap, PAGE_PRESENT | PAGE_WRITE);
 
+	//Task PML4s copy the kernel half's top level entries, so they all have to exist before the first task is created
+	paging_populate_kernel_half(pml4v);
+
 	kKernelPML4 = (uintptr_t)pml4p;
 	kKernelPML4v = (uintptr_t)pml4v;
 
 	asm volatile ("cli\nmov cr3, %0\nsti" :: "r"(kKernelPML4) : "memory");
+	paging_enable_global_pages();
 }
\ No newline at end of file
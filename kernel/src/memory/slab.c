@@ -0,0 +1,136 @@
+#include "CONFIG.h"
+#include "slab.h"
+#include "kmalloc.h"
+#include "memset.h"
+#include "strcpy.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+kmem_cache_t kSlabCaches[SLAB_MAX_CACHES];
+int kSlabCacheCount = 0;
+volatile int kSlabCacheCreateLock = 0;
+
+/// @brief Create a cache of fixed size objects
+/// @param name Name of the cache, for debugging
+/// @param object_size Size of each object
+/// @return The new cache
+kmem_cache_t* kmem_cache_create(const char* name, size_t object_size)
+{
+	return kmem_cache_create_aligned(name, object_size, SLAB_DEFAULT_ALIGNMENT);
+}
+
+/// @brief Create a cache of fixed size objects, each aligned to alignment bytes
+/// @param name Name of the cache, for debugging
+/// @param object_size Size of each object
+/// @param alignment Power of 2 alignment of each object, up to PAGE_SIZE
+/// @return The new cache
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t object_size, size_t alignment)
+{
+	kmem_cache_t* cache;
+
+	if (alignment < SLAB_DEFAULT_ALIGNMENT || alignment > PAGE_SIZE || (alignment & (alignment - 1)))
+		panic("kmem_cache_create: Invalid alignment 0x%lx for cache %s\n", alignment, name);
+
+	while (__sync_lock_test_and_set(&kSlabCacheCreateLock, 1));
+	if (kSlabCacheCount == SLAB_MAX_CACHES)
+		panic("kmem_cache_create: No room for cache %s, SLAB_MAX_CACHES is %u\n", name, SLAB_MAX_CACHES);
+	cache = &kSlabCaches[kSlabCacheCount++];
+	__sync_lock_release(&kSlabCacheCreateLock);
+
+	memset(cache, 0, sizeof(kmem_cache_t));
+	strncpy(cache->name, name, SLAB_NAME_LENGTH - 1);
+	cache->object_size = object_size;
+	//Free objects hold the free list link so they must be at least a pointer long
+	cache->stride = object_size < sizeof(void*)?sizeof(void*):object_size;
+	cache->stride = (cache->stride + alignment - 1) & ~(alignment - 1);
+	cache->slab_size = (cache->stride * SLAB_MIN_OBJECTS_PER_SLAB + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+	cache->objects_per_slab = cache->slab_size / cache->stride;
+
+	printd(DEBUG_KMALLOC, "SLAB: Created cache %s, object size 0x%lx, stride 0x%lx, %u objects per 0x%lx byte slab\n",
+			cache->name, cache->object_size, cache->stride, cache->objects_per_slab, cache->slab_size);
+	return cache;
+}
+
+//Carve a new slab into objects and put them on the cache's free list.  Called with the cache lock held.
+static void kmem_cache_grow(kmem_cache_t* cache)
+{
+	uint8_t* slab = kmalloc_aligned(cache->slab_size);
+
+	for (size_t cnt = 0; cnt < cache->objects_per_slab; cnt++)
+	{
+		void** object = (void**)(slab + (cnt * cache->stride));
+		*object = cache->free_list;
+		cache->free_list = object;
+	}
+	cache->free_count += cache->objects_per_slab;
+	cache->slab_count++;
+	printd(DEBUG_KMALLOC | DEBUG_DETAILED, "SLAB: Cache %s grew to %u slabs\n", cache->name, cache->slab_count);
+}
+
+/// @brief Allocate a zeroed object from a cache
+/// @param cache The cache to allocate from
+/// @return The object's virtual address
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+	void* object;
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t cpu = read_apic_id();
+	slab_magazine_t* magazine = cpu < MAX_CPUS?&cache->magazines[cpu]:NULL;
+
+	if (magazine != NULL && magazine->count > 0)
+		object = magazine->objects[--magazine->count];
+	else
+	{
+		//Slow path, refill the magazine from the shared free list, growing the cache if necessary
+		while (__sync_lock_test_and_set(&cache->lock, 1));
+		if (cache->free_count < SLAB_BATCH_SIZE)
+			kmem_cache_grow(cache);
+		if (magazine != NULL)
+			for (int cnt = 0; cnt < SLAB_BATCH_SIZE - 1; cnt++)
+			{
+				magazine->objects[magazine->count++] = cache->free_list;
+				cache->free_list = *(void**)cache->free_list;
+				cache->free_count--;
+			}
+		object = cache->free_list;
+		cache->free_list = *(void**)object;
+		cache->free_count--;
+		__sync_lock_release(&cache->lock);
+	}
+	interrupts_restore(flags);
+
+	memset(object, 0, cache->object_size);
+	return object;
+}
+
+/// @brief Return an object to the cache it was allocated from
+/// @param cache The cache the object was allocated from
+/// @param object The object to free
+void kmem_cache_free(kmem_cache_t* cache, void* object)
+{
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t cpu = read_apic_id();
+	slab_magazine_t* magazine = cpu < MAX_CPUS?&cache->magazines[cpu]:NULL;
+
+	if (magazine != NULL && magazine->count < SLAB_MAGAZINE_SIZE)
+		magazine->objects[magazine->count++] = object;
+	else
+	{
+		//Slow path, give half of the full magazine back to the shared free list
+		while (__sync_lock_test_and_set(&cache->lock, 1));
+		if (magazine != NULL)
+			for (int cnt = 0; cnt < SLAB_BATCH_SIZE; cnt++)
+			{
+				void** released = (void**)magazine->objects[--magazine->count];
+				*released = cache->free_list;
+				cache->free_list = released;
+				cache->free_count++;
+			}
+		*(void**)object = cache->free_list;
+		cache->free_list = object;
+		cache->free_count++;
+		__sync_lock_release(&cache->lock);
+	}
+	interrupts_restore(flags);
+}
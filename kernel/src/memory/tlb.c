@@ -0,0 +1,169 @@
+#include "tlb.h"
+#include "smp_core.h"
+#include "x86_64.h"
+#include "serial_logging.h"
+
+volatile uint64_t kTLBActiveCR3[MAX_CPUS];
+volatile uint32_t kTLBPCIDCpus[PAGING_PCID_COUNT];
+tlb_queue_t kTLBQueues[MAX_CPUS];
+uint64_t kTLBShootdownCount = 0, kTLBShootdownIPICount = 0;
+
+/// @brief Invalidate [start, end) of an address space on this CPU, whether or not it is the one loaded
+/// @param addressSpace CR3 (PML4 physical address | PCID) of the address space
+void tlb_invalidate_local(uint64_t addressSpace, uint64_t start, uint64_t end)
+{
+	uint16_t pcid = addressSpace & CR3_PCID_MASK;
+	uint64_t cr3;
+
+	if (start >= end)
+		return;
+	//Kernel half pages are global, invlpg drops them whatever CR3 is loaded.  A request for the whole kernel half (page
+	//tables were freed) is over PAGING_FLUSH_ALL_THRESHOLD and flushes everything.
+	if (start & (1ULL << 63))
+	{
+		paging_flush_tlb_range(start, end);
+		return;
+	}
+	asm volatile("mov %0, cr3" : "=r"(cr3));
+	if (cr3 == addressSpace)
+	{
+		paging_flush_tlb_range(start, end);
+		return;
+	}
+	//The address space isn't loaded (i.e. this CPU is in a syscall on the kernel's CR3).  Without PCIDs, or on the shared
+	//PCID, loading it again flushes its entries anyway.
+	if (!kPagingPCIDEnabled || pcid == PAGING_SHARED_PCID)
+		return;
+	if (!kPagingINVPCIDSupported)
+	{
+		paging_flush_tlb_all();
+		return;
+	}
+	if ((end - start) / PAGE_SIZE > PAGING_FLUSH_ALL_THRESHOLD)
+	{
+		paging_invpcid(INVPCID_CONTEXT, pcid, 0);
+		return;
+	}
+	for (uint64_t address = start & PAGE_ADDRESS_MASK; address < end; address += PAGE_SIZE)
+		paging_invpcid(INVPCID_ADDRESS, pcid, address);
+}
+
+//Add a request to a CPU's queue.  Deferred requests (no ack) which don't fit turn the queue into a full flush, requests
+//being waited on wait for room instead, servicing this CPU's own queue meanwhile.
+static void tlb_queue_request(uint32_t apic_id, uint64_t cr3, uint64_t start, uint64_t end, volatile uint32_t* ack)
+{
+	tlb_queue_t* queue = &kTLBQueues[apic_id];
+
+	while (1)
+	{
+		while (__sync_lock_test_and_set(&queue->lock, 1));
+		if (queue->count < TLB_QUEUE_SIZE)
+		{
+			tlb_request_t* request = &queue->requests[queue->count++];
+			request->cr3 = cr3;
+			request->start = start;
+			request->end = end;
+			request->ack = ack;
+			__sync_lock_release(&queue->lock);
+			return;
+		}
+		if (ack == NULL)
+		{
+			queue->flushAll = true;
+			__sync_lock_release(&queue->lock);
+			return;
+		}
+		__sync_lock_release(&queue->lock);
+		tlb_process_queue();
+		asm volatile("pause");
+	}
+}
+
+/// @brief Carry out every invalidation queued for this CPU, acknowledging the ones being waited on.  Called from the TLB
+/// shootdown IPI, by the scheduler before it switches address spaces and while waiting on a shootdown.
+void tlb_process_queue()
+{
+	tlb_request_t requests[TLB_QUEUE_SIZE];
+	uint64_t flags = interrupts_save_and_disable();
+	tlb_queue_t* queue = &kTLBQueues[read_apic_id()];
+
+	while (__sync_lock_test_and_set(&queue->lock, 1));
+	uint32_t count = queue->count;
+	bool flushAll = queue->flushAll;
+	for (uint32_t cnt = 0; cnt < count; cnt++)
+		requests[cnt] = queue->requests[cnt];
+	queue->count = 0;
+	queue->flushAll = false;
+	__sync_lock_release(&queue->lock);
+
+	if (flushAll)
+		paging_flush_tlb_all();
+	for (uint32_t cnt = 0; cnt < count; cnt++)
+	{
+		if (!flushAll)
+			tlb_invalidate_local(requests[cnt].cr3, requests[cnt].start, requests[cnt].end);
+		if (requests[cnt].ack)
+			__sync_fetch_and_sub(requests[cnt].ack, 1);
+	}
+	interrupts_restore(flags);
+}
+
+/// @brief Invalidate [start, end) of an address space on every other CPU which may have it cached.  The caller has already
+/// changed the paging entries and flushed its own TLB.
+/// @param cr3 PML4 physical address | PCID of the address space
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end)
+{
+	volatile uint32_t pending = 0;
+	uint16_t pcid = cr3 & CR3_PCID_MASK;
+	//Kernel half mappings, and the kernel PML4's own user half, can be cached by every CPU
+	bool everyCPU = (start & (1ULL << 63)) || (cr3 & PAGE_ADDRESS_MASK) == kKernelPML4;
+
+	if (start >= end || kMPCoreCount < 2 || kCoreLocalStorage == NULL)
+		return;
+
+	uint64_t flags = interrupts_save_and_disable();
+	uint32_t self = read_apic_id();
+	__sync_fetch_and_add(&kTLBShootdownCount, 1);
+
+	//CPUs which ran the address space earlier can still have entries tagged with its PCID.  They pick the request up before
+	//they next switch address spaces, without being interrupted.
+	if (!everyCPU && kPagingPCIDEnabled && pcid != PAGING_SHARED_PCID)
+		for (uint32_t apic_id = 0; apic_id < MAX_CPUS; apic_id++)
+			if (apic_id != self && (kTLBPCIDCpus[pcid] & (1U << apic_id)))
+				tlb_queue_request(apic_id, cr3, start, end, NULL);
+	//Pairs with tlb_switch_cr3, either the CPU sees the deferred request or we see it running the address space
+	__sync_synchronize();
+
+	//CPUs running the address space now get one IPI each for the whole range, then we wait for all of them at once
+	for (int cnt = 0; cnt < kMPCoreCount; cnt++)
+	{
+		uint32_t apic_id = kCPUInfo[cnt].apicID;
+		if (apic_id == self || !get_core_local_storage_for_core(apic_id)->coreInitialized)
+			continue;
+		if (!everyCPU && kTLBActiveCR3[apic_id] != cr3)
+			continue;
+		__sync_fetch_and_add(&pending, 1);
+		tlb_queue_request(apic_id, cr3, start, end, &pending);
+		mpSendInvTLB(apic_id);
+		__sync_fetch_and_add(&kTLBShootdownIPICount, 1);
+	}
+	//Keep servicing our own queue so two CPUs shooting each other down can't deadlock
+	while (pending)
+	{
+		tlb_process_queue();
+		asm volatile("pause");
+	}
+	interrupts_restore(flags);
+	printd(DEBUG_PAGING | DEBUG_DETAILED, "TLB: Shot down 0x%016lx-0x%016lx of CR3 0x%016lx\n", start, end, cr3);
+}
+
+/// @brief Record the address space a CPU is about to run, and catch up on the invalidations queued while it wasn't running it
+/// @param cr3 The CR3 the CPU will load (PML4 physical address | PCID)
+void tlb_switch_cr3(uint32_t apic_id, uint64_t cr3)
+{
+	kTLBActiveCR3[apic_id] = cr3;
+	if (kPagingPCIDEnabled)
+		__sync_fetch_and_or(&kTLBPCIDCpus[cr3 & CR3_PCID_MASK], 1U << apic_id);
+	__sync_synchronize();
+	tlb_process_queue();
+}
@@ -0,0 +1,171 @@
+#include "vma.h"
+#include "paging.h"
+#include "buddy.h"
+#include "zeropool.h"
+#include "cow.h"
+#include "kmalloc.h"
+#include "memset.h"
+#include "x86_64.h"
+#include "smp_core.h"
+#include "serial_logging.h"
+#include "panic.h"
+
+//Find the VMA containing address, trying the last one a fault was resolved in first.  Caller holds mmapLock.
+static vma_t* vma_find_locked(task_t* task, uintptr_t address)
+{
+	vma_t* vma;
+
+	if (task->mmaps == NULL)
+		return NULL;
+	if (task->mmapHint != NULL)
+	{
+		vma = (vma_t*)task->mmapHint->data;
+		if (address >= vma->start && address < vma->end)
+			return vma;
+	}
+	for (dlist_node_t* node = task->mmaps->head; node != NULL; node = node->next)
+	{
+		vma = (vma_t*)node->data;
+		if (address >= vma->start && address < vma->end)
+		{
+			task->mmapHint = node;
+			return vma;
+		}
+	}
+	return NULL;
+}
+
+/// @brief Reserve a range of a task's address space to be populated as it is touched
+/// @param start Page aligned start of the range
+/// @param length Length of the range, rounded up to a page
+/// @param flags Page flags to map the range's pages with, PAGE_PRESENT is implied
+/// @param physical Page aligned physical address backing start for a lazy mapping, or VMA_ANONYMOUS for zero filled pages
+/// @return The new VMA, or NULL if the range overlaps one the task already has
+vma_t* vma_add(task_t* task, uintptr_t start, size_t length, uint64_t flags, uintptr_t physical)
+{
+	uintptr_t end = (start + length + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK;
+	vma_t* vma = NULL;
+
+	start &= PAGE_ADDRESS_MASK;
+	uint64_t intFlags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&task->mmapLock, 1));
+	if (task->mmaps == NULL)
+	{
+		task->mmaps = kmalloc(sizeof(dlist_t));
+		dlist_init(task->mmaps);
+	}
+	for (dlist_node_t* node = task->mmaps->head; node != NULL; node = node->next)
+		if (start < ((vma_t*)node->data)->end && end > ((vma_t*)node->data)->start)
+			goto out;
+	vma = kmalloc(sizeof(vma_t));
+	vma->start = start;
+	vma->end = end;
+	vma->flags = (flags & (PAGE_FLAGS_MASK | PAGE_NO_EXECUTE)) | PAGE_PRESENT;
+	vma->physical = physical & PAGE_ADDRESS_MASK;
+	dlist_add(task->mmaps, vma);
+out:
+	__sync_lock_release(&task->mmapLock);
+	interrupts_restore(intFlags);
+	printd(DEBUG_PAGING | DEBUG_DETAILED, "VMA: %s 0x%016lx-0x%016lx (%s) to task %u\n", vma?"Added":"Couldn't add", start, end,
+			physical == VMA_ANONYMOUS?"anonymous":"lazy", task->taskID);
+	return vma;
+}
+
+/// @brief Find the VMA containing address
+/// @return The VMA, or NULL if address isn't in one
+vma_t* vma_find(task_t* task, uintptr_t address)
+{
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&task->mmapLock, 1));
+	vma_t* vma = vma_find_locked(task, address);
+	__sync_lock_release(&task->mmapLock);
+	interrupts_restore(flags);
+	return vma;
+}
+
+/// @brief Map the page containing address if it is in one of the current task's VMAs.  Called by the page fault handler.
+/// @param address The faulting address (CR2)
+/// @param error_code The page fault error code
+/// @return true if the page is now mapped and the faulting instruction can be restarted
+bool vma_handle_fault(uint64_t address, uint64_t error_code)
+{
+	core_local_storage_t* cls = get_core_local_storage();
+	uint64_t cr3;
+
+	if ((error_code & PAGE_FAULT_PRESENT) || cls == NULL || cls->currentThread == NULL)
+		return false;
+	task_t* task = (task_t*)cls->currentThread->ownerTask;
+	if (task->mmaps == NULL)
+		return false;
+	//Only the address space being run is resolved, i.e. not a user address touched on the kernel's CR3
+	__asm__ __volatile__("mov %0, cr3" : "=r"(cr3));
+	if ((cr3 & 0x000FFFFFFFFFF000ULL) != (uint64_t)task->pml4)
+		return false;
+
+	while (__sync_lock_test_and_set(&task->mmapLock, 1));
+	vma_t* vma = vma_find_locked(task, address);
+	if (vma == NULL || ((error_code & PAGE_FAULT_WRITE) && !(vma->flags & PAGE_WRITE)) ||
+			((error_code & PAGE_FAULT_USER) && !(vma->flags & PAGE_USER)))
+	{
+		__sync_lock_release(&task->mmapLock);
+		return false;
+	}
+	uintptr_t page = address & PAGE_ADDRESS_MASK;
+	//Another of the task's threads may have faulted the page in while we waited for the lock
+	if (paging_walk_paging_table((pt_entry_t*)task->pml4v, page) == 0xbadbadba)
+	{
+		uintptr_t physical = vma->physical + (page - vma->start);
+		if (vma->physical == VMA_ANONYMOUS)
+		{
+			physical = zero_pool_get_page();
+			if (physical == 0)
+			{
+				physical = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+				if (physical == 0)
+					panic("vma_handle_fault: Out of memory\n");
+				memset((void*)PHYS_TO_VIRT(physical), 0, PAGE_SIZE);
+			}
+		}
+		paging_map_page((pt_entry_t*)task->pml4v, page, physical, vma->flags);
+	}
+	__sync_lock_release(&task->mmapLock);
+	return true;
+}
+
+/// @brief Give a forked task the same VMAs as its parent
+void vma_copy_all(task_t* parent, task_t* child)
+{
+	if (parent->mmaps == NULL)
+		return;
+	for (dlist_node_t* node = parent->mmaps->head; node != NULL; node = node->next)
+	{
+		vma_t* vma = (vma_t*)node->data;
+		vma_add(child, vma->start, vma->end - vma->start, vma->flags, vma->physical);
+	}
+}
+
+/// @brief Free a task's VMAs and the anonymous pages faulted into them.  Part of task teardown, before the task's page tables are freed.
+void vma_release_all(task_t* task)
+{
+	if (task->mmaps == NULL)
+		return;
+	for (dlist_node_t* node = task->mmaps->head; node != NULL; node = node->next)
+	{
+		vma_t* vma = (vma_t*)node->data;
+		if (vma->physical != VMA_ANONYMOUS)
+			continue;
+		for (uintptr_t page = vma->start; page < vma->end; page += PAGE_SIZE)
+		{
+			uintptr_t physical = paging_walk_paging_table((pt_entry_t*)task->pml4v, page);
+			//A forked task may still share the page
+			if (physical != 0xbadbadba && cow_release_page(physical & PAGE_ADDRESS_MASK))
+				buddy_free_pages(physical & PAGE_ADDRESS_MASK);
+		}
+		//So cow_release_range doesn't drop the shared ones a second time
+		paging_unmap_pages((pt_entry_t*)task->pml4v, vma->start, vma->end - vma->start);
+	}
+	dlist_destroy(task->mmaps);
+	kfree(task->mmaps);
+	task->mmaps = NULL;
+	task->mmapHint = NULL;
+}
@@ -0,0 +1,100 @@
+#include "zeropool.h"
+#include "buddy.h"
+#include "paging.h"
+#include "memset.h"
+#include "x86_64.h"
+#include "kernel.h"
+#include "smp_core.h"
+#include "signals.h"
+#include "serial_logging.h"
+
+//Physical addresses of pages which have already been zeroed
+uint64_t kZeroPool[ZERO_POOL_MAX_PAGES];
+volatile uint64_t kZeroPoolCount = 0;
+volatile int kZeroPoolLock = 0;
+
+volatile uint64_t kZeroPoolHits = 0;
+volatile uint64_t kZeroPoolMisses = 0;
+volatile uint64_t kZeroPoolPagesZeroed = 0;
+//Tick at which the pool last fell below the low watermark, 0 when it is above it
+volatile uint64_t kZeroPoolLowSinceTick = 0;
+volatile uint64_t kZeroPoolLastRefillLagTicks = 0;
+volatile uint64_t kZeroPoolMaxRefillLagTicks = 0;
+
+/// @brief Take a pre-zeroed page from the pool
+/// @return The physical address of a zeroed page which is accessible at its HHDM address, or 0 if the pool is empty
+uint64_t zero_pool_get_page()
+{
+	uint64_t address = 0;
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&kZeroPoolLock, 1));
+	if (kZeroPoolCount > 0)
+		address = kZeroPool[--kZeroPoolCount];
+	if (kZeroPoolCount < ZERO_POOL_LOW_WATERMARK && kZeroPoolLowSinceTick == 0)
+		kZeroPoolLowSinceTick = kTicksSinceStart?kTicksSinceStart:1;
+	__sync_lock_release(&kZeroPoolLock);
+	interrupts_restore(flags);
+
+	if (address)
+		__sync_fetch_and_add(&kZeroPoolHits, 1);
+	else
+		__sync_fetch_and_add(&kZeroPoolMisses, 1);
+	return address;
+}
+
+/// @brief Zero pages and add them to the pool until it is full
+/// @param max_pages The most pages to zero before returning
+/// @return true if the pool is full
+bool zero_pool_refill(uint64_t max_pages)
+{
+	for (uint64_t cnt = 0; cnt < max_pages; cnt++)
+	{
+		if (kZeroPoolCount >= ZERO_POOL_MAX_PAGES)
+			break;
+		uint64_t address = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+		if (address == 0)
+			return false;
+		//Zeroing happens outside the lock, that is the whole point of the pool
+		memset((void*)(address + kHHDMOffset), 0, PAGE_SIZE);
+		kZeroPoolPagesZeroed++;
+
+		uint64_t flags = interrupts_save_and_disable();
+		while (__sync_lock_test_and_set(&kZeroPoolLock, 1));
+		bool stored = kZeroPoolCount < ZERO_POOL_MAX_PAGES;
+		if (stored)
+			kZeroPool[kZeroPoolCount++] = address;
+		__sync_lock_release(&kZeroPoolLock);
+		interrupts_restore(flags);
+		if (!stored)
+			buddy_free_pages(address);
+	}
+
+	if (kZeroPoolCount < ZERO_POOL_MAX_PAGES)
+		return false;
+	if (kZeroPoolLowSinceTick)
+	{
+		kZeroPoolLastRefillLagTicks = kTicksSinceStart - kZeroPoolLowSinceTick;
+		if (kZeroPoolLastRefillLagTicks > kZeroPoolMaxRefillLagTicks)
+			kZeroPoolMaxRefillLagTicks = kZeroPoolLastRefillLagTicks;
+		kZeroPoolLowSinceTick = 0;
+		printd(DEBUG_KMALLOC | DEBUG_DETAILED, "zero_pool: Refilled, lag=%lu ticks, hits=%lu, misses=%lu\n",
+				kZeroPoolLastRefillLagTicks, kZeroPoolHits, kZeroPoolMisses);
+	}
+	return true;
+}
+
+//Body of the /pagezero task.  Runs at the lowest priority so it only gets a core which would otherwise be idle,
+//tops the pool back up and goes back to sleep.
+void zero_pool_thread()
+{
+	thread_t *self = get_core_local_storage()->currentThread;
+
+	while (1==1)
+	{
+		//Stops early if the buddy allocator runs dry, in which case we'll try again next time around
+		if (kZeroPoolCount < ZERO_POOL_LOW_WATERMARK || kZeroPoolLowSinceTick)
+			zero_pool_refill(ZERO_POOL_MAX_PAGES);
+		sigaction(SIGSLEEP, NULL, kTicksSinceStart + ZERO_POOL_SLEEP_TICKS, self);
+	}
+}
@@ -11,6 +11,8 @@
 #include "tss.h"
 #include "strcmp.h"
 #include "paging.h"
+#include "tlb.h"
+#include "fpu.h"
 #include "strstr.h"
 
 volatile uint64_t mp_isrSavedRAX[MAX_CPUS],mp_isrSavedRBX[MAX_CPUS],mp_isrSavedRCX[MAX_CPUS],mp_isrSavedRDX[MAX_CPUS],mp_isrSavedRSI[MAX_CPUS],
@@ -27,10 +29,12 @@ task_t *kTaskList;
 thread_t *kThreadList = NO_THREAD;
 //List of all of the zombie threads.  These are threads which don't have a parent thread
 thread_t *qZombie = NO_THREAD;
-//List of all of the currently running threads.
-thread_t *qRunning = NO_THREAD;
-//List of all of the threads waiting to run.
-thread_t *qRunnable = NO_THREAD;
+//Runnable threads are queued per core.  Each queue has its own lock, so cores pick their next thread without contending
+//with each other, and a core only looks at the other queues to pull work over from the busiest (see scheduler_balance).
+//Pinned threads (the idle threads) are only ever queued on their own core.  Within a queue threads are listed by priority
+//level, so picking the next one is a bit scan and a list pop however many are waiting.
+scheduler_runqueue_t kRunQueues[MAX_CPUS];
+volatile uint64_t kSchedulerStealCount = 0;
 //List of all of the threads that have been stopped.
 thread_t *qStopped = NO_THREAD;
 //List of all of the threads which are in a blocking sleep (waiting for event to happen)
@@ -83,12 +87,6 @@ thread_t* scheduler_get_queue(eThreadState state)
 		case THREAD_STATE_NONE:
 			return NULL;
 			break;
-        case THREAD_STATE_RUNNABLE:
-            return qRunnable;
-            break;
-        case THREAD_STATE_RUNNING:
-            return qRunning;
-            break;
         case THREAD_STATE_ZOMBIE:
             return qZombie;
             break;
@@ -115,6 +113,13 @@ void scheduler_init()
 	kSchedulerInitialized = true;
     printd(DEBUG_SCHEDULER,"\tInitialized kThreadList @ 0x%08x, sizeof(thread_t)=0x%02X\n",kThreadList,sizeof(thread_t));
 
+    for (int cnt=0;cnt<MAX_CPUS;cnt++)
+    {
+        for (int level=0;level<SCHEDULER_PRIORITY_LEVELS;level++)
+            kRunQueues[cnt].levelHead[level] = kRunQueues[cnt].levelTail[level] = NO_THREAD;
+        kRunQueues[cnt].idle = kRunQueues[cnt].current = NO_THREAD;
+        kRunQueues[cnt].balanceCountdown = SCHEDULER_BALANCE_INTERVAL;
+    }
     for (int cnt=0;cnt<kMPCoreCount;cnt++)
     {
         printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "\tAllocating stack for CPU %u, 0x%04x bytes\n",cnt,SCHEDULER_STACK_SIZE);
@@ -160,12 +165,6 @@ void set_queue_head(eThreadState queue, thread_t* thread)
 {
 	switch(queue)
 	{
-		case THREAD_STATE_RUNNABLE:
-			qRunnable = thread;
-			break;
-		case THREAD_STATE_RUNNING:
-			qRunning = thread;
-			break;
 		case THREAD_STATE_STOPPED:
 			qStopped = thread;
 			break;
@@ -184,11 +183,265 @@ void set_queue_head(eThreadState queue, thread_t* thread)
 	thread->prev = NO_PREV;
 }
 
+static inline bool scheduler_thread_pinned(thread_t *thread)
+{
+	return thread->mp_apic != THREAD_NOT_PINNED;
+}
+
+/// @brief Priority level of a thread's task, see SCHEDULER_PRIORITY_LEVELS
+static inline uint8_t scheduler_priority_level(thread_t *thread)
+{
+	int level = ((task_t*)thread->ownerTask)->priority + 20;
+
+	if (level < 0)
+		return 0;
+	if (level >= SCHEDULER_PRIORITY_LEVELS)
+		return SCHEDULER_PRIORITY_LEVELS - 1;
+	return level;
+}
+
+//Caller holds rq->lock.  The thread goes on the tail of its queueLevel list.
+static void scheduler_runqueue_append(scheduler_runqueue_t *rq, uint32_t cpu, thread_t *thread)
+{
+	uint8_t level = thread->queueLevel;
+
+	thread->runQueueCpu = cpu;
+	rq->count++;
+	if (thread->idleThread)
+	{
+		rq->idle = thread;
+		return;
+	}
+	thread->prev = rq->levelTail[level];
+	thread->next = NO_NEXT;
+	if (rq->levelTail[level] == NO_THREAD)
+		rq->levelHead[level] = thread;
+	else
+		rq->levelTail[level]->next = thread;
+	rq->levelTail[level] = thread;
+	rq->levelBitmap |= 1ULL << level;
+	if (!scheduler_thread_pinned(thread))
+		rq->stealableCount++;
+}
+
+//Caller holds rq->lock
+static void scheduler_runqueue_unlink(scheduler_runqueue_t *rq, thread_t *thread)
+{
+	uint8_t level = thread->queueLevel;
+
+	rq->count--;
+	if (thread->idleThread)
+	{
+		rq->idle = NO_THREAD;
+		return;
+	}
+	if (thread->prev == NO_PREV)
+		rq->levelHead[level] = thread->next;
+	else
+		thread->prev->next = thread->next;
+	if (thread->next == NO_NEXT)
+		rq->levelTail[level] = thread->prev;
+	else
+		thread->next->prev = thread->prev;
+	if (rq->levelHead[level] == NO_THREAD)
+		rq->levelBitmap &= ~(1ULL << level);
+	thread->next = thread->prev = NO_THREAD;
+	if (!scheduler_thread_pinned(thread))
+		rq->stealableCount--;
+}
+
+/// @brief Pick the core whose run queue a thread becoming runnable goes on.  Pinned threads go to their own core, others
+/// back to the core they last ran on, whose cache may still hold their working set.  New threads go to the core with the
+/// fewest queued.
+static uint32_t scheduler_select_cpu(thread_t *thread)
+{
+	uint32_t best = 0;
+
+	if (scheduler_thread_pinned(thread))
+		return thread->mp_apic;
+	if (thread->runQueueCpu < kMPCoreCount)
+		return thread->runQueueCpu;
+	for (uint32_t cnt = 1; cnt < kMPCoreCount; cnt++)
+		if (kRunQueues[cnt].count < kRunQueues[best].count)
+			best = cnt;
+	return best;
+}
+
+static void scheduler_runqueue_add(thread_t *thread)
+{
+	uint32_t cpu = scheduler_select_cpu(thread);
+	scheduler_runqueue_t *rq = &kRunQueues[cpu];
+	uint64_t flags = interrupts_save_and_disable();
+
+	thread->queueLevel = thread->wakeBoost ? 0 : scheduler_priority_level(thread);
+	thread->wakeBoost = false;
+	thread->runnableSinceTicks = kTicksSinceStart;
+	while (__sync_lock_test_and_set(&rq->lock, 1));
+	scheduler_runqueue_append(rq, cpu, thread);
+	__sync_lock_release(&rq->lock);
+	interrupts_restore(flags);
+}
+
+static void scheduler_runqueue_remove(thread_t *thread)
+{
+	scheduler_runqueue_t *rq;
+	uint64_t flags = interrupts_save_and_disable();
+
+	//The thread can be stolen while we wait for the lock, so make sure it's still on the queue that was locked
+	while (true)
+	{
+		rq = &kRunQueues[thread->runQueueCpu];
+		while (__sync_lock_test_and_set(&rq->lock, 1));
+		if (rq == &kRunQueues[thread->runQueueCpu])
+			break;
+		__sync_lock_release(&rq->lock);
+	}
+	scheduler_runqueue_unlink(rq, thread);
+	__sync_lock_release(&rq->lock);
+	interrupts_restore(flags);
+}
+
+/// @brief Move one thread from victim's run queue to cpu's.  Threads pinned to victim are never moved.
+/// @return The thread moved, NO_THREAD if victim had nothing to give
+thread_t* scheduler_steal_thread(uint32_t cpu, uint32_t victim)
+{
+	scheduler_runqueue_t *rq = &kRunQueues[cpu], *from = &kRunQueues[victim];
+	scheduler_runqueue_t *first = cpu < victim ? rq : from, *second = cpu < victim ? from : rq;
+	thread_t *thread;
+	uint64_t flags;
+
+	if (cpu == victim || from->stealableCount == 0)
+		return NO_THREAD;
+	flags = interrupts_save_and_disable();
+	//Always lock the lower numbered core's queue first, so two cores stealing from each other can't deadlock
+	while (__sync_lock_test_and_set(&first->lock, 1));
+	while (__sync_lock_test_and_set(&second->lock, 1));
+	//The first unpinned thread at the highest priority level, the one the victim would have run soonest
+	thread = NO_THREAD;
+	for (uint64_t levels = from->levelBitmap; levels != 0 && thread == NO_THREAD; levels &= levels - 1)
+		for (thread = from->levelHead[__builtin_ctzll(levels)]; thread != NO_THREAD && scheduler_thread_pinned(thread);
+				thread = thread->next)
+			;
+	if (thread != NO_THREAD)
+	{
+		scheduler_runqueue_unlink(from, thread);
+		scheduler_runqueue_append(rq, cpu, thread);
+		__sync_fetch_and_add(&kSchedulerStealCount, 1);
+	}
+	__sync_lock_release(&second->lock);
+	__sync_lock_release(&first->lock);
+	interrupts_restore(flags);
+	if (thread != NO_THREAD)
+		printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "scheduler_steal_thread: CPU %u took thread 0x%08x from CPU %u\n", cpu, thread->threadID, victim);
+	return thread;
+}
+
+/// @brief Pull a thread over from the core with the most stealable threads queued.  Done whenever this core has nothing
+/// but its idle thread to run, and every SCHEDULER_BALANCE_INTERVAL passes if that core has two or more queued than this one.
+static void scheduler_balance(core_local_storage_t *cls)
+{
+	uint32_t cpu = cls->apic_id, busiest = cpu;
+	scheduler_runqueue_t *rq = &kRunQueues[cpu];
+	bool idle = rq->stealableCount == 0 && (rq->current == NO_THREAD || rq->current->idleThread);
+	bool balanceDue = --rq->balanceCountdown == 0;
+
+	if (balanceDue)
+		rq->balanceCountdown = SCHEDULER_BALANCE_INTERVAL;
+	if (!idle && !balanceDue)
+		return;
+	//The counts are read without the locks, scheduler_steal_thread checks again under them
+	for (uint32_t cnt = 0; cnt < kMPCoreCount; cnt++)
+		if (kRunQueues[cnt].stealableCount > kRunQueues[busiest].stealableCount)
+			busiest = cnt;
+	if (busiest != cpu && (idle || kRunQueues[busiest].stealableCount > rq->stealableCount + 1))
+		scheduler_steal_thread(cpu, busiest);
+}
+
+/// @brief Look for one starving thread on this core's queue.  Each pass checks the head (longest waiting) thread of the
+/// next non-empty level, cycling through them, so it stays O(1).  A thread which has waited SCHEDULER_STARVATION_TICKS is
+/// moved to the tail of the highest level with threads queued or running, where it gets its turn after them.  It drops back
+/// to its own level after it next runs.
+static void scheduler_runqueue_age(core_local_storage_t *cls)
+{
+	scheduler_runqueue_t *rq = &kRunQueues[cls->apic_id];
+	uint64_t flags = interrupts_save_and_disable();
+
+	while (__sync_lock_test_and_set(&rq->lock, 1));
+	uint64_t levels = rq->levelBitmap & (~0ULL << rq->agingLevel);
+	if (levels == 0)
+		levels = rq->levelBitmap;
+	if (levels != 0)
+	{
+		uint32_t level = __builtin_ctzll(levels);
+		uint32_t top = __builtin_ctzll(rq->levelBitmap);
+		thread_t *thread = rq->levelHead[level];
+
+		rq->agingLevel = level + 1;
+		if (rq->current != NO_THREAD && !rq->current->idleThread && rq->current->queueLevel < top)
+			top = rq->current->queueLevel;
+		if (level > top && kTicksSinceStart - thread->runnableSinceTicks >= SCHEDULER_STARVATION_TICKS)
+		{
+			scheduler_runqueue_unlink(rq, thread);
+			thread->queueLevel = top;
+			thread->runnableSinceTicks = kTicksSinceStart;
+			scheduler_runqueue_append(rq, cls->apic_id, thread);
+			printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "scheduler_runqueue_age: Thread 0x%08x promoted from level %u to %u\n", thread->threadID, level, top);
+		}
+	}
+	__sync_lock_release(&rq->lock);
+	interrupts_restore(flags);
+}
+
+/// @brief Decide whether this pass takes the running thread off the CPU.  It does if the thread has exited or is going to
+/// sleep, a higher priority thread is waiting, or its time slice has run out (or it yielded) and a thread of the same or
+/// higher priority is waiting.  Otherwise a thread whose slice ran out gets another one.
+static bool scheduler_should_switch(core_local_storage_t *cls, bool yielded)
+{
+	scheduler_runqueue_t *rq = &kRunQueues[cls->apic_id];
+	thread_t *current = rq->current;
+	//Read without the lock, if it changes underneath us scheduler_find_thread_to_run still picks under the lock
+	uint64_t levels = rq->levelBitmap;
+	uint32_t top = levels ? __builtin_ctzll(levels) : SCHEDULER_PRIORITY_LEVELS;
+
+	//scheduler_run_new_thread moves a thread with signals pending to the sleep queue
+	if (current == NO_THREAD || current->exited || current->signals.sigind)
+		return true;
+	if (current->idleThread)
+		return levels != 0;
+	if (current->timeSliceLeft > 0)
+		current->timeSliceLeft--;
+	if (top < current->queueLevel)
+		return true;
+	if (yielded)
+		return levels != 0;
+	if (current->timeSliceLeft > 0)
+		return false;
+	if (top == current->queueLevel)
+		return true;
+	current->timeSliceLeft = SCHEDULER_TIMESLICE(current->queueLevel);
+	return false;
+}
+
 void scheduler_add_thread_to_queue(eThreadState queue, thread_t *thread)
 {
 	VERIFY_QUEUE(queue);
 	bool found = false;
-	thread_t *slot = scheduler_get_queue(queue);
+	thread_t *slot;
+
+	if (queue == THREAD_STATE_RUNNABLE)
+	{
+		scheduler_runqueue_add(thread);
+		return;
+	}
+	//Only called on the core which is about to run the thread
+	if (queue == THREAD_STATE_RUNNING)
+	{
+		uint32_t cpu = get_core_local_storage()->apic_id;
+		kRunQueues[cpu].current = thread;
+		thread->runQueueCpu = cpu;
+		return;
+	}
+	slot = scheduler_get_queue(queue);
 
 	printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "scheduler_add_thread_to_queue: Adding thread 0x%08x to queue %s\n", thread->threadID, THREAD_STATE_NAMES[queue]);
 
@@ -228,12 +481,6 @@ void scheduler_set_queue_empty(eThreadState queue)
 	{
 		case THREAD_STATE_NONE:
 			break;
-        case THREAD_STATE_RUNNABLE:
-            qRunnable = NO_THREAD;
-            break;
-        case THREAD_STATE_RUNNING:
-            qRunning = NO_THREAD;
-            break;
         case THREAD_STATE_ZOMBIE:
              qZombie = NO_THREAD;
             break;
@@ -255,6 +502,16 @@ void scheduler_remove_thread_from_queue(eThreadState queue, thread_t *thread)
 {
     VERIFY_QUEUE(queue);
 
+    if (queue == THREAD_STATE_RUNNABLE) {
+        scheduler_runqueue_remove(thread);
+        return;
+    }
+    if (queue == THREAD_STATE_RUNNING) {
+        if (kRunQueues[thread->runQueueCpu].current == thread)
+            kRunQueues[thread->runQueueCpu].current = NO_THREAD;
+        return;
+    }
+
     thread_t *head = scheduler_get_queue(queue);
     bool found = false;
     if (head != NO_THREAD) {
@@ -309,9 +566,7 @@ void scheduler_change_thread_queue(thread_t* thread, eThreadState newState)
     }
     thread->threadState=newState;
     scheduler_add_thread_to_queue(newState,thread);
-    if (newState==THREAD_STATE_RUNNABLE)
-        thread->prioritizedTicksInRunnable=0;
-    else if (newState==THREAD_STATE_RUNNING)
+    if (newState==THREAD_STATE_RUNNING)
         thread->lastRunStartTicks=kTicksSinceStart;
 }
 
@@ -338,25 +593,13 @@ void scheduler_submit_new_task(task_t *newTask)
 	scheduler_change_thread_queue(newTask->threads, THREAD_STATE_RUNNABLE);
 }
 
-thread_t* scheduler_get_running_thread(uint64_t threadID)
+thread_t* scheduler_get_running_thread(core_local_storage_t *cls)
 {
-	thread_t *slot = scheduler_get_queue(THREAD_STATE_RUNNING);
-	bool found = false;
+	thread_t *thread = kRunQueues[cls->apic_id].current;
 
-	if (slot!=NO_THREAD)
-	do
-	{
-		if (slot->threadID == threadID)
-		{
-			found = true;
-			break;
-		}
-		slot = slot->next;
-	} while (slot!=NO_NEXT);
-	
-	if (!found)
-		panic("scheduler_get_running_thread: Can't find thread with id %lu in running queue", threadID);
-	return slot;
+	if (thread == NO_THREAD || thread->threadID != cls->threadID)
+		panic("scheduler_get_running_thread: Thread with id %lu isn't running on CPU %u", cls->threadID, cls->apic_id);
+	return thread;
 }
 
 void debug_print_registers(uint64_t apic_id, char* prefix, bool unconditional)
@@ -399,6 +642,7 @@ void scheduler_store_thread(core_local_storage_t *cls, thread_t* thread)
         printd(DEBUG_SCHEDULER,"storeISRSavedRegs: AP hasn't been through the scheduler before, not saving registers\n");
         return;
     }
+    fpu_switch_out(apic_id, thread);
     if (thread->execDontSaveRegisters)
     {
         printd(DEBUG_SCHEDULER, "* storeISRSavedRegs: ***Process %u exec'd, not saving registers***\n", task->taskID);
@@ -434,7 +678,6 @@ void scheduler_load_thread(core_local_storage_t *cls, thread_t* thread)
 	//task_t* task = cls->currentThread->ownerTask;
 	//task_t* ownerTask = ((task_t*)cls->currentThread->ownerTask)->ownerTask;
 	uint64_t apic_id = cls->apic_id;
-	thread_t* forkedThread = (thread_t*)thread->forkedThread;
 
 	cls->currentThread = thread;
 	cls->threadID = thread->threadID;
@@ -455,6 +698,7 @@ void scheduler_load_thread(core_local_storage_t *cls, thread_t* thread)
     mp_isrSavedFS[apic_id]=thread->regs.FS;
     mp_isrSavedGS[apic_id]=thread->regs.GS;
     mp_isrSavedCR3[apic_id]=thread->regs.CR3;
+    tlb_switch_cr3(apic_id, thread->regs.CR3);
     
     printd(DEBUG_SCHEDULER | DEBUG_DETAILED,"scheduler_load_thread: Loading SYSENTER_ESP_MSR with value 0x%08x\n",thread->regs.RSP0);
 
@@ -464,31 +708,11 @@ void scheduler_load_thread(core_local_storage_t *cls, thread_t* thread)
 		tss_set_rsp0(cls->apic_id, thread->regs.RSP0);
 	}
 
-	//TODO: Handle forked threads
+	//A forked child's registers were copied from its parent's syscall frame, it only differs by fork() returning 0
     if (((task_t*)cls->currentThread->ownerTask)->justForked)
     {
-		panic("scheduler_load_thread: Finish the fork register load\n");
         printd(DEBUG_SCHEDULER,"loadISRSavedRegs: Fork return for newly spawned child thread\n");
-        mp_isrSavedCS[apic_id] = thread->regs.CS;
-        mp_isrSavedRIP[apic_id] = thread->regs.RIP;
-        mp_isrSavedSS[apic_id] = thread->regs.SS;
-        mp_isrSavedDS[apic_id] = thread->regs.DS;
-        mp_isrSavedRAX[apic_id] = thread->regs.RAX;
-        mp_isrSavedRBX[apic_id] = thread->regs.RBX;
-        mp_isrSavedRCX[apic_id] = thread->regs.RCX;
-        mp_isrSavedRDX[apic_id] = thread->regs.RDX;
-        mp_isrSavedES[apic_id] = thread->regs.RSI;
-        mp_isrSavedRDI[apic_id] = thread->regs.RDI;
-        mp_isrSavedRSP[apic_id] = forkedThread->regs.RSP;
-        mp_isrSavedRBP[apic_id] = forkedThread->regs.RBP;
-        //Removed line of code that was setting the EBP directly to the parent's.  The above code is correct for assigning the EBP after a fork
-        mp_isrSavedRFlags[apic_id] = thread->regs.RFLAGS;
-        mp_isrSavedES[apic_id] = thread->regs.ES;
-        mp_isrSavedFS[apic_id] = thread->regs.FS;
-        mp_isrSavedGS[apic_id] = thread->regs.GS;
-        //We need to load the CR3 because whatever CR3 the parent was using, that's what the child should use for the FIRST return from syscall.
-        mp_isrSavedCR3[apic_id] = thread->regs.CR3; 
-//        memcpy((uintptr_t*)((process_t*)task->process)->stackStart, (uintptr_t*)parent->stackStart, ((process_t*)task->process)->stackSize);
+        mp_isrSavedRAX[apic_id] = 0;
     }
 #if SCHEDULER_DEBUG == 1
 	debug_print_registers(apic_id, "load", false);
@@ -540,57 +764,46 @@ void scheduler_wake_isleep_task(task_t *task) {
     if (task == NULL || task->threads == NULL) return; // Ensure task is valid
 
     if (task->threads->threadState == THREAD_STATE_ISLEEP) {
+        // Queued ahead of everything else so it responds quickly
+        task->threads->wakeBoost = true;
         scheduler_change_thread_queue(task->threads, THREAD_STATE_RUNNABLE);
     }
-    task->threads->prioritizedTicksInRunnable += HIGH_PRIORITY_TICKS_BOOST;
     scheduler_trigger(NULL);
 }
 
+/// @brief Find the thread this core should run next: the head of its highest priority non-empty level, or its idle thread
+/// if no other thread is queued.
+/// @param justBrowsing If false the thread is taken off the run queue, ready to be moved to the running state
 thread_t *scheduler_find_thread_to_run(core_local_storage_t *cls, bool justBrowsing)
 {
-    uint32_t mostIdleTicks=0, oldTicks;
-    task_t *task;
-    thread_t *thread, *threadToRun = NO_THREAD;
-    thread_t *queue=qRunnable;
-    
-    int queEntryNum = 0;
-    while (queue!=NO_NEXT)
-    {
-		thread = queue;
-		task = (task_t*)thread->ownerTask;
-		oldTicks=thread->prioritizedTicksInRunnable;
-		//This is where we increment all the runnable ticks, based on the process' priority
-		if (!thread->idleThread)
-			thread->prioritizedTicksInRunnable+=(RUNNABLE_TICKS_INTERVAL-task->priority)+1;
-		if (!justBrowsing)
-			printd(DEBUG_SCHEDULER | DEBUG_DETAILED,"*\t%u-Thr 0x%08x (tsk 0x%08x-%s), pri=%i, oldt=%u, newt=%u (runt=%u)\n",
-					queEntryNum,
-					thread->threadID, 
-					task->taskID,
-					task->exename,
-					task->priority,
-					oldTicks,
-					thread->prioritizedTicksInRunnable, 
-					thread->totalRunTicks);
-		if ( thread->prioritizedTicksInRunnable >= mostIdleTicks)
-		{
-			//All non-idle threads, and idle threads belonging to the current core, can be selected to run
-			if (!thread->idleThread || (thread->idleThread && thread->mp_apic==cls->apic_id))
-			{
-				if (thread->idleThread)
-					printd(DEBUG_SCHEDULER | DEBUG_DETAILED | DEBUG_EXTRA_DETAILED,"*\t\tfindTaskToRun: Found idle thread for APIC %u\n",cls->apic_id);
-				threadToRun=thread;
-				mostIdleTicks=thread->prioritizedTicksInRunnable;
-			}
-		}
-        queEntryNum++;
-        queue=queue->next;
-    }
+    thread_t *threadToRun;
+    scheduler_runqueue_t *rq = &kRunQueues[cls->apic_id];
+    uint64_t flags = interrupts_save_and_disable();
+
+	//Only this core's queue is searched, scheduler_balance has already pulled work over from the others if it was needed
+	while (__sync_lock_test_and_set(&rq->lock, 1));
+	if (rq->levelBitmap != 0)
+		threadToRun = rq->levelHead[__builtin_ctzll(rq->levelBitmap)];
+	else
+		threadToRun = rq->idle;
+	//Take it off the queue before the lock is dropped, so another core can't steal it in between
+	if (threadToRun != NO_THREAD && !justBrowsing)
+	{
+		scheduler_runqueue_unlink(rq, threadToRun);
+		threadToRun->threadState = THREAD_STATE_NONE;
+		//Back to its own level if it was boosted or promoted, a preempted thread keeps what was left of its slice
+		threadToRun->queueLevel = scheduler_priority_level(threadToRun);
+		if (threadToRun->timeSliceLeft == 0)
+			threadToRun->timeSliceLeft = SCHEDULER_TIMESLICE(threadToRun->queueLevel);
+	}
+	__sync_lock_release(&rq->lock);
+	interrupts_restore(flags);
 
 	if (threadToRun == NO_THREAD && !justBrowsing)
 		panic("scheduler_find_thread_to_run: No runnable threads found\n");
 	if (!justBrowsing)
-		printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "Found new thread 0x%08x to run\n", threadToRun->threadID);
+		printd(DEBUG_SCHEDULER | DEBUG_DETAILED, "Found new thread 0x%08x (%s, level %u) to run\n", threadToRun->threadID,
+				((task_t*)threadToRun->ownerTask)->exename, threadToRun->queueLevel);
 	return threadToRun;
 }
 
@@ -647,7 +860,7 @@ void scheduler_run_new_thread()
     }
 	else
 	{
-		threadToStop=scheduler_get_running_thread(cls->threadID);
+		threadToStop=scheduler_get_running_thread(cls);
 
 		task_t *taskToStop = (task_t*)threadToStop->ownerTask;
 		printd(DEBUG_SCHEDULER,"*Found thread 0x%08x to take off CPU @0x%04x:0x%08x (exited=%u, retval=0x%08x).\n",
@@ -668,7 +881,19 @@ void scheduler_run_new_thread()
 		else
             threadToStopNewQueue=THREAD_STATE_RUNNABLE;
         scheduler_store_thread(cls, threadToStop);              //we're taking it off the cpu so save the registers
+		//The sleep and zombie queues are shared by all the cores, the run queues lock themselves
+		if (threadToStopNewQueue != THREAD_STATE_RUNNABLE)
+			while (__sync_lock_test_and_set(&kSchedulerSwitchTasksLock, 1));
         scheduler_change_thread_queue(threadToStop, threadToStopNewQueue);
+		if (threadToStopNewQueue != THREAD_STATE_RUNNABLE)
+			__sync_lock_release(&kSchedulerSwitchTasksLock);
+		//Tasks have a single thread, so the task is done once it is on the zombie queue.  The scheduler runs on the kernel's
+		//CR3, the task's page tables aren't in use on this CPU any more.
+		if (threadToStopNewQueue == THREAD_STATE_ZOMBIE)
+		{
+			taskToStop->exited = true;
+			task_release_address_space(taskToStop);
+		}
 	}
 	printd(DEBUG_SCHEDULER | DEBUG_DETAILED,"*Finding thread to run\n");
     thread_t* threadToRun=scheduler_find_thread_to_run(cls, false);
@@ -743,17 +968,18 @@ void scheduler_do()
 {
 	core_local_storage_t *cls = get_core_local_storage();
 	uint8_t apic_id = cls->apic_id;
+	//Set by scheduler_trigger, i.e. the running thread is giving up the CPU rather than the timer calling
+	bool yielded = mp_waitingForScheduler[apic_id];
     mp_waitingForScheduler[apic_id] = false;
     printd(DEBUG_SCHEDULER,"****************************** SCHEDULER *******************************\n");
     printd(DEBUG_SCHEDULER,"scheduler: AP %u, current CR3 = 0x%08x\n",apic_id,getCR3());
 #if SCHEDULER_DEBUG == 1
     uint64_t ticksBefore = rdtsc();
 #endif
-	//Lock the section of code from the time we start looking for another thread to run, until we're done 
-	//either switching threads, or have identified that there's no new thread to run
-	while (__sync_lock_test_and_set(&kSchedulerSwitchTasksLock, 1));
-    thread_t* threadToRun=scheduler_find_thread_to_run(cls, true);
-  	if (threadToRun != NO_THREAD && threadToRun->threadID!=cls->threadID)
+	//No global lock here, each step only locks the run queues it touches
+	scheduler_balance(cls);
+	scheduler_runqueue_age(cls);
+  	if (scheduler_should_switch(cls, yielded))
     {
 		printd(DEBUG_SCHEDULER, "Time to make the donuts. (switch threads)\n");
 		scheduler_run_new_thread();
@@ -765,7 +991,6 @@ void scheduler_do()
 #endif
         printd(DEBUG_SCHEDULER,"*Shortcut! No new thread to run, continuing with 0x%016lx-%s\n", cls->currentThread->threadID, ((task_t*)cls->currentThread->ownerTask)->exename);
 	}
-	__sync_lock_release(&kSchedulerSwitchTasksLock);   
     kSchedulerCallCount++;
 #if SCHEDULER_DEBUG == 1
     uint64_t ticksAfter = rdtsc();
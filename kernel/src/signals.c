@@ -70,14 +70,7 @@ void processSignals()
 
 	// Update CR3 only if needed.
 	if (priorCR3 != (uint64_t)kKernelPML4)
-	{
-		__asm__ __volatile__(
-			"mov cr3, %[cr3Val]\n"
-			:
-			: [cr3Val] "r"((uint64_t)kKernelPML4)
-			: "memory"
-		);
-	}
+		paging_write_cr3((uint64_t)kKernelPML4);
 
     printd(DEBUG_SIGNALS | DEBUG_DETAILED,"\tScanning Interruptable Sleep queue\n");
 
@@ -102,7 +95,7 @@ void processSignals()
     printd(DEBUG_SIGNALS | DEBUG_DETAILED,"\tprocessSignals: Done processing signals\n");
     //No need to act on "awoken" since processSignals() is called by the scheduler
 	if (priorCR3 != (uint64_t)kKernelPML4)
-	    __asm__("mov cr3,%[cr3Val]\n"::[cr3Val] "r" (priorCR3));
+	    paging_write_cr3(priorCR3);
 }
 
 void init_signals()
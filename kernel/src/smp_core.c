@@ -17,6 +17,9 @@
 #include "tss.h"
 #include "thread.h"
 #include "idt.h"
+#include "paging.h"
+#include "tlb.h"
+#include "fpu.h"
 
 extern struct IDTPointer kIDTPtr;
 extern void syscall_Enter();
@@ -164,6 +167,9 @@ void ap_wakeup_entry() {
     load_gdt_and_jump(&kGDTr);
     tss_initialize_cpu(temp_apic_id);
     asm volatile ("lidt %0" : : "m" (kIDTPtr));
+    paging_enable_global_pages();
+    paging_enable_pcid();
+    fpu_init_cpu();
 
 	// Set up the AP stack
     stackVirtualAddress = (uintptr_t)kmalloc_aligned(AP_STACK_SIZE);
@@ -390,18 +396,11 @@ void mpDisableAP(int apic_id)
     printd (DEBUG_SMP, "MP: mpDisableAP: APIC %u, IPI sent for vector 0x%02x\n", apic_id, IPI_DISABLE_SCHEDULING_VECTOR);
 }
 
-void mpSendInvTLB()
+// Interrupt a CPU so it processes its TLB shootdown queue (see tlb_shootdown)
+void mpSendInvTLB(uint32_t apic_id)
 {
-    return;
-    // Send an IPI to the AP to invalidate the TLB
-    // Send to all APs except the current one
-    for (int i = 0; i < kMPCoreCount; i++) {
-        uint32_t apic_id = kCPUInfo[i].apicID;
-        if (apic_id != read_apic_id()) {
-            send_ipi(apic_id, IPI_INVALIDATE_TLB_VECTOR, 0, 1, 0);
-            printd (DEBUG_SMP, "MP: mpSendInvTLB: APIC %u, IPI sent for vector 0x%02x\n", apic_id, IPI_INVALIDATE_TLB_VECTOR);
-        }
-    }
+    send_ipi(apic_id, IPI_INVALIDATE_TLB_VECTOR, 0, 1, 0);
+    printd (DEBUG_SMP | DEBUG_DETAILED, "MP: mpSendInvTLB: APIC %u, IPI sent for vector 0x%02x\n", apic_id, IPI_INVALIDATE_TLB_VECTOR);
 }
 
 void enableApicTimerInterrupt() {
@@ -418,8 +417,6 @@ void disableApicTimerInterrupt() {
 
 void inv_tlb_ISR()
 {
-    
-    printd(DEBUG_SMP,"Flush\n");
-        __asm__("mov rax,cr3\ncmp rax,0\nje overflush\nmov cr3,rax\noverflush:\n");
-        write_eoi();
+    tlb_process_queue();
+    write_eoi();
 }
@@ -1,9 +1,23 @@
 #include "strings.h"
+#include "strings/strword.h"
 
 char *strchr(const char *s, int c)
 {
-    while (*s != (char)c)
-        if (!*s++)
+    uint64_t pattern = STRWORD_REPEAT(c);
+
+    for (; (uintptr_t)s & 7; s++) {
+        if (*s == (char)c)
+            return (char *)s;
+        if (*s == 0)
             return 0;
-    return (char *)s;
+    }
+    // Stop at the first word holding either c or the terminator, the lowest flagged byte is whichever comes first
+    for (;; s += 8) {
+        uint64_t word = *(const strword_t *)s;
+        uint64_t found = STRWORD_HAS_ZERO(word) | STRWORD_HAS_ZERO(word ^ pattern);
+        if (found) {
+            s += STRWORD_FIRST_BYTE(found);
+            return *s == (char)c ? (char *)s : 0;
+        }
+    }
 }
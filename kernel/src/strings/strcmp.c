@@ -1,4 +1,9 @@
 #include "strings/strcmp.h"
+#include "strings/strword.h"
+
+// Both compare a word at a time once p1 is aligned.  p2's word is loaded unaligned, except where the load would run onto
+// the next page, since the string could end before it.  A word holding a terminator or a difference is finished a byte
+// at a time.
 
 /// @brief 
 /// @param p1 
@@ -10,16 +15,34 @@ int strcmp (const char *p1, const char *p2)
   register const unsigned char *s2 = (const unsigned char *) p2;
   unsigned char c1, c2;
 
-  do
+  for (; (uintptr_t) s1 & 7; s1++, s2++)
     {
-      c1 = (unsigned char) *s1++;
-      c2 = (unsigned char) *s2++;
-      if (c1 == '\0')
+      c1 = *s1;
+      c2 = *s2;
+      if (c1 == '\0' || c1 != c2)
 	return c1 - c2;
     }
-  while (c1 == c2);
-
-  return c1 - c2;
+  for (;;)
+    {
+      if (!STRWORD_CROSSES_PAGE (s2))
+	{
+	  uint64_t w1 = *(const strword_t *) s1;
+	  uint64_t w2 = *(const strword_unaligned_t *) s2;
+	  if (!(STRWORD_HAS_ZERO (w1) | (w1 ^ w2)))
+	    {
+	      s1 += 8;
+	      s2 += 8;
+	      continue;
+	    }
+	}
+      for (int i = 0; i < 8; i++)
+	{
+	  c1 = *s1++;
+	  c2 = *s2++;
+	  if (c1 == '\0' || c1 != c2)
+	    return c1 - c2;
+	}
+    }
 }
 
 
@@ -37,6 +60,28 @@ int strcmp (const char *p1, const char *p2)
  */
 int strncmp(const char *s1, const char *s2, size_t n)
 {
+    for ( ; n > 0 && ((uintptr_t)s1 & 7); s1++, s2++, --n)
+	if (*s1 != *s2)
+	    return ((*(unsigned char *)s1 < *(unsigned char *)s2) ? -1 : +1);
+	else if (*s1 == '\0')
+	    return 0;
+    while (n >= 8) {
+	if (!STRWORD_CROSSES_PAGE(s2)) {
+	    uint64_t w1 = *(const strword_t *)s1;
+	    uint64_t w2 = *(const strword_unaligned_t *)s2;
+	    if (!(STRWORD_HAS_ZERO(w1) | (w1 ^ w2))) {
+		s1 += 8;
+		s2 += 8;
+		n -= 8;
+		continue;
+	    }
+	}
+	for (int i = 0; i < 8; i++, s1++, s2++, --n)
+	    if (*s1 != *s2)
+		return ((*(unsigned char *)s1 < *(unsigned char *)s2) ? -1 : +1);
+	    else if (*s1 == '\0')
+		return 0;
+    }
     for ( ; n > 0; s1++, s2++, --n)
 	if (*s1 != *s2)
 	    return ((*(unsigned char *)s1 < *(unsigned char *)s2) ? -1 : +1);
@@ -1,21 +1,61 @@
 #include <strlen.h>
+#include "strings/strword.h"
+#include "strings/strsimd.h"
+#include "fpu.h"
+
+// Scans a word at a time from the first 8 byte boundary.  An aligned word never spans two pages, so reading past the
+// terminator can't fault.
+size_t strlen_word(const char* str) {
+    const char* p = str;
+
+    for (; (uintptr_t)p & 7; p++)
+        if (*p == 0)
+            return p - str;
+    for (;; p += 8) {
+        uint64_t zero = STRWORD_HAS_ZERO(*(const strword_t*)p);
+        if (zero)
+            return p - str + STRWORD_FIRST_BYTE(zero);
+    }
+}
 
 size_t strlen(const char* str) {
-          size_t ret = 0;
-        while ( str[ret] != 0 )
-                ret++;
-        return ret;
+    const char* p = str;
+    const char* simdStart;
+    size_t len;
+
+    for (; (uintptr_t)p & 7; p++)
+        if (*p == 0)
+            return p - str;
+    // Most strings end well before the vector routine would pay for its FPU section
+    for (simdStart = p + STRINGS_SIMD_THRESHOLD; p < simdStart; p += 8) {
+        uint64_t zero = STRWORD_HAS_ZERO(*(const strword_t*)p);
+        if (zero)
+            return p - str + STRWORD_FIRST_BYTE(zero);
+    }
+    if (kStrlenSimd == NULL || !kernel_fpu_usable())
+        return p - str + strlen_word(p);
+    kernel_fpu_begin();
+    len = kStrlenSimd(p);
+    kernel_fpu_end();
+    return p - str + len;
 }
 
+// maxLen <= 0 means no limit
 size_t strnlen(const char* str, int maxLen) {
-    size_t ret = 0;
-    int len = 0;
+    const char* p = str;
+    size_t left = maxLen;
 
-          while ( str[ret] != 0 )
-        {
-                ret++;
-                if (++len==maxLen)
-                    break;
-        }
-        return ret;
+    if (maxLen <= 0)
+        return strlen(str);
+    for (; ((uintptr_t)p & 7) && left; p++, left--)
+        if (*p == 0)
+            return p - str;
+    for (; left >= 8; p += 8, left -= 8) {
+        uint64_t zero = STRWORD_HAS_ZERO(*(const strword_t*)p);
+        if (zero)
+            return p - str + STRWORD_FIRST_BYTE(zero);
+    }
+    for (; left && *p != 0; p++, left--)
+        ;
+    return p - str;
 }
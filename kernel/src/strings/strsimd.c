@@ -0,0 +1,134 @@
+#include "strings/strsimd.h"
+#include "memory/memops.h"
+#include "serial_logging.h"
+
+// Callers run these between kernel_fpu_begin and kernel_fpu_end
+
+strings_strlen_t kStrlenSimd = NULL;
+strings_memcmp_t kMemcmpSimd = NULL;
+
+/// @brief Pick the vector strlen/memcmp for this CPU.  Called after memops_init, which has worked out whether AVX2 is usable.
+void strings_init() {
+    if (kMemopsFeatures & MEMOPS_FEATURE_AVX2) {
+        kStrlenSimd = strlen_avx2;
+        kMemcmpSimd = memcmp_avx2;
+    } else {
+        kStrlenSimd = strlen_sse2;
+        kMemcmpSimd = memcmp_sse2;
+    }
+    printd(DEBUG_BOOT, "STRINGS: %s strlen/memcmp past 0x%x bytes\n", (kMemopsFeatures & MEMOPS_FEATURE_AVX2)?"AVX2":"SSE2", STRINGS_SIMD_THRESHOLD);
+}
+
+size_t strlen_sse2(const char* str) {
+    const char* p = (const char*)((uintptr_t)str & ~(uintptr_t)15);
+    uint32_t mask;
+
+    // Aligned loads never reach into the next page.  The bytes of the first one before str are shifted out of the mask.
+    __asm__ __volatile__(
+        "pxor xmm0, xmm0\n\t"
+        "movdqa xmm1, [%1]\n\t"
+        "pcmpeqb xmm1, xmm0\n\t"
+        "pmovmskb %0, xmm1\n\t"
+        : "=r"(mask) : "r"(p) : "memory");
+    mask >>= str - p;
+    if (mask)
+        return __builtin_ctz(mask);
+    __asm__ __volatile__(
+        "pxor xmm0, xmm0\n\t"
+        "1:\n\t"
+        "add %0, 16\n\t"
+        "movdqa xmm1, [%0]\n\t"
+        "pcmpeqb xmm1, xmm0\n\t"
+        "pmovmskb %1, xmm1\n\t"
+        "test %1, %1\n\t"
+        "jz 1b\n\t"
+        : "+r"(p), "=r"(mask) : : "memory", "cc");
+    return p - str + __builtin_ctz(mask);
+}
+
+size_t strlen_avx2(const char* str) {
+    const char* p = (const char*)((uintptr_t)str & ~(uintptr_t)31);
+    uint32_t mask;
+
+    __asm__ __volatile__(
+        "vpxor ymm0, ymm0, ymm0\n\t"
+        "vmovdqa ymm1, [%1]\n\t"
+        "vpcmpeqb ymm1, ymm1, ymm0\n\t"
+        "vpmovmskb %0, ymm1\n\t"
+        : "=r"(mask) : "r"(p) : "memory");
+    mask >>= str - p;
+    if (mask) {
+        __asm__ __volatile__("vzeroupper");
+        return __builtin_ctz(mask);
+    }
+    __asm__ __volatile__(
+        "vpxor ymm0, ymm0, ymm0\n\t"
+        "1:\n\t"
+        "add %0, 32\n\t"
+        "vmovdqa ymm1, [%0]\n\t"
+        "vpcmpeqb ymm1, ymm1, ymm0\n\t"
+        "vpmovmskb %1, ymm1\n\t"
+        "test %1, %1\n\t"
+        "jz 1b\n\t"
+        "vzeroupper\n\t"
+        : "+r"(p), "=r"(mask) : : "memory", "cc");
+    return p - str + __builtin_ctz(mask);
+}
+
+int memcmp_sse2(const void* ptr1, const void* ptr2, size_t num) {
+    const unsigned char* a = ptr1;
+    const unsigned char* b = ptr2;
+    uint32_t mask = 0;
+
+    // mask ends up with a bit set for each byte of the first differing block which doesn't match
+    if (num >= 16)
+        __asm__ __volatile__(
+            "1:\n\t"
+            "movdqu xmm0, [%1]\n\t"
+            "movdqu xmm1, [%2]\n\t"
+            "pcmpeqb xmm0, xmm1\n\t"
+            "pmovmskb %0, xmm0\n\t"
+            "xor %0, 0xFFFF\n\t"
+            "jnz 2f\n\t"
+            "add %1, 16\n\t"
+            "add %2, 16\n\t"
+            "sub %3, 16\n\t"
+            "cmp %3, 16\n\t"
+            "jae 1b\n\t"
+            "2:\n\t"
+            : "=&r"(mask), "+r"(a), "+r"(b), "+r"(num) : : "memory", "cc");
+    if (mask) {
+        int index = __builtin_ctz(mask);
+        return (int)a[index] - (int)b[index];
+    }
+    return memcmp_word(a, b, num);
+}
+
+int memcmp_avx2(const void* ptr1, const void* ptr2, size_t num) {
+    const unsigned char* a = ptr1;
+    const unsigned char* b = ptr2;
+    uint32_t mask = 0;
+
+    if (num >= 32)
+        __asm__ __volatile__(
+            "1:\n\t"
+            "vmovdqu ymm0, [%1]\n\t"
+            "vpcmpeqb ymm0, ymm0, [%2]\n\t"
+            "vpmovmskb %0, ymm0\n\t"
+            "not %0\n\t"
+            "test %0, %0\n\t"
+            "jnz 2f\n\t"
+            "add %1, 32\n\t"
+            "add %2, 32\n\t"
+            "sub %3, 32\n\t"
+            "cmp %3, 32\n\t"
+            "jae 1b\n\t"
+            "2:\n\t"
+            "vzeroupper\n\t"
+            : "=&r"(mask), "+r"(a), "+r"(b), "+r"(num) : : "memory", "cc");
+    if (mask) {
+        int index = __builtin_ctz(mask);
+        return (int)a[index] - (int)b[index];
+    }
+    return memcmp_word(a, b, num);
+}
@@ -1,80 +1,58 @@
 #include "strstr.h"
+#include "strings/strchr.h"
+#include "strings/strcmp.h"
+#include "strings/strlen.h"
+#include "memory/memcmp.h"
 
 char* strstr(const char* string, const char* substring)
 {
-    register const char *a, *b;
+    size_t len = strlen(substring);
 
-    /* First scan quickly through the two strings looking for a
-     * single-character match.  When it's found, then compare the
-     * rest of the substring.
+    /* strchr skips a word at a time to each candidate for the
+     * first character, then the rest of the substring is compared.
      */
-
-    b = substring;
-    if (*b == 0) 
+    if (len == 0)
     {
         return (char *)string;
     }
-    for ( ; *string != 0; string += 1) 
+    for ( ; (string = strchr(string, *substring)) != 0; string += 1)
     {
-        if (*string != *b) 
-        {
-            continue;
-        }
-        a = string;
-        while (1) 
+        if (strncmp(string + 1, substring + 1, len - 1) == 0)
         {
-            if (*b == 0) 
-            {
-                return (char *)string;
-            }
-            if (*a++ != *b++) 
-            {
-                break;
-            }
+            return (char *)string;
         }
-        b = substring;
     }
     return (char *)0;
 }
 
+/* Find substring in the first length characters of string.  The
+ * whole match has to lie within them.
+ */
 char* strnstr(const char* string, const char* substring, int length)
 {
-    register const char *a, *b;
+    size_t len = strlen(substring);
+    size_t searchLen;
+    const char* last;
 
-    /* First scan quickly through the two strings looking for a
-     * single-character match.  When it's found, then compare the
-     * rest of the substring.
-     */
-    int len = length;
-
-    b = substring;
-    if (*b == 0) 
+    if (len == 0)
     {
         return (char *)string;
     }
-    for ( ; *string != 0; string += 1) 
+    if (length <= 0)
     {
-        if (*string != *b) 
-        {
-            if (len-- <= 0)
-                return (char *)string;
-            continue;
-        }
-        a = string;
-        while (1) 
+        return (char *)0;
+    }
+    searchLen = strnlen(string, length);
+    if (searchLen < len)
+    {
+        return (char *)0;
+    }
+    for (last = string + searchLen - len; string <= last; string += 1)
+    {
+        if (*string == *substring && memcmp(string + 1, substring + 1, len - 1) == 0)
         {
-            if (*b == 0) 
-            {
-                return (char *)string;
-            }
-            if (len-- <= 0)
-                return (char *)string;
-            if (*a++ != *b++) 
-            {
-                break;
-            }
+            return (char *)string;
         }
-        b = substring;
     }
     return (char *)0;
 }
@@ -9,7 +9,11 @@
 #include "smp_core.h"
 #include "memory/memcpy.h"
 #include "memory/paging.h"
+#include "memory/vma.h"
 #include "log.h"
+#include "task.h"
+#include "x86_64.h"
+#include "fpu.h"
 
 #define SYSCALL_RESULT_INVALID UINT64_C(0xFFFFFFFFFFFFFFFF)
 #define SYSCALL_RESULT_BAD_USER_DATA UINT64_C(0xFFFFFFFFFFFFFFFE)
@@ -25,10 +29,16 @@ static uint64_t syscall_yield(uint64_t arg0, uint64_t arg1, uint64_t arg2,
     uint64_t arg3, uint64_t arg4, uint64_t arg5);
 static uint64_t syscall_debug_log(uint64_t arg0, uint64_t arg1, uint64_t arg2,
     uint64_t arg3, uint64_t arg4, uint64_t arg5);
+static uint64_t syscall_fork(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+    uint64_t arg3, uint64_t arg4, uint64_t arg5);
+static uint64_t syscall_brk(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+    uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
 syscall_entry_t syscall_table[MAX_SYSCALLS] = {
 	SYSCALL_DEFINE(0, "yield", syscall_yield, false, false),
 	SYSCALL_DEFINE(1, "debug_log", syscall_debug_log, true, true),
+	SYSCALL_DEFINE(2, "fork", syscall_fork, false, false),
+	SYSCALL_DEFINE(3, "brk", syscall_brk, false, false),
 };
 
 uint64_t _syscall(void)
@@ -108,7 +118,7 @@ void switch_to_kernel_cr3(void)
 
 	if (current_cr3 != (uint64_t)kKernelPML4)
 	{
-		asm volatile("mov cr3, %0" :: "r"((uint64_t)kKernelPML4) : "memory");
+		paging_write_cr3((uint64_t)kKernelPML4);
 	}
 }
 
@@ -125,7 +135,7 @@ void restore_user_cr3(void)
 
 	if (user_cr3 && user_cr3 != (uint64_t)kKernelPML4)
 	{
-		asm volatile("mov cr3, %0" :: "r"(user_cr3) : "memory");
+		paging_write_cr3(user_cr3);
 	}
 }
 
@@ -226,7 +236,7 @@ static bool copy_user_string(const char *user_str, char *buffer, size_t buffer_l
                         uint64_t user_cr3 = g_saved_cr3[cpu_index];
                         if (user_cr3 && user_cr3 != kernel_cr3)
                         {
-                                asm volatile("mov cr3, %0" :: "r"(user_cr3) : "memory");
+                                paging_write_cr3(user_cr3);
                                 temporarily_switched_to_user_cr3 = true;
                         }
                 }
@@ -255,7 +265,7 @@ static bool copy_user_string(const char *user_str, char *buffer, size_t buffer_l
 out:
         if (temporarily_switched_to_user_cr3)
         {
-                asm volatile("mov cr3, %0" :: "r"(original_cr3) : "memory");
+                paging_write_cr3(original_cr3);
         }
 
         return success;
@@ -295,3 +305,83 @@ static uint64_t syscall_debug_log(uint64_t arg0, uint64_t arg1, uint64_t arg2,
 	printf("[user] %s\n", kernel_buffer);
 	return 0;
 }
+
+static uint64_t syscall_fork(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+    uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+	(void)arg0;
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)arg4;
+	(void)arg5;
+
+	core_local_storage_t *cls = get_core_local_storage();
+	thread_t *parentThread = cls->currentThread;
+	task_t *parentTask = (task_t*)parentThread->ownerTask;
+
+	if (parentTask->kernelTask)
+	{
+		return SYSCALL_RESULT_INVALID;
+	}
+
+	task_t *childTask = task_fork(parentTask);
+	thread_t *childThread = childTask->threads;
+	const syscall_frame_t *frame = (const syscall_frame_t*)(cls->kernel_rsp0 - sizeof(syscall_frame_t));
+
+	// The child resumes in user mode where the parent made the syscall, with the registers the syscall preserves
+	childThread->regs.RIP = frame->userRIP;
+	childThread->regs.RSP = frame->userRSP;
+	childThread->regs.RFLAGS = frame->userRFLAGS | 0x200;
+	childThread->regs.RBX = frame->RBX;
+	childThread->regs.RBP = frame->RBP;
+	childThread->regs.R12 = frame->R12;
+	childThread->regs.R13 = frame->R13;
+	childThread->regs.R14 = frame->R14;
+	childThread->regs.R15 = frame->R15;
+	childThread->regs.RAX = 0;
+	childThread->forkedThread = parentThread;
+	fpu_copy_thread(parentThread, childThread);
+
+	uint64_t flags = interrupts_save_and_disable();
+	while (__sync_lock_test_and_set(&kSchedulerSwitchTasksLock, 1));
+	scheduler_submit_new_task(childTask);
+	__sync_lock_release(&kSchedulerSwitchTasksLock);
+	interrupts_restore(flags);
+
+	return childTask->taskID;
+}
+
+// Moves the task's break (the end of its heap) to arg0 and returns the new break.  The pages added are reserved as a VMA
+// and faulted in as they are touched.  The heap can't shrink yet, an arg0 of 0, below the current break or past
+// TASK_HEAP_END leaves it where it is and returns it.
+static uint64_t syscall_brk(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+    uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+	(void)arg1;
+	(void)arg2;
+	(void)arg3;
+	(void)arg4;
+	(void)arg5;
+
+	core_local_storage_t *cls = get_core_local_storage();
+	task_t *task = (task_t*)cls->currentThread->ownerTask;
+
+	if (task->kernelTask)
+	{
+		return SYSCALL_RESULT_INVALID;
+	}
+	if (arg0 <= task->heapEnd || arg0 > TASK_HEAP_END)
+	{
+		return task->heapEnd;
+	}
+
+	// Pages up to the current break, rounded up, are already reserved
+	uint64_t reservedEnd = (task->heapEnd + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK;
+	if (arg0 > reservedEnd && vma_add(task, reservedEnd, arg0 - reservedEnd, PAGE_WRITE | PAGE_USER, VMA_ANONYMOUS) == NULL)
+	{
+		return task->heapEnd;
+	}
+	task->heapEnd = arg0;
+	return task->heapEnd;
+}
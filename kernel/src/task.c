@@ -1,6 +1,7 @@
 #include "task.h"
 #include "CONFIG.h"
 #include "kmalloc.h"
+#include "slab.h"
 #include "thread.h"
 #include "serial_logging.h"
 #include "paging.h"
@@ -17,8 +18,13 @@
 #include "scheduler.h"
 #include "panic.h"
 #include "log.h"
+#include "vma.h"
+#include "cow.h"
+#include "tlb.h"
+#include "zeropool.h"
 
 extern volatile uint64_t kSystemCurrentTime;
+kmem_cache_t* kTaskCache = NULL;
 
 void task_idle_loop()
 {
@@ -30,11 +36,18 @@ void task_idle_loop()
 	}
 }
 
+/// @brief Create the task_t cache.  Called once at boot, before the first task is created or the APs start.
+void task_cache_init()
+{
+	//task_t is mapped into the task at TASK_STRUCT_VADDR so it has to start on a page boundary
+	kTaskCache = kmem_cache_create_aligned("task_t", sizeof(task_t), PAGE_SIZE);
+}
+
 task_t* task_initialize(task_t* parentTask, bool kernelTask, bool idleTask, uint64_t pinnedAPICId)
 {
     printd(DEBUG_TASK,"task_initialize: Initializing task\n");
 
-	task_t* newTask = kmalloc_aligned(sizeof(task_t));
+	task_t* newTask = kmem_cache_alloc(kTaskCache);
     printd(DEBUG_TASK,"task_initialize: Malloc'd 0x%016x for process\n",newTask);
 
 	newTask->parentTask = parentTask;
@@ -46,26 +59,42 @@ task_t* task_initialize(task_t* parentTask, bool kernelTask, bool idleTask, uint
 	}
 	else
 	{
-		newTask->pml4v = (uintptr_t*)get_paging_table_pageV();  
+		newTask->pml4v = (uintptr_t*)paging_create_pml4();
 		newTask->pml4 = (uintptr_t*)((uintptr_t)newTask->pml4v & ~(kHHDMOffset));
+		newTask->pcid = paging_alloc_pcid((uint64_t)newTask->pml4);
 	}
 	newTask->threads = createThread((void*)newTask, kernelTask);
 	newTask->threads->idleThread = idleTask;
 	if (idleTask)
 		newTask->threads->mp_apic = pinnedAPICId;
 	else
-		newTask->threads->mp_apic = 0xffffffffffffffff;
+		newTask->threads->mp_apic = THREAD_NOT_PINNED;
 	newTask->taskID = newTask->threads->threadID;
 	newTask->exited = false;
     printd(DEBUG_TASK,"task_initialize: Mapping the task_t struct into the task, v=0x%08x, p=0x%08x\n",TASK_STRUCT_VADDR,newTask);
 	uint32_t mapPages = sizeof(task_t) / PAGE_SIZE;
 	if (sizeof(task_t) % PAGE_SIZE)
 		mapPages++;
-	paging_map_pages(newTask->pml4v, TASK_STRUCT_VADDR, (uintptr_t)newTask, mapPages, PAGE_PRESENT | PAGE_WRITE);
+	paging_map_pages(newTask->pml4v, TASK_STRUCT_VADDR, VIRT_TO_PHYS(newTask), mapPages, PAGE_PRESENT | PAGE_WRITE);
 
 	return newTask;
 }
 
+/// @brief Free the task's page tables.  Part of task teardown, the task's threads must no longer be able to run.
+/// @param task The task, kernel tasks (which share the kernel's PML4) are left alone
+void task_release_address_space(task_t* task)
+{
+	if (task->pml4v == NULL || (uintptr_t)task->pml4v == kKernelPML4v)
+		return;
+	vma_release_all(task);
+	cow_release_range((pt_entry_t*)task->pml4v, 0, TLB_USER_HALF_END);
+	paging_free_pml4((pt_entry_t*)task->pml4v);
+	paging_free_pcid(task->pcid);
+	task->pml4v = NULL;
+	task->pml4 = NULL;
+	task->pcid = PAGING_KERNEL_PCID;
+}
+
 task_t* task_create(char* path, int argc, char** argv, task_t* parentTaskPtr, bool isKernelTask, uint64_t pinnedAPICID)
 {
 	uintptr_t mapPages;
@@ -100,6 +129,13 @@ task_t* task_create(char* path, int argc, char** argv, task_t* parentTaskPtr, bo
 		newTask->threads->regs.RIP = (uint64_t)&logd_thread;
 	}
 
+	if (strnstr(path, "/pagezero",10))
+	{
+		newTask->threads->regs.CS = GDT_KERNEL_CODE_ENTRY << 3;
+		newTask->threads->regs.RIP = (uint64_t)&zero_pool_thread;
+		newTask->priority = ZERO_POOL_TASK_PRIORITY;
+	}
+
 	gmtime((time_t*)&kSystemCurrentTime,&newTask->startTime);
 
 	//Initialize the heap at 0 bytes
@@ -168,12 +204,53 @@ task_t* task_create(char* path, int argc, char** argv, task_t* parentTaskPtr, bo
 	newTask->envPSize = parentTaskPtr->envPSize;
 	newTask->envSize = parentTaskPtr->envSize;
 
-	//Map the parentTask's environment pointers and values into the new task
-	//TODO: Make the parentTask's environment COW before mapping it into the child
-	mapPages = (newTask->envPSize + newTask->envSize) / PAGE_SIZE;
-	if ((newTask->envPSize + newTask->envSize) % PAGE_SIZE)
-		mapPages++;
-	paging_map_pages(newTask->pml4v, (uintptr_t)newTask->mappedEnvp, (uintptr_t)parentTaskPtr->realEnvp, mapPages,PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+	//Share the parentTask's environment pointers and values with the new task copy-on-write.  The kernel task's parentTask
+	//is a placeholder without a PML4, its environment is mapped into the kernel's.
+	pt_entry_t* parentPML4 = parentTaskPtr->pml4v?(pt_entry_t*)parentTaskPtr->pml4v:(pt_entry_t*)kKernelPML4v;
+	if ((pt_entry_t*)newTask->pml4v != parentPML4)
+		cow_share_range(parentPML4, (pt_entry_t*)newTask->pml4v, (uintptr_t)newTask->mappedEnvp,
+				(uintptr_t)newTask->mappedEnvp + newTask->envPSize + newTask->envSize, PAGE_USER);
+
+	return newTask;
+}
+
+/// @brief Create a copy of a user task whose address space shares all of the parent's pages copy-on-write.  The child's
+/// thread is left for the caller to set up (i.e. from the parent's syscall frame) and submit to the scheduler.
+/// @param parentTask The task being forked, which must be the one running
+/// @return The child task
+task_t* task_fork(task_t* parentTask)
+{
+	task_t* newTask = task_initialize(parentTask, false, false, 0);
+
+	newTask->path = kmalloc(TASK_MAX_PATH_LEN);
+	strncpy(newTask->path, parentTask->path, TASK_MAX_PATH_LEN);
+	strcpy(newTask->exename, parentTask->exename);
+	newTask->cwd = (char*)kmalloc(PAGE_SIZE);
+	strncpy(newTask->cwd, parentTask->cwd, TASK_MAX_PATH_LEN);
+	newTask->priority = parentTask->priority;
+	newTask->stdin = parentTask->stdin;
+	newTask->stdout = parentTask->stdout;
+	newTask->stderr = parentTask->stderr;
+	newTask->heapStart = parentTask->heapStart;
+	newTask->heapEnd = parentTask->heapEnd;
+	newTask->entryPoint = parentTask->entryPoint;
+	newTask->argc = parentTask->argc;
+	newTask->argv = parentTask->argv;
+	newTask->mappedEnvp = parentTask->mappedEnvp;
+	newTask->mappedEnv = parentTask->mappedEnv;
+	newTask->realEnvp = parentTask->realEnvp;
+	newTask->realEnv = parentTask->realEnv;
+	newTask->envPSize = parentTask->envPSize;
+	newTask->envSize = parentTask->envSize;
+	gmtime((time_t*)&kSystemCurrentTime,&newTask->startTime);
 
+	//The whole user half, except for what task_initialize already mapped (the child's own task_t).  The parent's stack
+	//comes along with everything else, the child returns from fork on it.
+	cow_share_range((pt_entry_t*)parentTask->pml4v, (pt_entry_t*)newTask->pml4v, 0, TLB_USER_HALF_END, 0);
+	vma_copy_all(parentTask, newTask);
+
+	newTask->justForked = true;
+	parentTask->forkChildCR3 = newTask->threads->regs.CR3;
+	printd(DEBUG_TASK, "task_fork: Forked task %u from %u, CR3=0x%016lx\n", newTask->taskID, parentTask->taskID, parentTask->forkChildCR3);
 	return newTask;
-}
\ No newline at end of file
+}
@@ -2,7 +2,9 @@
 #include <stdbool.h>
 #include "thread.h"
 #include "kmalloc.h"
+#include "slab.h"
 #include "allocator.h"
+#include "buddy.h"
 #include "paging.h"
 #include "BasicRenderer.h"
 #include "serial_logging.h"
@@ -17,6 +19,7 @@ extern uintptr_t kKernelBaseAddressP;
 //Will be a BSS variable so all indices will be 0 when the kernel is loaded
 uint64_t kTIDBitmap[MAX_THREADS / sizeof(uint64_t) * 8];
 uint32_t kFirstAvailableThreadID = RESERVED_THREADS;
+kmem_cache_t* kThreadCache = NULL;
 
 /// @brief Attempts to set a bitmap bit to indicate that we are marking that index as "used".
 /// @param tid The thread ID to mark as used
@@ -73,38 +76,92 @@ bool mark_TID_unused(uint32_t tid)
 	return wasSet;
 }
 
-/// @brief Create and return a block of aligned, guarded stack memory
-/// @param pml4 CR3 for the thread
-/// @param virtualStart The virtual address to map the stack to.  This value is populated by this function, on return
-/// @param requestedLength The length of the stack to be created
-/// @param isRing3Stack Is this a user stack (for including PAGE_USER in the mapping flags)
-/// @return The physical start address of the block of unmapped memory preceding the stack
-uintptr_t thread_allocate_guarded_stack_memory(uintptr_t pml4, uintptr_t *virtualStart, uint64_t requestedLength, bool isRing3Stack)
+//Map a zeroed page at address unless one is already there (a stack slot reused along with its thread ID)
+static uintptr_t thread_populate_stack_page(pt_entry_t* pml4, uintptr_t address, bool isRing3Stack)
 {
-	//Create and return a block of aligned, guarded stack memory
-	//To do so, allocate more memory than we need and leave the first Xk and last Xk unmapped (paging)
-	//Allocate THREAD_STACK_GUARD_PAGE_COUNT * 2 so there is room for THREAD_STACK_GUARD_PAGE_COUNT pages on each side of the stack
-	uint64_t physStackAddress = allocate_memory_aligned(requestedLength + (THREAD_STACK_GUARD_PAGE_COUNT * PAGE_SIZE * 2));
-	if (!physStackAddress) {
-    	panic("Failed to allocate stack memory!\n");
-	}
-    //If *no* starting virtual address, then calculate on in HHMD
-    if (*virtualStart==0)
-    {
-    	*virtualStart = physStackAddress | kHHDMOffset;//isRing3Stack?THREAD_USER_STACK_INITIAL_VIRT_ADDRESS:THREAD_KERNEL_STACK_VIRTUAL_START;
-    	//				(physStackAddress + (PAGE_SIZE*THREAD_STACK_GUARD_PAGE_COUNT)) | kHHDMOffset;
-    }
 	uint64_t flags = PAGE_PRESENT | PAGE_WRITE;
+	uintptr_t page = paging_walk_paging_table(pml4, address);
+
+	if (page != 0xbadbadba)
+		return page;
 	if (isRing3Stack)
 		flags |= PAGE_USER;
+	page = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+	if (page == 0)
+		panic("Failed to allocate stack memory!\n");
+	memset((void*)PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+	paging_map_page(pml4, address & PAGE_ADDRESS_MASK, page, flags);
+	return page;
+}
+
+/// @brief Reserve a thread's guarded stack in its stack slot.  Kernel stacks are populated in full.  Only the top page of a
+/// user stack is, the rest is faulted in by thread_handle_stack_fault as the stack grows.
+/// @param pml4 PML4 (virtual) to map a user stack into.  Kernel stacks always go into the kernel PML4.
+/// @param threadID The thread the stack is for, which picks the slot
+/// @param virtualStart Populated with the lowest address of the stack, on return
+/// @param requestedLength The length of the stack to be created
+/// @param isRing3Stack Is this a user stack (for including PAGE_USER in the mapping flags)
+/// @return The physical address of the stack's top page
+uintptr_t thread_allocate_guarded_stack_memory(uintptr_t pml4, uint64_t threadID, uintptr_t *virtualStart, uint64_t requestedLength, bool isRing3Stack)
+{
+	uintptr_t topPage, physTopPage;
+
+	if (isRing3Stack)
+		*virtualStart = THREAD_USER_STACK_REGION_BASE + (threadID * THREAD_USER_STACK_SLOT_SIZE);
+	else
+	{
+		*virtualStart = THREAD_KERNEL_STACK_REGION_BASE + (threadID * THREAD_KERNEL_STACK_SLOT_SIZE);
+		pml4 = (uintptr_t)kKernelPML4v;
+	}
+	*virtualStart += THREAD_STACK_GUARD_PAGE_COUNT * PAGE_SIZE;
+
+	topPage = (*virtualStart + requestedLength - 1) & PAGE_ADDRESS_MASK;
+	physTopPage = thread_populate_stack_page((pt_entry_t*)pml4, topPage, isRing3Stack);
+	//A fault on a kernel stack can be taken while the buddy or page table lock is held, which populating the page would need
+	//again.  Kernel stacks are never demand paged.
+	if (!isRing3Stack)
+		for (uintptr_t page = *virtualStart; page < topPage; page += PAGE_SIZE)
+			thread_populate_stack_page((pt_entry_t*)pml4, page, false);
+	return physTopPage;
+}
 
-	uint64_t pagesToMap = requestedLength / PAGE_SIZE;
-	if (requestedLength % PAGE_SIZE)
-		pagesToMap++;
-	uint64_t physStartMapAddress = physStackAddress + (PAGE_SIZE*THREAD_STACK_GUARD_PAGE_COUNT);
-	paging_map_pages((pt_entry_t*)pml4, *virtualStart, physStartMapAddress, pagesToMap, flags);
+/// @brief Populate the page of a user stack which address is in.  Called by the page fault handler.  Kernel stacks are
+/// populated in full when they are created, a fault on one is always an overflow.
+/// @param address The faulting address (CR2)
+/// @param error_code The page fault error code
+/// @return true if the page is now mapped and the faulting instruction can be restarted
+bool thread_handle_stack_fault(uint64_t address, uint64_t error_code)
+{
+	uint64_t cr3;
 
-	return physStackAddress;
+	if (error_code & PAGE_FAULT_PRESENT)
+		return false;
+	if (address >= THREAD_KERNEL_STACK_REGION_BASE && address < THREAD_KERNEL_STACK_REGION_BASE + (MAX_THREADS * (uint64_t)THREAD_KERNEL_STACK_SLOT_SIZE))
+	{
+		printd(DEBUG_EXCEPTIONS, "Thread %u overflowed its kernel stack, fault at 0x%016lx\n", (address - THREAD_KERNEL_STACK_REGION_BASE) / THREAD_KERNEL_STACK_SLOT_SIZE, address);
+		return false;
+	}
+	if (address < THREAD_USER_STACK_REGION_BASE || address >= THREAD_USER_STACK_REGION_BASE + (MAX_THREADS * (uint64_t)THREAD_USER_STACK_SLOT_SIZE))
+		return false;
+	//User stacks belong to the address space being run.  The kernel PML4 has none.
+	__asm__ __volatile__("mov %0, cr3" : "=r"(cr3));
+	cr3 &= 0x000FFFFFFFFFF000ULL;
+	if (cr3 == kKernelPML4)
+		return false;
+
+	uint64_t threadID = (address - THREAD_USER_STACK_REGION_BASE) / THREAD_USER_STACK_SLOT_SIZE;
+	uint64_t offset = (address - THREAD_USER_STACK_REGION_BASE) % THREAD_USER_STACK_SLOT_SIZE;
+	if (!(kTIDBitmap[threadID / 64] & (1ULL << (threadID % 64))))
+		return false;
+	if (offset < THREAD_STACK_GUARD_PAGE_COUNT * PAGE_SIZE || offset >= (THREAD_STACK_GUARD_PAGE_COUNT * PAGE_SIZE) + THREAD_USER_STACK_SIZE)
+	{
+		printd(DEBUG_EXCEPTIONS, "Thread %u overflowed its user stack, fault at 0x%016lx\n", threadID, address);
+		return false;
+	}
+
+	thread_populate_stack_page((pt_entry_t*)PHYS_TO_VIRT(cr3), address, true);
+	printd(DEBUG_THREAD | DEBUG_DETAILED, "Thread %u user stack grew to 0x%016lx\n", threadID, address & PAGE_ADDRESS_MASK);
+	return true;
 }
 
 uint64_t get_thread_id()
@@ -119,12 +176,18 @@ uint64_t get_thread_id()
 	return tid;
 }
 
+/// @brief Create the thread_t cache.  Called once at boot, before the first thread is created or the APs start.
+void thread_cache_init()
+{
+	kThreadCache = kmem_cache_create("thread_t", sizeof(thread_t));
+}
+
 thread_t* createThread(void* ownerTask, bool kernelThread)
 {
 	thread_t* newThread;
 
-	//Kmalloc zeroes out all memory so the thread context and other elements will be initialized to zeroes
-	newThread = kmalloc(sizeof(thread_t));
+	//kmem_cache_alloc zeroes out the object so the thread context and other elements will be initialized to zeroes
+	newThread = kmem_cache_alloc(kThreadCache);
 
 	newThread->ownerTask = (void*)ownerTask;
 
@@ -132,11 +195,9 @@ thread_t* createThread(void* ownerTask, bool kernelThread)
 
 	//TODO: Fixme - is one of the wrong?
 	newThread->regs.userCR3 = ((task_t*)ownerTask)->pml4;
-	newThread->regs.CR3 = (uint64_t)((task_t*)ownerTask)->pml4;
+	newThread->regs.CR3 = (uint64_t)((task_t*)ownerTask)->pml4 | ((task_t*)ownerTask)->pcid;
     printd(DEBUG_THREAD,"createThread: Set thread PML4 to %p\n",newThread->regs.userCR3);
 
-	paging_map_kernel_into_pml4(((task_t*)ownerTask)->pml4v);
-
 	if (kernelThread)
 	{
 		newThread->regs.DS = newThread->regs.ES = newThread->regs.FS = newThread->regs.GS = newThread->regs.SS = GDT_KERNEL_DATA_ENTRY << 3;
@@ -146,12 +207,12 @@ thread_t* createThread(void* ownerTask, bool kernelThread)
 	{
 		newThread->regs.DS = newThread->regs.ES = newThread->regs.FS = newThread->regs.GS = newThread->regs.SS = GDT_USER_DATA_ENTRY << 3 | 3;
 		newThread->regs.CS = GDT_USER_CODE_ENTRY << 3 | 3;
-		newThread->esp3BaseV = 0;
-		newThread->esp3BaseP = thread_allocate_guarded_stack_memory((uintptr_t)((task_t*)ownerTask)->pml4v, &newThread->esp3BaseV, THREAD_USER_STACK_SIZE, true);
+		newThread->esp3Size = THREAD_USER_STACK_SIZE;
+		newThread->esp3BaseP = thread_allocate_guarded_stack_memory((uintptr_t)((task_t*)ownerTask)->pml4v, newThread->threadID, &newThread->esp3BaseV, THREAD_USER_STACK_SIZE, true);
 	    printd(DEBUG_THREAD | DEBUG_DETAILED,"Created guarded ring3 stack for thread at P=0x%016lx, P=0x%016lx\n", newThread->esp3BaseP, newThread->esp3BaseV);
 	}
-	newThread->esp0BaseV = 0;
-	newThread->esp0BaseP = (uintptr_t)thread_allocate_guarded_stack_memory((uintptr_t)((task_t*)ownerTask)->pml4v, &newThread->esp0BaseV, THREAD_KERNEL_STACK_SIZE, false);
+	newThread->esp0Size = THREAD_KERNEL_STACK_SIZE;
+	newThread->esp0BaseP = thread_allocate_guarded_stack_memory((uintptr_t)((task_t*)ownerTask)->pml4v, newThread->threadID, &newThread->esp0BaseV, THREAD_KERNEL_STACK_SIZE, false);
 	printd(DEBUG_THREAD | DEBUG_DETAILED,"Created guarded ring0 stack for thread at P=0x%016lx, V=0x%016lx\n", newThread->esp0BaseP, newThread->esp0BaseV);
 
 	printd(DEBUG_THREAD | DEBUG_DETAILED,"createThread: Initialized %s thread segment registers, CS=0x%08x, others=0x%08x\n", kernelThread?"kernel":"user", newThread->regs.CS, newThread->regs.DS);
@@ -168,14 +229,16 @@ thread_t* createThread(void* ownerTask, bool kernelThread)
 	else
 	{
 		newThread->regs.SS = GDT_USER_DATA_ENTRY << 3;
-		newThread->regs.RSP = newThread->esp3BaseV + THREAD_KERNEL_STACK_SIZE - sizeof(uintptr_t) * 6;
+		//The user stack starts in its top page, the only one of it populated up front
+		newThread->regs.RSP = newThread->esp3BaseV + THREAD_USER_STACK_SIZE - sizeof(uintptr_t) * 6;
 		newThread->regs.SS0 = GDT_KERNEL_DATA_ENTRY << 3;
-		newThread->regs.RSP0 = newThread->esp3BaseV + THREAD_KERNEL_STACK_SIZE - sizeof(uintptr_t) * 6;
+		newThread->regs.RSP0 = newThread->esp0BaseV + THREAD_KERNEL_STACK_SIZE - sizeof(uintptr_t) * 6;
 	}
 
 	newThread->regs.RFLAGS = 0x202;  //Interrupts enabled, reserved bit 1 set
 
 	newThread->exited = false;
+	newThread->runQueueCpu = THREAD_NO_CPU;
 	newThread->next=NO_THREAD;
 	return newThread;
 }
\ No newline at end of file
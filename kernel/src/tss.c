@@ -10,6 +10,7 @@ extern uintptr_t kKernelStack;
 
 static tss_t kTSSPerCPU[MAX_CPUS];
 static uint16_t kTSSSelector[MAX_CPUS];
+static uint8_t kTSSPageFaultStacks[MAX_CPUS][TSS_IST_STACK_SIZE] __attribute__((aligned(16)));
 
 static inline int tss_descriptor_index(uint32_t cpu_index)
 {
@@ -36,6 +37,7 @@ void tss_initialize_cpu(uint32_t cpu_index)
     *tss = (tss_t){0};
     tss->iomap_base = sizeof(tss_t);
     tss->rsp0 = kKernelStack + KERNEL_STACK_SIZE - 8;
+    tss->ist1 = (uint64_t)&kTSSPageFaultStacks[cpu_index][TSS_IST_STACK_SIZE];
 
     tss_install_descriptor(cpu_index, tss);
 
@@ -1,6 +1,37 @@
 #include "test_framework.h"
 
 #include "memory/kmalloc.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "memory/allocstats.h"
+#include "memory/arena.h"
+#include "memory/slab.h"
+#include "memory/paging.h"
+#include "memory/vma.h"
+#include "memory/cow.h"
+#include "memory/memops.h"
+#include "memory/memcmp.h"
+#include "memory/memset.h"
+#include "strings/strings.h"
+#include "strings/strsimd.h"
+#include "fpu.h"
+#include "scheduler.h"
+#include "task.h"
+#include "smp_core.h"
+#include "x86_64.h"
+
+#define KMALLOC_BENCH_ITERATIONS 256
+#define ALLOCATOR_TREE_TEST_ALLOCATIONS 96
+// Enough objects to run through a magazine and the shared free list, so the cache has to grow
+#define SLAB_TEST_OBJECTS (SLAB_MAGAZINE_SIZE * 3)
+#define MEMOPS_TEST_SIZE 1000
+// Bytes each memops benchmark copies or fills, split into as many calls as the size needs
+#define MEMOPS_BENCH_BYTES (16 * 1024 * 1024)
+#define MEMOPS_BENCH_MAX_SIZE (2 * 1024 * 1024)
+#define STRINGS_TEST_SIZE 600
+#define STRINGS_BENCH_ITERATIONS 4096
+
+extern task_t *kKernelTask;
 
 static test_case_t g_test_cases[TEST_MAX_CASES];
 static size_t g_test_case_count = 0;
@@ -31,9 +62,918 @@ static bool test_kmalloc_not_null(void)
     return true;
 }
 
+static bool test_buddy_free_coalesces(void)
+{
+    uint64_t free_before = kBuddyFreePageCount;
+    uint64_t address = allocate_memory_aligned(3 * PAGE_SIZE);
+
+    if (kBuddyFreePageCount != free_before - 3) {
+        TEST_FAIL("buddy allocator did not give back the rounded up page");
+    }
+    if (free_memory(address) != ALLOCATOR_FREED_PAGES) {
+        TEST_FAIL("free_memory did not return the pages to the buddy allocator");
+    }
+    if (kBuddyFreePageCount != free_before) {
+        TEST_FAIL("buddy free page count not restored after free");
+    }
+    return true;
+}
+
+typedef struct {
+    uint64_t entries;
+    uint64_t free_entries;
+    uint32_t prev;
+    bool ok;
+} allocator_tree_walk_t;
+
+// In-order walk of one of the kMemoryStatus trees checking the order, the stored heights and the AVL balance.  Returns
+// the subtree's height.
+static int allocator_walk_tree(int tree, uint32_t idx, allocator_tree_walk_t *walk)
+{
+    if (idx == MEMORY_STATUS_NONE) {
+        return 0;
+    }
+    memory_status_t *entry = &kMemoryStatus[idx];
+    int left = allocator_walk_tree(tree, entry->link[tree][0], walk);
+    if (walk->prev != MEMORY_STATUS_NONE) {
+        memory_status_t *prev = &kMemoryStatus[walk->prev];
+        if (tree == MEMORY_STATUS_SIZE_TREE) {
+            if (prev->length > entry->length ||
+                (prev->length == entry->length && prev->startAddress >= entry->startAddress)) {
+                walk->ok = false;
+            }
+        } else if (prev->startAddress + prev->length > entry->startAddress ||
+                   // Freed blocks are merged with free neighbours, two touching free entries mean a merge was missed
+                   (!prev->in_use && !entry->in_use && prev->startAddress + prev->length == entry->startAddress)) {
+            walk->ok = false;
+        }
+    }
+    if (tree == MEMORY_STATUS_SIZE_TREE && entry->in_use) {
+        walk->ok = false;
+    }
+    walk->prev = idx;
+    walk->entries++;
+    walk->free_entries += !entry->in_use;
+    int right = allocator_walk_tree(tree, entry->link[tree][1], walk);
+    int height = (left > right ? left : right) + 1;
+    if (entry->height[tree] != height || left - right > 1 || right - left > 1) {
+        walk->ok = false;
+    }
+    return height;
+}
+
+static bool allocator_trees_valid(void)
+{
+    allocator_tree_walk_t by_address = {0, 0, MEMORY_STATUS_NONE, true};
+    allocator_tree_walk_t by_size = {0, 0, MEMORY_STATUS_NONE, true};
+
+    allocator_walk_tree(MEMORY_STATUS_ADDRESS_TREE, kMemoryStatusRoot[MEMORY_STATUS_ADDRESS_TREE], &by_address);
+    allocator_walk_tree(MEMORY_STATUS_SIZE_TREE, kMemoryStatusRoot[MEMORY_STATUS_SIZE_TREE], &by_size);
+    return by_address.ok && by_size.ok && by_address.entries == kMemoryStatusEntryCount &&
+           by_size.entries == by_address.free_entries;
+}
+
+// Interleaved kmalloc/kfree keeps both kMemoryStatus trees ordered and balanced, with every entry counted.  Freeing
+// every other block then the rest makes the second round of frees merge with neighbours on both sides.
+static bool test_allocator_trees_balanced(void)
+{
+    static void *ptrs[ALLOCATOR_TREE_TEST_ALLOCATIONS];
+
+    for (int cnt = 0; cnt < ALLOCATOR_TREE_TEST_ALLOCATIONS; cnt++) {
+        ptrs[cnt] = kmalloc((cnt * 37) % 500 + 1);
+        if (cnt % 3 == 2) {
+            kfree(ptrs[cnt - 1]);
+            ptrs[cnt - 1] = NULL;
+        }
+    }
+    if (!allocator_trees_valid()) {
+        TEST_FAIL("kMemoryStatus trees invalid after interleaved kmalloc/kfree");
+    }
+    for (int cnt = 0; cnt < ALLOCATOR_TREE_TEST_ALLOCATIONS; cnt += 2) {
+        if (ptrs[cnt] != NULL) {
+            kfree(ptrs[cnt]);
+            ptrs[cnt] = NULL;
+        }
+    }
+    if (!allocator_trees_valid()) {
+        TEST_FAIL("kMemoryStatus trees invalid after freeing every other block");
+    }
+    uint64_t entries_before = kMemoryStatusEntryCount;
+    for (int cnt = 0; cnt < ALLOCATOR_TREE_TEST_ALLOCATIONS; cnt++) {
+        if (ptrs[cnt] != NULL) {
+            kfree(ptrs[cnt]);
+        }
+    }
+    if (kMemoryStatusEntryCount >= entries_before) {
+        TEST_FAIL("freeing blocks between free neighbours did not merge any entries");
+    }
+    if (!allocator_trees_valid()) {
+        TEST_FAIL("kMemoryStatus trees invalid after merging frees");
+    }
+    return true;
+}
+
+static bool test_dma32_zone_below_4g(void)
+{
+    uint64_t address = allocate_memory_aligned_zone(2 * PAGE_SIZE, MEMORY_ZONE_DMA32);
+
+    if (address + 2 * PAGE_SIZE > MEMORY_ZONE_DMA32_LIMIT) {
+        TEST_FAIL("DMA32 allocation is not below 4GB");
+    }
+    free_memory(address);
+    return true;
+}
+
+static bool test_allocstats_live_bytes(void)
+{
+    allocator_stats_t before, during, after;
+
+    allocstats_get(&before);
+    void *ptr = kmalloc(100);
+    allocstats_get(&during);
+    kfree(ptr);
+    allocstats_get(&after);
+
+    if (during.live_bytes - before.live_bytes != 104) {
+        TEST_FAIL("kmalloc(100) did not add 104 live bytes");
+    }
+    if (after.live_bytes != before.live_bytes || after.free_count != before.free_count + 1) {
+        TEST_FAIL("kfree did not return the live bytes");
+    }
+    return true;
+}
+
+static bool test_arena_reset_reuses_chunks(void)
+{
+    arena_t *arena = arena_create(PAGE_SIZE);
+    uint8_t *first = arena_alloc(arena, 64);
+
+    // Overflow the first chunk so the arena grows
+    arena_alloc(arena, PAGE_SIZE);
+    if (arena->chunk_count != 2) {
+        TEST_FAIL("arena did not grow when the first chunk filled");
+    }
+    arena_reset(arena);
+    if (arena_alloc(arena, 64) != first) {
+        TEST_FAIL("arena_reset did not rewind to the start of the first chunk");
+    }
+    arena_alloc(arena, PAGE_SIZE);
+    if (arena->chunk_count != 2) {
+        TEST_FAIL("arena allocated a new chunk instead of reusing one after reset");
+    }
+    arena_destroy(arena);
+    return true;
+}
+
+static bool test_slab_alloc_free_reuse(void)
+{
+    kmem_cache_t *cache = kmem_cache_create("slab_test", 40);
+    uint8_t *objects[SLAB_TEST_OBJECTS];
+
+    for (int i = 0; i < SLAB_TEST_OBJECTS; i++) {
+        objects[i] = kmem_cache_alloc(cache);
+        if (objects[i] == NULL || ((uintptr_t)objects[i] & (SLAB_DEFAULT_ALIGNMENT - 1))) {
+            TEST_FAIL("kmem_cache_alloc returned a NULL or misaligned object");
+        }
+        for (int j = 0; j < i; j++) {
+            if (objects[j] == objects[i]) {
+                TEST_FAIL("kmem_cache_alloc handed out the same object twice");
+            }
+        }
+        memset(objects[i], 0xA5, 40);
+    }
+
+    // A freed object goes to this CPU's magazine, so the next allocation gets it back, zeroed
+    uint8_t *freed = objects[SLAB_TEST_OBJECTS / 2];
+    kmem_cache_free(cache, freed);
+    objects[SLAB_TEST_OBJECTS / 2] = kmem_cache_alloc(cache);
+    if (objects[SLAB_TEST_OBJECTS / 2] != freed) {
+        TEST_FAIL("kmem_cache_alloc did not reuse the object just freed");
+    }
+    for (int i = 0; i < 40; i++) {
+        if (freed[i] != 0) {
+            TEST_FAIL("reused slab object was not zeroed");
+        }
+    }
+
+    // Everything freed has to be reused before the cache grows again
+    uint64_t slabs = cache->slab_count;
+    for (int i = 0; i < SLAB_TEST_OBJECTS; i++) {
+        kmem_cache_free(cache, objects[i]);
+    }
+    for (int i = 0; i < SLAB_TEST_OBJECTS; i++) {
+        objects[i] = kmem_cache_alloc(cache);
+    }
+    if (cache->slab_count != slabs) {
+        TEST_FAIL("slab cache grew instead of reusing freed objects");
+    }
+    for (int i = 0; i < SLAB_TEST_OBJECTS; i++) {
+        kmem_cache_free(cache, objects[i]);
+    }
+    return true;
+}
+
+static bool test_paging_tables_reclaimed(void)
+{
+    // PML4 slot 200 is in the lower half and unused by the kernel, so mapping there needs a new PDPT, PD and PT
+    uint64_t virt = 200ULL << PML4_SHIFT;
+    uint64_t page = allocate_memory_aligned(4 * PAGE_SIZE);
+    uint64_t tables_before = kPagingTablePagesInUse;
+
+    paging_map_pages((pt_entry_t *)kKernelPML4v, virt, page, 4, PAGE_PRESENT | PAGE_WRITE);
+    if (kPagingTablePagesInUse != tables_before + 3) {
+        TEST_FAIL("mapping into an empty PML4 slot did not allocate 3 page tables");
+    }
+    paging_unmap_pages((pt_entry_t *)kKernelPML4v, virt, 4 * PAGE_SIZE);
+    free_memory(page);
+    if (kPagingTablePagesInUse != tables_before) {
+        TEST_FAIL("emptied page tables were not released on unmap");
+    }
+
+    // A 2MB page needs no PT, unmapping it has to release the PD and PDPT on their own
+    page = allocate_memory_aligned(PAGE_SIZE_2M);
+    if (page & (PAGE_SIZE_2M - 1)) {
+        free_memory(page);
+        return true;
+    }
+    paging_map_pages((pt_entry_t *)kKernelPML4v, virt, page, PAGE_SIZE_2M / PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE);
+    if (kPagingTablePagesInUse != tables_before + 2) {
+        TEST_FAIL("mapping a 2MB page into an empty PML4 slot did not allocate 2 page tables");
+    }
+    paging_unmap_pages((pt_entry_t *)kKernelPML4v, virt, PAGE_SIZE_2M);
+    free_memory(page);
+    if (kPagingTablePagesInUse != tables_before) {
+        TEST_FAIL("tables emptied by unmapping a 2MB page were not released");
+    }
+    return true;
+}
+
+// Entry of the kernel PML4's page directory for a mapped address
+static pt_entry_t paging_pd_entry(uint64_t virt)
+{
+    pt_entry_t *pml4 = (pt_entry_t *)kKernelPML4v;
+    pt_entry_t *pdpt = (pt_entry_t *)PHYS_TO_VIRT(pml4[(virt >> 39) & 0x1FF] & 0x000FFFFFFFFFF000ULL);
+    pt_entry_t *pd = (pt_entry_t *)PHYS_TO_VIRT(pdpt[(virt >> 30) & 0x1FF] & 0x000FFFFFFFFFF000ULL);
+
+    return pd[(virt >> 21) & 0x1FF];
+}
+
+// An aligned multi-MB range is mapped with 2MB pages.  Unmapping one 4K page inside one of them splits it, the rest of
+// the range has to keep translating to the same physical pages.
+static bool test_paging_large_page_split(void)
+{
+    // PML4 slot 203 is in the lower half and unused by the kernel
+    uint64_t virt = 203ULL << PML4_SHIFT;
+    uint64_t length = 2 * PAGE_SIZE_2M;
+    uint64_t hole = virt + PAGE_SIZE_2M + 0x80000;
+    uint64_t page = allocate_memory_aligned(length);
+    uint64_t tables_before = kPagingTablePagesInUse;
+
+    if (page & (PAGE_SIZE_2M - 1)) {
+        free_memory(page);
+        return true;
+    }
+    paging_map_pages((pt_entry_t *)kKernelPML4v, virt, page, length / PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE);
+    if (!(paging_pd_entry(virt) & PAGE_LARGE) || !(paging_pd_entry(virt + PAGE_SIZE_2M) & PAGE_LARGE)) {
+        TEST_FAIL("an aligned 4MB range was not mapped with 2MB pages");
+    }
+    paging_unmap_page((pt_entry_t *)kKernelPML4v, hole);
+    if (!(paging_pd_entry(virt) & PAGE_LARGE) || (paging_pd_entry(virt + PAGE_SIZE_2M) & PAGE_LARGE)) {
+        TEST_FAIL("unmapping a 4K page split the wrong 2MB page");
+    }
+    for (uint64_t offset = 0; offset < length; offset += PAGE_SIZE) {
+        uint64_t expected = virt + offset == hole ? 0xbadbadba : page + offset;
+        if (paging_walk_paging_table((pt_entry_t *)kKernelPML4v, virt + offset) != expected) {
+            TEST_FAIL("a page of the split 2MB page moved or the unmapped page is still mapped");
+        }
+    }
+    paging_unmap_pages((pt_entry_t *)kKernelPML4v, virt, length);
+    free_memory(page);
+    if (kPagingTablePagesInUse != tables_before) {
+        TEST_FAIL("page tables not released after unmapping the split range");
+    }
+    return true;
+}
+
+// Page table pages under the user half of a PML4, plus the PML4 itself.  These are the ones the address space owns.
+static uint64_t paging_count_user_tables(pt_entry_t *table, int level)
+{
+    uint64_t count = 1;
+    int entries = level == 4 ? PML4_KERNEL_FIRST_ENTRY : 512;
+
+    for (int i = 0; level > 1 && i < entries; i++) {
+        if ((table[i] & (PAGE_PRESENT | PAGE_LARGE)) == PAGE_PRESENT) {
+            count += paging_count_user_tables((pt_entry_t *)PHYS_TO_VIRT(table[i] & 0x000FFFFFFFFFF000ULL), level - 1);
+        }
+    }
+    return count;
+}
+
+static bool test_task_address_space_released(void)
+{
+    // Every user task shares the kernel task's environment copy-on-write, the reference has to go with the task
+    uintptr_t env_page = paging_walk_paging_table((pt_entry_t *)kKernelPML4v, (uintptr_t)kKernelTask->mappedEnvp) & PAGE_ADDRESS_MASK;
+    uint8_t shares_before = kBuddyPages[env_page / PAGE_SIZE].share_count;
+    uint64_t tables_before = kPagingTablePagesInUse;
+    task_t *task = task_create("/test", 0, NULL, kKernelTask, false, 0);
+    uint64_t user_tables = paging_count_user_tables((pt_entry_t *)task->pml4v, 4);
+    // The thread's kernel stack is mapped in the kernel PML4, any tables that took stay with the kernel
+    uint64_t kernel_tables = kPagingTablePagesInUse - tables_before - user_tables;
+
+    if (user_tables < 2) {
+        TEST_FAIL("task_create did not build the task's own page tables");
+    }
+    if (kBuddyPages[env_page / PAGE_SIZE].share_count != shares_before + 1) {
+        TEST_FAIL("task_create did not share the kernel task's environment");
+    }
+    task_release_address_space(task);
+    if (task->pml4v != NULL || kPagingTablePagesInUse != tables_before + kernel_tables) {
+        TEST_FAIL("task_release_address_space did not free the task's page tables");
+    }
+    if (kBuddyPages[env_page / PAGE_SIZE].share_count != shares_before) {
+        TEST_FAIL("task_release_address_space did not drop the task's share of the environment");
+    }
+    return true;
+}
+
+// A user stack is populated from the top down as it faults.  A page below the pre-faulted top is mapped on a fault,
+// the guard pages below the stack never are.
+static bool test_user_stack_demand_paged(void)
+{
+    task_t *task = task_create("/test", 0, NULL, kKernelTask, false, 0);
+    thread_t *thread = task->threads;
+    pt_entry_t *pml4 = (pt_entry_t *)task->pml4v;
+    uint64_t top = thread->esp3BaseV + THREAD_USER_STACK_SIZE - PAGE_SIZE;
+    uint64_t below = top - 3 * PAGE_SIZE + 0x10;
+    uint64_t guard = thread->esp3BaseV - PAGE_SIZE;
+    uint64_t cr3;
+
+    if (paging_walk_paging_table(pml4, top) == 0xbadbadba || paging_walk_paging_table(pml4, below) != 0xbadbadba) {
+        TEST_FAIL("a new user stack should have only its top page mapped");
+    }
+    // The handler works on the address space being run
+    uint64_t flags = interrupts_save_and_disable();
+    __asm__ __volatile__("mov %0, cr3" : "=r"(cr3));
+    __asm__ __volatile__("mov cr3, %0" : : "r"(paging_pml4_cr3(pml4)) : "memory");
+    bool grown = thread_handle_stack_fault(below, PAGE_FAULT_WRITE | PAGE_FAULT_USER);
+    bool guard_resolved = thread_handle_stack_fault(guard, PAGE_FAULT_WRITE | PAGE_FAULT_USER) ||
+                          thread_handle_stack_fault(guard - (THREAD_STACK_GUARD_PAGE_COUNT - 1) * PAGE_SIZE,
+                                                    PAGE_FAULT_WRITE | PAGE_FAULT_USER);
+    __asm__ __volatile__("mov cr3, %0" : : "r"(cr3) : "memory");
+    interrupts_restore(flags);
+
+    if (!grown || paging_walk_paging_table(pml4, below) == 0xbadbadba) {
+        TEST_FAIL("a fault below the top of the user stack was not resolved");
+    }
+    if (paging_walk_paging_table(pml4, below - PAGE_SIZE) != 0xbadbadba) {
+        TEST_FAIL("the stack fault mapped more than the page touched");
+    }
+    if (guard_resolved || paging_walk_paging_table(pml4, guard) != 0xbadbadba) {
+        TEST_FAIL("a fault on a user stack guard page was resolved");
+    }
+    task_release_address_space(task);
+    return true;
+}
+
+static bool test_vma_lookup(void)
+{
+    static task_t task;
+    uint64_t virt = 201ULL << PML4_SHIFT;
+
+    task.pml4v = (uint64_t *)kKernelPML4v;
+    if (vma_add(&task, virt, 4 * PAGE_SIZE, PAGE_WRITE, VMA_ANONYMOUS) == NULL) {
+        TEST_FAIL("vma_add failed on an empty task");
+    }
+    if (vma_add(&task, virt + 3 * PAGE_SIZE, PAGE_SIZE, PAGE_WRITE, VMA_ANONYMOUS) != NULL) {
+        TEST_FAIL("vma_add accepted an overlapping range");
+    }
+    vma_t *second = vma_add(&task, virt + 8 * PAGE_SIZE, 1, 0, VMA_ANONYMOUS);
+    if (second == NULL || second->end != virt + 9 * PAGE_SIZE) {
+        TEST_FAIL("vma_add did not round the length up to a page");
+    }
+    if (vma_find(&task, virt + 2 * PAGE_SIZE + 5) == NULL || vma_find(&task, virt + 8 * PAGE_SIZE) != second) {
+        TEST_FAIL("vma_find missed an address inside a VMA");
+    }
+    if (vma_find(&task, virt + 5 * PAGE_SIZE) != NULL) {
+        TEST_FAIL("vma_find returned a VMA for an unreserved address");
+    }
+    vma_release_all(&task);
+    if (task.mmaps != NULL) {
+        TEST_FAIL("vma_release_all left the task's VMA list");
+    }
+
+    // Touching an unpopulated page of a VMA the running task owns faults it in, zero filled, and counts a minor fault
+    core_local_storage_t *cls = get_core_local_storage();
+    thread_t *saved_thread = cls->currentThread;
+    uint32_t faults_before = kKernelTask->minorFaults;
+    cls->currentThread = kKernelTask->threads;
+    if (vma_add(kKernelTask, virt, 2 * PAGE_SIZE, PAGE_WRITE, VMA_ANONYMOUS) == NULL) {
+        TEST_FAIL("vma_add failed on the kernel task");
+    }
+    if (paging_walk_paging_table((pt_entry_t *)kKernelPML4v, virt + PAGE_SIZE) != 0xbadbadba) {
+        TEST_FAIL("vma_add mapped a page up front");
+    }
+    uint64_t value = *(volatile uint64_t *)(virt + PAGE_SIZE + 8);
+    cls->currentThread = saved_thread;
+    if (value != 0 || paging_walk_paging_table((pt_entry_t *)kKernelPML4v, virt + PAGE_SIZE) == 0xbadbadba) {
+        TEST_FAIL("touching a VMA page did not map a zero filled page");
+    }
+    if (paging_walk_paging_table((pt_entry_t *)kKernelPML4v, virt) != 0xbadbadba) {
+        TEST_FAIL("the fault mapped more than the page touched");
+    }
+    if (kKernelTask->minorFaults != faults_before + 1) {
+        TEST_FAIL("the VMA fault was not counted as a minor fault");
+    }
+    vma_release_all(kKernelTask);
+    return true;
+}
+
+// A write to a page shared copy-on-write gives the writer a private copy and leaves the other side's page alone, and
+// the last address space mapping a shared page gets it back writable without a copy
+static bool test_cow_fault_copies_shared_page(void)
+{
+    // PML4 slot 202 is unused by the kernel.  cow_handle_fault works on the CR3 being run, so the kernel's PML4 is the
+    // side which writes and a fresh PML4 the side which keeps the page.
+    pt_entry_t *kernel_pml4 = (pt_entry_t *)kKernelPML4v;
+    pt_entry_t *other_pml4 = paging_create_pml4();
+    uint64_t virt = 202ULL << PML4_SHIFT;
+    uint64_t page = allocate_memory_aligned(PAGE_SIZE);
+    uint8_t *contents = (uint8_t *)PHYS_TO_VIRT(page);
+
+    memset(contents, 0x11, PAGE_SIZE);
+    paging_map_page(kernel_pml4, virt, page, PAGE_PRESENT | PAGE_WRITE);
+    cow_share_range(kernel_pml4, other_pml4, virt, virt + PAGE_SIZE, 0);
+    if (kBuddyPages[page / PAGE_SIZE].share_count != 1 || (paging_walk_paging_table_keep_flags(kernel_pml4, virt, true) & PAGE_WRITE)) {
+        TEST_FAIL("cow_share_range did not count the share and write protect the page");
+    }
+
+    uint64_t copies_before = kCOWCopiedPages;
+    if (!cow_handle_fault(virt, PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE)) {
+        TEST_FAIL("cow_handle_fault did not resolve a write to a shared page");
+    }
+    uint64_t copy = paging_walk_paging_table(kernel_pml4, virt);
+    if (copy == page || kCOWCopiedPages != copies_before + 1 || kBuddyPages[page / PAGE_SIZE].share_count != 0) {
+        TEST_FAIL("the writer did not get a private copy of the shared page");
+    }
+    *(volatile uint8_t *)virt = 0x22;
+    if (contents[0] != 0x11 || paging_walk_paging_table(other_pml4, virt) != page || *(uint8_t *)PHYS_TO_VIRT(copy) != 0x22) {
+        TEST_FAIL("the other address space saw the writer's change");
+    }
+    paging_unmap_pages(kernel_pml4, virt, PAGE_SIZE);
+    free_memory(copy);
+
+    // Once the other side has let go, the last owner gets the page back writable without a copy
+    paging_map_page(kernel_pml4, virt, page, PAGE_PRESENT | PAGE_WRITE);
+    paging_unmap_pages(other_pml4, virt, PAGE_SIZE);
+    cow_share_range(kernel_pml4, other_pml4, virt, virt + PAGE_SIZE, 0);
+    cow_release_range(other_pml4, virt, virt + PAGE_SIZE);
+    copies_before = kCOWCopiedPages;
+    if (!cow_handle_fault(virt, PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE)) {
+        TEST_FAIL("cow_handle_fault did not resolve a write to a page it is the last owner of");
+    }
+    if (paging_walk_paging_table(kernel_pml4, virt) != page || kCOWCopiedPages != copies_before ||
+        !(paging_walk_paging_table_keep_flags(kernel_pml4, virt, true) & PAGE_WRITE)) {
+        TEST_FAIL("the single owner of a copy-on-write page did not get it back writable in place");
+    }
+
+    paging_unmap_pages(kernel_pml4, virt, PAGE_SIZE);
+    paging_free_pml4(other_pml4);
+    free_memory(page);
+    return true;
+}
+
+// The copies cow_handle_fault makes go back to the buddy allocator once the last address space mapping them is torn
+// down, whether or not the copy was shared on again
+static bool test_cow_copies_freed_at_teardown(void)
+{
+    // The page is also mapped plainly one page up on both sides, so their page tables stay put and only the copies
+    // move kBuddyFreePageCount
+    pt_entry_t *kernel_pml4 = (pt_entry_t *)kKernelPML4v;
+    pt_entry_t *other_pml4 = paging_create_pml4();
+    uint64_t virt = 202ULL << PML4_SHIFT;
+    uint64_t page = buddy_alloc_pages(1, BUDDY_PAGE_ALLOCATED);
+
+    paging_map_page(kernel_pml4, virt + PAGE_SIZE, page, PAGE_PRESENT | PAGE_WRITE);
+    paging_map_page(other_pml4, virt + PAGE_SIZE, page, PAGE_PRESENT | PAGE_WRITE);
+    paging_map_page(kernel_pml4, virt, page, PAGE_PRESENT | PAGE_WRITE);
+    uint64_t free_before = kBuddyFreePageCount;
+
+    // Share, write, then tear down the writer and the other side
+    cow_share_range(kernel_pml4, other_pml4, virt, virt + PAGE_SIZE, 0);
+    if (!cow_handle_fault(virt, PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE) || kBuddyFreePageCount != free_before - 1) {
+        TEST_FAIL("the write fault did not allocate a copy");
+    }
+    cow_release_range(kernel_pml4, virt, virt + PAGE_SIZE);
+    paging_unmap_page(kernel_pml4, virt);
+    cow_release_range(other_pml4, virt, virt + PAGE_SIZE);
+    paging_unmap_page(other_pml4, virt);
+    if (kBuddyFreePageCount != free_before || kBuddyPages[page / PAGE_SIZE].share_count != 0) {
+        TEST_FAIL("the private copy was not freed at teardown");
+    }
+
+    // A copy shared on again stays until its last mapping goes
+    paging_map_page(kernel_pml4, virt, page, PAGE_PRESENT | PAGE_WRITE);
+    cow_share_range(kernel_pml4, other_pml4, virt, virt + PAGE_SIZE, 0);
+    cow_handle_fault(virt, PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE);
+    uint64_t copy = paging_walk_paging_table(kernel_pml4, virt);
+    cow_release_range(other_pml4, virt, virt + PAGE_SIZE);
+    paging_unmap_page(other_pml4, virt);
+    cow_share_range(kernel_pml4, other_pml4, virt, virt + PAGE_SIZE, 0);
+    if (paging_walk_paging_table(other_pml4, virt) != copy || kBuddyPages[copy / PAGE_SIZE].share_count != 1) {
+        TEST_FAIL("the copy was not shared on");
+    }
+    cow_release_range(kernel_pml4, virt, virt + PAGE_SIZE);
+    paging_unmap_page(kernel_pml4, virt);
+    if (kBuddyFreePageCount != free_before - 1) {
+        TEST_FAIL("a copy was freed while another address space still mapped it");
+    }
+    cow_release_range(other_pml4, virt, virt + PAGE_SIZE);
+    paging_unmap_page(other_pml4, virt);
+    if (kBuddyFreePageCount != free_before) {
+        TEST_FAIL("the shared copy was not freed when its last mapping went");
+    }
+
+    paging_unmap_page(kernel_pml4, virt + PAGE_SIZE);
+    paging_free_pml4(other_pml4);
+    buddy_free_pages(page);
+    return true;
+}
+
+// Every variant this CPU can run must match a byte loop, with misaligned pointers and odd lengths
+static bool test_memops_variants(void)
+{
+    uint8_t *src = kmalloc(MEMOPS_TEST_SIZE + 64);
+    uint8_t *dst = kmalloc(MEMOPS_TEST_SIZE + 64);
+    size_t lengths[] = {0, 7, 63, 64, 129, MEMOPS_TEST_SIZE - 3};
+
+    for (uint32_t variant = 0; variant < kMemopsVariantCount; variant++) {
+        memops_variant_t *ops = &kMemopsVariants[variant];
+        if (!memops_variant_supported(ops)) {
+            continue;
+        }
+        for (size_t len = 0; len < sizeof(lengths) / sizeof(lengths[0]); len++) {
+            for (size_t cnt = 0; cnt < MEMOPS_TEST_SIZE + 64; cnt++) {
+                src[cnt] = (uint8_t)(cnt * 7 + variant);
+                dst[cnt] = 0xEE;
+            }
+            // Called directly, the variants need the FPU section memcpy and memset would open for them
+            kernel_fpu_begin();
+            ops->copy(dst + 3, src + 1, lengths[len]);
+            kernel_fpu_end();
+            for (size_t cnt = 0; cnt < lengths[len]; cnt++) {
+                if (dst[cnt + 3] != src[cnt + 1]) {
+                    TEST_FAIL("memops copy variant produced a different result");
+                }
+            }
+            if (dst[2] != 0xEE || dst[lengths[len] + 3] != 0xEE) {
+                TEST_FAIL("memops copy variant wrote outside the buffer");
+            }
+            kernel_fpu_begin();
+            ops->fill(dst + 5, 0xA5, lengths[len]);
+            kernel_fpu_end();
+            for (size_t cnt = 0; cnt < lengths[len]; cnt++) {
+                if (dst[cnt + 5] != 0xA5) {
+                    TEST_FAIL("memops fill variant produced a different result");
+                }
+            }
+            if (ops->moveBackward != NULL) {
+                // Overlapping move up by 9 bytes, src still holds the original pattern to compare against
+                memcpy_qword(dst, src, lengths[len] + 9);
+                kernel_fpu_begin();
+                ops->moveBackward(dst + 9, dst, lengths[len]);
+                kernel_fpu_end();
+                for (size_t cnt = 0; cnt < lengths[len]; cnt++) {
+                    if (dst[cnt + 9] != src[cnt]) {
+                        TEST_FAIL("memops backward move variant produced a different result");
+                    }
+                }
+            }
+        }
+    }
+    kfree(src);
+    kfree(dst);
+    return true;
+}
+
+// A thread's XMM registers survive a kernel FPU section that clobbers them.  kernel_fpu_begin saves them and the
+// thread's next FPU instruction takes #NM, which loads them back.
+static bool test_fpu_kernel_section_preserves_thread_state(void)
+{
+    static const uint64_t pattern[2] = {0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL};
+    static uint64_t result[2];
+    thread_t thread = {0};
+    core_local_storage_t *cls = get_core_local_storage();
+    thread_t *saved_thread = cls->currentThread;
+    uint64_t flags = interrupts_save_and_disable();
+
+    // An empty section leaves TS set and no owner, so the first load below faults and makes the thread the owner
+    kernel_fpu_begin();
+    kernel_fpu_end();
+    cls->currentThread = &thread;
+    uint64_t restores_before = kFPURestoreCount;
+    __asm__ __volatile__("movdqu xmm0, [%0]" : : "r"(pattern) : "memory");
+    if (kFPUOwner[cls->apic_id] != &thread) {
+        TEST_FAIL("thread's first FPU instruction didn't make it the FPU owner");
+    }
+    kernel_fpu_begin();
+    __asm__ __volatile__("pcmpeqb xmm0, xmm0" : : : "memory");
+    kernel_fpu_end();
+    __asm__ __volatile__("movdqu [%0], xmm0" : : "r"(result) : "memory");
+    uint64_t restores = kFPURestoreCount - restores_before;
+    // Drop the ownership so nothing later saves into the stack thread
+    kernel_fpu_begin();
+    kernel_fpu_end();
+    cls->currentThread = saved_thread;
+    interrupts_restore(flags);
+    kfree(thread.fpuState);
+    if (result[0] != pattern[0] || result[1] != pattern[1]) {
+        TEST_FAIL("XMM register not restored after a kernel FPU section");
+    }
+    if (restores != 2) {
+        TEST_FAIL("expected one restore per #NM");
+    }
+    return true;
+}
+
+// Microbenchmark, reports the average TSC cycles for a kmalloc/kfree pair.  With the HHDM built up front neither
+// call walks the page tables, so compare against a build where kmalloc_common still calls paging_map_pages.
+static bool test_kmalloc_latency(void)
+{
+    static void *ptrs[KMALLOC_BENCH_ITERATIONS];
+    uint64_t sizes[] = {64, PAGE_SIZE, 4 * PAGE_SIZE};
+
+    for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+        uint64_t start = rdtsc();
+        for (int cnt = 0; cnt < KMALLOC_BENCH_ITERATIONS; cnt++) {
+            ptrs[cnt] = sizes[size] < PAGE_SIZE ? kmalloc(sizes[size]) : kmalloc_aligned(sizes[size]);
+        }
+        uint64_t allocated = rdtsc();
+        for (int cnt = 0; cnt < KMALLOC_BENCH_ITERATIONS; cnt++) {
+            if (ptrs[cnt] == NULL) {
+                TEST_FAIL("kmalloc returned NULL");
+            }
+            kfree(ptrs[cnt]);
+        }
+        uint64_t freed = rdtsc();
+        printd(DEBUG_TESTS, "\t[Bench] kmalloc 0x%lx bytes: %lu cycles/alloc, %lu cycles/free\n", sizes[size],
+               (allocated - start) / KMALLOC_BENCH_ITERATIONS, (freed - allocated) / KMALLOC_BENCH_ITERATIONS);
+    }
+    return true;
+}
+
+// Microbenchmark, reports TSC cycles per KiB for each copy, fill and backward move variant the CPU can run.  The 2MiB
+// size is past MEMOPS_NON_TEMPORAL_THRESHOLD, where the -nt variants should pull ahead.
+static bool test_memops_bandwidth(void)
+{
+    uint8_t *src = kmalloc_aligned(MEMOPS_BENCH_MAX_SIZE + PAGE_SIZE);
+    uint8_t *dst = kmalloc_aligned(MEMOPS_BENCH_MAX_SIZE + PAGE_SIZE);
+    size_t sizes[] = {256, PAGE_SIZE, 64 * 1024, MEMOPS_BENCH_MAX_SIZE};
+
+    if (src == NULL || dst == NULL) {
+        TEST_FAIL("kmalloc_aligned returned NULL");
+    }
+    for (uint32_t variant = 0; variant < kMemopsVariantCount; variant++) {
+        memops_variant_t *ops = &kMemopsVariants[variant];
+        if (!memops_variant_supported(ops)) {
+            continue;
+        }
+        for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+            uint64_t iterations = MEMOPS_BENCH_BYTES / sizes[size];
+            uint64_t kib = MEMOPS_BENCH_BYTES / 1024;
+            // One FPU section per pass, so the cycles are the variants' own
+            kernel_fpu_begin();
+            uint64_t start = rdtsc();
+            for (uint64_t cnt = 0; cnt < iterations; cnt++) {
+                ops->copy(dst, src, sizes[size]);
+            }
+            uint64_t copied = rdtsc();
+            for (uint64_t cnt = 0; cnt < iterations; cnt++) {
+                ops->fill(dst, (int)cnt, sizes[size]);
+            }
+            uint64_t filled = rdtsc();
+            for (uint64_t cnt = 0; ops->moveBackward != NULL && cnt < iterations; cnt++) {
+                ops->moveBackward(dst + 64, dst, sizes[size]);
+            }
+            uint64_t moved = rdtsc();
+            kernel_fpu_end();
+            printd(DEBUG_TESTS, "\t[Bench] memops %s 0x%lx bytes: copy %lu, fill %lu, move %lu cycles/KiB\n", ops->name,
+                   sizes[size], (copied - start) / kib, (filled - copied) / kib, (moved - filled) / kib);
+        }
+    }
+    kfree(src);
+    kfree(dst);
+    return true;
+}
+
+// A steal takes the thread waiting longest on the victim's queue which isn't pinned there, and never a pinned one
+static bool test_runqueue_steal_skips_pinned(void)
+{
+    static task_t task;
+    thread_t pinned = {0}, unpinned = {0};
+
+    if (kMPCoreCount < 2) {
+        return true;
+    }
+    uint32_t count0 = kRunQueues[0].count, count1 = kRunQueues[1].count;
+    pinned.ownerTask = unpinned.ownerTask = &task;
+    pinned.mp_apic = 1;
+    unpinned.mp_apic = THREAD_NOT_PINNED;
+    unpinned.runQueueCpu = 1;
+    scheduler_change_thread_queue(&pinned, THREAD_STATE_RUNNABLE);
+    scheduler_change_thread_queue(&unpinned, THREAD_STATE_RUNNABLE);
+    if (pinned.runQueueCpu != 1 || kRunQueues[1].count != count1 + 2) {
+        TEST_FAIL("thread queued on the wrong core");
+    }
+    if (scheduler_steal_thread(0, 1) != &unpinned || unpinned.runQueueCpu != 0 || kRunQueues[0].count != count0 + 1) {
+        TEST_FAIL("steal didn't move the unpinned thread");
+    }
+    if (scheduler_steal_thread(0, 1) == &pinned) {
+        TEST_FAIL("steal moved a pinned thread");
+    }
+    scheduler_remove_thread_from_queue(THREAD_STATE_RUNNABLE, &pinned);
+    scheduler_remove_thread_from_queue(THREAD_STATE_RUNNABLE, &unpinned);
+    if (kRunQueues[0].count != count0 || kRunQueues[1].count != count1) {
+        TEST_FAIL("run queue counts wrong after removing the threads");
+    }
+    return true;
+}
+
+// Threads come off a run queue highest priority level first and in queued order within a level, each with the time
+// slice for its level
+static bool test_runqueue_priority_order(void)
+{
+    static task_t low, high;
+    thread_t first = {0}, second = {0}, urgent = {0};
+    core_local_storage_t *cls = get_core_local_storage();
+    scheduler_runqueue_t *rq = &kRunQueues[cls->apic_id];
+
+    // Runs before the idle threads are queued, so the queue should be empty
+    if (rq->levelBitmap != 0) {
+        TEST_FAIL("run queue not empty");
+    }
+    low.priority = 10;
+    high.priority = -10;
+    first.ownerTask = second.ownerTask = &low;
+    urgent.ownerTask = &high;
+    first.mp_apic = second.mp_apic = urgent.mp_apic = THREAD_NOT_PINNED;
+    first.runQueueCpu = second.runQueueCpu = urgent.runQueueCpu = cls->apic_id;
+    scheduler_change_thread_queue(&first, THREAD_STATE_RUNNABLE);
+    scheduler_change_thread_queue(&second, THREAD_STATE_RUNNABLE);
+    scheduler_change_thread_queue(&urgent, THREAD_STATE_RUNNABLE);
+    if (rq->levelBitmap != ((1ULL << 10) | (1ULL << 30))) {
+        TEST_FAIL("threads queued at the wrong levels");
+    }
+    if (scheduler_find_thread_to_run(cls, false) != &urgent || scheduler_find_thread_to_run(cls, false) != &first ||
+        scheduler_find_thread_to_run(cls, false) != &second) {
+        TEST_FAIL("threads came off the run queue in the wrong order");
+    }
+    if (rq->levelBitmap != 0 || urgent.timeSliceLeft != SCHEDULER_TIMESLICE(10) ||
+        first.timeSliceLeft != SCHEDULER_TIMESLICE(30) || urgent.timeSliceLeft <= first.timeSliceLeft) {
+        TEST_FAIL("run queue or time slices wrong after the threads were taken");
+    }
+    return true;
+}
+
+static size_t strings_strlen_bytes(const char *str)
+{
+    size_t len = 0;
+
+    while (str[len] != 0) {
+        len++;
+    }
+    return len;
+}
+
+static int strings_memcmp_bytes(const void *ptr1, const void *ptr2, size_t num)
+{
+    const unsigned char *a = ptr1, *b = ptr2;
+
+    for (size_t cnt = 0; cnt < num; cnt++) {
+        if (a[cnt] != b[cnt]) {
+            return (int)a[cnt] - (int)b[cnt];
+        }
+    }
+    return 0;
+}
+
+// The word and vector string routines must agree with a byte loop at every alignment, including a difference or
+// terminator in each byte of a word
+static bool test_strings_word_at_a_time(void)
+{
+    char *a = kmalloc(STRINGS_TEST_SIZE + 16);
+    char *b = kmalloc(STRINGS_TEST_SIZE + 16);
+    size_t lengths[] = {0, 1, 7, 8, 9, 31, 255, 256, 300, STRINGS_TEST_SIZE - 1};
+
+    for (size_t len = 0; len < sizeof(lengths) / sizeof(lengths[0]); len++) {
+        for (size_t align = 0; align < 8; align++) {
+            char *s1 = a + align, *s2 = b + 7 - align;
+            for (size_t cnt = 0; cnt < lengths[len]; cnt++) {
+                s1[cnt] = s2[cnt] = (char)('a' + cnt % 23);
+            }
+            s1[lengths[len]] = s2[lengths[len]] = 0;
+            if (strlen(s1) != lengths[len] || strnlen(s1, 0) != lengths[len] ||
+                strnlen(s1, 5) != (lengths[len] < 5 ? lengths[len] : 5)) {
+                TEST_FAIL("strlen/strnlen returned the wrong length");
+            }
+            if (kStrlenSimd != NULL) {
+                kernel_fpu_begin();
+                size_t simd = kStrlenSimd(s1);
+                kernel_fpu_end();
+                if (simd != lengths[len]) {
+                    TEST_FAIL("vector strlen returned the wrong length");
+                }
+            }
+            if (strcmp(s1, s2) != 0 || strncmp(s1, s2, lengths[len] + 4) != 0 || memcmp(s1, s2, lengths[len]) != 0) {
+                TEST_FAIL("equal strings compared unequal");
+            }
+            if (strchr(s1, 0) != s1 + lengths[len] || strchr(s1, '!') != NULL) {
+                TEST_FAIL("strchr stopped in the wrong place");
+            }
+            for (size_t diff = 0; diff < lengths[len] && diff < 24; diff++) {
+                s2[diff] = '~';
+                if (strcmp(s1, s2) >= 0 || strncmp(s2, s1, lengths[len]) != 1 ||
+                    memcmp(s1, s2, lengths[len]) != strings_memcmp_bytes(s1, s2, lengths[len])) {
+                    TEST_FAIL("differing strings compared wrongly");
+                }
+                if (strchr(s2, '~') != s2 + diff || strstr(s2, "~") != s2 + diff) {
+                    TEST_FAIL("strchr/strstr missed the character");
+                }
+                s2[diff] = s1[diff];
+            }
+        }
+    }
+    if (strnstr("/bin/idle", "/idle", 10) == NULL || strnstr("/bin/longname", "/idle", 10) != NULL) {
+        TEST_FAIL("strnstr searched the wrong range");
+    }
+    kfree(a);
+    kfree(b);
+    return true;
+}
+
+// Microbenchmark, reports TSC cycles per call for strlen and memcmp done a byte at a time, a word at a time and with the
+// vector routine strings_init picked
+static bool test_strings_bandwidth(void)
+{
+    size_t sizes[] = {16, 64, 256, PAGE_SIZE};
+    char *a = kmalloc_aligned(PAGE_SIZE * 2);
+    char *b = kmalloc_aligned(PAGE_SIZE * 2);
+    volatile size_t sink = 0;
+
+    if (a == NULL || b == NULL) {
+        TEST_FAIL("kmalloc_aligned returned NULL");
+    }
+    for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+        memset(a, 'x', sizes[size]);
+        memset(b, 'x', sizes[size]);
+        a[sizes[size]] = b[sizes[size]] = 0;
+        uint64_t start = rdtsc();
+        for (int cnt = 0; cnt < STRINGS_BENCH_ITERATIONS; cnt++) {
+            sink += strings_strlen_bytes(a) + strings_memcmp_bytes(a, b, sizes[size]);
+        }
+        uint64_t bytes = rdtsc();
+        for (int cnt = 0; cnt < STRINGS_BENCH_ITERATIONS; cnt++) {
+            sink += strlen_word(a) + memcmp_word(a, b, sizes[size]);
+        }
+        uint64_t words = rdtsc();
+        for (int cnt = 0; kStrlenSimd != NULL && cnt < STRINGS_BENCH_ITERATIONS; cnt++) {
+            kernel_fpu_begin();
+            sink += kStrlenSimd(a) + kMemcmpSimd(a, b, sizes[size]);
+            kernel_fpu_end();
+        }
+        uint64_t vectors = rdtsc();
+        printd(DEBUG_TESTS, "\t[Bench] strings 0x%lx bytes: byte %lu, word %lu, vector %lu cycles/call\n", sizes[size],
+               (bytes - start) / STRINGS_BENCH_ITERATIONS, (words - bytes) / STRINGS_BENCH_ITERATIONS,
+               (vectors - words) / STRINGS_BENCH_ITERATIONS);
+    }
+    kfree(a);
+    kfree(b);
+    return true;
+}
+
 static void register_builtin_tests(void)
 {
     test_register("kmalloc_not_null", test_kmalloc_not_null);
+    test_register("buddy_free_coalesces", test_buddy_free_coalesces);
+    test_register("allocator_trees_balanced", test_allocator_trees_balanced);
+    test_register("dma32_zone_below_4g", test_dma32_zone_below_4g);
+    test_register("allocstats_live_bytes", test_allocstats_live_bytes);
+    test_register("arena_reset_reuses_chunks", test_arena_reset_reuses_chunks);
+    test_register("slab_alloc_free_reuse", test_slab_alloc_free_reuse);
+    test_register("paging_tables_reclaimed", test_paging_tables_reclaimed);
+    test_register("paging_large_page_split", test_paging_large_page_split);
+    test_register("task_address_space_released", test_task_address_space_released);
+    test_register("user_stack_demand_paged", test_user_stack_demand_paged);
+    test_register("vma_lookup", test_vma_lookup);
+    test_register("cow_fault_copies_shared_page", test_cow_fault_copies_shared_page);
+    test_register("cow_copies_freed_at_teardown", test_cow_copies_freed_at_teardown);
+    test_register("memops_variants", test_memops_variants);
+    test_register("fpu_kernel_section_preserves_thread_state", test_fpu_kernel_section_preserves_thread_state);
+    test_register("kmalloc_latency", test_kmalloc_latency);
+    test_register("memops_bandwidth", test_memops_bandwidth);
+    test_register("strings_word_at_a_time", test_strings_word_at_a_time);
+    test_register("strings_bandwidth", test_strings_bandwidth);
+    test_register("runqueue_steal_skips_pinned", test_runqueue_steal_skips_pinned);
+    test_register("runqueue_priority_order", test_runqueue_priority_order);
 }
 
 void test_framework_init(void)